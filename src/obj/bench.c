@@ -0,0 +1,433 @@
+// -*- c-basic-offset: 2; indent-tabs-mode: nil -*-
+
+/*
+ * Copyright 2018-19, Lancaster University
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ * 
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the
+ *    distribution.
+ * 
+ *  * Neither the name of the copyright holder nor the names of
+ *    its contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ *
+ * Author: Steven Simpson <https://github.com/simpsonst>
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+
+#include "kernels.h"
+#include "pool.h"
+#include "detector.h"
+
+/* Synthetic frames repeat after this many, and a recorded corpus is
+   limited to this many. */
+#define CYCLE 64
+#define MAXFRAMES 1000
+
+static uint64_t now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * UINT64_C(1000000000) + ts.tv_nsec;
+}
+
+/* Generate frame 'i' of a synthetic sequence: a gradient with a
+   little noise, and a bright disc moving back and forth across it,
+   so that there is some motion to detect.  The sequence depends only
+   on the grid size. */
+static void synth(unsigned width, unsigned height, unsigned i,
+                  unsigned char grid[])
+{
+  const unsigned phase = i % CYCLE;
+  const unsigned pos = phase < CYCLE / 2 ? phase : CYCLE - phase;
+  const double cx = width * (0.1 + 0.8 * pos / (CYCLE / 2));
+  const double cy = height * (0.3 + 0.4 * pos / (CYCLE / 2));
+  const double r = height / 5.0 + 1.0;
+  uint32_t seed = 2463534242u ^ (i * 2654435761u);
+  for (unsigned y = 0; y < height; y++)
+    for (unsigned x = 0; x < width; x++) {
+      seed ^= seed << 13;
+      seed ^= seed >> 17;
+      seed ^= seed << 5;
+      unsigned v = 20 + 100 * x / width + 40 * y / height + (seed & 31);
+      const double dx = x - cx, dy = y - cy;
+      if (dx * dx + dy * dy < r * r)
+        v += 100;
+      grid[(size_t) y * width + x] = v;
+    }
+}
+
+/* The frames to be fed to the detector at one grid size */
+struct corpus {
+  unsigned width, height;
+  unsigned count;
+  unsigned char *frames;
+};
+
+/* Prepare the frames of a corpus, synthetic if 'names' is NULL, or
+   loaded from the files listed in it. */
+static int load_corpus(struct corpus *c, unsigned width, unsigned height,
+                       const char *const *names, unsigned nnames)
+{
+  const size_t cells = (size_t) width * height;
+  c->width = width;
+  c->height = height;
+  c->count = names == NULL ? CYCLE : nnames;
+  c->frames = malloc(c->count * cells);
+  if (c->frames == NULL) return -1;
+  if (names == NULL) {
+    for (unsigned i = 0; i < c->count; i++)
+      synth(width, height, i, c->frames + i * cells);
+    return 0;
+  }
+  struct framesrc fs = { .ringpath = NULL };
+  unsigned got = 0;
+  for (unsigned i = 0; i < nnames; i++)
+    if (framesrc_load(&fs, names[i], width, height,
+                      c->frames + got * cells) == 0)
+      got++;
+  framesrc_release(&fs);
+  c->count = got;
+  if (got == 0) {
+    errno = ENOENT;
+    return -1;
+  }
+  return 0;
+}
+
+static const unsigned char *corpus_frame(const struct corpus *c, unsigned i)
+{
+  return c->frames + (size_t) (i % c->count) * c->width * c->height;
+}
+
+/* Feed enough frames to fill the history, then 'frames' more,
+   reporting scores to 'out'. */
+static struct detector *run(const struct corpus *c,
+                            const struct detparams *par, struct pool *pool,
+                            unsigned frames, FILE *out, const char *tag,
+                            uint64_t *elapsed,
+                            uint64_t ns[DETSTAGE_COUNT])
+{
+  struct detector *d = detector_create(par, pool);
+  if (d == NULL) return NULL;
+  const unsigned tdeg = par->mdeg + par->hdeg;
+  char name[32];
+  for (unsigned i = 0; i < tdeg; i++) {
+    snprintf(name, sizeof name, "frame%05u", i);
+    detector_feed_grid(d, name, corpus_frame(c, i), out, tag);
+  }
+  if (detector_set_timing(d, true) < 0) {
+    detector_destroy(d);
+    return NULL;
+  }
+  const uint64_t t0 = now_ns();
+  for (unsigned i = tdeg; i < tdeg + frames; i++) {
+    snprintf(name, sizeof name, "frame%05u", i);
+    detector_feed_grid(d, name, corpus_frame(c, i), out, tag);
+  }
+  *elapsed = now_ns() - t0;
+  detector_times(d, ns);
+  return d;
+}
+
+static int add_uint(unsigned *list, unsigned *n, unsigned max,
+                    const char *arg)
+{
+  if (*n == max) return -1;
+  list[(*n)++] = atoi(arg);
+  return 0;
+}
+
+int main(int argc, const char *const *argv)
+{
+  /* A file listing recorded frames, one per line; synthetic frames
+     are used otherwise */
+  const char *corpusname = NULL;
+
+  const char *kernels = NULL;
+  unsigned threads = 1;
+  unsigned frames = 200;
+  double varpow = 0.5;
+
+  /* Produce scores for comparison with earlier versions, rather
+     than timings. */
+  bool golden = false;
+
+  unsigned widths[16], heights[16], nsizes = 0;
+  unsigned merges[16], nmerges = 0;
+  unsigned gathers[16], ngathers = 0;
+
+  bool show_help = false, fail = false;
+  for (int argi = 1; argi < argc; argi++) {
+    if (!strcmp(argv[argi], "-f")) {
+      if (++argi == argc) {
+        show_help = true;
+        fail = true;
+        break;
+      }
+      corpusname = argv[argi];
+    } else if (!strcmp(argv[argi], "+f")) {
+      corpusname = NULL;
+    } else if (!strcmp(argv[argi], "-k")) {
+      if (++argi == argc) {
+        show_help = true;
+        fail = true;
+        break;
+      }
+      kernels = argv[argi];
+    } else if (!strcmp(argv[argi], "-j")) {
+      if (++argi == argc) {
+        show_help = true;
+        fail = true;
+        break;
+      }
+      threads = atoi(argv[argi]);
+      if (threads < 1) threads = 1;
+    } else if (!strcmp(argv[argi], "-F")) {
+      if (++argi == argc) {
+        show_help = true;
+        fail = true;
+        break;
+      }
+      frames = atoi(argv[argi]);
+    } else if (!strcmp(argv[argi], "-v")) {
+      if (++argi == argc) {
+        show_help = true;
+        fail = true;
+        break;
+      }
+      varpow = atof(argv[argi]);
+    } else if (!strcmp(argv[argi], "-s")) {
+      if (++argi == argc || nsizes == 16) {
+        show_help = true;
+        fail = true;
+        break;
+      }
+      if (sscanf(argv[argi], "%ux%u",
+                 &widths[nsizes], &heights[nsizes]) == 2)
+        nsizes++;
+    } else if (!strcmp(argv[argi], "-H")) {
+      if (++argi == argc || add_uint(merges, &nmerges, 16, argv[argi])) {
+        show_help = true;
+        fail = true;
+        break;
+      }
+    } else if (!strcmp(argv[argi], "-n")) {
+      if (++argi == argc || add_uint(gathers, &ngathers, 16, argv[argi])) {
+        show_help = true;
+        fail = true;
+        break;
+      }
+    } else if (!strcmp(argv[argi], "-g")) {
+      golden = true;
+    } else if (!strcmp(argv[argi], "+g")) {
+      golden = false;
+    } else if (!strcmp(argv[argi], "-h")) {
+      show_help = true;
+    } else if (argv[argi][0] == '-' || argv[argi][0] == '+') {
+      fprintf(stderr, "%s: unknown switch: %s\n", argv[0], argv[argi]);
+      exit(EXIT_FAILURE);
+    } else {
+      fprintf(stderr, "%s: unknown argument: %s\n", argv[0], argv[argi]);
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  if (show_help) {
+    fprintf(stderr,
+            "Usage: %s [-f corpus|+f]\n"
+            "\t[-s WxH]...\n"
+            "\t[-H frames before]...\n"
+            "\t[-n frames after]...\n"
+            "\t[-F frames]\n"
+            "\t[-v varpow]\n"
+            "\t[-k scalar|sse2|avx2]\n"
+            "\t[-j threads]\n"
+            "\t[-g|+g]\n", argv[0]);
+    exit(fail ? EXIT_FAILURE : EXIT_SUCCESS);
+  }
+
+  if (kernels_init(kernels) < 0) {
+    fprintf(stderr, "%s: kernels unavailable: %s\n", argv[0], kernels);
+    exit(EXIT_FAILURE);
+  }
+
+  struct pool *pool = pool_create(threads);
+  if (pool == NULL) {
+    fprintf(stderr, "%s: %s: creating %u threads\n",
+            argv[0], strerror(errno), threads);
+    exit(EXIT_FAILURE);
+  }
+
+  if (golden) {
+    /* Score a fixed set of configurations on synthetic frames,
+       covering both ways of computing differences, and grids of one
+       band and of several. */
+    static const struct {
+      unsigned width, height, hdeg, mdeg;
+      double varpow;
+    } configs[] = {
+      { 16, 12, 50, 1, 0.5 },
+      { 16, 12, 10, 5, 0.7 },
+      { 64, 48, 50, 5, 0.5 },
+      { 160, 120, 10, 1, 0.5 },
+    };
+    for (size_t i = 0; i < sizeof configs / sizeof configs[0]; i++) {
+      struct detparams par;
+      detparams_init(&par);
+      par.width = configs[i].width;
+      par.height = configs[i].height;
+      par.hdeg = configs[i].hdeg;
+      par.mdeg = configs[i].mdeg;
+      par.varpow0 = configs[i].varpow;
+      struct corpus c;
+      if (load_corpus(&c, par.width, par.height, NULL, 0) < 0) {
+        fprintf(stderr, "%s: %s: generating frames\n",
+                argv[0], strerror(errno));
+        exit(EXIT_FAILURE);
+      }
+      char tag[64];
+      snprintf(tag, sizeof tag, "%ux%u-H%u-n%u-v%g",
+               par.width, par.height, par.hdeg, par.mdeg, par.varpow0);
+      uint64_t elapsed, ns[DETSTAGE_COUNT];
+      struct detector *d =
+        run(&c, &par, pool, 2 * CYCLE, stdout, tag, &elapsed, ns);
+      if (d == NULL) {
+        fprintf(stderr, "%s: %s: %s\n", argv[0], tag, strerror(errno));
+        exit(EXIT_FAILURE);
+      }
+      detector_destroy(d);
+      free(c.frames);
+    }
+    pool_destroy(pool);
+    return 0;
+  }
+
+  if (nsizes == 0) {
+    static const unsigned dw[] = { 16, 32, 64, 160, 320, 640 };
+    for (nsizes = 0; nsizes < sizeof dw / sizeof dw[0]; nsizes++) {
+      widths[nsizes] = dw[nsizes];
+      heights[nsizes] = dw[nsizes] * 3 / 4;
+    }
+  }
+  if (nmerges == 0) {
+    merges[nmerges++] = 10;
+    merges[nmerges++] = 50;
+    merges[nmerges++] = 100;
+  }
+  if (ngathers == 0) {
+    gathers[ngathers++] = 1;
+    gathers[ngathers++] = 5;
+  }
+
+  /* Read the names of the recorded frames. */
+  static char *names[MAXFRAMES];
+  unsigned nnames = 0;
+  if (corpusname != NULL) {
+    FILE *fin = fopen(corpusname, "r");
+    if (fin == NULL) {
+      fprintf(stderr, "%s: could not read %s\n", argv[0], corpusname);
+      exit(EXIT_FAILURE);
+    }
+    char line[PATH_MAX + 1];
+    while (nnames < MAXFRAMES && fgets(line, sizeof line, fin) != NULL) {
+      line[strcspn(line, "\n")] = '\0';
+      if (line[0] == '\0') continue;
+      if ((names[nnames] = strdup(line)) == NULL) {
+        fprintf(stderr, "%s: %s: allocating\n", argv[0], strerror(errno));
+        exit(EXIT_FAILURE);
+      }
+      nnames++;
+    }
+    fclose(fin);
+  }
+
+  FILE *sink = fopen("/dev/null", "w");
+  if (sink == NULL) {
+    fprintf(stderr, "%s: %s: opening /dev/null\n", argv[0], strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+
+  printf("# kernels %s; threads %u; %u frames each; %s corpus\n",
+         kernels_name(), threads, frames,
+         corpusname == NULL ? "synthetic" : corpusname);
+  printf("%-9s %5s %6s %10s", "grid", "merge", "gather", "frames/s");
+  for (unsigned s = 0; s < DETSTAGE_COUNT; s++)
+    if (s != DETSTAGE_LOAD)
+      printf(" %10s", detstage_names[s]);
+  printf("  (ns/frame)\n");
+
+  for (unsigned si = 0; si < nsizes; si++) {
+    struct corpus c;
+    if (load_corpus(&c, widths[si], heights[si],
+                    corpusname == NULL ? NULL : (const char *const *) names,
+                    nnames) < 0) {
+      fprintf(stderr, "%s: %s: loading frames\n", argv[0], strerror(errno));
+      exit(EXIT_FAILURE);
+    }
+    for (unsigned mi = 0; mi < nmerges; mi++)
+      for (unsigned gi = 0; gi < ngathers; gi++) {
+        struct detparams par;
+        detparams_init(&par);
+        par.width = widths[si];
+        par.height = heights[si];
+        par.hdeg = merges[mi];
+        par.mdeg = gathers[gi];
+        par.varpow0 = varpow;
+        uint64_t elapsed, ns[DETSTAGE_COUNT];
+        struct detector *d =
+          run(&c, &par, pool, frames, sink, NULL, &elapsed, ns);
+        if (d == NULL) {
+          fprintf(stderr, "%s: %s: running\n", argv[0], strerror(errno));
+          exit(EXIT_FAILURE);
+        }
+        char grid[24];
+        snprintf(grid, sizeof grid, "%ux%u", par.width, par.height);
+        printf("%-9s %5u %6u %10.1f", grid, par.hdeg, par.mdeg,
+               elapsed > 0 ? frames * 1e9 / elapsed : 0.0);
+        for (unsigned s = 0; s < DETSTAGE_COUNT; s++)
+          if (s != DETSTAGE_LOAD)
+            printf(" %10.0f", frames > 0 ? (double) ns[s] / frames : 0.0);
+        putchar('\n');
+        fflush(stdout);
+        detector_destroy(d);
+      }
+    free(c.frames);
+  }
+
+  fclose(sink);
+  for (unsigned i = 0; i < nnames; i++)
+    free(names[i]);
+  pool_destroy(pool);
+  return 0;
+}
@@ -0,0 +1,648 @@
+// -*- c-basic-offset: 2; indent-tabs-mode: nil -*-
+
+/*
+ * Copyright 2018-19, Lancaster University
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ * 
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the
+ *    distribution.
+ * 
+ *  * Neither the name of the copyright holder nor the names of
+ *    its contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ *
+ * Author: Steven Simpson <https://github.com/simpsonst>
+ */
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <strings.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <setjmp.h>
+#include <dirent.h>
+#include <poll.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include <linux/videodev2.h>
+#include <jpeglib.h>
+
+#include "capture.h"
+
+/* Two sources share the one interface, so that the rest of the
+   pipeline can be driven from recorded material when there is no
+   camera to hand.
+
+   The Video4Linux source replaces 'streamer', which had to be
+   restarted every so many frames, and each restart showed up as a
+   flash.  The device streams into buffers mapped from the kernel,
+   and an MJPEG frame is handed on straight from its buffer, which is
+   only queued back to the driver when the next frame is requested.
+   The kernel's timestamp is used, moved onto the real-time clock. */
+
+#define NBUFS 4
+
+/* How long to wait for a frame before deciding the device has
+   stalled */
+#define STALL_MS 10000
+
+enum kind { V4L2, REPLAY };
+
+struct capture {
+  enum kind kind;
+
+  /* Video4Linux */
+  int fd;
+  unsigned nbufs;
+  struct {
+    void *start;
+    size_t len;
+  } buf[NBUFS];
+  int held;
+  bool yuyv;
+  unsigned width, height, stride;
+  int quality;
+  unsigned char *jpeg, *row;
+  unsigned long jpeglen;
+
+  /* replay */
+  char *path;
+  struct dirent **names;
+  int nnames, pos;
+  const unsigned char *map;
+  size_t maplen, off;
+  unsigned char *file;
+  size_t filecap;
+  bool loop;
+  long long period, due;
+
+  /* where each JPEG in the file is, once indexed */
+  size_t (*spans)[2];
+  size_t nspans;
+};
+
+static long long now_ns(clockid_t clk)
+{
+  struct timespec ts;
+  clock_gettime(clk, &ts);
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void set_ns(struct timespec *ts, long long ns)
+{
+  ts->tv_sec = ns / 1000000000;
+  ts->tv_nsec = ns % 1000000000;
+}
+
+static int xioctl(int fd, unsigned long req, void *arg)
+{
+  int rc;
+  do
+    rc = ioctl(fd, req, arg);
+  while (rc < 0 && errno == EINTR);
+  return rc;
+}
+
+struct errmgr {
+  struct jpeg_error_mgr pub;
+  jmp_buf jmp;
+};
+
+static void on_error(j_common_ptr cinfo)
+{
+  struct errmgr *err = (struct errmgr *) cinfo->err;
+  longjmp(err->jmp, 1);
+}
+
+static void on_message(j_common_ptr cinfo)
+{
+  (void) cinfo;
+}
+
+/* Encode a YUYV frame, passing the samples to libjpeg as YCbCr, so
+   there is no colour conversion. */
+static int encode_yuyv(struct capture *c, const unsigned char *in)
+{
+  struct jpeg_compress_struct cinfo;
+  struct errmgr err;
+  cinfo.err = jpeg_std_error(&err.pub);
+  err.pub.error_exit = &on_error;
+  err.pub.output_message = &on_message;
+  free(c->jpeg);
+  c->jpeg = NULL;
+  c->jpeglen = 0;
+  if (setjmp(err.jmp)) {
+    jpeg_destroy_compress(&cinfo);
+    errno = EIO;
+    return -1;
+  }
+  jpeg_create_compress(&cinfo);
+  cinfo.image_width = c->width;
+  cinfo.image_height = c->height;
+  cinfo.input_components = 3;
+  cinfo.in_color_space = JCS_YCbCr;
+  jpeg_set_defaults(&cinfo);
+  jpeg_set_quality(&cinfo, c->quality, TRUE);
+  jpeg_mem_dest(&cinfo, &c->jpeg, &c->jpeglen);
+  jpeg_start_compress(&cinfo, TRUE);
+  for (unsigned y = 0; y < c->height; y++) {
+    const unsigned char *src = in + (size_t) y * c->stride;
+    unsigned char *dst = c->row;
+    for (unsigned x = 0; x + 1 < c->width; x += 2, src += 4) {
+      *dst++ = src[0];
+      *dst++ = src[1];
+      *dst++ = src[3];
+      *dst++ = src[2];
+      *dst++ = src[1];
+      *dst++ = src[3];
+    }
+    JSAMPROW rp = c->row;
+    jpeg_write_scanlines(&cinfo, &rp, 1);
+  }
+  jpeg_finish_compress(&cinfo);
+  jpeg_destroy_compress(&cinfo);
+  return 0;
+}
+
+static struct capture *alloc_capture(enum kind kind)
+{
+  struct capture *c = calloc(1, sizeof *c);
+  if (c == NULL) return NULL;
+  c->kind = kind;
+  c->fd = -1;
+  c->held = -1;
+  return c;
+}
+
+struct capture *capture_v4l2(const char *dev, unsigned width,
+                             unsigned height, unsigned rate,
+                             int quality)
+{
+  struct capture *c = alloc_capture(V4L2);
+  if (c == NULL) return NULL;
+  c->quality = quality;
+  c->fd = open(dev, O_RDWR | O_NONBLOCK | O_CLOEXEC);
+  if (c->fd < 0) goto failed;
+
+  struct v4l2_capability cap;
+  if (xioctl(c->fd, VIDIOC_QUERYCAP, &cap) < 0) goto failed;
+  unsigned caps = cap.capabilities & V4L2_CAP_DEVICE_CAPS ?
+    cap.device_caps : cap.capabilities;
+  if (!(caps & V4L2_CAP_VIDEO_CAPTURE) || !(caps & V4L2_CAP_STREAMING)) {
+    errno = ENODEV;
+    goto failed;
+  }
+
+  /* Ask for MJPEG, and fall back to YUYV. */
+  struct v4l2_format fmt;
+  static const unsigned pixfmts[] = { V4L2_PIX_FMT_MJPEG, V4L2_PIX_FMT_YUYV };
+  unsigned pfi;
+  for (pfi = 0; pfi < sizeof pixfmts / sizeof pixfmts[0]; pfi++) {
+    memset(&fmt, 0, sizeof fmt);
+    fmt.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    fmt.fmt.pix.width = width;
+    fmt.fmt.pix.height = height;
+    fmt.fmt.pix.pixelformat = pixfmts[pfi];
+    fmt.fmt.pix.field = V4L2_FIELD_ANY;
+    if (xioctl(c->fd, VIDIOC_S_FMT, &fmt) == 0 &&
+        fmt.fmt.pix.pixelformat == pixfmts[pfi])
+      break;
+  }
+  if (pfi == sizeof pixfmts / sizeof pixfmts[0]) {
+    errno = EPROTONOSUPPORT;
+    goto failed;
+  }
+  c->yuyv = fmt.fmt.pix.pixelformat == V4L2_PIX_FMT_YUYV;
+  c->width = fmt.fmt.pix.width;
+  c->height = fmt.fmt.pix.height;
+  c->stride = fmt.fmt.pix.bytesperline;
+  if (c->stride < c->width * 2) c->stride = c->width * 2;
+  if (c->yuyv && (c->row = malloc((size_t) c->width * 3)) == NULL)
+    goto failed;
+
+  /* Not all devices can set their rate, and they choose the nearest
+     they can anyway. */
+  if (rate > 0) {
+    struct v4l2_streamparm parm = { .type = V4L2_BUF_TYPE_VIDEO_CAPTURE };
+    parm.parm.capture.timeperframe.numerator = 1;
+    parm.parm.capture.timeperframe.denominator = rate;
+    xioctl(c->fd, VIDIOC_S_PARM, &parm);
+  }
+
+  struct v4l2_requestbuffers req = {
+    .count = NBUFS,
+    .type = V4L2_BUF_TYPE_VIDEO_CAPTURE,
+    .memory = V4L2_MEMORY_MMAP,
+  };
+  if (xioctl(c->fd, VIDIOC_REQBUFS, &req) < 0) goto failed;
+  if (req.count < 2) {
+    errno = ENOMEM;
+    goto failed;
+  }
+  if (req.count > NBUFS) req.count = NBUFS;
+  for (c->nbufs = 0; c->nbufs < req.count; c->nbufs++) {
+    struct v4l2_buffer b = {
+      .type = V4L2_BUF_TYPE_VIDEO_CAPTURE,
+      .memory = V4L2_MEMORY_MMAP,
+      .index = c->nbufs,
+    };
+    if (xioctl(c->fd, VIDIOC_QUERYBUF, &b) < 0) goto failed;
+    void *start = mmap(NULL, b.length, PROT_READ, MAP_SHARED,
+                       c->fd, b.m.offset);
+    if (start == MAP_FAILED) goto failed;
+    c->buf[c->nbufs].start = start;
+    c->buf[c->nbufs].len = b.length;
+    if (xioctl(c->fd, VIDIOC_QBUF, &b) < 0) {
+      c->nbufs++;
+      goto failed;
+    }
+  }
+
+  enum v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+  if (xioctl(c->fd, VIDIOC_STREAMON, &type) < 0) goto failed;
+  return c;
+
+ failed:
+  {
+    int e = errno;
+    capture_close(c);
+    errno = e;
+  }
+  return NULL;
+}
+
+static int next_v4l2(struct capture *c, struct capture_frame *fr)
+{
+  /* The previous frame is finished with. */
+  if (c->held >= 0) {
+    struct v4l2_buffer b = {
+      .type = V4L2_BUF_TYPE_VIDEO_CAPTURE,
+      .memory = V4L2_MEMORY_MMAP,
+      .index = c->held,
+    };
+    c->held = -1;
+    if (xioctl(c->fd, VIDIOC_QBUF, &b) < 0) return -1;
+  }
+
+  for ( ; ; ) {
+    struct v4l2_buffer b = {
+      .type = V4L2_BUF_TYPE_VIDEO_CAPTURE,
+      .memory = V4L2_MEMORY_MMAP,
+    };
+    if (xioctl(c->fd, VIDIOC_DQBUF, &b) < 0) {
+      if (errno != EAGAIN) return -1;
+      struct pollfd pfd = { .fd = c->fd, .events = POLLIN };
+      int rc = poll(&pfd, 1, STALL_MS);
+      if (rc < 0 && errno != EINTR) return -1;
+      if (rc == 0) {
+        errno = ETIMEDOUT;
+        return -1;
+      }
+      continue;
+    }
+
+    if ((b.flags & V4L2_BUF_FLAG_ERROR) || b.bytesused == 0 ||
+        b.index >= c->nbufs) {
+      /* Corrupt frame: give the buffer straight back. */
+      if (xioctl(c->fd, VIDIOC_QBUF, &b) < 0) return -1;
+      continue;
+    }
+    c->held = b.index;
+
+    /* Move the kernel's timestamp onto the real-time clock. */
+    long long at = b.timestamp.tv_sec * 1000000000LL +
+      b.timestamp.tv_usec * 1000LL;
+    if ((b.flags & V4L2_BUF_FLAG_TIMESTAMP_MASK) ==
+        V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC && at != 0)
+      at += now_ns(CLOCK_REALTIME) - now_ns(CLOCK_MONOTONIC);
+    else
+      at = now_ns(CLOCK_REALTIME);
+    set_ns(&fr->stamp, at);
+
+    if (c->yuyv) {
+      if (encode_yuyv(c, c->buf[b.index].start) < 0) return -1;
+      fr->data = c->jpeg;
+      fr->len = c->jpeglen;
+    } else {
+      fr->data = c->buf[b.index].start;
+      fr->len = b.bytesused;
+    }
+    return 0;
+  }
+}
+
+static int is_jpeg_name(const struct dirent *ent)
+{
+  const char *dot = strrchr(ent->d_name, '.');
+  return ent->d_name[0] != '.' && dot != NULL &&
+    (!strcasecmp(dot, ".jpg") || !strcasecmp(dot, ".jpeg"));
+}
+
+struct capture *capture_replay(const char *path, unsigned rate, int loop)
+{
+  struct capture *c = alloc_capture(REPLAY);
+  if (c == NULL) return NULL;
+  c->loop = loop;
+  c->period = rate > 0 ? 1000000000LL / rate : 0;
+  c->due = now_ns(CLOCK_MONOTONIC);
+  if ((c->path = strdup(path)) == NULL) goto failed;
+
+  struct stat st;
+  if (stat(path, &st) < 0) goto failed;
+  if (S_ISDIR(st.st_mode)) {
+    c->nnames = scandir(path, &c->names, &is_jpeg_name, &alphasort);
+    if (c->nnames < 0) {
+      c->nnames = 0;
+      goto failed;
+    }
+  } else {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) goto failed;
+    if (st.st_size > 0) {
+      void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (map == MAP_FAILED) {
+        int e = errno;
+        close(fd);
+        errno = e;
+        goto failed;
+      }
+      c->map = map;
+      c->maplen = st.st_size;
+    }
+    close(fd);
+  }
+  return c;
+
+ failed:
+  {
+    int e = errno;
+    capture_close(c);
+    errno = e;
+  }
+  return NULL;
+}
+
+/* Find the end of the JPEG at the start of 'p' by following its
+   marker structure, so an EOI within an embedded thumbnail does not
+   end it early.  Return its length, or 0 if it is incomplete. */
+static size_t jpeg_span(const unsigned char *p, size_t len)
+{
+  if (len < 4 || p[0] != 0xff || p[1] != 0xd8) return 0;
+  size_t i = 2;
+  while (i + 1 < len) {
+    if (p[i] != 0xff) return 0;
+    const unsigned char m = p[i + 1];
+    if (m == 0xff) {
+      i++;
+      continue;
+    }
+    i += 2;
+    if (m == 0xd9) return i;
+    if (m == 0x01 || (m >= 0xd0 && m <= 0xd7)) continue;
+    if (i + 2 > len) return 0;
+    i += (p[i] << 8) | p[i + 1];
+    if (m != 0xda) continue;
+
+    /* Skip entropy-coded data, up to the next real marker. */
+    while (i + 1 < len &&
+           (p[i] != 0xff || p[i + 1] == 0x00 ||
+            (p[i + 1] >= 0xd0 && p[i + 1] <= 0xd7)))
+      i++;
+  }
+  return 0;
+}
+
+/* Find the next whole JPEG in a replayed file, at or after '*off'.
+   Return its length, with '*off' at its start, or 0 if there are no
+   more. */
+static size_t next_span(const struct capture *c, size_t *off)
+{
+  size_t span = 0;
+  while (*off < c->maplen &&
+         (span = jpeg_span(c->map + *off, c->maplen - *off)) == 0) {
+    /* Resynchronize on the next SOI. */
+    const unsigned char *soi =
+      memmem(c->map + *off + 1, c->maplen - *off - 1, "\xff\xd8", 2);
+    *off = soi ? (size_t) (soi - c->map) : c->maplen;
+  }
+  return span;
+}
+
+/* Read the file 'leaf' of a replayed directory into '*buf', which
+   has '*cap' bytes, and is enlarged as needed.  Get its length, and
+   its modification time if 'mtime' is not NULL. */
+static int read_named(const struct capture *c, const char *leaf,
+                      unsigned char **buf, size_t *cap, size_t *len,
+                      struct timespec *mtime)
+{
+  char name[PATH_MAX];
+  snprintf(name, sizeof name, "%s/%s", c->path, leaf);
+  int fd = open(name, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) return -1;
+  struct stat st;
+  if (mtime != NULL && fstat(fd, &st) == 0)
+    *mtime = st.st_mtim;
+  size_t got = 0;
+  for ( ; ; ) {
+    if (got == *cap) {
+      size_t ncap = *cap ? *cap * 2 : 65536;
+      void *nf = realloc(*buf, ncap);
+      if (nf == NULL) {
+        close(fd);
+        return -1;
+      }
+      *buf = nf;
+      *cap = ncap;
+    }
+    ssize_t rc = read(fd, *buf + got, *cap - got);
+    if (rc < 0 && errno == EINTR) continue;
+    if (rc < 0) {
+      int e = errno;
+      close(fd);
+      errno = e;
+      return -1;
+    }
+    if (rc == 0) break;
+    got += rc;
+  }
+  close(fd);
+  *len = got;
+  return 0;
+}
+
+static int load_named(struct capture *c, const char *leaf,
+                      struct capture_frame *fr)
+{
+  if (read_named(c, leaf, &c->file, &c->filecap, &fr->len, NULL) < 0)
+    return -1;
+  fr->data = c->file;
+  return 0;
+}
+
+static int next_replay(struct capture *c, struct capture_frame *fr)
+{
+  for (bool wrapped = false; ; ) {
+    if (c->map != NULL) {
+      const size_t span = next_span(c, &c->off);
+      if (span > 0) {
+        fr->data = c->map + c->off;
+        fr->len = span;
+        c->off += span;
+        break;
+      }
+    } else {
+      while (c->pos < c->nnames) {
+        if (load_named(c, c->names[c->pos++]->d_name, fr) == 0 &&
+            fr->len > 0)
+          goto found;
+      }
+    }
+    if (!c->loop || wrapped) return 1;
+    wrapped = true;
+    c->off = 0;
+    c->pos = 0;
+  }
+ found:
+
+  /* Pace the frames, without trying to catch up after a stall. */
+  if (c->period > 0) {
+    c->due += c->period;
+    long long now = now_ns(CLOCK_MONOTONIC);
+    if (c->due > now) {
+      struct timespec ts;
+      set_ns(&ts, c->due);
+      while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) ==
+             EINTR)
+        ;
+    } else if (now - c->due > c->period) {
+      c->due = now;
+    }
+  }
+  set_ns(&fr->stamp, now_ns(CLOCK_REALTIME));
+  return 0;
+}
+
+int capture_next(struct capture *c, struct capture_frame *fr)
+{
+  switch (c->kind) {
+  case V4L2:
+    return next_v4l2(c, fr);
+  case REPLAY:
+    return next_replay(c, fr);
+  }
+  errno = EINVAL;
+  return -1;
+}
+
+long capture_index(struct capture *c)
+{
+  if (c->kind != REPLAY) {
+    errno = EINVAL;
+    return -1;
+  }
+  if (c->map == NULL) return c->nnames;
+  if (c->spans != NULL) return c->nspans;
+
+  size_t cap = 0;
+  for (size_t off = 0, span; (span = next_span(c, &off)) > 0; off += span) {
+    if (c->nspans == cap) {
+      const size_t ncap = cap ? cap * 2 : 1024;
+      void *ns = realloc(c->spans, ncap * sizeof *c->spans);
+      if (ns == NULL) return -1;
+      c->spans = ns;
+      cap = ncap;
+    }
+    c->spans[c->nspans][0] = off;
+    c->spans[c->nspans][1] = span;
+    c->nspans++;
+  }
+  return c->nspans;
+}
+
+const char *capture_frame_name(const struct capture *c, size_t i)
+{
+  return c->map == NULL && i < (size_t) c->nnames ?
+    c->names[i]->d_name : NULL;
+}
+
+int capture_frame_at(const struct capture *c, size_t i,
+                     struct capture_frame *fr,
+                     unsigned char **buf, size_t *cap)
+{
+  fr->stamp.tv_sec = 0;
+  fr->stamp.tv_nsec = 0;
+  if (c->map != NULL) {
+    if (i >= c->nspans) {
+      errno = EINVAL;
+      return -1;
+    }
+    fr->data = c->map + c->spans[i][0];
+    fr->len = c->spans[i][1];
+    return 0;
+  }
+  if (i >= (size_t) c->nnames) {
+    errno = EINVAL;
+    return -1;
+  }
+  if (read_named(c, c->names[i]->d_name, buf, cap, &fr->len,
+                 &fr->stamp) < 0)
+    return -1;
+  fr->data = *buf;
+  return 0;
+}
+
+void capture_close(struct capture *c)
+{
+  if (c == NULL) return;
+  if (c->fd >= 0) {
+    enum v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    xioctl(c->fd, VIDIOC_STREAMOFF, &type);
+    close(c->fd);
+  }
+  for (unsigned i = 0; i < c->nbufs; i++)
+    munmap(c->buf[i].start, c->buf[i].len);
+  free(c->jpeg);
+  free(c->row);
+
+  free(c->path);
+  for (int i = 0; i < c->nnames; i++)
+    free(c->names[i]);
+  free(c->names);
+  if (c->map != NULL)
+    munmap((void *) c->map, c->maplen);
+  free(c->file);
+  free(c->spans);
+  free(c);
+}
@@ -0,0 +1,102 @@
+// -*- c-basic-offset: 2; indent-tabs-mode: nil -*-
+
+/*
+ * Copyright 2018-19, Lancaster University
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ * 
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the
+ *    distribution.
+ * 
+ *  * Neither the name of the copyright holder nor the names of
+ *    its contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ *
+ * Author: Steven Simpson <https://github.com/simpsonst>
+ */
+
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <stddef.h>
+#include <time.h>
+
+/* A source of JPEG frames, either a live camera or a recording
+   replayed in its place.  Each frame remains valid only until the
+   next is requested, or the source is closed. */
+
+struct capture;
+
+/* A frame's description */
+struct capture_frame {
+  const void *data;
+  size_t len;
+
+  /* the time of capture, on the real-time clock */
+  struct timespec stamp;
+};
+
+/* Open a Video4Linux device for streaming capture into memory-mapped
+   buffers, at about 'rate' frames per second, and at 'width' by
+   'height' if the device allows it.  MJPEG is preferred; YUYV is
+   accepted, and encoded at 'quality'.  Return NULL on error, with
+   errno set. */
+struct capture *capture_v4l2(const char *dev, unsigned width,
+                             unsigned height, unsigned rate,
+                             int quality);
+
+/* Open 'path' for replay, either a directory of JPEG files (taken in
+   name order), or a file of concatenated JPEGs.  Frames are
+   delivered at 'rate' per second, or as fast as they are taken if
+   'rate' is zero, and stamped with the time of delivery.  If 'loop'
+   is set, the replay restarts when it runs out.  Return NULL on
+   error, with errno set. */
+struct capture *capture_replay(const char *path, unsigned rate, int loop);
+
+/* Get the next frame, waiting for it if necessary.  Return 0 on
+   success, 1 at the end of a replay, or -1 on error, with errno
+   set. */
+int capture_next(struct capture *, struct capture_frame *);
+
+/* Index the frames of a replay, so that they can be fetched in any
+   order, from any thread, with 'capture_frame_at'.  Return the
+   number of frames, or -1 on error, with errno set. */
+long capture_index(struct capture *);
+
+/* Get the name of file 'i' of an indexed replay of a directory, or
+   NULL if the replay is of a file. */
+const char *capture_frame_name(const struct capture *, size_t i);
+
+/* Get frame 'i' of an indexed replay.  A frame of a file refers to
+   its mapping.  A frame from a directory is read into '*buf', which
+   holds '*cap' bytes, and is enlarged with 'realloc' if necessary,
+   and is stamped with the file's modification time.  Return 0 on
+   success; -1 on error, with errno set. */
+int capture_frame_at(const struct capture *, size_t i,
+                     struct capture_frame *,
+                     unsigned char **buf, size_t *cap);
+
+void capture_close(struct capture *);
+
+#endif
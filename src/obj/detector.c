@@ -0,0 +1,1563 @@
+// -*- c-basic-offset: 2; indent-tabs-mode: nil -*-
+
+/*
+ * Copyright 2018-19, Lancaster University
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ * 
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the
+ *    distribution.
+ * 
+ *  * Neither the name of the copyright holder nor the names of
+ *    its contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ *
+ * Author: Steven Simpson <https://github.com/simpsonst>
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <math.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <limits.h>
+
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "jpegdet.h"
+#include "ring.h"
+#include "kernels.h"
+#include "pool.h"
+#include "mask.h"
+#include "uring.h"
+#include "detector.h"
+
+
+/* Update the smoothed ratio of stddev to mean '*rm' with a new mean
+   and stddev, and return it. */
+static double smooth(double *rm, double mean, double sd)
+{
+  const double alt = fdim((sd + 1e-7) / (mean + 1e-7), 1.0);
+  return *rm = 0.8 * *rm + 0.2 * alt;
+}
+
+/* Make a parsable report to the user.  The first word is the score,
+   or '-' if there is no score because the frame was not used for
+   motion detection (indicated by 'fact<0').  The last word (to the
+   end of the line) is the name of the source file associated with
+   this score, surrounded by a couple of graphic characters.  Other
+   words are additional diagnostic values, and then 'zones', if not
+   NULL. */
+static void report(FILE *out, const char *tag, double *rm,
+                   double mean, double sd, const char *zones,
+                   const char *line, double fact)
+{
+  smooth(rm, mean, sd);
+  if (out == NULL) return;
+
+  if (tag != NULL)
+    fprintf(out, "%s ", tag);
+  if (fact < 0.0)
+    fprintf(out, "- - - - X%sX\n", line);
+  else {
+#if 0
+    fprintf(out, "%.0f %g %g %g X%sX\n",
+            (mean / 2.0 + sd / 8.0) * fact, mean, sd,
+            *rm, line);
+#else
+    fprintf(out, "%.0f %g %g %g %sX%sX\n",
+            *rm * fact, mean, sd,
+            *rm, zones ? zones : "", line);
+#endif
+  }
+  fflush(stderr);
+}
+
+static double cos2vect(double ax, double ay, double bx, double by)
+{
+  const double maga = ax * ax + ay * ay;
+  const double magb = bx * bx + by * by;
+  const double denom = sqrt(maga * magb);
+  if (denom < 1e-6) return 0.0;
+
+  const double numer = ax * bx + ay * by;
+  return (numer / denom + 1.0) / 2.0 * denom;
+}
+
+/* Per-cell state is aligned to cache lines, and mapped directly when
+   at least the size of a huge page. */
+#define ARENA_ALIGN 64
+#define HUGE_SIZE ((size_t) 2 << 20)
+
+/* Each frame is processed in bands of this many rows, which may be
+   shared between threads.  The bands do not depend on the number of
+   threads, and their results are combined in order, so neither do
+   the scores. */
+#define BAND_ROWS 16
+
+/* The fine grid of a coarse-to-fine detector, divided into tiles,
+   each covering one cell of the coarse grid */
+struct tiles {
+  unsigned cols, rows;
+
+  /* Tile (tx, ty) covers columns 'x[tx]' to 'x[tx + 1] - 1', and
+     rows 'y[ty]' to 'y[ty + 1] - 1'.  Each row lies in tile row
+     'row_tile[y]'. */
+  unsigned *x, *y, *row_tile;
+
+  /* the smallest coarse difference that makes a tile active */
+  double gate;
+
+  /* Which tiles are active for this frame and were for the last?
+     Which are to be processed, i.e., are within one tile of an
+     active one? */
+  unsigned char *active, *was_active, *work;
+
+  /* the frame for which each tile's sums were last brought up to
+     date, and the current frame */
+  unsigned long *stamp, seq;
+};
+
+/* The state shared by the bands of a frame */
+struct step {
+  unsigned width, height;
+  unsigned mdeg, hdeg;
+  double varpow1, varpow0;
+  struct stats *before, *after;
+  double *diff, *adjwork;
+
+  /* the EWMA of 'before', and the weight of the frame leaving
+     'after', or NULL if 'before' is summed */
+  struct ewstats *ew;
+  double alpha;
+
+  /* the cells to process, or NULL for all of them */
+  const struct cellmask *mask;
+
+  /* the tiles to process, if gated by a coarse grid, and the frames
+     from which to rebuild the sums of tiles that have fallen behind,
+     the oldest being at 'rplidx' */
+  const struct tiles *tiles;
+  const unsigned char *src;
+  unsigned rplidx, tdeg;
+
+  /* the frames entering and leaving the sums */
+  const unsigned char *oldest, *trans, *newest;
+
+  /* the current and previous motion vectors */
+  double *mx, *my, *ox, *oy;
+
+  /* the sum of scores and the sum of their squares for each band,
+     overall and then for each zone */
+  unsigned zones;
+  double (*partial)[2];
+
+  /* the time spent on each stage by each band, or NULL if not
+     timing */
+  uint64_t (*ns)[DETSTAGE_COUNT];
+};
+
+static uint64_t now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * UINT64_C(1000000000) + ts.tv_nsec;
+}
+
+/* Charge the time since '*t' to a stage of a band, and restart the
+   clock. */
+static void charge(const struct step *st, unsigned band,
+                   enum detstage stage, uint64_t *t)
+{
+  if (st->ns == NULL) return;
+  const uint64_t t1 = now_ns();
+  st->ns[band][stage] += t1 - *t;
+  *t = t1;
+}
+
+static void band_rows(const struct step *st, unsigned band,
+                      unsigned *y0, unsigned *y1)
+{
+  *y0 = band * BAND_ROWS;
+  *y1 = *y0 + BAND_ROWS;
+  if (*y1 > st->height) *y1 = st->height;
+}
+
+/* Update the sums of cells 'i' to 'i + n - 1' of a band, and compute
+   their differences. */
+static void diff_range(const struct step *st, unsigned band,
+                       size_t i, size_t n, uint64_t *tp)
+{
+  uint64_t t = *tp;
+  struct stats after = { st->after->sum + i, st->after->sum_sq + i };
+  if (st->ew != NULL) {
+    struct ewstats before = { st->ew->mean + i, st->ew->var + i };
+    slide_ewma(n, st->alpha, &before, &after,
+               st->oldest + i, st->newest + i);
+    charge(st, band, DETSTAGE_SLIDE, &t);
+    compute_diffs_ewma(n, st->mdeg, st->varpow1, st->varpow0,
+                       &after, &before, st->diff + i);
+    charge(st, band, DETSTAGE_DIFFS, &t);
+    *tp = t;
+    return;
+  }
+  struct stats before = { st->before->sum + i, st->before->sum_sq + i };
+  slide_window(n, &before, &after,
+               st->oldest + i, st->trans + i, st->newest + i);
+  charge(st, band, DETSTAGE_SLIDE, &t);
+  compute_diffs(n, st->mdeg, st->hdeg, st->varpow1, st->varpow0,
+                &after, &before, st->diff + i);
+  charge(st, band, DETSTAGE_DIFFS, &t);
+  *tp = t;
+}
+
+/* Rebuild the sums of cells 'i' to 'i + n - 1' of a band from the
+   frames of the window, including the newest, and compute their
+   differences. */
+static void refill_range(const struct step *st, unsigned band,
+                         size_t i, size_t n, uint64_t *tp)
+{
+  uint64_t t = *tp;
+  struct stats before = { st->before->sum + i, st->before->sum_sq + i };
+  struct stats after = { st->after->sum + i, st->after->sum_sq + i };
+  memset(before.sum, 0, n * sizeof *before.sum);
+  memset(before.sum_sq, 0, n * sizeof *before.sum_sq);
+  memset(after.sum, 0, n * sizeof *after.sum);
+  memset(after.sum_sq, 0, n * sizeof *after.sum_sq);
+  const size_t cells = (size_t) st->width * st->height;
+  for (unsigned k = 1; k <= st->tdeg; k++) {
+    const unsigned char *frame = k == st->tdeg ? st->newest :
+      st->src + (st->rplidx + k) % st->tdeg * cells;
+    add_image(+1, n, k <= st->hdeg ? &before : &after, frame + i);
+  }
+  charge(st, band, DETSTAGE_SLIDE, &t);
+  compute_diffs(n, st->mdeg, st->hdeg, st->varpow1, st->varpow0,
+                &after, &before, st->diff + i);
+  charge(st, band, DETSTAGE_DIFFS, &t);
+  *tp = t;
+}
+
+/* Is a tile's sums up to date as of the last frame? */
+static bool tile_fresh(const struct tiles *tl, size_t tile)
+{
+  return tl->stamp[tile] + 1 == tl->seq;
+}
+
+/* Find the end of the run of tiles to be processed starting at 'tx'
+   in tile row 'ty', or 'tx' itself if it is not to be processed.  If
+   'by_freshness', the run does not go beyond tiles which are as up
+   to date as the first. */
+static unsigned work_run(const struct tiles *tl, unsigned ty, unsigned tx,
+                         bool by_freshness)
+{
+  const size_t row = (size_t) ty * tl->cols;
+  if (!tl->work[row + tx]) return tx;
+  const bool fresh = tile_fresh(tl, row + tx);
+  unsigned end = tx + 1;
+  while (end < tl->cols && tl->work[row + end] &&
+         (!by_freshness || tile_fresh(tl, row + end) == fresh))
+    end++;
+  return end;
+}
+
+/* Update the sums of a band, and compute its differences.  With a
+   mask, only the runs of cells needed to score the active cells are
+   processed.  With tiles, only those within one tile of an active
+   one are, and those that have fallen behind are rebuilt. */
+static void diff_band(void *ctx, unsigned band)
+{
+  const struct step *st = ctx;
+  unsigned y0, y1;
+  band_rows(st, band, &y0, &y1);
+  uint64_t t = st->ns ? now_ns() : 0;
+  if (st->tiles != NULL) {
+    const struct tiles *tl = st->tiles;
+    for (unsigned y = y0; y < y1; y++) {
+      const unsigned ty = tl->row_tile[y];
+      for (unsigned tx = 0, end; tx < tl->cols; tx = end) {
+        if ((end = work_run(tl, ty, tx, true)) == tx) {
+          end++;
+          continue;
+        }
+        const size_t i = (size_t) y * st->width + tl->x[tx];
+        const size_t n = tl->x[end] - tl->x[tx];
+        if (tile_fresh(tl, (size_t) ty * tl->cols + tx))
+          diff_range(st, band, i, n, &t);
+        else
+          refill_range(st, band, i, n, &t);
+      }
+    }
+    return;
+  }
+  if (st->mask == NULL) {
+    diff_range(st, band, (size_t) y0 * st->width,
+               (size_t) (y1 - y0) * st->width, &t);
+    return;
+  }
+  const struct spans *sp = &st->mask->diffs;
+  for (size_t r = sp->row[y0]; r < sp->row[y1]; r++)
+    diff_range(st, band, sp->runs[r].start,
+               sp->runs[r].end - sp->runs[r].start, &t);
+}
+
+/* Compute the edges of a band.  This needs the differences of the
+   rows either side. */
+static void edge_band(void *ctx, unsigned band)
+{
+  const struct step *st = ctx;
+  unsigned y0, y1;
+  band_rows(st, band, &y0, &y1);
+  uint64_t t = st->ns ? now_ns() : 0;
+  if (st->tiles != NULL) {
+    /* Only inner cells have edges. */
+    const struct tiles *tl = st->tiles;
+    if (y0 < 1) y0 = 1;
+    if (y1 > st->height - 1) y1 = st->height - 1;
+    for (unsigned y = y0; y < y1; y++) {
+      const unsigned ty = tl->row_tile[y];
+      for (unsigned tx = 0, end; tx < tl->cols; tx = end) {
+        if ((end = work_run(tl, ty, tx, false)) == tx) {
+          end++;
+          continue;
+        }
+        const size_t row = (size_t) y * st->width;
+        const unsigned xa = tl->x[tx] < 1 ? 1 : tl->x[tx];
+        const unsigned xb =
+          tl->x[end] > st->width - 1 ? st->width - 1 : tl->x[end];
+        if (xa < xb)
+          adj_edges_range(st->width, st->height, row + xa, row + xb,
+                          st->diff, st->adjwork);
+      }
+    }
+  } else if (st->mask == NULL) {
+    adj_edges(st->width, st->height, y0, y1, st->diff, st->adjwork);
+  } else {
+    const struct spans *sp = &st->mask->edges;
+    for (size_t r = sp->row[y0]; r < sp->row[y1]; r++)
+      adj_edges_range(st->width, st->height,
+                      sp->runs[r].start, sp->runs[r].end,
+                      st->diff, st->adjwork);
+  }
+  charge(st, band, DETSTAGE_ADJS, &t);
+}
+
+/* Compare the motion vector of inner cell 'i' with the previous
+   vectors of the cells above, left, and diagonally left. */
+static inline double cell_score(const struct step *st, size_t i)
+{
+  const size_t w = st->width;
+  const double vx = st->mx[i], vy = st->my[i];
+  double s = 0.0;
+  s += cos2vect(vx, vy, st->ox[i - w], st->oy[i - w]);
+  s += cos2vect(vx, vy, st->ox[i - w - 1], st->oy[i - w - 1]);
+  s += cos2vect(vx, vy, st->ox[i - 1], st->oy[i - 1]);
+  s += cos2vect(vx, vy, st->ox[i + w - 1], st->oy[i + w - 1]);
+  return s;
+}
+
+/* Compute the motion vectors of the tiles of a band to be processed,
+   and score the cells of those active now and for the last frame.
+   Others are left out, as if they scored nothing. */
+static void score_tiles(const struct step *st, unsigned band,
+                        unsigned y0, unsigned y1, uint64_t *t)
+{
+  const struct tiles *tl = st->tiles;
+  const unsigned width = st->width, height = st->height;
+  for (unsigned y = y0; y < y1; y++) {
+    const unsigned ty = tl->row_tile[y];
+    for (unsigned tx = 0, end; tx < tl->cols; tx = end) {
+      if ((end = work_run(tl, ty, tx, false)) == tx) {
+        end++;
+        continue;
+      }
+      const size_t row = (size_t) y * width;
+      adj_gather_range(width, height, row + tl->x[tx], row + tl->x[end],
+                       st->mx, st->my, st->adjwork);
+    }
+  }
+  charge(st, band, DETSTAGE_ADJS, t);
+
+  double sum = 0.0, sum2 = 0.0;
+  if (y0 < 1) y0 = 1;
+  if (y1 > height - 1) y1 = height - 1;
+  for (unsigned y = y0; y < y1; y++) {
+    const size_t trow = (size_t) tl->row_tile[y] * tl->cols;
+    for (unsigned tx = 0; tx < tl->cols; tx++) {
+      if (!tl->active[trow + tx] || !tl->was_active[trow + tx]) continue;
+      const size_t row = (size_t) y * width;
+      const unsigned x0 = tl->x[tx] < 1 ? 1 : tl->x[tx];
+      for (unsigned x = x0; x < tl->x[tx + 1]; x++) {
+        const double s = cell_score(st, row + x);
+        sum += s;
+        sum2 += s * s;
+      }
+    }
+  }
+  st->partial[band][0] = sum;
+  st->partial[band][1] = sum2;
+  charge(st, band, DETSTAGE_SCORE, t);
+}
+
+/* Score the active cells of a band against the previous vectors of
+   neighbouring cells, overall and by zone. */
+static void score_cells(const struct step *st, unsigned y0, unsigned y1,
+                        double (*part)[2])
+{
+  const struct cellmask *m = st->mask;
+  for (unsigned z = 0; z <= st->zones; z++)
+    part[z][0] = part[z][1] = 0.0;
+  for (size_t k = m->row[y0]; k < m->row[y1]; k++) {
+    const double s = cell_score(st, m->cells[k]);
+    double *const zp = part[1 + m->zone[k]];
+    part[0][0] += s;
+    part[0][1] += s * s;
+    zp[0] += s;
+    zp[1] += s * s;
+  }
+}
+
+/* Compute the motion vectors of a band, and score them against the
+   previous vectors of neighbouring cells.  This needs the edges of
+   the rows either side. */
+static void score_band(void *ctx, unsigned band)
+{
+  const struct step *st = ctx;
+  const unsigned width = st->width, height = st->height;
+  unsigned y0, y1;
+  band_rows(st, band, &y0, &y1);
+  uint64_t t = st->ns ? now_ns() : 0;
+  if (st->tiles != NULL) {
+    score_tiles(st, band, y0, y1, &t);
+    return;
+  }
+  if (st->mask != NULL) {
+    const struct spans *sp = &st->mask->motion;
+    for (size_t r = sp->row[y0]; r < sp->row[y1]; r++)
+      adj_gather_range(width, height, sp->runs[r].start, sp->runs[r].end,
+                       st->mx, st->my, st->adjwork);
+    charge(st, band, DETSTAGE_ADJS, &t);
+    score_cells(st, y0, y1, st->partial + band * (st->zones + 1));
+    charge(st, band, DETSTAGE_SCORE, &t);
+    return;
+  }
+  adj_gather(width, height, y0, y1, st->mx, st->my, st->adjwork);
+  charge(st, band, DETSTAGE_ADJS, &t);
+
+  const double (*const mx)[width] = (const double (*)[width]) st->mx;
+  const double (*const my)[width] = (const double (*)[width]) st->my;
+  const double (*const ox)[width] = (const double (*)[width]) st->ox;
+  const double (*const oy)[width] = (const double (*)[width]) st->oy;
+
+  /* Compare previous and current vectors for inner cells. */
+  double sum = 0.0, sum2 = 0.0;
+  if (y0 < 1) y0 = 1;
+  if (y1 > height - 1) y1 = height - 1;
+  for (unsigned y = y0; y < y1; y++) {
+    const unsigned up = y - 1;
+    const unsigned down = y + 1;
+    for (unsigned x = 1; x < width; x++) {
+      const unsigned left = x - 1;
+      const double vx = mx[y][x], vy = my[y][x];
+      double s = 0.0;
+      s += cos2vect(vx, vy, ox[up][x], oy[up][x]);
+      s += cos2vect(vx, vy, ox[up][left], oy[up][left]);
+      s += cos2vect(vx, vy, ox[y][left], oy[y][left]);
+      s += cos2vect(vx, vy, ox[down][left], oy[down][left]);
+      sum += s;
+      sum2 += s * s;
+    }
+  }
+  st->partial[band][0] = sum;
+  st->partial[band][1] = sum2;
+  charge(st, band, DETSTAGE_SCORE, &t);
+}
+
+#if 0
+static int digiclamp(double val)
+{
+  if (val < 0.0) return 0;
+  if (val > 9.0) return 9;
+  return val;
+}
+#endif
+
+#if 0
+static int signum(int v)
+{
+  return (v > 0) - (v < 0);
+}
+
+static double detedge(signed short pix1, signed short pix2)
+{
+  if (signum(pix1) == signum(pix2)) return 0.0;
+  return (double) pix1 * -pix2;
+}
+#endif
+
+
+/* Convert the 'len' bytes of a frame at 'data' into a
+   'width'x'height' detection grid in 'src'.  The frame may be a PGM
+   already condensed to the grid size, or the source JPEG, which is
+   then condensed here.  Return 0 on success; non-zero on failure. */
+static int parse_frame(const unsigned width, const unsigned height,
+                       unsigned char src[width * height],
+                       const unsigned char *data, size_t len)
+{
+  if (len == 0) return -1;
+  if (data[0] == 0xff)
+    return decode_jpeg(width, height, src, data, len);
+
+  /* Skip over the PGM header (P5\n16 12\n255\n). */
+  size_t pos = 0;
+  for (int nl = 3; nl > 0 && pos < len; )
+    if (data[pos++] == '\n') nl--;
+
+  /* Copy the raw bytes. */
+  const size_t amount = (size_t) width * height;
+  if (len - pos < amount) return 1;
+  memcpy(src, data + pos, amount);
+  return 0;
+}
+
+int framesrc_attach(struct framesrc *fs)
+{
+  if (fs->ring != NULL || fs->ringpath == NULL) return 0;
+  struct ring *r = ring_open(fs->ringpath);
+  if (r == NULL) return -1;
+  const size_t max = ring_maxframe(r);
+  if (fs->max < max) {
+    void *buf = realloc(fs->buf, max);
+    if (buf == NULL) {
+      ring_close(r);
+      return -1;
+    }
+    fs->buf = buf;
+    fs->max = max;
+  }
+  fs->ring = r;
+  return 0;
+}
+
+void framesrc_release(struct framesrc *fs)
+{
+  ring_close(fs->ring);
+  fs->ring = NULL;
+  uring_destroy(fs->uring);
+  fs->uring = NULL;
+  fs->plain = false;
+  free(fs->buf);
+  fs->buf = NULL;
+  fs->max = 0;
+}
+
+int framesrc_load(struct framesrc *fs, const char *name,
+                  const unsigned width, const unsigned height,
+                  unsigned char src[width * height])
+{
+  if (*name == '@' && fs->ringpath != NULL) {
+    /* The producer might not have created the ring yet. */
+    if (framesrc_attach(fs) < 0) return -1;
+
+    struct ring_frame fr;
+    if (ring_fetch(fs->ring, strtoull(name + 1, NULL, 10),
+                   fs->buf, fs->max, &fr) != RING_OK)
+      return -1;
+    return decode_jpeg(width, height, src, fs->buf, fr.len) != 0;
+  }
+
+  /* Files are read whole, so that opening, reading and closing each
+     can be a single submission. */
+  if (fs->uring == NULL && !fs->plain &&
+      (fs->uring = uring_create()) == NULL)
+    fs->plain = true;
+  const ssize_t len = uring_load(fs->uring, name, &fs->buf, &fs->max, NULL);
+  if (len < 0) return -1;
+  return parse_frame(width, height, src, fs->buf, len) != 0;
+}
+
+void detparams_init(struct detparams *par)
+{
+  par->width = 16;
+  par->height = 12;
+
+  /* By default, 100 images in a sequence will be averaged to produce
+     the 'before' image, and 5 for 'after'. */
+  par->mdeg = 5;
+  par->hdeg = 100;
+
+  par->factpow = 9;
+  par->varpow0 = par->varpow1 = 0.5;
+  par->ewma = false;
+  par->mask = NULL;
+  par->coarse_width = par->coarse_height = 0;
+  par->gate = 0.02;
+  par->checkpoint = NULL;
+  par->resume = 300;
+}
+
+struct detector {
+  struct detparams par;
+  double fact;
+  size_t cells;
+
+  /* How many frames make up the history?  It's the number of before
+     and after frames. */
+  unsigned tdeg;
+
+  /* How many frames do we keep?  It's 'tdeg', or just the after
+     frames if 'before' is an EWMA. */
+  unsigned kept;
+
+  /* How many frames of the history have been loaded?  Scoring
+     begins when it reaches 'tdeg'. */
+  unsigned filled;
+
+  /* the position of the oldest frame in 'src' */
+  unsigned sources;
+
+  /* the weight of a frame entering the EWMA once warmed up, and how
+     many frames have entered it so far */
+  double alpha;
+  unsigned long folded;
+
+  /* which of the two sets of motion vectors is to be replaced
+     next */
+  unsigned next_mrplidx;
+
+  /* the smoothed ratio of stddev to mean */
+  double rm;
+
+  /* All the per-cell state below is carved from this one block, each
+     part aligned to a cache line.  A large block is mapped directly,
+     so that it can be backed by huge pages. */
+  void *arena;
+  size_t arena_size;
+  bool mapped;
+
+  /* the most recent mdeg images, and the previous hdeg images unless
+     'before' is an EWMA, and space for the next one */
+  unsigned char *src, *tmp;
+
+  /* Store the sums for the 'before' and 'after' images.  We store
+     both the sum and the sum of squares, so we can easily calculate
+     the mean and standard deviation.  Each is a separate plane, so
+     that cells can be processed several at a time. */
+  struct stats sum_before, sum_after;
+
+  /* the mean and variance of 'before', if modelled as an EWMA */
+  struct ewstats ew;
+
+  /* the difference per cell between the most recent frames and the
+     prior frames */
+  double *diff;
+
+  /* working space for comparing neighbouring cells */
+  double *adjwork;
+
+  /* vector computations, old and new, as planes of x and y
+     components */
+  double *motion;
+
+  /* the cells to process, if masked, and the smoothed ratio and the
+     report of each zone */
+  bool masked;
+  struct cellmask mask;
+  double *zrm;
+  char *zonetext;
+  size_t zonelen;
+
+  /* where to keep the history, or NULL */
+  char *checkpoint;
+
+  /* where 'detector_score' records the current frame's statistics,
+     or NULL if it is to be reported */
+  double *raw;
+
+  /* the detector of the coarse grid, and the tiles it gates, or NULL
+     if not coarse-to-fine */
+  struct detector *coarse;
+  struct tiles tiles;
+
+  struct pool *pool;
+  unsigned bands;
+  double (*partial)[2];
+  struct step st;
+
+  /* the time spent on each stage by each band, if timing */
+  uint64_t (*ns)[DETSTAGE_COUNT];
+};
+
+const char *const detstage_names[DETSTAGE_COUNT] = {
+  [DETSTAGE_LOAD] = "load",
+  [DETSTAGE_SLIDE] = "slide",
+  [DETSTAGE_DIFFS] = "diffs",
+  [DETSTAGE_ADJS] = "adjs",
+  [DETSTAGE_SCORE] = "score",
+};
+
+/* Reserve space for 'bytes' at '*off', and advance it to the next
+   cache line.  Return the reserved offset. */
+static size_t carve(size_t *off, size_t bytes)
+{
+  const size_t at = *off;
+  *off += (bytes + ARENA_ALIGN - 1) & ~(size_t) (ARENA_ALIGN - 1);
+  return at;
+}
+
+/* Allocate a zeroed arena of 'size' bytes. */
+static int arena_alloc(struct detector *d, size_t size)
+{
+  if (size >= HUGE_SIZE) {
+    void *p = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) return -1;
+#ifdef MADV_HUGEPAGE
+    /* This is only advice, so failure doesn't matter. */
+    madvise(p, size, MADV_HUGEPAGE);
+#endif
+    d->arena = p;
+    d->mapped = true;
+  } else {
+    d->arena = aligned_alloc(ARENA_ALIGN, size);
+    if (d->arena == NULL) return -1;
+    memset(d->arena, 0, size);
+    d->mapped = false;
+  }
+  d->arena_size = size;
+  return 0;
+}
+
+/* Divide a 'width'x'height' grid into 'cols'x'rows' tiles.  Return
+   0 on success; -1 on error, with errno set. */
+static int tiles_init(struct tiles *tl, unsigned width, unsigned height,
+                      unsigned cols, unsigned rows, double gate)
+{
+  const size_t count = (size_t) cols * rows;
+  tl->cols = cols;
+  tl->rows = rows;
+  tl->gate = gate;
+  tl->x = calloc(cols + 1, sizeof *tl->x);
+  tl->y = calloc(rows + 1, sizeof *tl->y);
+  tl->row_tile = calloc(height, sizeof *tl->row_tile);
+  tl->active = calloc(count, 1);
+  tl->was_active = calloc(count, 1);
+  tl->work = calloc(count, 1);
+  tl->stamp = calloc(count, sizeof *tl->stamp);
+  if (tl->x == NULL || tl->y == NULL || tl->row_tile == NULL ||
+      tl->active == NULL || tl->was_active == NULL || tl->work == NULL ||
+      tl->stamp == NULL)
+    return -1;
+  for (unsigned tx = 0; tx <= cols; tx++)
+    tl->x[tx] = (size_t) tx * width / cols;
+  for (unsigned ty = 0; ty <= rows; ty++)
+    tl->y[ty] = (size_t) ty * height / rows;
+  for (unsigned ty = 0; ty < rows; ty++)
+    for (unsigned y = tl->y[ty]; y < tl->y[ty + 1]; y++)
+      tl->row_tile[y] = ty;
+  return 0;
+}
+
+static void tiles_free(struct tiles *tl)
+{
+  free(tl->x);
+  free(tl->y);
+  free(tl->row_tile);
+  free(tl->active);
+  free(tl->was_active);
+  free(tl->work);
+  free(tl->stamp);
+}
+
+/* Average each tile of 'fine' into a cell of 'coarse'. */
+static void downsample(const struct tiles *tl, unsigned width,
+                       const unsigned char *fine, unsigned char *coarse)
+{
+  for (unsigned ty = 0; ty < tl->rows; ty++)
+    for (unsigned tx = 0; tx < tl->cols; tx++) {
+      unsigned sum = 0;
+      for (unsigned y = tl->y[ty]; y < tl->y[ty + 1]; y++)
+        for (unsigned x = tl->x[tx]; x < tl->x[tx + 1]; x++)
+          sum += fine[(size_t) y * width + x];
+      const unsigned n =
+        (tl->y[ty + 1] - tl->y[ty]) * (tl->x[tx + 1] - tl->x[tx]);
+      coarse[(size_t) ty * tl->cols + tx] = (sum + n / 2) / n;
+    }
+}
+
+struct detector *detector_create(const struct detparams *par,
+                                 struct pool *pool)
+{
+  /* Each tile must be big enough that a scored cell's neighbours,
+     and the cells they depend on, lie within its neighbouring
+     tiles. */
+  if (par->coarse_width > 0 &&
+      (par->ewma || par->mask != NULL ||
+       par->coarse_height == 0 ||
+       par->width / par->coarse_width < 3 ||
+       par->height / par->coarse_height < 3)) {
+    errno = EINVAL;
+    return NULL;
+  }
+
+  struct detector *d = calloc(1, sizeof *d);
+  if (d == NULL) return NULL;
+  d->par = *par;
+  d->fact = pow(10, par->factpow - 5);
+  d->cells = (size_t) par->width * par->height;
+  d->tdeg = par->mdeg + par->hdeg;
+  d->kept = par->ewma ? par->mdeg : d->tdeg;
+  d->alpha = 2.0 / (par->hdeg + 1.0);
+  d->next_mrplidx = 1;
+  d->pool = pool;
+  d->bands = (par->height + BAND_ROWS - 1) / BAND_ROWS;
+  if (par->checkpoint != NULL &&
+      (d->par.checkpoint = d->checkpoint = strdup(par->checkpoint)) == NULL) {
+    free(d);
+    return NULL;
+  }
+
+  /* Lay out the per-cell state. */
+  const size_t cells = d->cells;
+  size_t size = 0;
+  const size_t src_at = carve(&size, (d->kept + 1) * cells);
+  const size_t sum_at[2] = {
+    carve(&size, cells * sizeof *d->sum_before.sum),
+    carve(&size, cells * sizeof *d->sum_after.sum),
+  };
+  const size_t sum_sq_at[2] = {
+    carve(&size, cells * sizeof *d->sum_before.sum_sq),
+    carve(&size, cells * sizeof *d->sum_after.sum_sq),
+  };
+  const size_t ew_at[2] = {
+    carve(&size, par->ewma ? cells * sizeof *d->ew.mean : 0),
+    carve(&size, par->ewma ? cells * sizeof *d->ew.var : 0),
+  };
+  const size_t diff_at = carve(&size, cells * sizeof *d->diff);
+  const size_t adjwork_at =
+    carve(&size, adj_scratch(par->width, par->height) * sizeof *d->adjwork);
+  const size_t motion_at = carve(&size, 4 * cells * sizeof *d->motion);
+
+  if (par->mask != NULL) {
+    if (cellmask_load(&d->mask, par->mask, par->width, par->height) < 0) {
+      const int saved = errno;
+      detector_destroy(d);
+      errno = saved;
+      return NULL;
+    }
+    d->masked = true;
+
+    /* Allow for each zone's name, and a score. */
+    size_t len = 1;
+    for (unsigned z = 0; z < d->mask.zones; z++)
+      len += strlen(d->mask.names[z]) + 32;
+    d->zrm = calloc(d->mask.zones + 1, sizeof *d->zrm);
+    d->zonetext = malloc(d->zonelen = len);
+    if (d->zrm == NULL || d->zonetext == NULL) {
+      detector_destroy(d);
+      errno = ENOMEM;
+      return NULL;
+    }
+  }
+  const unsigned zones = d->masked ? d->mask.zones : 0;
+
+  if (par->coarse_width > 0) {
+    struct detparams cpar = *par;
+    cpar.width = par->coarse_width;
+    cpar.height = par->coarse_height;
+    cpar.coarse_width = cpar.coarse_height = 0;
+    cpar.checkpoint = NULL;
+    if ((d->coarse = detector_create(&cpar, pool)) == NULL ||
+        tiles_init(&d->tiles, par->width, par->height,
+                   par->coarse_width, par->coarse_height, par->gate) < 0) {
+      detector_destroy(d);
+      errno = ENOMEM;
+      return NULL;
+    }
+  }
+
+  d->partial = calloc((size_t) d->bands * (zones + 1), sizeof *d->partial);
+  if (d->partial == NULL || arena_alloc(d, size) < 0) {
+    detector_destroy(d);
+    errno = ENOMEM;
+    return NULL;
+  }
+  unsigned char *const base = d->arena;
+  d->src = base + src_at;
+  d->tmp = d->src + (size_t) d->kept * cells;
+  d->sum_before.sum = (void *) (base + sum_at[0]);
+  d->sum_after.sum = (void *) (base + sum_at[1]);
+  d->sum_before.sum_sq = (void *) (base + sum_sq_at[0]);
+  d->sum_after.sum_sq = (void *) (base + sum_sq_at[1]);
+  if (par->ewma) {
+    d->ew.mean = (void *) (base + ew_at[0]);
+    d->ew.var = (void *) (base + ew_at[1]);
+  }
+  d->diff = (void *) (base + diff_at);
+  d->adjwork = (void *) (base + adjwork_at);
+  d->motion = (void *) (base + motion_at);
+
+  d->st = (struct step) {
+    .width = par->width,
+    .height = par->height,
+    .mdeg = par->mdeg,
+    .hdeg = par->hdeg,
+    .varpow1 = par->varpow1,
+    .varpow0 = par->varpow0,
+    .before = &d->sum_before,
+    .after = &d->sum_after,
+    .diff = d->diff,
+    .adjwork = d->adjwork,
+    .ew = par->ewma ? &d->ew : NULL,
+    .mask = d->masked ? &d->mask : NULL,
+    .tiles = d->coarse ? &d->tiles : NULL,
+    .src = d->src,
+    .tdeg = d->tdeg,
+    .zones = zones,
+    .partial = d->partial,
+  };
+  return d;
+}
+
+void detector_destroy(struct detector *d)
+{
+  if (d == NULL) return;
+  free(d->ns);
+  free(d->partial);
+  if (d->coarse != NULL) {
+    detector_destroy(d->coarse);
+    tiles_free(&d->tiles);
+  }
+  free(d->checkpoint);
+  free(d->zonetext);
+  free(d->zrm);
+  if (d->masked)
+    cellmask_free(&d->mask);
+  if (d->mapped)
+    munmap(d->arena, d->arena_size);
+  else
+    free(d->arena);
+  free(d);
+}
+
+/* Get one plane of one of the sets of motion vectors. */
+static double *motion_plane(struct detector *d, unsigned idx, unsigned c)
+{
+  return d->motion + (2 * idx + c) * d->cells;
+}
+
+/* Get the weight of the next frame to enter the EWMA.  Until it has
+   seen enough frames, it's a plain mean of those it has. */
+static double next_alpha(struct detector *d)
+{
+  const double alpha = 1.0 / ++d->folded;
+  return alpha > d->alpha ? alpha : d->alpha;
+}
+
+/* Start scoring, now that the history is full. */
+static void prime(struct detector *d)
+{
+  /* Make the frames contribute to their respective sums.  The
+     'before' frames have already gone into the EWMA, if used, and
+     the 'after' frames begin at the oldest. */
+  if (d->par.ewma) {
+    for (unsigned rplidx = 0; rplidx < d->kept; rplidx++)
+      add_image(+1, d->cells, &d->sum_after, d->src + rplidx * d->cells);
+    compute_diffs_ewma(d->cells, d->par.mdeg,
+                       d->par.varpow1, d->par.varpow0,
+                       &d->sum_after, &d->ew, d->diff);
+  } else {
+    for (unsigned rplidx = 0; rplidx < d->par.hdeg; rplidx++)
+      add_image(+1, d->cells, &d->sum_before, d->src + rplidx * d->cells);
+    for (unsigned rplidx = d->par.hdeg; rplidx < d->tdeg; rplidx++)
+      add_image(+1, d->cells, &d->sum_after, d->src + rplidx * d->cells);
+
+    /* Compute the difference per pixel between the most recent
+       frames and the prior frames. */
+    compute_diffs(d->cells, d->par.mdeg, d->par.hdeg,
+                  d->par.varpow1, d->par.varpow0,
+                  &d->sum_after, &d->sum_before, d->diff);
+  }
+
+  /* Initialize the new motion vectors [0] based on the initial
+     'diff'. */
+  sum_adjs(d->par.width, d->par.height,
+           motion_plane(d, 1 - d->next_mrplidx, 0),
+           motion_plane(d, 1 - d->next_mrplidx, 1),
+           d->diff, d->adjwork);
+
+  /* Every tile is now up to date, and has vectors to compare
+     with. */
+  if (d->coarse != NULL)
+    memset(d->tiles.was_active, 1, (size_t) d->tiles.cols * d->tiles.rows);
+}
+
+/* The start of a checkpoint, identifying the parameters that the
+   history depends on, followed by the state that isn't per-cell.
+   The rest is the zones' smoothed ratios, the frames, the EWMA
+   planes if used, and the motion vectors, and then the same for the
+   coarse grid, if used, which otherwise shares this state.  The sums
+   are rebuilt from the frames.  It is in native byte order, as it
+   only has to survive a restart. */
+struct ckpt_head {
+  char magic[8];
+  uint32_t width, height, mdeg, hdeg, ewma, zones;
+  uint32_t coarse_width, coarse_height;
+  uint64_t mask;
+  double varpow0, varpow1;
+
+  uint32_t filled, sources, next_mrplidx, pad;
+  uint64_t folded;
+  double rm;
+};
+
+#define CKPT_MAGIC "stecamH1"
+
+/* Fill in the parameters of a checkpoint's header. */
+static void ckpt_ident(const struct detector *d, struct ckpt_head *h)
+{
+  memset(h, 0, sizeof *h);
+  memcpy(h->magic, CKPT_MAGIC, sizeof h->magic);
+  h->width = d->par.width;
+  h->height = d->par.height;
+  h->mdeg = d->par.mdeg;
+  h->hdeg = d->par.hdeg;
+  h->ewma = d->par.ewma;
+  h->zones = d->masked ? d->mask.zones : 0;
+  h->coarse_width = d->par.coarse_width;
+  h->coarse_height = d->par.coarse_height;
+  h->mask = d->masked ? d->mask.digest : 0;
+  h->varpow0 = d->par.varpow0;
+  h->varpow1 = d->par.varpow1;
+}
+
+/* Apply 'fn' to each of the blocks of per-cell state kept in a
+   checkpoint, stopping if it fails.  Return 0 on success; -1 if 'fn'
+   failed. */
+static int ckpt_blocks(const struct detector *d,
+                       int (*fn)(void *ctx, void *p, size_t len),
+                       void *ctx)
+{
+  const size_t cells = d->cells;
+  if (d->masked &&
+      (*fn)(ctx, d->zrm, d->mask.zones * sizeof *d->zrm) < 0) return -1;
+  if ((*fn)(ctx, d->src, (size_t) d->kept * cells) < 0) return -1;
+  if (d->par.ewma &&
+      ((*fn)(ctx, d->ew.mean, cells * sizeof *d->ew.mean) < 0 ||
+       (*fn)(ctx, d->ew.var, cells * sizeof *d->ew.var) < 0)) return -1;
+  if ((*fn)(ctx, d->motion, 4 * cells * sizeof *d->motion) < 0) return -1;
+  return d->coarse != NULL ? ckpt_blocks(d->coarse, fn, ctx) : 0;
+}
+
+/* Adopt the position in the history of a restored checkpoint, and
+   rebuild the sums of a complete history.  The oldest frame is at
+   'sources', and the 'after' frames are the last 'mdeg'. */
+static void restore(struct detector *d, const struct ckpt_head *h)
+{
+  d->filled = h->filled;
+  d->sources = h->sources;
+  d->next_mrplidx = h->next_mrplidx;
+  d->folded = h->folded;
+  if (d->filled == d->tdeg) {
+    for (unsigned k = 0; k < d->kept; k++) {
+      const unsigned idx = (d->sources + k) % d->kept;
+      struct stats *sum = d->par.ewma || k >= d->par.hdeg ?
+        &d->sum_after : &d->sum_before;
+      add_image(+1, d->cells, sum, d->src + (size_t) idx * d->cells);
+    }
+  }
+
+  /* The coarse grid is in step.  The tiles' sums are now up to date,
+     but their vectors might not be, so none is scored until it has
+     been active for a frame. */
+  if (d->coarse != NULL)
+    restore(d->coarse, h);
+}
+
+static int write_block(void *ctx, void *p, size_t len)
+{
+  return fwrite(p, 1, len, ctx) == len ? 0 : -1;
+}
+
+static int read_block(void *ctx, void *p, size_t len)
+{
+  return fread(p, 1, len, ctx) == len ? 0 : -1;
+}
+
+int detector_checkpoint(const struct detector *d)
+{
+  if (d->checkpoint == NULL) return 0;
+
+  struct ckpt_head h;
+  ckpt_ident(d, &h);
+  h.filled = d->filled;
+  h.sources = d->sources;
+  h.next_mrplidx = d->next_mrplidx;
+  h.folded = d->folded;
+  h.rm = d->rm;
+
+  /* Write to a temporary file, and rename it into place, so that a
+     reader never sees a partial checkpoint. */
+  char tmp[PATH_MAX + 8];
+  snprintf(tmp, sizeof tmp, "%s.tmp", d->checkpoint);
+  FILE *out = fopen(tmp, "wb");
+  if (out == NULL) return -1;
+  const bool ok = fwrite(&h, sizeof h, 1, out) == 1 &&
+    ckpt_blocks(d, &write_block, out) == 0;
+  if (fclose(out) != 0 || !ok || rename(tmp, d->checkpoint) != 0) {
+    const int saved = errno;
+    unlink(tmp);
+    errno = saved;
+    return -1;
+  }
+  return 0;
+}
+
+int detector_resume(struct detector *d)
+{
+  if (d->checkpoint == NULL || d->filled > 0) return 0;
+  FILE *in = fopen(d->checkpoint, "rb");
+  if (in == NULL) return errno == ENOENT ? 0 : -1;
+
+  /* Reject a checkpoint that is stale, or made with other
+     parameters. */
+  struct stat st;
+  struct ckpt_head want, h;
+  ckpt_ident(d, &want);
+  if (fstat(fileno(in), &st) < 0) {
+    fclose(in);
+    return -1;
+  }
+  if (time(NULL) - st.st_mtime > (time_t) d->par.resume ||
+      fread(&h, sizeof h, 1, in) != 1 ||
+      memcmp(&h, &want, offsetof(struct ckpt_head, filled)) != 0 ||
+      h.filled > d->tdeg || h.sources >= d->kept || h.next_mrplidx > 1) {
+    fclose(in);
+    return 0;
+  }
+
+  /* Load the per-cell state, or start again if it's incomplete. */
+  const bool ok = ckpt_blocks(d, &read_block, in) == 0;
+  fclose(in);
+  if (!ok) {
+    for (struct detector *l = d; l != NULL; l = l->coarse)
+      memset(l->arena, 0, l->arena_size);
+    if (d->masked)
+      memset(d->zrm, 0, d->mask.zones * sizeof *d->zrm);
+    return 0;
+  }
+  d->rm = h.rm;
+  restore(d, &h);
+  return 1;
+}
+
+int detector_set_timing(struct detector *d, bool on)
+{
+  if (d->coarse != NULL && detector_set_timing(d->coarse, on) < 0)
+    return -1;
+  if (!on) {
+    free(d->ns);
+    d->ns = d->st.ns = NULL;
+    return 0;
+  }
+  if (d->ns != NULL) return 0;
+  d->ns = calloc(d->bands, sizeof *d->ns);
+  if (d->ns == NULL) return -1;
+  d->st.ns = d->ns;
+  return 0;
+}
+
+void detector_times(const struct detector *d, uint64_t ns[DETSTAGE_COUNT])
+{
+  /* The coarse grid's time counts too. */
+  if (d->coarse != NULL)
+    detector_times(d->coarse, ns);
+  else
+    for (unsigned s = 0; s < DETSTAGE_COUNT; s++)
+      ns[s] = 0;
+  if (d->ns == NULL) return;
+  for (unsigned b = 0; b < d->bands; b++)
+    for (unsigned s = 0; s < DETSTAGE_COUNT; s++)
+      ns[s] += d->ns[b][s];
+}
+
+/* Get the place for the next frame's cells. */
+static unsigned char *next_grid(struct detector *d)
+{
+  if (d->filled < d->kept)
+    return d->src + d->filled * d->cells;
+  return d->tmp;
+}
+
+static int accept_grid(struct detector *d, const char *srcname, int lrc,
+                       FILE *out, const char *tag);
+
+/* Get the mean and stddev of the scores of 'count' cells from the
+   sums of their bands, in column 'z' of the partial sums. */
+static void band_stats(const struct detector *d, unsigned z, size_t count,
+                       double *mean, double *sd)
+{
+  const unsigned cols = d->st.zones + 1;
+  double sum = 0.0, sum2 = 0.0;
+  for (unsigned b = 0; b < d->bands; b++) {
+    sum += d->partial[b * cols + z][0];
+    sum2 += d->partial[b * cols + z][1];
+  }
+  *mean = count ? sum / count : 0.0;
+  *sd = count ? sqrt(sum2 / count - *mean * *mean) : 0.0;
+}
+
+/* Report a frame, or record its statistics to be reported later. */
+static void tell(struct detector *d, FILE *out, const char *tag,
+                 double mean, double sd, const char *srcname, double fact)
+{
+  if (d->raw != NULL) {
+    d->raw[0] = 0;
+    d->raw[1] = mean;
+    d->raw[2] = sd;
+    return;
+  }
+  report(out, tag, &d->rm, mean, sd, NULL, srcname, fact);
+}
+
+/* Report the score of a masked frame over all its active cells from
+   their mean and stddev, and of each zone from those in 'zs' if
+   there are several. */
+static void report_stats(struct detector *d, FILE *out, const char *tag,
+                         double mean, double sd, const double (*zs)[2],
+                         const char *srcname)
+{
+  const struct cellmask *m = &d->mask;
+  const char *zones = NULL;
+  if (m->zones > 1) {
+    size_t len = 0;
+    for (unsigned z = 0; z < m->zones && len < d->zonelen; z++)
+      len += snprintf(d->zonetext + len, d->zonelen - len, "%s=%.0f ",
+                      m->names[z],
+                      smooth(&d->zrm[z], zs[z][0], zs[z][1]) * d->fact);
+    zones = d->zonetext;
+  }
+  report(out, tag, &d->rm, mean, sd, zones, srcname, d->fact);
+}
+
+/* Report the score of a masked frame over all its active cells, and
+   of each zone if there are several. */
+static void report_zones(struct detector *d, FILE *out, const char *tag,
+                         const char *srcname)
+{
+  const struct cellmask *m = &d->mask;
+  size_t total = 0;
+  double zs[m->zones][2];
+  for (unsigned z = 0; z < m->zones; z++) {
+    total += m->count[z];
+    band_stats(d, 1 + z, m->count[z], &zs[z][0], &zs[z][1]);
+  }
+
+  double mean, sd;
+  band_stats(d, 0, total, &mean, &sd);
+  if (d->raw != NULL) {
+    /* Keep the zones' statistics to be smoothed later. */
+    d->raw[0] = m->zones > 1;
+    d->raw[1] = mean;
+    d->raw[2] = sd;
+    memcpy(d->raw + 3, zs, sizeof zs);
+    return;
+  }
+  report_stats(d, out, tag, mean, sd, (const double (*)[2]) zs, srcname);
+}
+
+int detector_feed(struct detector *d, const char *srcname,
+                  const char *name, struct framesrc *fs,
+                  FILE *out, const char *tag)
+{
+  if (*name == '\0') {
+    /* No condensed file is actually being provided, but we must
+       still report the original file. */
+    tell(d, out, tag, 0.0, 0.0, srcname, -1.0);
+    return 0;
+  }
+
+  uint64_t t = d->ns ? now_ns() : 0;
+  const int lrc = framesrc_load(fs, name, d->par.width, d->par.height,
+                                next_grid(d));
+  charge(&d->st, 0, DETSTAGE_LOAD, &t);
+  return accept_grid(d, srcname, lrc, out, tag);
+}
+
+int detector_feed_grid(struct detector *d, const char *srcname,
+                       const unsigned char *grid,
+                       FILE *out, const char *tag)
+{
+  memcpy(next_grid(d), grid, d->cells);
+  return accept_grid(d, srcname, 0, out, tag);
+}
+
+size_t detector_raw_size(const struct detector *d)
+{
+  return 3 + (d->masked ? 2 * (size_t) d->mask.zones : 0);
+}
+
+int detector_score(struct detector *d, const unsigned char *grid, int lrc,
+                   double raw[])
+{
+  d->raw = raw;
+  const int rc = detector_feed_loaded(d, NULL, grid, lrc, 0, NULL, NULL);
+  d->raw = NULL;
+  return rc;
+}
+
+double detector_report(struct detector *d, const double raw[],
+                       const char *srcname, FILE *out, const char *tag)
+{
+  if (raw[0] != 0)
+    report_stats(d, out, tag, raw[1], raw[2],
+                 (const double (*)[2]) (raw + 3), srcname);
+  else
+    report(out, tag, &d->rm, raw[1], raw[2], NULL, srcname, d->fact);
+  return d->rm * d->fact;
+}
+
+int detector_feed_loaded(struct detector *d, const char *srcname,
+                         const unsigned char *grid, int lrc,
+                         uint64_t load_ns, FILE *out, const char *tag)
+{
+  if (d->ns != NULL)
+    d->ns[0][DETSTAGE_LOAD] += load_ns;
+  if (lrc == 0)
+    memcpy(next_grid(d), grid, d->cells);
+  return accept_grid(d, srcname, lrc, out, tag);
+}
+
+/* Pass a frame to the coarse detector. */
+static void feed_coarse(struct detector *d, const unsigned char *grid)
+{
+  downsample(&d->tiles, d->par.width, grid, next_grid(d->coarse));
+  accept_grid(d->coarse, NULL, 0, NULL, NULL);
+}
+
+/* Score a frame on the coarse grid, and choose the tiles of the fine
+   grid to process from its differences. */
+static void gate_tiles(struct detector *d, const unsigned char *grid)
+{
+  feed_coarse(d, grid);
+
+  struct tiles *const tl = &d->tiles;
+  const unsigned cols = tl->cols, rows = tl->rows;
+  tl->seq++;
+  for (size_t t = 0; t < (size_t) cols * rows; t++)
+    tl->active[t] = fabs(d->coarse->diff[t]) >= tl->gate;
+  for (unsigned ty = 0; ty < rows; ty++)
+    for (unsigned tx = 0; tx < cols; tx++) {
+      bool near = false;
+      for (unsigned ny = ty ? ty - 1 : 0; !near && ny <= ty + 1 && ny < rows;
+           ny++)
+        for (unsigned nx = tx ? tx - 1 : 0; nx <= tx + 1 && nx < cols; nx++)
+          if (tl->active[(size_t) ny * cols + nx]) {
+            near = true;
+            break;
+          }
+      tl->work[(size_t) ty * cols + tx] = near;
+    }
+}
+
+/* Record which tiles were brought up to date, and which were
+   active. */
+static void end_tiles(struct detector *d)
+{
+  struct tiles *const tl = &d->tiles;
+  for (size_t t = 0; t < (size_t) tl->cols * tl->rows; t++) {
+    if (tl->work[t])
+      tl->stamp[t] = tl->seq;
+    tl->was_active[t] = tl->active[t];
+  }
+}
+
+/* Process a frame just placed by 'next_grid', or report that it
+   couldn't be found (lrc<0) or read (lrc>0). */
+static int accept_grid(struct detector *d, const char *srcname, int lrc,
+                       FILE *out, const char *tag)
+{
+  const unsigned width = d->par.width, height = d->par.height;
+  const unsigned hdeg = d->par.hdeg;
+  const unsigned tdeg = d->tdeg;
+  const unsigned kept = d->kept;
+
+  if (d->filled < tdeg) {
+    /* We're still populating the history. */
+    tell(d, out, tag, 0.0, 0.0, srcname, d->fact);
+    if (lrc != 0) return 0;
+    if (d->coarse != NULL)
+      feed_coarse(d, d->src + (size_t) d->filled * d->cells);
+    if (d->filled >= d->kept) {
+      /* Only the 'after' frames are kept, so the oldest makes way
+         for the new one by going into the EWMA. */
+      unsigned char *const oldest = d->src + d->sources * d->cells;
+      ewma_image(d->cells, next_alpha(d), &d->ew, oldest);
+      memcpy(oldest, d->tmp, d->cells);
+      if (++d->sources == d->kept)
+        d->sources = 0;
+    }
+    if (++d->filled == tdeg) {
+      prime(d);
+      return 1;
+    }
+    return 0;
+  }
+
+  unsigned char (*const src)[height][width] =
+    (unsigned char (*)[height][width]) d->src;
+  unsigned char (*const tmp)[width] = (unsigned char (*)[width]) d->tmp;
+
+  /* If we failed to read the frame, we don't count it. */
+  if (lrc < 0) {
+    tell(d, out, tag, 0.0, 0.0, srcname, d->fact);
+    return 0;
+  }
+
+  /* Which motion vector array are we replacing? */
+  const unsigned mrplidx = d->next_mrplidx;
+  const unsigned maltidx = d->next_mrplidx = 1 - mrplidx;
+
+  /* Move images between the 'before' and 'after' sums.  'rplidx'
+     holds the oldest frame, so that should be overwritten. */
+  const unsigned rplidx = d->sources;
+
+  /* Which image is to be subtracted from the 'after' sum and added
+     to 'before'?  It's hdeg frames ahead, wrapped around.  (With an
+     EWMA, it's the oldest, and goes into the EWMA instead.) */
+  const unsigned transidx = (rplidx + hdeg) % kept;
+
+#if 0
+  fprintf(stderr, "src %d; rpl %u; trans %u\n",
+          d->sources, rplidx, transidx);
+#endif
+
+  if (lrc != 0) {
+    memset(&src[rplidx][0][0], 0, width * height);
+    tell(d, out, tag, 0.0, 0.0, srcname, d->fact);
+    return 0;
+  }
+
+  /* We got a complete image, so ensure we move to the next frame in
+     our buffer. */
+  if (++d->sources == kept)
+    d->sources = 0;
+
+  /* Subtract the old image from the 'before' sum, move the middle
+     image from 'after' to 'before', and add the new image to the
+     'after' sum.  Then compute the differences in the means of each
+     pixel, and the ratio of standard deviations. */
+  struct step *const st = &d->st;
+  st->oldest = &src[rplidx][0][0];
+  st->trans = &src[transidx][0][0];
+  st->newest = &tmp[0][0];
+  if (st->ew != NULL)
+    st->alpha = next_alpha(d);
+  if (d->coarse != NULL) {
+    st->rplidx = rplidx;
+    gate_tiles(d, st->newest);
+  }
+  pool_run(d->pool, d->bands, &diff_band, st);
+
+  /* Copy the new image into place. */
+  memcpy(src[rplidx], tmp, d->cells);
+
+#if 0
+  {
+    const unsigned (*const sum0)[width] =
+      (const unsigned (*)[width]) d->sum_before.sum;
+    const unsigned (*const sum1)[width] =
+      (const unsigned (*)[width]) d->sum_after.sum;
+    const double (*const diff)[width] = (const double (*)[width]) d->diff;
+    for (unsigned y = 0; y < height; y++) {
+      for (unsigned i = 0; i < d->par.mdeg + 1; i++) {
+        for (unsigned x = 0; x < width; x++) {
+          fprintf(stderr, "%d",
+                  (int) (src[(rplidx + i + hdeg - 1) %
+                             kept][y][x] * 10.0 / 255));
+        }
+        putc(' ', stderr);
+      }
+      for (unsigned x = 0; x < width; x++) {
+        fprintf(stderr, "%d",
+                (int) (sum0[y][x] * 10.0 / (hdeg * 255  + 1)));
+      }
+      putc(' ', stderr);
+      for (unsigned x = 0; x < width; x++) {
+        fprintf(stderr, "%d",
+                (int) (sum1[y][x] * 10.0 / (d->par.mdeg * 255 + 1)));
+      }
+      putc(' ', stderr);
+      for (unsigned x = 0; x < width; x++) {
+        int sn = copysign(1.0, diff[y][x]);
+        fprintf(stderr, "%s", sn < 0 ? "-" : sn > 0 ? "+" : "0");
+      }
+      putc('\n', stderr);
+    }
+  }
+#endif
+
+  /* Compare each pixel difference with each of its neighbours, and
+     compare the resulting vectors with the previous (maltidx)
+     ones. */
+  st->mx = motion_plane(d, mrplidx, 0);
+  st->my = motion_plane(d, mrplidx, 1);
+  st->ox = motion_plane(d, maltidx, 0);
+  st->oy = motion_plane(d, maltidx, 1);
+  pool_run(d->pool, d->bands, &edge_band, st);
+  pool_run(d->pool, d->bands, &score_band, st);
+  if (d->coarse != NULL)
+    end_tiles(d);
+
+#if 0
+  {
+    const double (*const mx)[width] = (const double (*)[width]) st->mx;
+    const double (*const my)[width] = (const double (*)[width]) st->my;
+    for (unsigned y = 0; y < height; y++) {
+      for (unsigned x = 0; x < width; x++) {
+        fprintf(stderr, "(%6.3f %6.3f) ", mx[y][x] * 1e2, my[y][x] * 1e2);
+      }
+      fprintf(stderr, "\n");
+    }
+  }
+#endif
+
+  if (d->masked) {
+    report_zones(d, out, tag, srcname);
+    return 0;
+  }
+
+  double sum = 0.0, sum2 = 0.0;
+  for (unsigned b = 0; b < d->bands; b++) {
+    sum += d->partial[b][0];
+    sum2 += d->partial[b][1];
+  }
+  const double mean = sum / ((width - 1) * (height - 1));
+  const double var = sum2 / ((width - 1) * (height - 1)) - mean * mean;
+  const double sd = sqrt(var);
+  tell(d, out, tag, mean, sd, srcname, d->fact);
+  return 0;
+}
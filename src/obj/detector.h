@@ -0,0 +1,221 @@
+// -*- c-basic-offset: 2; indent-tabs-mode: nil -*-
+
+/*
+ * Copyright 2018-19, Lancaster University
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ * 
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the
+ *    distribution.
+ * 
+ *  * Neither the name of the copyright holder nor the names of
+ *    its contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ *
+ * Author: Steven Simpson <https://github.com/simpsonst>
+ */
+
+#ifndef DETECTOR_H
+#define DETECTOR_H
+
+#include <stdio.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "ring.h"
+#include "pool.h"
+
+/* The parameters of motion detection on one stream of frames */
+struct detparams {
+  /* Each image is expected to be an 8bpp PGM of this many cells, or
+     a JPEG to be condensed to that size. */
+  unsigned width, height;
+
+  /* the number of frames averaged for 'after' and 'before' */
+  unsigned mdeg, hdeg;
+
+  /* log of scale factor for the score */
+  int factpow;
+
+  /* the powers converting variance to stddev for 'before' and
+     'after' */
+  double varpow0, varpow1;
+
+  /* Model 'before' as an exponentially weighted mean and variance
+     of the frames leaving 'after', spanning about 'hdeg' frames,
+     rather than keeping them all. */
+  bool ewma;
+
+  /* a PGM of 'width'x'height' selecting the cells to be scored, and
+     dividing them into zones to be scored separately (see
+     'cellmask_load'), or NULL to score all cells */
+  const char *mask;
+
+  /* If not zero, the size of a coarse grid to be scored first, its
+     cells dividing the grid into tiles; only tiles within one tile of
+     a cell whose difference reaches 'gate' in magnitude are then
+     processed, and only tiles active for this and the last frame are
+     scored.  It cannot be combined with EWMA or a mask, and each tile
+     must be at least 3x3. */
+  unsigned coarse_width, coarse_height;
+  double gate;
+
+  /* a file to keep the history in, so that a detector can resume
+     from it, or NULL; and the age in seconds beyond which it is too
+     old to resume from */
+  const char *checkpoint;
+  unsigned resume;
+};
+
+/* Set the default parameters: 16x12 cells, 5 frames after, 100
+   before, 9 and 0.5, without EWMA, mask, coarse grid or checkpoint,
+   gating tiles at 0.02, and resuming from checkpoints up to 300
+   seconds old. */
+void detparams_init(struct detparams *);
+
+/* Where frames are to be found, '@<seq>' naming one in a ring */
+struct framesrc {
+  /* the ring to attach to, or NULL if there is none */
+  const char *ringpath;
+
+  /* the attached ring, or NULL if not attached yet */
+  struct ring *ring;
+
+  /* space for a frame fetched from the ring, or read from a file */
+  unsigned char *buf;
+  size_t max;
+
+  /* how files are read, created when first needed; and whether that
+     failed, so that plain calls are used */
+  struct uring *uring;
+  bool plain;
+};
+
+/* Attach to the ring if there is one, and not already attached.
+   Return 0 on success; -1 on error, with errno set. */
+int framesrc_attach(struct framesrc *);
+
+void framesrc_release(struct framesrc *);
+
+/* Load the frame named 'name' as a 'width'x'height' detection grid
+   in 'src'.  It is fetched from the ring if its name begins with
+   '@', or else read from a file, either a PGM already condensed to
+   the grid size, or the source JPEG.  Return 0 on success; -1 if
+   the frame could not be found; 1 if it could not be read. */
+int framesrc_load(struct framesrc *fs, const char *name,
+                  unsigned width, unsigned height,
+                  unsigned char src[width * height]);
+
+/* The history of one stream of frames, and the state derived from
+   it */
+struct detector;
+
+/* Create a detector with the parameters 'par', loading its mask if
+   it has one.  The work on each frame is shared out in bands on
+   'pool'.  Return NULL on error, with errno set. */
+struct detector *detector_create(const struct detparams *par,
+                                 struct pool *pool);
+
+void detector_destroy(struct detector *);
+
+/* Restore the history of a new detector from its checkpoint, if it
+   has one no older than its 'resume' age, written with the same
+   parameters.  Return 1 if the history was restored (though it might
+   not be complete); 0 if there was no suitable checkpoint; -1 on
+   error, with errno set. */
+int detector_resume(struct detector *);
+
+/* Write the history to the detector's checkpoint, replacing it
+   atomically, if it has one.  Return 0 on success; -1 on error, with
+   errno set. */
+int detector_checkpoint(const struct detector *);
+
+/* Process the frame 'name', loading it from 'fs' if its name
+   begins with '@', and report its score for the source 'srcname' as
+   a line on 'out'.  If the mask has several zones, a scored frame's
+   line also gives '<zone>=<score>' for each zone before the source.
+   An empty 'name' means that the source was not condensed, and is
+   reported without a score.  If 'tag' is not NULL, it prefixes the
+   report.  Return 1 if the frame completed the history, so that
+   subsequent frames will be scored; 0 otherwise. */
+int detector_feed(struct detector *, const char *srcname,
+                   const char *name, struct framesrc *fs,
+                   FILE *out, const char *tag);
+
+/* As 'detector_feed', but with the frame's cells already loaded in
+   'grid'. */
+int detector_feed_grid(struct detector *, const char *srcname,
+                        const unsigned char *grid,
+                        FILE *out, const char *tag);
+
+/* As 'detector_feed_grid', for a frame already loaded by
+   'framesrc_load', which returned 'lrc' after taking 'load_ns'
+   nanoseconds.  Its time is counted as loading, if timing. */
+int detector_feed_loaded(struct detector *, const char *srcname,
+                         const unsigned char *grid, int lrc,
+                         uint64_t load_ns, FILE *out, const char *tag);
+
+/* Get the number of values that 'detector_score' records for each
+   frame. */
+size_t detector_raw_size(const struct detector *);
+
+/* As 'detector_feed_loaded', but instead of reporting the frame,
+   record the statistics of its score, before smoothing, in 'raw'.
+   Once the history is complete, they depend only on the last
+   'hdeg + mdeg + 1' frames (without EWMA), so a run of frames can be
+   scored by separate detectors, each started that far ahead of its
+   part. */
+int detector_score(struct detector *, const unsigned char *grid, int lrc,
+                   double raw[]);
+
+/* Report a frame from the statistics recorded for it by
+   'detector_score', by this or another detector with the same
+   parameters, smoothing them as 'detector_feed' would have.  Frames
+   must be reported in order.  Nothing is written if 'out' is NULL.
+   Return the frame's score. */
+double detector_report(struct detector *, const double raw[],
+                       const char *srcname, FILE *out, const char *tag);
+
+/* The stages of processing a frame, for timing */
+enum detstage {
+  DETSTAGE_LOAD, /* loading and condensing */
+  DETSTAGE_SLIDE, /* sliding the window of sums */
+  DETSTAGE_DIFFS, /* computing differences */
+  DETSTAGE_ADJS, /* computing motion vectors */
+  DETSTAGE_SCORE, /* comparing motion vectors */
+  DETSTAGE_COUNT
+};
+
+extern const char *const detstage_names[DETSTAGE_COUNT];
+
+/* Start or stop accumulating the time spent on each stage.  Return 0
+   on success; -1 on error, with errno set. */
+int detector_set_timing(struct detector *, bool on);
+
+/* Get the time spent on each stage since timing started, in
+   nanoseconds, summed over the threads involved. */
+void detector_times(const struct detector *, uint64_t ns[DETSTAGE_COUNT]);
+
+#endif
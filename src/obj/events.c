@@ -0,0 +1,438 @@
+// -*- c-basic-offset: 2; indent-tabs-mode: nil -*-
+
+/*
+ * Copyright 2018-19, Lancaster University
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ * 
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the
+ *    distribution.
+ * 
+ *  * Neither the name of the copyright holder nor the names of
+ *    its contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ *
+ * Author: Steven Simpson <https://github.com/simpsonst>
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <time.h>
+
+#include <poll.h>
+#include <unistd.h>
+
+/* Deletions are passed on in batches of up to this many frames, or
+   sooner if there's no input waiting. */
+#define DELBATCH 32
+
+/* A frame reported by modect, with the most recent scores at the
+   time */
+struct frame {
+  unsigned long long t;
+  long long score;
+  double mean, stddev, rat;
+};
+
+/* The frames retained for possible recording, oldest first */
+struct fring {
+  struct frame *buf;
+  size_t cap, head, len;
+};
+
+/* The timestamps of frames that have been scored, oldest first */
+struct tring {
+  unsigned long long *buf;
+  size_t cap, head, len;
+};
+
+static void *grow(void *buf, size_t *cap, size_t head, size_t len,
+                  size_t elem)
+{
+  /* Double the capacity, and move the wrapped part into the new
+     space, so that the elements remain contiguous modulo the new
+     capacity. */
+  const size_t ncap = *cap ? *cap * 2 : 64;
+  char *nbuf = realloc(buf, ncap * elem);
+  if (nbuf == NULL) {
+    perror("events: growing history");
+    exit(EXIT_FAILURE);
+  }
+  if (head + len > *cap)
+    memcpy(nbuf + *cap * elem, nbuf, (head + len - *cap) * elem);
+  *cap = ncap;
+  return nbuf;
+}
+
+static struct frame *fr_at(const struct fring *r, size_t i)
+{
+  return &r->buf[(r->head + i) & (r->cap - 1)];
+}
+
+static void fr_push(struct fring *r, const struct frame *f)
+{
+  if (r->len == r->cap)
+    r->buf = grow(r->buf, &r->cap, r->head, r->len, sizeof *r->buf);
+  *fr_at(r, r->len++) = *f;
+}
+
+static void fr_shift(struct fring *r)
+{
+  r->head = (r->head + 1) & (r->cap - 1);
+  r->len--;
+}
+
+static unsigned long long tr_at(const struct tring *r, size_t i)
+{
+  return r->buf[(r->head + i) & (r->cap - 1)];
+}
+
+static void tr_push(struct tring *r, unsigned long long t)
+{
+  if (r->len == r->cap)
+    r->buf = grow(r->buf, &r->cap, r->head, r->len, sizeof *r->buf);
+  r->buf[(r->head + r->len++) & (r->cap - 1)] = t;
+}
+
+/* Keep only the last 'n' elements.  As with bash's ${a[@]:0-n}, no
+   elements are kept if there are fewer than 'n'. */
+static void tr_keep(struct tring *r, size_t n)
+{
+  const size_t drop = n > r->len ? r->len : r->len - n;
+  r->head = (r->head + drop) & (r->cap - 1);
+  r->len -= drop;
+}
+
+/* Frames to be deleted, not yet passed on */
+static unsigned long long deletions[DELBATCH];
+static size_t ndeletions;
+
+static void flush_deletions(void)
+{
+  if (ndeletions == 0) return;
+  fputs("delete", stdout);
+  for (size_t i = 0; i < ndeletions; i++)
+    printf(" %llu", deletions[i]);
+  putchar('\n');
+  fflush(stdout);
+  ndeletions = 0;
+}
+
+static void delete_frame(unsigned long long t)
+{
+  deletions[ndeletions++] = t;
+  if (ndeletions == DELBATCH)
+    flush_deletions();
+}
+
+/* Pass on retained frames that are certain to be recorded, i.e.,
+   those before 'bound' whose successors (and so durations) are
+   known.  '*sent' counts those already passed on. */
+static void send_frames(const struct fring *r, size_t *sent,
+                        unsigned long long bound)
+{
+  size_t i = *sent;
+  while (i + 1 < r->len && fr_at(r, i)->t < bound) {
+    const struct frame *f = fr_at(r, i);
+    printf("frame %llu %llu %lld %.6g %.6g %.6g\n",
+           f->t, fr_at(r, i + 1)->t - f->t,
+           f->score, f->rat, f->mean, f->stddev);
+    i++;
+  }
+  if (i == *sent) return;
+  *sent = i;
+  fflush(stdout);
+}
+
+/* Get the time of a frame from its name, .../at-<ms>.jpg. */
+static unsigned long long name_stamp(const char *name)
+{
+  const char *leaf = strrchr(name, '/');
+  leaf = leaf == NULL ? name : leaf + 1;
+  if (strncmp(leaf, "at-", 3) == 0)
+    leaf += 3;
+  return strtoull(leaf, NULL, 10);
+}
+
+static void show_time(FILE *out, unsigned long long t)
+{
+  const time_t s = t / 1000;
+  struct tm tm;
+  char buf[32];
+  localtime_r(&s, &tm);
+  strftime(buf, sizeof buf, "%T", &tm);
+  fprintf(out, "%s.%03u", buf, (unsigned) (t % 1000));
+}
+
+int main(int argc, const char *const *argv)
+{
+  long long low = 400, high = 400;
+  unsigned gather = 1, hesitate = 4, linger = 10, leader = 5;
+  int pdigs = 5;
+  bool debug = false;
+
+  bool show_help = false, fail = false;
+  for (int argi = 1; argi < argc; argi++) {
+    if (!strcmp(argv[argi], "-t")) {
+      if (++argi == argc) {
+        show_help = true;
+        fail = true;
+        break;
+      }
+      /* Either a single threshold, or a pair (low-high) in either
+         order */
+      char *end;
+      low = high = strtoll(argv[argi], &end, 10);
+      if (*end == '-')
+        high = strtoll(end + 1, NULL, 10);
+      if (high < low) {
+        const long long tmp = low;
+        low = high;
+        high = tmp;
+      }
+    } else if (!strcmp(argv[argi], "-n")) {
+      if (++argi == argc) {
+        show_help = true;
+        fail = true;
+        break;
+      }
+      gather = atoi(argv[argi]);
+    } else if (!strcmp(argv[argi], "-z")) {
+      if (++argi == argc) {
+        show_help = true;
+        fail = true;
+        break;
+      }
+      hesitate = atoi(argv[argi]);
+    } else if (!strcmp(argv[argi], "-l")) {
+      if (++argi == argc) {
+        show_help = true;
+        fail = true;
+        break;
+      }
+      linger = atoi(argv[argi]);
+    } else if (!strcmp(argv[argi], "-L")) {
+      if (++argi == argc) {
+        show_help = true;
+        fail = true;
+        break;
+      }
+      leader = atoi(argv[argi]);
+    } else if (!strcmp(argv[argi], "-w")) {
+      if (++argi == argc) {
+        show_help = true;
+        fail = true;
+        break;
+      }
+      pdigs = atoi(argv[argi]);
+    } else if (!strcmp(argv[argi], "-v")) {
+      debug = true;
+    } else if (!strcmp(argv[argi], "+v")) {
+      debug = false;
+    } else if (!strcmp(argv[argi], "-h")) {
+      show_help = true;
+    } else if (argv[argi][0] == '-' || argv[argi][0] == '+') {
+      fprintf(stderr, "%s: unknown switch: %s\n", argv[0], argv[argi]);
+      exit(EXIT_FAILURE);
+    } else {
+      fprintf(stderr, "%s: unknown argument: %s\n", argv[0], argv[argi]);
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  if (show_help) {
+    fprintf(stderr,
+            "Usage: %s [-t threshold[-threshold]]\n"
+            "\t[-n gather]\n"
+            "\t[-z hesitate]\n"
+            "\t[-l linger]\n"
+            "\t[-L leader]\n"
+            "\t[-w digits]\n"
+            "\t[-v|+v]\n", argv[0]);
+    exit(fail ? EXIT_FAILURE : EXIT_SUCCESS);
+  }
+
+  /* Before we can stop a recording, we have to wait at least as long
+     as our hesitation time plus the number of frames we merge. */
+  unsigned backstep;
+  if (gather + hesitate > linger) {
+    backstep = gather + hesitate - linger;
+    linger = gather + hesitate;
+  } else {
+    backstep = linger;
+  }
+
+  struct fring retained = { .buf = NULL };
+  struct tring analyzed = { .buf = NULL };
+  struct frame last = { .rat = 1.0 };
+  bool recording = false;
+  size_t sent = 0;
+  long long rem = 0;
+
+  char *line = NULL;
+  size_t linecap = 0;
+  for ( ; ; ) {
+    /* Pass on deletions if we'd otherwise wait for input. */
+    if (ndeletions > 0) {
+      struct pollfd pfd = { .fd = STDIN_FILENO, .events = POLLIN };
+      if (poll(&pfd, 1, 0) == 0)
+        flush_deletions();
+    }
+    if (getline(&line, &linecap, stdin) < 0) break;
+
+    /* score mean stddev rat [zone=score ...] XfileX */
+    char score[32];
+    double mean, stddev, rat;
+    int pos = 0;
+    if (sscanf(line, "%31s %lf %lf %lf %n",
+               score, &mean, &stddev, &rat, &pos) < 4 &&
+        sscanf(line, "%31s - - - %n", score, &pos) < 1)
+      continue;
+    if (pos == 0) continue;
+    char *file = line + pos;
+
+    /* Skip the scores of zones; only the overall score drives
+       recording. */
+    for (size_t wl; *file != 'X' && (wl = strcspn(file, " \n")) > 0 &&
+           memchr(file, '=', wl) != NULL; )
+      file += wl + strspn(file + wl, " ");
+    file[strcspn(file, "\n")] = '\0';
+    size_t flen = strlen(file);
+    if (flen > 0 && file[flen - 1] == 'X') file[--flen] = '\0';
+    if (file[0] == 'X') file++;
+
+    /* Extract the source file's timestamp, and append it to our frame
+       list. */
+    const bool scored = strcmp(score, "-") != 0;
+    if (scored) {
+      last.score = strtoll(score, NULL, 10);
+      last.mean = mean;
+      last.stddev = stddev;
+      last.rat = rat;
+    }
+    last.t = name_stamp(file);
+    fr_push(&retained, &last);
+
+    if (debug) {
+      show_time(stderr, last.t);
+      fprintf(stderr, ": %0*lld%s %3lld %1s %6.3f %.3g %.3g\n",
+              pdigs, last.score, scored ? "*" : " ", rem,
+              recording ? "R" : "", last.rat, last.mean, last.stddev);
+    }
+
+    /* If no score is provided, the recording state shouldn't
+       change, but the previous frame's duration is now known. */
+    if (!scored) {
+      if (recording && backstep <= analyzed.len)
+        send_frames(&retained, &sent,
+                    tr_at(&analyzed, analyzed.len - backstep));
+      continue;
+    }
+
+    /* Record the timestamp of this frame which has been analyzed. */
+    tr_push(&analyzed, last.t);
+
+    if (recording) {
+      /* We're already recording.  Look for a reason to stop. */
+      if (last.score > low) {
+        rem = linger;
+      } else if (rem > 0) {
+        /* We should still hang on a while. */
+        rem--;
+      } else {
+        /* Pass on the rest of the frames to record, up to the end
+           time. */
+        const unsigned long long t0 = fr_at(&retained, 0)->t;
+        const unsigned long long t1 = backstep <= analyzed.len ?
+          tr_at(&analyzed, analyzed.len - backstep) : 0;
+        flush_deletions();
+        send_frames(&retained, &sent, t1);
+        printf("stop %llu %llu\n", t0, t1);
+        fflush(stdout);
+        sent = 0;
+        tr_keep(&analyzed, linger);
+        recording = false;
+      }
+    } else {
+      if (last.score > high) {
+        /* We're not recording, but the score is high enough. */
+        if (rem >= hesitate) {
+          /* It's been high enough for long enough. */
+          recording = true;
+          rem = linger;
+          flush_deletions();
+
+          /* Identify the recording's start time, and the first frame
+             whose score exceeds the initial detection threshold, to
+             be used as the thumbnail. */
+          size_t thumb = 0;
+          while (fr_at(&retained, thumb)->score < high)
+            thumb++;
+          printf("start %llu %llu\n",
+                 fr_at(&retained, 0)->t, fr_at(&retained, thumb)->t);
+          fflush(stdout);
+        } else {
+          /* We haven't been consistently high yet. */
+          rem++;
+        }
+      } else if (rem > 0) {
+        /* We're not recording, and the score is too low to start
+           recording.  Decay the record of activity. */
+        rem--;
+      }
+
+      /* If we're not recording, we only keep the last
+         GATHER+HESITATE+LEADER analyzed frames. */
+      if (!recording && analyzed.len > gather + hesitate + leader)
+        tr_keep(&analyzed, gather + hesitate + leader);
+    }
+
+    /* Pass on frames that will be recorded however soon we stop.
+       Those before the frame we would stop at now can't be after the
+       one we'll eventually stop at. */
+    if (recording && backstep <= analyzed.len)
+      send_frames(&retained, &sent,
+                  tr_at(&analyzed, analyzed.len - backstep));
+
+    /* If we're not recording, get rid of old frames. */
+    if (!recording) {
+      while (retained.len > 0 &&
+             (analyzed.len > 0 ?
+              fr_at(&retained, 0)->t < tr_at(&analyzed, 0) :
+              false)) {
+        delete_frame(fr_at(&retained, 0)->t);
+        fr_shift(&retained);
+      }
+    }
+  }
+  flush_deletions();
+
+  free(line);
+  free(retained.buf);
+  free(analyzed.buf);
+  return 0;
+}
@@ -0,0 +1,276 @@
+// -*- c-basic-offset: 2; indent-tabs-mode: nil -*-
+
+/*
+ * Copyright 2018-19, Lancaster University
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ * 
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the
+ *    distribution.
+ * 
+ *  * Neither the name of the copyright holder nor the names of
+ *    its contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ *
+ * Author: Steven Simpson <https://github.com/simpsonst>
+ */
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <limits.h>
+#include <stdbool.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "capture.h"
+#include "ring.h"
+
+/* Capture frames from a local camera, or replay them from a
+   directory or file, writing each as a file renamed into place (as
+   'ingest' does), or appending it to a shared-memory ring. */
+
+static int write_all(int fd, const void *data, size_t len)
+{
+  const unsigned char *p = data;
+  while (len > 0) {
+    ssize_t done = write(fd, p, len);
+    if (done < 0) {
+      if (errno == EINTR) continue;
+      return -1;
+    }
+    p += done;
+    len -= done;
+  }
+  return 0;
+}
+
+/* Write a frame to a hidden file, set its time, and rename it into
+   place. */
+static int put_file(const char *name, const struct capture_frame *fr)
+{
+  char tmpname[NAME_MAX + 6];
+  snprintf(tmpname, sizeof tmpname, ".tmp-%s", name);
+  int fd = open(tmpname, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  if (fd < 0) return -1;
+  if (write_all(fd, fr->data, fr->len) < 0) {
+    int e = errno;
+    close(fd);
+    unlink(tmpname);
+    errno = e;
+    return -1;
+  }
+  struct timespec times[2] = { fr->stamp, fr->stamp };
+  futimens(fd, times);
+  if (close(fd) < 0 || rename(tmpname, name) < 0) {
+    int e = errno;
+    unlink(tmpname);
+    errno = e;
+    return -1;
+  }
+  return 0;
+}
+
+int main(int argc, const char *const *argv)
+{
+  const char *templ = "snap%03d.jpeg";
+  unsigned long piclim = 1000;
+  const char *device = NULL, *replay = NULL;
+  unsigned width = 640, height = 480, rate = 10;
+  int quality = 90;
+  bool loop = false;
+  const char *ringpath = NULL;
+  size_t ringslots = 256, ringmb = 64;
+
+  /* Parse command-line arguments. */
+  bool show_help = false, fail = false;
+  for (int argi = 1; argi < argc; argi++) {
+    if (!strcmp(argv[argi], "-d")) {
+      if (++argi == argc) {
+        show_help = true;
+        fail = true;
+        break;
+      }
+      device = argv[argi];
+      replay = NULL;
+    } else if (!strcmp(argv[argi], "-p")) {
+      if (++argi == argc) {
+        show_help = true;
+        fail = true;
+        break;
+      }
+      replay = argv[argi];
+      device = NULL;
+    } else if (!strcmp(argv[argi], "-s")) {
+      if (++argi == argc) {
+        show_help = true;
+        fail = true;
+        break;
+      }
+      if (sscanf(argv[argi], "%ux%u", &width, &height) != 2) {
+        fprintf(stderr, "%s: bad size: %s\n", argv[0], argv[argi]);
+        exit(EXIT_FAILURE);
+      }
+    } else if (!strcmp(argv[argi], "-r")) {
+      if (++argi == argc) {
+        show_help = true;
+        fail = true;
+        break;
+      }
+      rate = strtoul(argv[argi], NULL, 10);
+    } else if (!strcmp(argv[argi], "-q")) {
+      if (++argi == argc) {
+        show_help = true;
+        fail = true;
+        break;
+      }
+      quality = atoi(argv[argi]);
+    } else if (!strcmp(argv[argi], "-l")) {
+      loop = true;
+    } else if (!strcmp(argv[argi], "+l")) {
+      loop = false;
+    } else if (!strcmp(argv[argi], "-t")) {
+      if (++argi == argc) {
+        show_help = true;
+        fail = true;
+        break;
+      }
+      templ = argv[argi];
+    } else if (!strcmp(argv[argi], "-n")) {
+      if (++argi == argc) {
+        show_help = true;
+        fail = true;
+        break;
+      }
+      piclim = strtoul(argv[argi], NULL, 10);
+    } else if (!strcmp(argv[argi], "-m")) {
+      if (++argi == argc) {
+        show_help = true;
+        fail = true;
+        break;
+      }
+      ringpath = argv[argi];
+    } else if (!strcmp(argv[argi], "+m")) {
+      ringpath = NULL;
+    } else if (!strcmp(argv[argi], "-S")) {
+      if (++argi == argc) {
+        show_help = true;
+        fail = true;
+        break;
+      }
+      ringslots = strtoul(argv[argi], NULL, 10);
+    } else if (!strcmp(argv[argi], "-B")) {
+      if (++argi == argc) {
+        show_help = true;
+        fail = true;
+        break;
+      }
+      ringmb = strtoul(argv[argi], NULL, 10);
+    } else if (!strcmp(argv[argi], "-h")) {
+      show_help = true;
+    } else if (argv[argi][0] == '-' || argv[argi][0] == '+') {
+      fprintf(stderr, "%s: unknown switch: %s\n", argv[0], argv[argi]);
+      exit(EXIT_FAILURE);
+    } else {
+      fprintf(stderr, "%s: unknown argument: %s\n", argv[0], argv[argi]);
+      exit(EXIT_FAILURE);
+    }
+  }
+  if ((device == NULL && replay == NULL) || piclim == 0 ||
+      ringslots == 0 || ringmb == 0 || quality < 1 || quality > 100) {
+    show_help = true;
+    fail = true;
+  }
+
+  if (show_help) {
+    fprintf(stderr,
+            "Usage: %s -d device|-p replay\n"
+            "\t[-s WxH]\n"
+            "\t[-r rate]\n"
+            "\t[-q quality]\n"
+            "\t[-l|+l]\n"
+            "\t[-t template]\n"
+            "\t[-n limit]\n"
+            "\t[-m ring|+m]\n"
+            "\t[-S ring slots]\n"
+            "\t[-B ring MiB]\n", argv[0]);
+    exit(fail ? EXIT_FAILURE : EXIT_SUCCESS);
+  }
+
+  struct capture *cap = device != NULL ?
+    capture_v4l2(device, width, height, rate, quality) :
+    capture_replay(replay, rate, loop);
+  if (cap == NULL) {
+    fprintf(stderr, "%s: %s: opening %s\n",
+            argv[0], strerror(errno), device ? device : replay);
+    exit(EXIT_FAILURE);
+  }
+
+  struct ring *ring = NULL;
+  if (ringpath != NULL) {
+    ring = ring_create(ringpath, ringslots, ringmb << 20);
+    if (ring == NULL) {
+      fprintf(stderr, "%s: %s: creating ring %s\n",
+              argv[0], strerror(errno), ringpath);
+      capture_close(cap);
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  int rc = EXIT_SUCCESS;
+  unsigned long picno = 0;
+  struct capture_frame fr;
+  int got;
+  while ((got = capture_next(cap, &fr)) == 0) {
+    if (ring != NULL) {
+      if (ring_put(ring, fr.data, fr.len, &fr.stamp, 0) != RING_OK)
+        fprintf(stderr, "%s: frame of %zu bytes too big for ring\n",
+                argv[0], fr.len);
+      continue;
+    }
+    char name[NAME_MAX + 1];
+    snprintf(name, sizeof name, templ, (int) (picno++ % piclim));
+    if (put_file(name, &fr) < 0) {
+      fprintf(stderr, "%s: %s: writing %s\n",
+              argv[0], strerror(errno), name);
+      rc = EXIT_FAILURE;
+      break;
+    }
+  }
+  if (got < 0) {
+    fprintf(stderr, "%s: %s: capturing from %s\n",
+            argv[0], strerror(errno), device ? device : replay);
+    rc = EXIT_FAILURE;
+  }
+
+  ring_close(ring);
+  capture_close(cap);
+  return rc;
+}
@@ -0,0 +1,770 @@
+// -*- c-basic-offset: 2; indent-tabs-mode: nil -*-
+
+/*
+ * Copyright 2018-19, Lancaster University
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ * 
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the
+ *    distribution.
+ * 
+ *  * Neither the name of the copyright holder nor the names of
+ *    its contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ *
+ * Author: Steven Simpson <https://github.com/simpsonst>
+ */
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <assert.h>
+#include <string.h>
+#include <strings.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <ctype.h>
+#include <time.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "ring.h"
+
+/* Split a stream of JPEGs into files.  By default, the stream is an
+   HTTP response (status line and headers included, as from 'curl
+   -i') carrying a multipart/x-mixed-replace body of image/jpeg
+   parts.  With -r, the stream is raw concatenated JPEGs, as from
+   'ffmpeg -f mjpeg -'.  Each frame is written to a hidden file, and
+   then renamed into place, so a watcher sees only complete frames.
+   With -m, frames are instead appended to a shared-memory ring. */
+
+#define BUFSIZE 65536
+#define LINEMAX 1024
+
+/* Buffered input from a descriptor */
+struct input {
+  int fd;
+  size_t pos, len;
+  unsigned char buf[BUFSIZE];
+};
+
+/* Ensure that there are unread bytes in the buffer, moving them to
+   the start to make room if necessary.  Return the number
+   available, 0 at end of stream, or -1 on error. */
+static ssize_t fill(struct input *in)
+{
+  if (in->pos < in->len) return in->len - in->pos;
+  in->pos = in->len = 0;
+  ssize_t got;
+  do
+    got = read(in->fd, in->buf, sizeof in->buf);
+  while (got < 0 && errno == EINTR);
+  if (got <= 0) return got;
+  in->len = got;
+  return got;
+}
+
+/* As 'fill', but ensure at least 'need' bytes are available, unless
+   the stream ends first. */
+static ssize_t fill_to(struct input *in, size_t need)
+{
+  assert(need <= sizeof in->buf);
+  if (in->len - in->pos >= need) return in->len - in->pos;
+  memmove(in->buf, in->buf + in->pos, in->len - in->pos);
+  in->len -= in->pos;
+  in->pos = 0;
+  while (in->len < need) {
+    ssize_t got = read(in->fd, in->buf + in->len, sizeof in->buf - in->len);
+    if (got < 0 && errno == EINTR) continue;
+    if (got < 0) return -1;
+    if (got == 0) break;
+    in->len += got;
+  }
+  return in->len;
+}
+
+/* Read a line terminated by LF, removing the terminator and any
+   preceding CR.  Overlong lines are truncated.  Return false at end
+   of stream. */
+static bool read_line(struct input *in, char *line, size_t max)
+{
+  size_t got = 0;
+  bool any = false;
+  for ( ; ; ) {
+    if (fill(in) <= 0) {
+      line[got] = '\0';
+      return any;
+    }
+    any = true;
+    const unsigned char *start = in->buf + in->pos;
+    const unsigned char *lf = memchr(start, '\n', in->len - in->pos);
+    size_t amount = (lf ? lf : in->buf + in->len) - start;
+    size_t keep = amount < max - 1 - got ? amount : max - 1 - got;
+    memcpy(line + got, start, keep);
+    got += keep;
+    in->pos += amount;
+    if (lf) {
+      in->pos++;
+      break;
+    }
+  }
+  if (got > 0 && line[got - 1] == '\r')
+    got--;
+  line[got] = '\0';
+  return true;
+}
+
+static int write_all(int fd, const void *data, size_t len)
+{
+  const unsigned char *p = data;
+  while (len > 0) {
+    ssize_t done = write(fd, p, len);
+    if (done < 0) {
+      if (errno == EINTR) continue;
+      return -1;
+    }
+    p += done;
+    len -= done;
+  }
+  return 0;
+}
+
+/* A frame being written, either to a file, or to a buffer destined
+   for a ring */
+struct output {
+  const char *templ;
+  unsigned long picno, piclim;
+  int fd;
+  char name[NAME_MAX + 1];
+  char tmpname[NAME_MAX + 6];
+
+  struct ring *ring;
+  bool active;
+  unsigned char *frame;
+  size_t len, cap;
+};
+
+/* Get a name for the frame's destination, for diagnostics. */
+static const char *out_name(const struct output *out)
+{
+  return out->ring != NULL ? "ring" : out->tmpname;
+}
+
+static int begin_frame(struct output *out)
+{
+  out->active = true;
+  if (out->ring != NULL) {
+    out->len = 0;
+    return 0;
+  }
+  snprintf(out->name, sizeof out->name, out->templ,
+           (int) (out->picno % out->piclim));
+  out->picno++;
+  snprintf(out->tmpname, sizeof out->tmpname, ".tmp-%s", out->name);
+  out->fd = open(out->tmpname, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  if (out->fd < 0) {
+    out->active = false;
+    return -1;
+  }
+  return 0;
+}
+
+/* Append to the frame. */
+static int emit(struct output *out, const void *data, size_t len)
+{
+  if (out->ring == NULL)
+    return write_all(out->fd, data, len);
+
+  if (out->len + len > out->cap) {
+    size_t ncap = out->cap ? out->cap : 65536;
+    while (ncap < out->len + len)
+      ncap *= 2;
+    if (ncap > ring_maxframe(out->ring)) {
+      errno = EFBIG;
+      return -1;
+    }
+    void *nf = realloc(out->frame, ncap);
+    if (nf == NULL) return -1;
+    out->frame = nf;
+    out->cap = ncap;
+  }
+  memcpy(out->frame + out->len, data, len);
+  out->len += len;
+  return 0;
+}
+
+/* Discard a partially written frame. */
+static void abandon_frame(struct output *out)
+{
+  if (!out->active) return;
+  out->active = false;
+  if (out->ring != NULL) return;
+  close(out->fd);
+  out->fd = -1;
+  unlink(out->tmpname);
+}
+
+/* Complete a frame, optionally setting its timestamp, and move it
+   into place. */
+static int end_frame(struct output *out, const struct timespec *ts)
+{
+  out->active = false;
+  if (out->ring != NULL) {
+    struct timespec now;
+    if (ts == NULL) {
+      clock_gettime(CLOCK_REALTIME, &now);
+      ts = &now;
+    }
+    if (ring_put(out->ring, out->frame, out->len, ts, 0) != RING_OK) {
+      errno = EFBIG;
+      return -1;
+    }
+    return 0;
+  }
+
+  if (ts != NULL) {
+    struct timespec times[2] = { *ts, *ts };
+    futimens(out->fd, times);
+  }
+  int rc = close(out->fd);
+  out->fd = -1;
+  if (rc < 0 || rename(out->tmpname, out->name) < 0) {
+    unlink(out->tmpname);
+    return -1;
+  }
+  return 0;
+}
+
+/* Parse an X-Timestamp value of the form <secs>.<frac>. */
+static bool parse_stamp(const char *s, struct timespec *ts)
+{
+  if (!isdigit((unsigned char) *s)) return false;
+  char *end;
+  errno = 0;
+  unsigned long long secs = strtoull(s, &end, 10);
+  if (errno != 0 || *end != '.' || !isdigit((unsigned char) end[1]))
+    return false;
+  long nsec = 0;
+  int digs = 0;
+  for (s = end + 1; isdigit((unsigned char) *s); s++)
+    if (digs++ < 9)
+      nsec = nsec * 10 + (*s - '0');
+  if (*s != '\0') return false;
+  for ( ; digs < 9; digs++)
+    nsec *= 10;
+  ts->tv_sec = secs;
+  ts->tv_nsec = nsec;
+  return true;
+}
+
+
+
+/* The headers we care about */
+struct header {
+  char type[LINEMAX];
+  char length[64];
+  char stamp[64];
+};
+
+/* Read headers up to the blank line, retaining only those we're
+   interested in.  Return false if the stream ended. */
+static bool read_header(struct input *in, struct header *hdr)
+{
+  hdr->type[0] = hdr->length[0] = hdr->stamp[0] = '\0';
+  char *cur = NULL;
+  size_t curmax = 0;
+  char line[LINEMAX];
+  for ( ; ; ) {
+    if (!read_line(in, line, sizeof line)) return false;
+    if (line[0] == '\0') return true;
+
+    const char *val;
+    if (line[0] == ' ' || line[0] == '\t') {
+      /* Continue the previous header. */
+      val = line + 1;
+    } else {
+      char *colon = strchr(line, ':');
+      cur = NULL;
+      if (colon == NULL) continue;
+      char *end = colon;
+      while (end > line && isspace((unsigned char) end[-1]))
+        end--;
+      *end = '\0';
+      if (!strcasecmp(line, "Content-Type"))
+        cur = hdr->type, curmax = sizeof hdr->type;
+      else if (!strcasecmp(line, "Content-Length"))
+        cur = hdr->length, curmax = sizeof hdr->length;
+      else if (!strcasecmp(line, "X-Timestamp"))
+        cur = hdr->stamp, curmax = sizeof hdr->stamp;
+      if (cur != NULL) *cur = '\0';
+      val = colon + 1;
+      while (isspace((unsigned char) *val))
+        val++;
+    }
+    if (cur == NULL) continue;
+    size_t have = strlen(cur);
+    snprintf(cur + have, curmax - have, "%s", val);
+  }
+}
+
+/* Token characters, i.e., excluding separators ()<>@,;:\"/[]?={} */
+static bool istoken(int c)
+{
+  return c > 32 && c < 127 && !strchr("()<>@,;:\\\"/[]?={}", c);
+}
+
+static const char *skip_ws(const char *s)
+{
+  while (*s == ' ' || *s == '\t')
+    s++;
+  return s;
+}
+
+/* Parse a token or quoted string into 'out', returning the position
+   after it, or NULL if neither is present. */
+static const char *parse_toqs(const char *s, char *out, size_t max)
+{
+  size_t got = 0;
+  if (*s == '"') {
+    for (s++; *s != '"'; s++) {
+      if (*s == '\\' && s[1] != '\0') s++;
+      if (*s == '\0') return NULL;
+      if (got < max - 1) out[got++] = *s;
+    }
+    s++;
+  } else {
+    if (!istoken((unsigned char) *s)) return NULL;
+    while (istoken((unsigned char) *s)) {
+      if (got < max - 1) out[got++] = *s;
+      s++;
+    }
+  }
+  out[got] = '\0';
+  return s;
+}
+
+/* Check that 'type' is of type 'major'/'minor', ignoring case and
+   parameters, and return the position of its parameters, or NULL
+   if it doesn't match. */
+static const char *match_type(const char *type,
+                              const char *major, const char *minor)
+{
+  type = skip_ws(type);
+  size_t len = strlen(major);
+  if (strncasecmp(type, major, len) || type[len] != '/') return NULL;
+  type += len + 1;
+  len = strlen(minor);
+  if (strncasecmp(type, minor, len) || istoken((unsigned char) type[len]))
+    return NULL;
+  return type + len;
+}
+
+/* Find the boundary parameter of a multipart type. */
+static bool get_boundary(const char *pars, char *out, size_t max)
+{
+  out[0] = '\0';
+  for ( ; ; ) {
+    pars = skip_ws(pars);
+    if (*pars++ != ';') break;
+    pars = skip_ws(pars);
+    char key[LINEMAX], value[LINEMAX];
+    if ((pars = parse_toqs(pars, key, sizeof key)) == NULL) break;
+    pars = skip_ws(pars);
+    if (*pars++ != '=') break;
+    pars = skip_ws(pars);
+    if ((pars = parse_toqs(pars, value, sizeof value)) == NULL) break;
+    if (!strcasecmp(key, "boundary"))
+      snprintf(out, max, "%s", value);
+  }
+  return out[0] != '\0';
+}
+
+/* Copy 'rem' bytes of input to the frame, or discard them if 'out'
+   is NULL.  Return 0 on success, 1 at end of stream, -1 on write
+   error. */
+static int copy_body(struct input *in, unsigned long long rem,
+                     struct output *out)
+{
+  while (rem > 0) {
+    ssize_t avail = fill(in);
+    if (avail <= 0) return 1;
+    size_t amount = (unsigned long long) avail < rem ? (size_t) avail : rem;
+    if (out != NULL && emit(out, in->buf + in->pos, amount) < 0)
+      return -1;
+    in->pos += amount;
+    rem -= amount;
+  }
+  return 0;
+}
+
+/* Copy input to the frame (or discard it if 'out' is NULL) up to
+   but excluding the delimiter 'delim', which is left unread.
+   Return as 'copy_body'. */
+static int copy_to_delim(struct input *in, const char *delim,
+                         struct output *out)
+{
+  const size_t dlen = strlen(delim);
+  for ( ; ; ) {
+    ssize_t avail = fill_to(in, dlen);
+    if (avail < 0 || (size_t) avail < dlen) return 1;
+    const unsigned char *start = in->buf + in->pos;
+    const unsigned char *hit = memmem(start, avail, delim, dlen);
+    size_t amount = hit ? (size_t) (hit - start) : avail - (dlen - 1);
+    if (out != NULL && emit(out, start, amount) < 0)
+      return -1;
+    in->pos += amount;
+    if (hit) return 0;
+  }
+}
+
+static int run_multipart(const char *prog, struct input *in,
+                         struct output *out)
+{
+  char line[LINEMAX];
+  if (!read_line(in, line, sizeof line)) return EXIT_SUCCESS;
+  char *code = strchr(line, ' ');
+  if (code == NULL || atoi(code + 1) != 200) {
+    fprintf(stderr, "Bad HTTP status: %s\n", code ? code + 1 : line);
+    return EXIT_FAILURE;
+  }
+
+  struct header hdr;
+  read_header(in, &hdr);
+
+  const char *pars =
+    match_type(hdr.type, "multipart", "x-mixed-replace");
+  char boundary[LINEMAX];
+  if (pars == NULL || !get_boundary(pars, boundary, sizeof boundary)) {
+    fprintf(stderr, "Not a multipart/x-mixed-replace"
+            " with a defined boundary\n");
+    fprintf(stderr, "  Type: %s\n", hdr.type);
+    return EXIT_FAILURE;
+  }
+
+  /* Each delimiter line is the boundary preceded by two hyphens.
+     When a part has no length, its end is found by searching for a
+     delimiter at the start of a line. */
+  char dashed[LINEMAX + 2], delim[LINEMAX + 4];
+  snprintf(dashed, sizeof dashed, "--%s", boundary);
+  snprintf(delim, sizeof delim, "\r\n%s", dashed);
+
+  /* Skip the preamble. */
+  bool more;
+  while ((more = read_line(in, line, sizeof line)) && strcmp(line, dashed))
+    ;
+
+  while (more && !strcmp(line, dashed)) {
+    if (!read_header(in, &hdr)) break;
+
+    struct output *dst = NULL;
+    if (match_type(hdr.type, "image", "jpeg")) {
+      if (begin_frame(out) < 0) {
+        fprintf(stderr, "%s: %s: creating %s\n",
+                prog, strerror(errno), out_name(out));
+        return EXIT_FAILURE;
+      }
+      dst = out;
+    }
+
+    int rc;
+    char *end;
+    unsigned long long length = strtoull(hdr.length, &end, 10);
+    if (hdr.length[0] != '\0' && *end == '\0') {
+      rc = copy_body(in, length, dst);
+      if (rc == 0) {
+        /* Skip the rest of the line after the body. */
+        read_line(in, line, sizeof line);
+      }
+    } else {
+      rc = copy_to_delim(in, delim, dst);
+      if (rc == 0) {
+        /* Skip the CRLF that belongs to the delimiter. */
+        in->pos += 2;
+      }
+    }
+    if (rc < 0) {
+      fprintf(stderr, "%s: %s: writing %s\n",
+              prog, strerror(errno), out_name(out));
+      abandon_frame(out);
+      return EXIT_FAILURE;
+    }
+    if (rc > 0) {
+      /* The stream ended mid-part. */
+      abandon_frame(out);
+      break;
+    }
+
+    if (dst != NULL) {
+      struct timespec ts;
+      if (end_frame(out, parse_stamp(hdr.stamp, &ts) ? &ts : NULL) < 0) {
+        fprintf(stderr, "%s: %s: renaming %s\n",
+                prog, strerror(errno), out_name(out));
+        return EXIT_FAILURE;
+      }
+    }
+
+    more = read_line(in, line, sizeof line);
+  }
+
+  return EXIT_SUCCESS;
+}
+
+
+
+/* States of the raw JPEG scanner */
+enum jstate {
+  J_SOI0,                       /* seeking 0xFF of SOI */
+  J_SOI1,                       /* seeking 0xD8 of SOI */
+  J_MARK0,                      /* expecting 0xFF of a marker */
+  J_MARK1,                      /* expecting a marker code */
+  J_LEN0,                       /* high byte of segment length */
+  J_LEN1,                       /* low byte of segment length */
+  J_SKIP,                       /* within a segment */
+  J_DATA,                       /* within entropy-coded data */
+  J_DATAFF,                     /* after 0xFF in entropy-coded data */
+};
+
+/* Split concatenated JPEGs by following their marker structure.
+   Segment lengths are honoured, so an EOI within an embedded
+   thumbnail does not end the frame early. */
+static int run_raw(const char *prog, struct input *in, struct output *out)
+{
+  enum jstate st = J_SOI0;
+  unsigned seglen = 0;
+  bool scan = false;
+  ssize_t avail;
+  while ((avail = fill(in)) > 0) {
+    const unsigned char *const base = in->buf + in->pos;
+    const unsigned char *p = base, *const lim = base + avail;
+    const unsigned char *from = st >= J_MARK0 ? base : NULL;
+    bool done = false;
+
+    while (p < lim && !done) {
+      const unsigned c = *p++;
+      switch (st) {
+      case J_SOI0:
+        if (c == 0xff) st = J_SOI1;
+        break;
+
+      case J_SOI1:
+        if (c == 0xd8) {
+          if (begin_frame(out) < 0) {
+            fprintf(stderr, "%s: %s: creating %s\n",
+                    prog, strerror(errno), out_name(out));
+            return EXIT_FAILURE;
+          }
+          static const unsigned char soi[] = { 0xff, 0xd8 };
+          if (emit(out, soi, sizeof soi) < 0) goto failed;
+          from = p;
+          scan = false;
+          st = J_MARK0;
+        } else if (c != 0xff) {
+          st = J_SOI0;
+        }
+        break;
+
+      case J_MARK0:
+        st = c == 0xff ? J_MARK1 : scan ? J_DATA : J_MARK0;
+        break;
+
+      case J_DATAFF:
+      case J_MARK1:
+        if (c == 0xff) break;
+        if (st == J_DATAFF && (c == 0x00 || (c >= 0xd0 && c <= 0xd7))) {
+          /* Stuffed byte or restart marker */
+          st = J_DATA;
+        } else if (c == 0xd9) {
+          /* EOI: the frame is complete. */
+          done = true;
+        } else if (c == 0x01 || (c >= 0xd0 && c <= 0xd8)) {
+          st = scan ? J_DATA : J_MARK0;
+        } else {
+          scan = c == 0xda;
+          st = J_LEN0;
+        }
+        break;
+
+      case J_LEN0:
+        seglen = c << 8;
+        st = J_LEN1;
+        break;
+
+      case J_LEN1:
+        seglen |= c;
+        seglen = seglen >= 2 ? seglen - 2 : 0;
+        st = seglen > 0 ? J_SKIP : scan ? J_DATA : J_MARK0;
+        break;
+
+      case J_SKIP: {
+        /* Skip as much of the segment as we have. */
+        size_t amount = lim - (p - 1) < seglen ? lim - (p - 1) : seglen;
+        p += amount - 1;
+        seglen -= amount;
+        if (seglen == 0) st = scan ? J_DATA : J_MARK0;
+        break;
+      }
+
+      case J_DATA:
+        if (c == 0xff) {
+          st = J_DATAFF;
+        } else {
+          const unsigned char *ff = memchr(p, 0xff, lim - p);
+          if (ff == NULL) {
+            p = lim;
+          } else {
+            p = ff + 1;
+            st = J_DATAFF;
+          }
+        }
+        break;
+      }
+    }
+
+    if (from != NULL && out->active && emit(out, from, p - from) < 0)
+      goto failed;
+    in->pos += p - base;
+
+    if (done) {
+      if (end_frame(out, NULL) < 0) {
+        fprintf(stderr, "%s: %s: renaming %s\n",
+                prog, strerror(errno), out_name(out));
+        return EXIT_FAILURE;
+      }
+      st = J_SOI0;
+    }
+  }
+
+  /* Discard any incomplete frame. */
+  abandon_frame(out);
+  return EXIT_SUCCESS;
+
+ failed:
+  fprintf(stderr, "%s: %s: writing %s\n",
+          prog, strerror(errno), out_name(out));
+  abandon_frame(out);
+  return EXIT_FAILURE;
+}
+
+int main(int argc, const char *const *argv)
+{
+  struct output out = {
+    .templ = "snap%03d.jpeg",
+    .piclim = 1000,
+    .fd = -1,
+  };
+  bool raw = false;
+  const char *ringpath = NULL;
+  size_t ringslots = 256, ringmb = 64;
+
+  /* Parse command-line arguments. */
+  bool show_help = false, fail = false;
+  for (int argi = 1; argi < argc; argi++) {
+    if (!strcmp(argv[argi], "-t")) {
+      if (++argi == argc) {
+        show_help = true;
+        fail = true;
+        break;
+      }
+      out.templ = argv[argi];
+    } else if (!strcmp(argv[argi], "-n")) {
+      if (++argi == argc) {
+        show_help = true;
+        fail = true;
+        break;
+      }
+      out.piclim = strtoul(argv[argi], NULL, 10);
+    } else if (!strcmp(argv[argi], "-m")) {
+      if (++argi == argc) {
+        show_help = true;
+        fail = true;
+        break;
+      }
+      ringpath = argv[argi];
+    } else if (!strcmp(argv[argi], "+m")) {
+      ringpath = NULL;
+    } else if (!strcmp(argv[argi], "-S")) {
+      if (++argi == argc) {
+        show_help = true;
+        fail = true;
+        break;
+      }
+      ringslots = strtoul(argv[argi], NULL, 10);
+    } else if (!strcmp(argv[argi], "-B")) {
+      if (++argi == argc) {
+        show_help = true;
+        fail = true;
+        break;
+      }
+      ringmb = strtoul(argv[argi], NULL, 10);
+    } else if (!strcmp(argv[argi], "-r")) {
+      raw = true;
+    } else if (!strcmp(argv[argi], "+r")) {
+      raw = false;
+    } else if (!strcmp(argv[argi], "-h")) {
+      show_help = true;
+    } else if (argv[argi][0] == '-' || argv[argi][0] == '+') {
+      fprintf(stderr, "%s: unknown switch: %s\n", argv[0], argv[argi]);
+      exit(EXIT_FAILURE);
+    } else {
+      fprintf(stderr, "%s: unknown argument: %s\n", argv[0], argv[argi]);
+      exit(EXIT_FAILURE);
+    }
+  }
+  if (out.piclim == 0 || ringslots == 0 || ringmb == 0) {
+    show_help = true;
+    fail = true;
+  }
+
+  if (show_help) {
+    fprintf(stderr,
+            "Usage: %s [-r|+r]\n"
+            "\t[-t template]\n"
+            "\t[-n limit]\n"
+            "\t[-m ring|+m]\n"
+            "\t[-S ring slots]\n"
+            "\t[-B ring MiB]\n", argv[0]);
+    exit(fail ? EXIT_FAILURE : EXIT_SUCCESS);
+  }
+
+  if (ringpath != NULL) {
+    out.ring = ring_create(ringpath, ringslots, ringmb << 20);
+    if (out.ring == NULL) {
+      fprintf(stderr, "%s: %s: creating ring %s\n",
+              argv[0], strerror(errno), ringpath);
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  static struct input in = { .fd = 0 };
+  int rc = raw ? run_raw(argv[0], &in, &out) :
+    run_multipart(argv[0], &in, &out);
+  ring_close(out.ring);
+  free(out.frame);
+  return rc;
+}
@@ -0,0 +1,218 @@
+// -*- c-basic-offset: 2; indent-tabs-mode: nil -*-
+
+/*
+ * Copyright 2018-19, Lancaster University
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ * 
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the
+ *    distribution.
+ * 
+ *  * Neither the name of the copyright holder nor the names of
+ *    its contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ *
+ * Author: Steven Simpson <https://github.com/simpsonst>
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <setjmp.h>
+
+#include <jpeglib.h>
+
+#include "jpegdet.h"
+
+/* This replaces the per-frame invocation of
+
+     convert in.jpg -normalize -scale WxH! \
+       -set colorspace Gray -separate -average -depth 8 out.pgm
+
+   Only the luma component is decoded, and libjpeg is asked to scale
+   the image down by the largest power of two (up to 8) that still
+   leaves at least one decoded pixel per detection cell.  At 1/8,
+   libjpeg uses only the DC coefficient of each block, so no inverse
+   DCT is performed at all.  The remaining reduction is a box
+   average into the cells.  Luma is used instead of the mean of the
+   R, G and B channels, which makes no difference to detection, as
+   only changes in the grid are of interest. */
+
+struct errmgr {
+  struct jpeg_error_mgr pub;
+  jmp_buf jmp;
+};
+
+static void on_error(j_common_ptr cinfo)
+{
+  struct errmgr *err = (struct errmgr *) cinfo->err;
+  longjmp(err->jmp, 1);
+}
+
+static void on_message(j_common_ptr cinfo)
+{
+  /* Ignore warnings, as 'convert -quiet' did. */
+  (void) cinfo;
+}
+
+/* Stretch the grid's levels so that the darkest 2% of pixels become
+   black, and the brightest 1% become white, as 'convert -normalize'
+   does.  The levels are found from the histogram of all decoded
+   pixels, but applied to the cell averages; as the stretch is
+   linear, this differs only where individual pixels would have been
+   clipped. */
+static void normalize(unsigned amount, unsigned char dst[amount],
+                      const unsigned long hist[256], unsigned long total)
+{
+  const unsigned long blk = total / 50, wht = total / 100;
+
+  unsigned lo = 0;
+  for (unsigned long acc = hist[0]; lo < 255 && acc <= blk; )
+    acc += hist[++lo];
+
+  unsigned hi = 255;
+  for (unsigned long acc = hist[255]; hi > 0 && acc <= wht; )
+    acc += hist[--hi];
+
+  if (hi <= lo) return;
+
+  unsigned char map[256];
+  for (unsigned v = 0; v < 256; v++)
+    map[v] = v <= lo ? 0 : v >= hi ? 255 :
+      ((v - lo) * 255 + (hi - lo) / 2) / (hi - lo);
+  for (unsigned i = 0; i < amount; i++)
+    dst[i] = map[dst[i]];
+}
+
+/* Decode from a source already attached to 'cinfo'. */
+static int decode(struct jpeg_decompress_struct *cinfo,
+                  unsigned width, unsigned height, unsigned char dst[])
+{
+  if (jpeg_read_header(cinfo, TRUE) != JPEG_HEADER_OK)
+    return -1;
+
+  /* Choose the coarsest scale that leaves each cell covered. */
+  cinfo->out_color_space = JCS_GRAYSCALE;
+  cinfo->dct_method = JDCT_IFAST;
+  cinfo->do_fancy_upsampling = FALSE;
+  cinfo->scale_num = 1;
+  for (cinfo->scale_denom = 8; cinfo->scale_denom > 1;
+       cinfo->scale_denom /= 2) {
+    const unsigned d = cinfo->scale_denom;
+    if ((cinfo->image_width + d - 1) / d >= width &&
+        (cinfo->image_height + d - 1) / d >= height)
+      break;
+  }
+  jpeg_start_decompress(cinfo);
+
+  const unsigned ow = cinfo->output_width, oh = cinfo->output_height;
+  if (ow < width || oh < height) {
+    /* Too small to fill the grid, so don't try to enlarge it. */
+    jpeg_abort_decompress(cinfo);
+    return -1;
+  }
+
+  /* Accumulate each decoded pixel into its cell.  The working space
+     comes from libjpeg's per-image pool, so it is released even if
+     decoding is abandoned. */
+  const j_common_ptr cc = (j_common_ptr) cinfo;
+  unsigned long *sums =
+    (*cinfo->mem->alloc_large)(cc, JPOOL_IMAGE,
+                               (size_t) width * height * sizeof *sums);
+  unsigned *cellx =
+    (*cinfo->mem->alloc_small)(cc, JPOOL_IMAGE, ow * sizeof *cellx);
+  unsigned *colpix =
+    (*cinfo->mem->alloc_small)(cc, JPOOL_IMAGE, width * sizeof *colpix);
+  unsigned *rowpix =
+    (*cinfo->mem->alloc_small)(cc, JPOOL_IMAGE, height * sizeof *rowpix);
+  JSAMPLE *row = (*cinfo->mem->alloc_small)(cc, JPOOL_IMAGE, ow);
+  memset(sums, 0, (size_t) width * height * sizeof *sums);
+  memset(colpix, 0, width * sizeof *colpix);
+  memset(rowpix, 0, height * sizeof *rowpix);
+  for (unsigned x = 0; x < ow; x++)
+    colpix[cellx[x] = (unsigned long) x * width / ow]++;
+  for (unsigned y = 0; y < oh; y++)
+    rowpix[(unsigned long) y * height / oh]++;
+
+  unsigned long hist[256] = { 0 };
+  while (cinfo->output_scanline < oh) {
+    const unsigned y = cinfo->output_scanline;
+    JSAMPROW rows[1] = { row };
+    jpeg_read_scanlines(cinfo, rows, 1);
+    unsigned long *cells = &sums[(unsigned long) y * height / oh * width];
+    for (unsigned x = 0; x < ow; x++) {
+      cells[cellx[x]] += row[x];
+      hist[row[x]]++;
+    }
+  }
+
+  /* Convert the sums to means.  Cells differ in size by up to a row
+     or column when the grid doesn't divide the image, so each is
+     divided by the number of pixels binned into it. */
+  for (unsigned y = 0; y < height; y++)
+    for (unsigned x = 0; x < width; x++) {
+      const unsigned long n = (unsigned long) colpix[x] * rowpix[y];
+      dst[y * width + x] = (sums[y * width + x] + n / 2) / n;
+    }
+  jpeg_finish_decompress(cinfo);
+
+  normalize(width * height, dst, hist, (unsigned long) ow * oh);
+  return 0;
+}
+
+/* Decode from 'fin' if not NULL, or from 'len' bytes at 'data'. */
+static int run(unsigned width, unsigned height, unsigned char dst[],
+               FILE *fin, const void *data, size_t len)
+{
+  struct jpeg_decompress_struct cinfo;
+  struct errmgr err;
+  cinfo.err = jpeg_std_error(&err.pub);
+  err.pub.error_exit = &on_error;
+  err.pub.output_message = &on_message;
+  if (setjmp(err.jmp)) {
+    jpeg_destroy_decompress(&cinfo);
+    return -1;
+  }
+  jpeg_create_decompress(&cinfo);
+  if (fin != NULL)
+    jpeg_stdio_src(&cinfo, fin);
+  else
+    jpeg_mem_src(&cinfo, (const unsigned char *) data, len);
+  int rc = decode(&cinfo, width, height, dst);
+  jpeg_destroy_decompress(&cinfo);
+  return rc;
+}
+
+int read_jpeg(unsigned width, unsigned height,
+              unsigned char dst[], FILE *fin)
+{
+  int rc = run(width, height, dst, fin, NULL, 0);
+  fclose(fin);
+  return rc;
+}
+
+int decode_jpeg(unsigned width, unsigned height,
+                unsigned char dst[], const void *data, size_t len)
+{
+  return run(width, height, dst, NULL, data, len);
+}
@@ -0,0 +1,712 @@
+// -*- c-basic-offset: 2; indent-tabs-mode: nil -*-
+
+/*
+ * Copyright 2018-19, Lancaster University
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ * 
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the
+ *    distribution.
+ * 
+ *  * Neither the name of the copyright holder nor the names of
+ *    its contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ *
+ * Author: Steven Simpson <https://github.com/simpsonst>
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <math.h>
+
+#include "kernels.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define KERNELS_X86 1
+#endif
+
+#define ROOT2 (1.41421356237309504880)
+
+/* The SIMD versions perform exactly the same operations in the same
+   order as the scalar ones, so all implementations produce the same
+   results.
+
+   Compared with the original cell-at-a-time code, 'slide_window' is
+   exact, as is 'compute_diffs' except that sqrt replaces pow(x, 0.5),
+   which may differ in the last bit.  'sum_adjs' gathers each cell's
+   contributions instead of scattering them to neighbours, so its
+   additions are in a different order.  Together, these change the
+   mean and stddev of the score by a relative error no greater than
+   about 1e-12, so the printed score may occasionally differ by one
+   where it lies on a rounding boundary. */
+
+
+
+/* Scalar implementations, also used for the ends of rows that
+   don't fill a vector */
+
+static void slide_range(size_t i, size_t n,
+                        struct stats *before, struct stats *after,
+                        const unsigned char oldest[n],
+                        const unsigned char trans[n],
+                        const unsigned char newest[n])
+{
+  for ( ; i < n; i++) {
+    const unsigned o = oldest[i], t = trans[i], w = newest[i];
+    before->sum[i] += t - o;
+    before->sum_sq[i] += (int64_t) (t * t) - (int64_t) (o * o);
+    after->sum[i] += w - t;
+    after->sum_sq[i] += (int64_t) (w * w) - (int64_t) (t * t);
+  }
+}
+
+static void slide_scalar(size_t n,
+                         struct stats *before, struct stats *after,
+                         const unsigned char oldest[n],
+                         const unsigned char trans[n],
+                         const unsigned char newest[n])
+{
+  slide_range(0, n, before, after, oldest, trans, newest);
+}
+
+/* Compute one cell's difference, given its means and stddevs. */
+static inline double diff_of(double mu1, double mu0, double sig1, double sig0)
+{
+  return (mu1 - mu0) / 255.0 * ((sig1 / 255.0 + 1.0) / (sig0 / 255.0 + 1.0));
+}
+
+static void diffs_range(size_t i, size_t n,
+                        unsigned nf_after, unsigned nf_before,
+                        const struct stats *after,
+                        const struct stats *before,
+                        double diff[n])
+{
+  for ( ; i < n; i++) {
+    const double mu1 = after->sum[i] / (double) nf_after;
+    const double mu0 = before->sum[i] / (double) nf_before;
+    const double var1 = after->sum_sq[i] / (double) nf_after - mu1 * mu1;
+    const double var0 = before->sum_sq[i] / (double) nf_before - mu0 * mu0;
+    diff[i] = diff_of(mu1, mu0, sqrt(var1), sqrt(var0));
+  }
+}
+
+static void diffs_scalar(size_t n, unsigned nf_after, unsigned nf_before,
+                         const struct stats *after,
+                         const struct stats *before,
+                         double diff[n])
+{
+  diffs_range(0, n, nf_after, nf_before, after, before, diff);
+}
+
+/* The general case, for any power */
+static void diffs_pow(size_t n, unsigned nf_after, unsigned nf_before,
+                      double vp_after, double vp_before,
+                      const struct stats *after,
+                      const struct stats *before,
+                      double diff[n])
+{
+  for (size_t i = 0; i < n; i++) {
+    const double mu1 = after->sum[i] / (double) nf_after;
+    const double mu0 = before->sum[i] / (double) nf_before;
+    const double var1 = after->sum_sq[i] / (double) nf_after - mu1 * mu1;
+    const double var0 = before->sum_sq[i] / (double) nf_before - mu0 * mu0;
+    diff[i] = diff_of(mu1, mu0, pow(var1, vp_after), pow(var0, vp_before));
+  }
+}
+
+/* Two neighbouring differences of opposite sign suggest an edge that
+   has moved between them.  This is symmetric in its arguments. */
+static inline double fdetedge(double pix1, double pix2)
+{
+  const double e = -(pix1 * pix2);
+  return e > 0.0 ? e : 0.0;
+}
+
+/* The scratch space of 'sum_adjs' holds four planes, recording the
+   edge magnitude of each inner cell with its left, upper, upper-left
+   and lower-left neighbours.  Outer cells remain zero, and each
+   plane is padded with zeroes on both sides, so a cell can gather
+   from its neighbours' edges without testing whether they are
+   inner. */
+struct edges {
+  double *left, *up, *upleft, *downleft;
+};
+
+static size_t plane_size(unsigned width, unsigned height)
+{
+  return (size_t) width * height + 2 * width + 2;
+}
+
+static void get_edges(struct edges *e, unsigned width, unsigned height,
+                      double scratch[])
+{
+  const size_t sz = plane_size(width, height);
+  e->left = scratch + width + 1;
+  e->up = e->left + sz;
+  e->upleft = e->up + sz;
+  e->downleft = e->upleft + sz;
+}
+
+static void edges_range(size_t i, size_t end, unsigned width,
+                        const struct edges *e, const double diff[])
+{
+  for ( ; i < end; i++) {
+    e->left[i] = fdetedge(diff[i], diff[i - 1]) * 0.125;
+    e->up[i] = fdetedge(diff[i], diff[i - width]) * 0.125;
+    e->upleft[i] = fdetedge(diff[i], diff[i - width - 1]) * 0.125;
+    e->downleft[i] = fdetedge(diff[i], diff[i + width - 1]) * 0.125;
+  }
+}
+
+static void gather_range(size_t i, size_t end, unsigned width,
+                         const struct edges *e, double mx[], double my[])
+{
+  for ( ; i < end; i++) {
+    const double ul = ROOT2 * e->upleft[i];
+    const double dl = ROOT2 * e->downleft[i];
+    const double ulin = ROOT2 * e->upleft[i + width + 1];
+    const double dlin = ROOT2 * e->downleft[i - width + 1];
+    mx[i] = -e->left[i] - ul - dl + e->left[i + 1] + ulin + dlin;
+    my[i] = -e->up[i] - ul + dl + e->up[i + width] + ulin - dlin;
+  }
+}
+
+static void edges_scalar(size_t i, size_t end, unsigned width,
+                         const struct edges *e, const double diff[])
+{
+  edges_range(i, end, width, e, diff);
+}
+
+static void gather_scalar(size_t i, size_t end, unsigned width,
+                          const struct edges *e, double mx[], double my[])
+{
+  gather_range(i, end, width, e, mx, my);
+}
+
+
+
+#if KERNELS_X86
+
+/* SSE2 implementations */
+
+#ifdef __SSE2__
+#define HAVE_SSE2 1
+
+static void slide_sse2(size_t n,
+                       struct stats *before, struct stats *after,
+                       const unsigned char oldest[n],
+                       const unsigned char trans[n],
+                       const unsigned char newest[n])
+{
+  const __m128i z = _mm_setzero_si128();
+  size_t i = 0;
+  for ( ; i + 8 <= n; i += 8) {
+    /* Widen to 16 bits, where squares of bytes still fit. */
+    const __m128i o = _mm_unpacklo_epi8
+      (_mm_loadl_epi64((const __m128i *) (oldest + i)), z);
+    const __m128i t = _mm_unpacklo_epi8
+      (_mm_loadl_epi64((const __m128i *) (trans + i)), z);
+    const __m128i w = _mm_unpacklo_epi8
+      (_mm_loadl_epi64((const __m128i *) (newest + i)), z);
+    const __m128i o2 = _mm_mullo_epi16(o, o);
+    const __m128i t2 = _mm_mullo_epi16(t, t);
+    const __m128i w2 = _mm_mullo_epi16(w, w);
+
+    /* Widen to 32 bits, four cells at a time. */
+    for (unsigned h = 0; h < 8; h += 4) {
+#define WIDEN(V) (h ? _mm_unpackhi_epi16((V), z) : _mm_unpacklo_epi16((V), z))
+      const __m128i o32 = WIDEN(o), t32 = WIDEN(t), w32 = WIDEN(w);
+      const __m128i o232 = WIDEN(o2), t232 = WIDEN(t2), w232 = WIDEN(w2);
+#undef WIDEN
+      __m128i *const bs = (__m128i *) (before->sum + i + h);
+      __m128i *const as = (__m128i *) (after->sum + i + h);
+      _mm_storeu_si128(bs, _mm_add_epi32(_mm_loadu_si128(bs),
+                                         _mm_sub_epi32(t32, o32)));
+      _mm_storeu_si128(as, _mm_add_epi32(_mm_loadu_si128(as),
+                                         _mm_sub_epi32(w32, t32)));
+
+      /* Sign-extend the changes of squares to 64 bits, two cells at
+         a time. */
+      const __m128i bd = _mm_sub_epi32(t232, o232);
+      const __m128i ad = _mm_sub_epi32(w232, t232);
+      const __m128i bsign = _mm_srai_epi32(bd, 31);
+      const __m128i asign = _mm_srai_epi32(ad, 31);
+      for (unsigned q = 0; q < 4; q += 2) {
+        __m128i *const bq = (__m128i *) (before->sum_sq + i + h + q);
+        __m128i *const aq = (__m128i *) (after->sum_sq + i + h + q);
+        const __m128i bd64 = q ? _mm_unpackhi_epi32(bd, bsign) :
+          _mm_unpacklo_epi32(bd, bsign);
+        const __m128i ad64 = q ? _mm_unpackhi_epi32(ad, asign) :
+          _mm_unpacklo_epi32(ad, asign);
+        _mm_storeu_si128(bq, _mm_add_epi64(_mm_loadu_si128(bq), bd64));
+        _mm_storeu_si128(aq, _mm_add_epi64(_mm_loadu_si128(aq), ad64));
+      }
+    }
+  }
+  slide_range(i, n, before, after, oldest, trans, newest);
+}
+
+/* Convert two unsigned 64-bit integers, less than 2^52, to doubles,
+   by planting them in the mantissa of 2^52. */
+static inline __m128d cvt_u64_sse2(const uint64_t *p)
+{
+  const __m128i v = _mm_loadu_si128((const __m128i *) p);
+  const __m128d magic = _mm_set1_pd(4503599627370496.0);
+  return _mm_sub_pd(_mm_or_pd(_mm_castsi128_pd(v), magic), magic);
+}
+
+/* Convert the lower two unsigned 32-bit integers to doubles. */
+static inline __m128d cvt_u32_sse2(const unsigned *p)
+{
+  const __m128i v = _mm_loadl_epi64((const __m128i *) p);
+  const __m128i bias = _mm_set1_epi32((int) 0x80000000u);
+  return _mm_add_pd(_mm_cvtepi32_pd(_mm_xor_si128(v, bias)),
+                    _mm_set1_pd(2147483648.0));
+}
+
+static void diffs_sse2(size_t n, unsigned nf_after, unsigned nf_before,
+                       const struct stats *after,
+                       const struct stats *before,
+                       double diff[n])
+{
+  const __m128d na = _mm_set1_pd(nf_after), nb = _mm_set1_pd(nf_before);
+  const __m128d k = _mm_set1_pd(255.0), one = _mm_set1_pd(1.0);
+  size_t i = 0;
+  for ( ; i + 2 <= n; i += 2) {
+    const __m128d mu1 = _mm_div_pd(cvt_u32_sse2(after->sum + i), na);
+    const __m128d mu0 = _mm_div_pd(cvt_u32_sse2(before->sum + i), nb);
+    const __m128d sq1 = cvt_u64_sse2(after->sum_sq + i);
+    const __m128d sq0 = cvt_u64_sse2(before->sum_sq + i);
+    const __m128d var1 = _mm_sub_pd(_mm_div_pd(sq1, na), _mm_mul_pd(mu1, mu1));
+    const __m128d var0 = _mm_sub_pd(_mm_div_pd(sq0, nb), _mm_mul_pd(mu0, mu0));
+    const __m128d sig1 = _mm_sqrt_pd(var1), sig0 = _mm_sqrt_pd(var0);
+    const __m128d ratio =
+      _mm_div_pd(_mm_add_pd(_mm_div_pd(sig1, k), one),
+                 _mm_add_pd(_mm_div_pd(sig0, k), one));
+    _mm_storeu_pd(diff + i,
+                  _mm_mul_pd(_mm_div_pd(_mm_sub_pd(mu1, mu0), k), ratio));
+  }
+  diffs_range(i, n, nf_after, nf_before, after, before, diff);
+}
+
+static inline __m128d fdetedge_sse2(__m128d a, __m128d b)
+{
+  const __m128d sign = _mm_set1_pd(-0.0);
+  const __m128d e = _mm_xor_pd(_mm_mul_pd(a, b), sign);
+  return _mm_mul_pd(_mm_max_pd(e, _mm_setzero_pd()), _mm_set1_pd(0.125));
+}
+
+static void edges_sse2(size_t i, size_t end, unsigned width,
+                       const struct edges *e, const double diff[])
+{
+  for ( ; i + 2 <= end; i += 2) {
+    const __m128d d = _mm_loadu_pd(diff + i);
+    _mm_storeu_pd(e->left + i, fdetedge_sse2(d, _mm_loadu_pd(diff + i - 1)));
+    _mm_storeu_pd(e->up + i,
+                  fdetedge_sse2(d, _mm_loadu_pd(diff + i - width)));
+    _mm_storeu_pd(e->upleft + i,
+                  fdetedge_sse2(d, _mm_loadu_pd(diff + i - width - 1)));
+    _mm_storeu_pd(e->downleft + i,
+                  fdetedge_sse2(d, _mm_loadu_pd(diff + i + width - 1)));
+  }
+  edges_range(i, end, width, e, diff);
+}
+
+static void gather_sse2(size_t i, size_t end, unsigned width,
+                        const struct edges *e, double mx[], double my[])
+{
+  const __m128d r2 = _mm_set1_pd(ROOT2);
+  const __m128d sign = _mm_set1_pd(-0.0);
+  for ( ; i + 2 <= end; i += 2) {
+    const __m128d ul = _mm_mul_pd(r2, _mm_loadu_pd(e->upleft + i));
+    const __m128d dl = _mm_mul_pd(r2, _mm_loadu_pd(e->downleft + i));
+    const __m128d ulin =
+      _mm_mul_pd(r2, _mm_loadu_pd(e->upleft + i + width + 1));
+    const __m128d dlin =
+      _mm_mul_pd(r2, _mm_loadu_pd(e->downleft + i - width + 1));
+    __m128d x = _mm_xor_pd(_mm_loadu_pd(e->left + i), sign);
+    x = _mm_sub_pd(x, ul);
+    x = _mm_sub_pd(x, dl);
+    x = _mm_add_pd(x, _mm_loadu_pd(e->left + i + 1));
+    x = _mm_add_pd(x, ulin);
+    x = _mm_add_pd(x, dlin);
+    _mm_storeu_pd(mx + i, x);
+    __m128d y = _mm_xor_pd(_mm_loadu_pd(e->up + i), sign);
+    y = _mm_sub_pd(y, ul);
+    y = _mm_add_pd(y, dl);
+    y = _mm_add_pd(y, _mm_loadu_pd(e->up + i + width));
+    y = _mm_add_pd(y, ulin);
+    y = _mm_sub_pd(y, dlin);
+    _mm_storeu_pd(my + i, y);
+  }
+  gather_range(i, end, width, e, mx, my);
+}
+#endif
+
+
+
+/* AVX2 implementations */
+
+#define AVX2 __attribute__((target("avx2")))
+#define HAVE_AVX2 1
+
+AVX2 static void slide_avx2(size_t n,
+                            struct stats *before, struct stats *after,
+                            const unsigned char oldest[n],
+                            const unsigned char trans[n],
+                            const unsigned char newest[n])
+{
+  size_t i = 0;
+  for ( ; i + 8 <= n; i += 8) {
+    const __m256i o = _mm256_cvtepu8_epi32
+      (_mm_loadl_epi64((const __m128i *) (oldest + i)));
+    const __m256i t = _mm256_cvtepu8_epi32
+      (_mm_loadl_epi64((const __m128i *) (trans + i)));
+    const __m256i w = _mm256_cvtepu8_epi32
+      (_mm_loadl_epi64((const __m128i *) (newest + i)));
+    const __m256i o2 = _mm256_mullo_epi32(o, o);
+    const __m256i t2 = _mm256_mullo_epi32(t, t);
+    const __m256i w2 = _mm256_mullo_epi32(w, w);
+    __m256i *const bs = (__m256i *) (before->sum + i);
+    __m256i *const as = (__m256i *) (after->sum + i);
+    _mm256_storeu_si256(bs, _mm256_add_epi32(_mm256_loadu_si256(bs),
+                                             _mm256_sub_epi32(t, o)));
+    _mm256_storeu_si256(as, _mm256_add_epi32(_mm256_loadu_si256(as),
+                                             _mm256_sub_epi32(w, t)));
+
+    /* Sign-extend the changes of squares to 64 bits, four cells at a
+       time. */
+    const __m256i bd = _mm256_sub_epi32(t2, o2);
+    const __m256i ad = _mm256_sub_epi32(w2, t2);
+    for (unsigned h = 0; h < 8; h += 4) {
+      __m256i *const bq = (__m256i *) (before->sum_sq + i + h);
+      __m256i *const aq = (__m256i *) (after->sum_sq + i + h);
+      const __m256i bd64 = _mm256_cvtepi32_epi64
+        (h ? _mm256_extracti128_si256(bd, 1) : _mm256_castsi256_si128(bd));
+      const __m256i ad64 = _mm256_cvtepi32_epi64
+        (h ? _mm256_extracti128_si256(ad, 1) : _mm256_castsi256_si128(ad));
+      _mm256_storeu_si256(bq, _mm256_add_epi64(_mm256_loadu_si256(bq), bd64));
+      _mm256_storeu_si256(aq, _mm256_add_epi64(_mm256_loadu_si256(aq), ad64));
+    }
+  }
+  slide_range(i, n, before, after, oldest, trans, newest);
+}
+
+/* Convert four unsigned 64-bit integers, less than 2^52, to
+   doubles. */
+AVX2 static inline __m256d cvt_u64_avx2(const uint64_t *p)
+{
+  const __m256i v = _mm256_loadu_si256((const __m256i *) p);
+  const __m256d magic = _mm256_set1_pd(4503599627370496.0);
+  return _mm256_sub_pd(_mm256_or_pd(_mm256_castsi256_pd(v), magic), magic);
+}
+
+/* Convert four unsigned 32-bit integers to doubles. */
+AVX2 static inline __m256d cvt_u32_avx2(const unsigned *p)
+{
+  const __m128i v = _mm_loadu_si128((const __m128i *) p);
+  const __m128i bias = _mm_set1_epi32((int) 0x80000000u);
+  return _mm256_add_pd(_mm256_cvtepi32_pd(_mm_xor_si128(v, bias)),
+                       _mm256_set1_pd(2147483648.0));
+}
+
+AVX2 static void diffs_avx2(size_t n, unsigned nf_after, unsigned nf_before,
+                            const struct stats *after,
+                            const struct stats *before,
+                            double diff[n])
+{
+  const __m256d na = _mm256_set1_pd(nf_after);
+  const __m256d nb = _mm256_set1_pd(nf_before);
+  const __m256d k = _mm256_set1_pd(255.0), one = _mm256_set1_pd(1.0);
+  size_t i = 0;
+  for ( ; i + 4 <= n; i += 4) {
+    const __m256d mu1 = _mm256_div_pd(cvt_u32_avx2(after->sum + i), na);
+    const __m256d mu0 = _mm256_div_pd(cvt_u32_avx2(before->sum + i), nb);
+    const __m256d var1 =
+      _mm256_sub_pd(_mm256_div_pd(cvt_u64_avx2(after->sum_sq + i), na),
+                    _mm256_mul_pd(mu1, mu1));
+    const __m256d var0 =
+      _mm256_sub_pd(_mm256_div_pd(cvt_u64_avx2(before->sum_sq + i), nb),
+                    _mm256_mul_pd(mu0, mu0));
+    const __m256d sig1 = _mm256_sqrt_pd(var1), sig0 = _mm256_sqrt_pd(var0);
+    const __m256d ratio =
+      _mm256_div_pd(_mm256_add_pd(_mm256_div_pd(sig1, k), one),
+                    _mm256_add_pd(_mm256_div_pd(sig0, k), one));
+    _mm256_storeu_pd(diff + i,
+                     _mm256_mul_pd(_mm256_div_pd(_mm256_sub_pd(mu1, mu0), k),
+                                   ratio));
+  }
+  diffs_range(i, n, nf_after, nf_before, after, before, diff);
+}
+
+AVX2 static inline __m256d fdetedge_avx2(__m256d a, __m256d b)
+{
+  const __m256d sign = _mm256_set1_pd(-0.0);
+  const __m256d e = _mm256_xor_pd(_mm256_mul_pd(a, b), sign);
+  return _mm256_mul_pd(_mm256_max_pd(e, _mm256_setzero_pd()),
+                       _mm256_set1_pd(0.125));
+}
+
+AVX2 static void edges_avx2(size_t i, size_t end, unsigned width,
+                            const struct edges *e, const double diff[])
+{
+  for ( ; i + 4 <= end; i += 4) {
+    const __m256d d = _mm256_loadu_pd(diff + i);
+    _mm256_storeu_pd(e->left + i,
+                     fdetedge_avx2(d, _mm256_loadu_pd(diff + i - 1)));
+    _mm256_storeu_pd(e->up + i,
+                     fdetedge_avx2(d, _mm256_loadu_pd(diff + i - width)));
+    _mm256_storeu_pd(e->upleft + i,
+                     fdetedge_avx2(d, _mm256_loadu_pd(diff + i - width - 1)));
+    _mm256_storeu_pd(e->downleft + i,
+                     fdetedge_avx2(d, _mm256_loadu_pd(diff + i + width - 1)));
+  }
+  edges_range(i, end, width, e, diff);
+}
+
+AVX2 static void gather_avx2(size_t i, size_t end, unsigned width,
+                             const struct edges *e, double mx[], double my[])
+{
+  const __m256d r2 = _mm256_set1_pd(ROOT2);
+  const __m256d sign = _mm256_set1_pd(-0.0);
+  for ( ; i + 4 <= end; i += 4) {
+    const __m256d ul = _mm256_mul_pd(r2, _mm256_loadu_pd(e->upleft + i));
+    const __m256d dl = _mm256_mul_pd(r2, _mm256_loadu_pd(e->downleft + i));
+    const __m256d ulin =
+      _mm256_mul_pd(r2, _mm256_loadu_pd(e->upleft + i + width + 1));
+    const __m256d dlin =
+      _mm256_mul_pd(r2, _mm256_loadu_pd(e->downleft + i - width + 1));
+    __m256d x = _mm256_xor_pd(_mm256_loadu_pd(e->left + i), sign);
+    x = _mm256_sub_pd(x, ul);
+    x = _mm256_sub_pd(x, dl);
+    x = _mm256_add_pd(x, _mm256_loadu_pd(e->left + i + 1));
+    x = _mm256_add_pd(x, ulin);
+    x = _mm256_add_pd(x, dlin);
+    _mm256_storeu_pd(mx + i, x);
+    __m256d y = _mm256_xor_pd(_mm256_loadu_pd(e->up + i), sign);
+    y = _mm256_sub_pd(y, ul);
+    y = _mm256_add_pd(y, dl);
+    y = _mm256_add_pd(y, _mm256_loadu_pd(e->up + i + width));
+    y = _mm256_add_pd(y, ulin);
+    y = _mm256_sub_pd(y, dlin);
+    _mm256_storeu_pd(my + i, y);
+  }
+  gather_range(i, end, width, e, mx, my);
+}
+
+#endif
+
+
+
+struct impl {
+  const char *name;
+  int (*usable)(void);
+  void (*slide)(size_t n, struct stats *before, struct stats *after,
+                const unsigned char oldest[n],
+                const unsigned char trans[n],
+                const unsigned char newest[n]);
+  void (*diffs)(size_t n, unsigned nf_after, unsigned nf_before,
+                const struct stats *after, const struct stats *before,
+                double diff[n]);
+  void (*edges)(size_t i, size_t end, unsigned width,
+                const struct edges *e, const double diff[]);
+  void (*gather)(size_t i, size_t end, unsigned width,
+                 const struct edges *e, double mx[], double my[]);
+};
+
+static int always(void)
+{
+  return 1;
+}
+
+#if HAVE_AVX2
+static int has_avx2(void)
+{
+  __builtin_cpu_init();
+  return __builtin_cpu_supports("avx2");
+}
+#endif
+
+/* Implementations in order of preference */
+static const struct impl impls[] = {
+#if HAVE_AVX2
+  { "avx2", &has_avx2, &slide_avx2, &diffs_avx2, &edges_avx2, &gather_avx2 },
+#endif
+#if HAVE_SSE2
+  { "sse2", &always, &slide_sse2, &diffs_sse2, &edges_sse2, &gather_sse2 },
+#endif
+  { "scalar", &always,
+    &slide_scalar, &diffs_scalar, &edges_scalar, &gather_scalar },
+};
+
+#define NIMPLS (sizeof impls / sizeof impls[0])
+
+static const struct impl *chosen = &impls[NIMPLS - 1];
+
+int kernels_init(const char *name)
+{
+  for (size_t i = 0; i < NIMPLS; i++) {
+    if (name != NULL && strcmp(name, impls[i].name)) continue;
+    if (!(*impls[i].usable)()) continue;
+    chosen = &impls[i];
+    return 0;
+  }
+  return -1;
+}
+
+const char *kernels_name(void)
+{
+  return chosen->name;
+}
+
+void add_image(int scale, size_t n, struct stats *sum,
+               const unsigned char img[n])
+{
+  for (size_t i = 0; i < n; i++) {
+    const unsigned val = img[i];
+    sum->sum[i] += scale * (int) val;
+    sum->sum_sq[i] += scale * (int64_t) (val * val);
+  }
+}
+
+void slide_window(size_t n, struct stats *before, struct stats *after,
+                  const unsigned char oldest[n],
+                  const unsigned char trans[n],
+                  const unsigned char newest[n])
+{
+  (*chosen->slide)(n, before, after, oldest, trans, newest);
+}
+
+void compute_diffs(size_t n, unsigned nf_after, unsigned nf_before,
+                   double vp_after, double vp_before,
+                   const struct stats *after, const struct stats *before,
+                   double diff[n])
+{
+  if (vp_after == 0.5 && vp_before == 0.5)
+    (*chosen->diffs)(n, nf_after, nf_before, after, before, diff);
+  else
+    diffs_pow(n, nf_after, nf_before, vp_after, vp_before,
+              after, before, diff);
+}
+
+/* Fold one cell's value into its mean and variance. */
+static inline void ewma_cell(double alpha, double *mean, double *var,
+                             double x)
+{
+  const double delta = x - *mean;
+  *mean += alpha * delta;
+  *var = (1.0 - alpha) * (*var + alpha * delta * delta);
+}
+
+void ewma_image(size_t n, double alpha, struct ewstats *ew,
+                const unsigned char img[n])
+{
+  for (size_t i = 0; i < n; i++)
+    ewma_cell(alpha, &ew->mean[i], &ew->var[i], img[i]);
+}
+
+void slide_ewma(size_t n, double alpha,
+                struct ewstats *before, struct stats *after,
+                const unsigned char oldest[n],
+                const unsigned char newest[n])
+{
+  for (size_t i = 0; i < n; i++) {
+    const unsigned o = oldest[i], w = newest[i];
+    ewma_cell(alpha, &before->mean[i], &before->var[i], o);
+    after->sum[i] += w - o;
+    after->sum_sq[i] += (int64_t) (w * w) - (int64_t) (o * o);
+  }
+}
+
+void compute_diffs_ewma(size_t n, unsigned nf_after,
+                        double vp_after, double vp_before,
+                        const struct stats *after,
+                        const struct ewstats *before,
+                        double diff[n])
+{
+  const bool fast = vp_after == 0.5 && vp_before == 0.5;
+  for (size_t i = 0; i < n; i++) {
+    const double mu1 = after->sum[i] / (double) nf_after;
+    const double mu0 = before->mean[i];
+    const double var1 = after->sum_sq[i] / (double) nf_after - mu1 * mu1;
+    const double var0 = before->var[i];
+    diff[i] = fast ? diff_of(mu1, mu0, sqrt(var1), sqrt(var0)) :
+      diff_of(mu1, mu0, pow(var1, vp_after), pow(var0, vp_before));
+  }
+}
+
+size_t adj_scratch(unsigned width, unsigned height)
+{
+  return 4 * plane_size(width, height);
+}
+
+void adj_edges(unsigned width, unsigned height, unsigned y0, unsigned y1,
+               const double diff[], double scratch[])
+{
+  struct edges e;
+  get_edges(&e, width, height, scratch);
+
+  /* Only inner cells have edges. */
+  if (y0 < 1) y0 = 1;
+  if (y1 > height - 1) y1 = height - 1;
+  for (unsigned y = y0; y < y1; y++) {
+    const size_t row = (size_t) y * width;
+    (*chosen->edges)(row + 1, row + width - 1, width, &e, diff);
+  }
+}
+
+void adj_gather(unsigned width, unsigned height, unsigned y0, unsigned y1,
+                double mx[], double my[], double scratch[])
+{
+  struct edges e;
+  get_edges(&e, width, height, scratch);
+  (*chosen->gather)((size_t) y0 * width, (size_t) y1 * width,
+                    width, &e, mx, my);
+}
+
+void adj_edges_range(unsigned width, unsigned height, size_t i, size_t end,
+                     const double diff[], double scratch[])
+{
+  struct edges e;
+  get_edges(&e, width, height, scratch);
+  (*chosen->edges)(i, end, width, &e, diff);
+}
+
+void adj_gather_range(unsigned width, unsigned height, size_t i, size_t end,
+                      double mx[], double my[], double scratch[])
+{
+  struct edges e;
+  get_edges(&e, width, height, scratch);
+  (*chosen->gather)(i, end, width, &e, mx, my);
+}
+
+void sum_adjs(unsigned width, unsigned height,
+              double mx[], double my[], const double diff[],
+              double scratch[])
+{
+  adj_edges(width, height, 0, height, diff, scratch);
+  adj_gather(width, height, 0, height, mx, my, scratch);
+}
@@ -0,0 +1,152 @@
+// -*- c-basic-offset: 2; indent-tabs-mode: nil -*-
+
+/*
+ * Copyright 2018-19, Lancaster University
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ * 
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the
+ *    distribution.
+ * 
+ *  * Neither the name of the copyright holder nor the names of
+ *    its contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ *
+ * Author: Steven Simpson <https://github.com/simpsonst>
+ */
+
+#ifndef KERNELS_H
+#define KERNELS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* The per-cell arithmetic of motion detection.  All planes are
+   stored row by row.  Each kernel has a scalar implementation, and
+   SSE2 and AVX2 ones where the processor supports them; the best
+   is chosen at run time. */
+
+/* The sums of a set of frames for each cell, and the sums of their
+   squares, as separate planes - The squares are summed in 64 bits,
+   as 32 would overflow after 66051 frames. */
+struct stats {
+  unsigned *sum;
+  uint64_t *sum_sq;
+};
+
+/* The exponentially weighted mean and variance of each cell, as
+   separate planes */
+struct ewstats {
+  double *mean;
+  double *var;
+};
+
+/* Choose the best implementation available.  If 'name' is not NULL,
+   choose that one instead ("scalar", "sse2" or "avx2").  Return 0
+   on success, or -1 if the named one is not available. */
+int kernels_init(const char *name);
+
+/* Get the name of the chosen implementation. */
+const char *kernels_name(void);
+
+/* Add each pixel of 'img' to 'sum', or subtract it if 'scale' is
+   negative. */
+void add_image(int scale, size_t n, struct stats *sum,
+               const unsigned char img[n]);
+
+/* Slide the window of frames by one: remove 'oldest' from 'before',
+   move 'trans' from 'after' to 'before', and add 'newest' to
+   'after', in one pass. */
+void slide_window(size_t n, struct stats *before, struct stats *after,
+                  const unsigned char oldest[n],
+                  const unsigned char trans[n],
+                  const unsigned char newest[n]);
+
+/* Compute the difference per pixel between two sets of images,
+   'after' (the most recent 'nf_after' frames) and 'before' (the
+   prior 'nf_before' frames).  The difference is diminished by high
+   stddev in the prior frames, but amplified by high stddev in the
+   most recent frames.  'vp_after' is the power used to convert
+   variance to stddev for the most recent frames, and 'vp_before'
+   likewise for prior frames.  These should be 0.5 for the normal
+   meaning of stddev as standard deviation, which is the fast
+   case. */
+void compute_diffs(size_t n, unsigned nf_after, unsigned nf_before,
+                   double vp_after, double vp_before,
+                   const struct stats *after, const struct stats *before,
+                   double diff[n]);
+
+/* Fold 'img' into 'ew' with weight 'alpha' (1 for the first
+   frame).  The EWMA kernels are scalar only. */
+void ewma_image(size_t n, double alpha, struct ewstats *ew,
+                const unsigned char img[n]);
+
+/* Slide the window of frames by one when the prior frames are
+   modelled by an EWMA: fold 'oldest' into 'before', and replace it
+   with 'newest' in 'after', in one pass. */
+void slide_ewma(size_t n, double alpha,
+                struct ewstats *before, struct stats *after,
+                const unsigned char oldest[n],
+                const unsigned char newest[n]);
+
+/* As 'compute_diffs', but with the prior frames modelled by an
+   EWMA. */
+void compute_diffs_ewma(size_t n, unsigned nf_after,
+                        double vp_after, double vp_before,
+                        const struct stats *after,
+                        const struct ewstats *before,
+                        double diff[n]);
+
+/* Get the number of elements of scratch space needed by 'sum_adjs'.
+   The space must be zeroed before first use, and then left alone
+   between calls. */
+size_t adj_scratch(unsigned width, unsigned height);
+
+/* Compute motion vectors 'mx' and 'my' for each cell, from the
+   differences between each inner cell of 'diff' and its
+   neighbours. */
+void sum_adjs(unsigned width, unsigned height,
+              double mx[], double my[], const double diff[],
+              double scratch[]);
+
+/* Perform the two passes of 'sum_adjs' separately on rows 'y0' to
+   'y1 - 1', so that bands of rows can be shared between threads.
+   'adj_edges' reads the rows of 'diff' either side of the band as
+   well.  'adj_gather' reads the edges of the rows either side, so
+   'adj_edges' must have completed on all three before it is
+   called. */
+void adj_edges(unsigned width, unsigned height, unsigned y0, unsigned y1,
+               const double diff[], double scratch[]);
+void adj_gather(unsigned width, unsigned height, unsigned y0, unsigned y1,
+                double mx[], double my[], double scratch[]);
+
+/* As 'adj_edges' and 'adj_gather', but only on the cells 'i' to
+   'end - 1' of one row, so that sparse sets of cells can be
+   processed.  'adj_edges_range' must only be given inner cells. */
+void adj_edges_range(unsigned width, unsigned height, size_t i, size_t end,
+                     const double diff[], double scratch[]);
+void adj_gather_range(unsigned width, unsigned height, size_t i, size_t end,
+                      double mx[], double my[], double scratch[]);
+
+#endif
@@ -0,0 +1,294 @@
+// -*- c-basic-offset: 2; indent-tabs-mode: nil -*-
+
+/*
+ * Copyright 2018-19, Lancaster University
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ * 
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the
+ *    distribution.
+ * 
+ *  * Neither the name of the copyright holder nor the names of
+ *    its contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ *
+ * Author: Steven Simpson <https://github.com/simpsonst>
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+
+#include "mask.h"
+
+/* Read the next number of a PGM header from 'in', skipping
+   whitespace and comments, and recording zone names found in
+   comments.  Return 0 on success; -1 on error. */
+static int header_number(FILE *in, unsigned *val, char *names[256])
+{
+  int c;
+  for ( ; ; ) {
+    c = getc(in);
+    if (c == '#') {
+      char line[256];
+      if (fgets(line, sizeof line, in) == NULL) return -1;
+      unsigned zv;
+      char name[64];
+      if (sscanf(line, " zone %u %63s", &zv, name) == 2 &&
+          zv > 0 && zv < 256) {
+        free(names[zv]);
+        if ((names[zv] = strdup(name)) == NULL) return -1;
+      }
+      continue;
+    }
+    if (c == EOF) return -1;
+    if (!isspace(c)) break;
+  }
+  if (!isdigit(c)) return -1;
+  ungetc(c, in);
+  return fscanf(in, "%u", val) == 1 ? 0 : -1;
+}
+
+/* Gather the marked cells of each row into runs. */
+static int make_spans(struct spans *sp, unsigned width, unsigned height,
+                      const bool mark[])
+{
+  size_t nruns = 0;
+  for (size_t i = 0; i < (size_t) width * height; i++)
+    if (mark[i] && (i % width == 0 || !mark[i - 1]))
+      nruns++;
+  sp->runs = malloc((nruns ? nruns : 1) * sizeof *sp->runs);
+  sp->row = malloc(((size_t) height + 1) * sizeof *sp->row);
+  if (sp->runs == NULL || sp->row == NULL) return -1;
+
+  size_t r = 0;
+  for (unsigned y = 0; y < height; y++) {
+    sp->row[y] = r;
+    const size_t base = (size_t) y * width;
+    for (unsigned x = 0; x < width; ) {
+      if (!mark[base + x]) {
+        x++;
+        continue;
+      }
+      sp->runs[r].start = base + x;
+      while (x < width && mark[base + x])
+        x++;
+      sp->runs[r++].end = base + x;
+    }
+  }
+  sp->row[height] = r;
+  return 0;
+}
+
+/* Mark the cell at offset 'off' from 'i', if it exists, and, if
+   'inner', is not on the border. */
+static void mark_at(bool mark[], unsigned width, unsigned height,
+                    size_t i, long off, bool inner)
+{
+  const long j = (long) i + off;
+  if (j < 0 || j >= (long) width * height) return;
+  const unsigned x = j % width, y = j / width;
+  if (inner && (x < 1 || x + 1 >= width || y < 1 || y + 1 >= height))
+    return;
+  mark[j] = true;
+}
+
+/* Work out which cells have to be processed to score the active
+   ones, and list the active ones. */
+static int derive(struct cellmask *m, const unsigned char *pix,
+                  const unsigned char zidx[256])
+{
+  const unsigned width = m->width, height = m->height;
+  const size_t cells = (size_t) width * height;
+  const long w = width;
+  bool *mark = calloc(3 * cells, sizeof *mark);
+  if (mark == NULL) return -1;
+  bool *const motion = mark, *const edges = mark + cells;
+  bool *const diffs = mark + 2 * cells;
+
+  /* Only inner rows are scored, each cell against the previous
+     vectors of the cells above, left, and diagonally left. */
+  size_t nactive = 0;
+  for (unsigned y = 1; y + 1 < height; y++)
+    for (unsigned x = 1; x < width; x++) {
+      const size_t i = (size_t) y * width + x;
+      if (pix[i] == 0) continue;
+      nactive++;
+      motion[i] = true;
+      mark_at(motion, width, height, i, -w, false);
+      mark_at(motion, width, height, i, -w - 1, false);
+      mark_at(motion, width, height, i, -1, false);
+      mark_at(motion, width, height, i, w - 1, false);
+    }
+
+  /* A vector is gathered from the edges of the cell, and of the
+     cells right, below, and diagonally right.  Only inner cells have
+     edges. */
+  for (size_t i = 0; i < cells; i++) {
+    if (!motion[i]) continue;
+    mark_at(edges, width, height, i, 0, true);
+    mark_at(edges, width, height, i, 1, true);
+    mark_at(edges, width, height, i, w, true);
+    mark_at(edges, width, height, i, w + 1, true);
+    mark_at(edges, width, height, i, -w + 1, true);
+  }
+
+  /* An edge compares the cell's difference with those left, above,
+     and diagonally left. */
+  for (size_t i = 0; i < cells; i++) {
+    if (!edges[i]) continue;
+    mark_at(diffs, width, height, i, 0, false);
+    mark_at(diffs, width, height, i, -1, false);
+    mark_at(diffs, width, height, i, -w, false);
+    mark_at(diffs, width, height, i, -w - 1, false);
+    mark_at(diffs, width, height, i, w - 1, false);
+  }
+
+  int rc = -1;
+  if (make_spans(&m->motion, width, height, motion) < 0 ||
+      make_spans(&m->edges, width, height, edges) < 0 ||
+      make_spans(&m->diffs, width, height, diffs) < 0)
+    goto done;
+
+  m->cells = malloc((nactive ? nactive : 1) * sizeof *m->cells);
+  m->zone = malloc(nactive ? nactive : 1);
+  m->row = malloc(((size_t) height + 1) * sizeof *m->row);
+  if (m->cells == NULL || m->zone == NULL || m->row == NULL)
+    goto done;
+  size_t n = 0;
+  for (unsigned y = 0; y < height; y++) {
+    m->row[y] = n;
+    if (y < 1 || y + 1 >= height) continue;
+    for (unsigned x = 1; x < width; x++) {
+      const size_t i = (size_t) y * width + x;
+      if (pix[i] == 0) continue;
+      m->cells[n] = i;
+      m->zone[n] = zidx[pix[i]];
+      m->count[m->zone[n]]++;
+      n++;
+    }
+  }
+  m->row[height] = n;
+  rc = 0;
+
+ done:
+  free(mark);
+  return rc;
+}
+
+int cellmask_load(struct cellmask *m, const char *path,
+                  unsigned width, unsigned height)
+{
+  *m = (struct cellmask) { .width = width, .height = height };
+  char *names[256] = { NULL };
+  unsigned char *pix = NULL;
+  int rc = -1;
+
+  FILE *in = fopen(path, "rb");
+  if (in == NULL) return -1;
+
+  /* Read the header, and check it fits the grid. */
+  unsigned pw, ph, maxval;
+  if (getc(in) != 'P' || getc(in) != '5' ||
+      header_number(in, &pw, names) < 0 ||
+      header_number(in, &ph, names) < 0 ||
+      header_number(in, &maxval, names) < 0 ||
+      !isspace(getc(in)) ||
+      pw != width || ph != height || maxval == 0 || maxval > 255) {
+    errno = ferror(in) ? EIO : EINVAL;
+    goto done;
+  }
+
+  const size_t cells = (size_t) width * height;
+  pix = malloc(cells);
+  if (pix == NULL) goto done;
+  if (fread(pix, 1, cells, in) != cells) {
+    errno = ferror(in) ? EIO : EINVAL;
+    goto done;
+  }
+
+  /* FNV-1a */
+  m->digest = UINT64_C(14695981039346656037);
+  for (size_t i = 0; i < cells; i++)
+    m->digest = (m->digest ^ pix[i]) * UINT64_C(1099511628211);
+
+  /* Number the zones in order of their values. */
+  bool present[256] = { false };
+  for (size_t i = 0; i < cells; i++)
+    present[pix[i]] = true;
+  unsigned char zidx[256] = { 0 };
+  for (unsigned v = 1; v < 256; v++)
+    if (present[v])
+      zidx[v] = m->zones++;
+  m->names = calloc(m->zones ? m->zones : 1, sizeof *m->names);
+  m->count = calloc(m->zones ? m->zones : 1, sizeof *m->count);
+  if (m->names == NULL || m->count == NULL) goto done;
+  for (unsigned v = 1; v < 256; v++) {
+    if (!present[v]) continue;
+    char **name = &m->names[zidx[v]];
+    if (names[v] != NULL) {
+      *name = names[v];
+      names[v] = NULL;
+    } else {
+      char num[4];
+      snprintf(num, sizeof num, "%u", v);
+      if ((*name = strdup(num)) == NULL) goto done;
+    }
+  }
+
+  rc = derive(m, pix, zidx);
+
+ done:
+  fclose(in);
+  free(pix);
+  for (unsigned v = 0; v < 256; v++)
+    free(names[v]);
+  if (rc < 0) {
+    const int saved = errno;
+    cellmask_free(m);
+    errno = saved;
+  }
+  return rc;
+}
+
+void cellmask_free(struct cellmask *m)
+{
+  for (unsigned z = 0; m->names != NULL && z < m->zones; z++)
+    free(m->names[z]);
+  free(m->names);
+  free(m->count);
+  free(m->diffs.runs);
+  free(m->diffs.row);
+  free(m->edges.runs);
+  free(m->edges.row);
+  free(m->motion.runs);
+  free(m->motion.row);
+  free(m->cells);
+  free(m->row);
+  free(m->zone);
+  *m = (struct cellmask) { .names = NULL };
+}
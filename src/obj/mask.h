@@ -0,0 +1,102 @@
+// -*- c-basic-offset: 2; indent-tabs-mode: nil -*-
+
+/*
+ * Copyright 2018-19, Lancaster University
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ * 
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the
+ *    distribution.
+ * 
+ *  * Neither the name of the copyright holder nor the names of
+ *    its contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ *
+ * Author: Steven Simpson <https://github.com/simpsonst>
+ */
+
+#ifndef MASK_H
+#define MASK_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* A run of cells 'start' to 'end - 1' within one row */
+struct span {
+  size_t start, end;
+};
+
+/* Runs of cells, grouped by row, so that bands of rows can be
+   shared between threads */
+struct spans {
+  /* the runs of all rows */
+  struct span *runs;
+
+  /* Row 'y' has the runs from 'row[y]' to 'row[y + 1] - 1'. */
+  size_t *row;
+};
+
+/* The cells of a detection grid that contribute to its score, and
+   those that must be kept up to date to score them, derived from a
+   PGM of the same size as the grid.  A cell is active if its pixel
+   is not zero, and cells with the same value form a zone.  A comment
+   '# zone <value> <name>' in the PGM's header names a zone; others
+   are named by their values. */
+struct cellmask {
+  unsigned width, height;
+
+  /* a hash of the mask's cells, to tell whether state derived
+     with another mask is still valid */
+  uint64_t digest;
+
+  /* the names of the zones, in increasing order of their values,
+     and how many active cells each has */
+  unsigned zones;
+  char **names;
+  size_t *count;
+
+  /* the cells whose sums and differences are maintained */
+  struct spans diffs;
+
+  /* the cells whose edges are computed */
+  struct spans edges;
+
+  /* the cells whose motion vectors are computed */
+  struct spans motion;
+
+  /* the active cells that can be scored, and their zones - Row 'y'
+     has those from 'row[y]' to 'row[y + 1] - 1'. */
+  size_t *cells, *row;
+  unsigned char *zone;
+};
+
+/* Load a mask for a 'width'x'height' grid from the binary PGM at
+   'path'.  Return 0 on success; -1 on error, with errno set
+   (EINVAL if the file is not a PGM of the right size). */
+int cellmask_load(struct cellmask *, const char *path,
+                  unsigned width, unsigned height);
+
+void cellmask_free(struct cellmask *);
+
+#endif
@@ -0,0 +1,442 @@
+// -*- c-basic-offset: 2; indent-tabs-mode: nil -*-
+
+/*
+ * Copyright 2018-19, Lancaster University
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ * 
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the
+ *    distribution.
+ * 
+ *  * Neither the name of the copyright holder nor the names of
+ *    its contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ *
+ * Author: Steven Simpson <https://github.com/simpsonst>
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <inttypes.h>
+
+#include <unistd.h>
+
+#include "overlay.h"
+#include "ring.h"
+
+/* Read lines of the form '<duration> <file>[<tab><label>]', where
+   the duration is in milliseconds and the file is a JPEG, and write
+   the frames to standard output as an MJPEG Matroska stream,
+   suitable for piping into FFmpeg.  Each frame is written as it
+   arrives (well, one frame behind, so that the durations of missing
+   frames can be credited to their predecessors), so a recording can
+   be encoded while it is still being made.  With -a, each frame's
+   label is stamped onto it using a glyph atlas.  With -m, a file of
+   the form '@<ms>' is instead the frame with that timestamp in a
+   shared-memory ring, so that recorded frames needn't be written out
+   first. */
+
+/* A frame waiting to be written */
+struct frame {
+  unsigned char *data;
+  size_t len, cap;
+  unsigned long long dur;
+};
+
+static void put_bytes(FILE *out, unsigned long long v, int n)
+{
+  while (n-- > 0)
+    putc((v >> (n * 8)) & 0xff, out);
+}
+
+static int uint_len(unsigned long long v)
+{
+  int n = 1;
+  while (n < 8 && (v >> (n * 8)) != 0)
+    n++;
+  return n;
+}
+
+/* Write an element ID, whose length is implied by its leading
+   bits. */
+static void put_id(FILE *out, unsigned long id)
+{
+  put_bytes(out, id, uint_len(id));
+}
+
+/* Write an element size, always in 8 bytes, so that it needn't be
+   known before choosing the length. */
+static void put_size(FILE *out, unsigned long long n)
+{
+  put_bytes(out, 0x0100000000000000ULL | n, 8);
+}
+
+static void put_uint(FILE *out, unsigned long id, unsigned long long v)
+{
+  const int n = uint_len(v);
+  put_id(out, id);
+  putc(0x80 | n, out);
+  put_bytes(out, v, n);
+}
+
+static void put_str(FILE *out, unsigned long id, const char *s)
+{
+  const size_t n = strlen(s);
+  put_id(out, id);
+  putc(0x80 | n, out);
+  fwrite(s, 1, n, out);
+}
+
+/* Write a master element whose content has been built in memory. */
+static void put_master(FILE *out, unsigned long id,
+                       const char *buf, size_t len)
+{
+  put_id(out, id);
+  put_size(out, len);
+  fwrite(buf, 1, len, out);
+}
+
+/* Find the dimensions of a JPEG from its start-of-frame marker. */
+static bool jpeg_dims(const unsigned char *p, size_t len,
+                      unsigned *width, unsigned *height)
+{
+  size_t i = 2;
+  while (i + 9 <= len) {
+    if (p[i] != 0xff) return false;
+    const unsigned m = p[i + 1];
+    if (m >= 0xc0 && m <= 0xcf && m != 0xc4 && m != 0xc8 && m != 0xcc) {
+      *height = p[i + 5] << 8 | p[i + 6];
+      *width = p[i + 7] << 8 | p[i + 8];
+      return true;
+    }
+    i += 2 + (p[i + 2] << 8 | p[i + 3]);
+  }
+  return false;
+}
+
+static bool load(struct frame *f, const char *name)
+{
+  FILE *in = fopen(name, "rb");
+  if (in == NULL) return false;
+  f->len = 0;
+  size_t got;
+  do {
+    if (f->len == f->cap) {
+      const size_t ncap = f->cap ? f->cap * 2 : 64 * 1024;
+      unsigned char *nd = realloc(f->data, ncap);
+      if (nd == NULL) {
+        fclose(in);
+        return false;
+      }
+      f->data = nd;
+      f->cap = ncap;
+    }
+    got = fread(f->data + f->len, 1, f->cap - f->len, in);
+    f->len += got;
+  } while (got > 0);
+  const bool ok = !ferror(in) && f->len >= 4 &&
+    f->data[0] == 0xff && f->data[1] == 0xd8;
+  fclose(in);
+  return ok;
+}
+
+static long long stamp_ms(const struct timespec *ts)
+{
+  return ts->tv_sec * 1000LL + ts->tv_nsec / 1000000;
+}
+
+/* Fetch the frame with timestamp 't' from the ring.  Frames are
+   requested in order, so the search starts from '*hint', the
+   sequence number after the last one found. */
+static bool load_ring(struct frame *f, struct ring *ring, uint64_t *hint,
+                      long long t)
+{
+  struct ring_frame fr;
+  uint64_t seq = *hint;
+  if (ring_peek(ring, seq, &fr) != RING_OK || stamp_ms(&fr.stamp) > t) {
+    /* Work back from the newest frame instead. */
+    seq = ring_head(ring);
+    while (seq > 0 && ring_peek(ring, seq - 1, &fr) == RING_OK &&
+           stamp_ms(&fr.stamp) >= t)
+      seq--;
+  }
+  while (ring_peek(ring, seq, &fr) == RING_OK && stamp_ms(&fr.stamp) < t)
+    seq++;
+  if (ring_peek(ring, seq, &fr) != RING_OK || stamp_ms(&fr.stamp) != t)
+    return false;
+
+  if (f->cap < fr.len) {
+    const size_t ncap = ring_maxframe(ring);
+    unsigned char *nd = realloc(f->data, ncap);
+    if (nd == NULL) return false;
+    f->data = nd;
+    f->cap = ncap;
+  }
+  if (ring_fetch(ring, seq, f->data, f->cap, &fr) != RING_OK)
+    return false;
+  f->len = fr.len;
+  *hint = seq + 1;
+  return true;
+}
+
+static void write_header(FILE *out, unsigned width, unsigned height)
+{
+  char *buf = NULL;
+  size_t len = 0;
+  FILE *mem;
+
+  /* EBML */
+  mem = open_memstream(&buf, &len);
+  put_uint(mem, 0x4286, 1); /* EBMLVersion */
+  put_uint(mem, 0x42f7, 1); /* EBMLReadVersion */
+  put_uint(mem, 0x42f2, 4); /* EBMLMaxIDLength */
+  put_uint(mem, 0x42f3, 8); /* EBMLMaxSizeLength */
+  put_str(mem, 0x4282, "matroska"); /* DocType */
+  put_uint(mem, 0x4287, 4); /* DocTypeVersion */
+  put_uint(mem, 0x4285, 2); /* DocTypeReadVersion */
+  fclose(mem);
+  put_master(out, 0x1a45dfa3, buf, len);
+  free(buf);
+
+  /* Segment, of unknown size */
+  put_id(out, 0x18538067);
+  put_bytes(out, 0x01ffffffffffffffULL, 8);
+
+  /* Info, with millisecond timestamps */
+  mem = open_memstream(&buf, &len);
+  put_uint(mem, 0x2ad7b1, 1000000); /* TimestampScale */
+  put_str(mem, 0x4d80, "stecam"); /* MuxingApp */
+  put_str(mem, 0x5741, "stecam"); /* WritingApp */
+  fclose(mem);
+  put_master(out, 0x1549a966, buf, len);
+  free(buf);
+
+  /* Tracks */
+  char *vbuf = NULL;
+  size_t vlen = 0;
+  mem = open_memstream(&vbuf, &vlen);
+  put_uint(mem, 0xb0, width); /* PixelWidth */
+  put_uint(mem, 0xba, height); /* PixelHeight */
+  fclose(mem);
+  char *tbuf = NULL;
+  size_t tlen = 0;
+  mem = open_memstream(&tbuf, &tlen);
+  put_uint(mem, 0xd7, 1); /* TrackNumber */
+  put_uint(mem, 0x73c5, 1); /* TrackUID */
+  put_uint(mem, 0x83, 1); /* TrackType: video */
+  put_uint(mem, 0x9c, 0); /* FlagLacing */
+  put_str(mem, 0x86, "V_MJPEG"); /* CodecID */
+  put_master(mem, 0xe0, vbuf, vlen); /* Video */
+  fclose(mem);
+  free(vbuf);
+  mem = open_memstream(&buf, &len);
+  put_master(mem, 0xae, tbuf, tlen); /* TrackEntry */
+  fclose(mem);
+  free(tbuf);
+  put_master(out, 0x1654ae6b, buf, len);
+  free(buf);
+}
+
+/* Write a frame as a cluster of its own, so that nothing has to be
+   buffered beyond the frame itself. */
+static void write_frame(FILE *out, const struct frame *f,
+                        unsigned long long ts)
+{
+  const int tslen = uint_len(ts), durlen = uint_len(f->dur);
+  const size_t blen = 4 + f->len;
+  const size_t glen = 1 + 8 + blen + 1 + 1 + durlen;
+  put_id(out, 0x1f43b675); /* Cluster */
+  put_size(out, 1 + 1 + tslen + 1 + 8 + glen);
+  put_uint(out, 0xe7, ts); /* Timestamp */
+  put_id(out, 0xa0); /* BlockGroup */
+  put_size(out, glen);
+  put_id(out, 0xa1); /* Block */
+  put_size(out, blen);
+  putc(0x81, out); /* track 1 */
+  put_bytes(out, 0, 2); /* relative timestamp */
+  putc(0x00, out); /* flags */
+  fwrite(f->data, 1, f->len, out);
+  put_uint(out, 0x9b, f->dur); /* BlockDuration */
+}
+
+int main(int argc, const char *const *argv)
+{
+  bool unlinking = false;
+  const char *atlas_path = NULL;
+  const char *ring_path = NULL;
+  const char *chars = "0123456789-+.:Tefina";
+  int gravity = 0;
+
+  bool show_help = false, fail = false;
+  for (int argi = 1; argi < argc; argi++) {
+    if (!strcmp(argv[argi], "-u")) {
+      unlinking = true;
+    } else if (!strcmp(argv[argi], "+u")) {
+      unlinking = false;
+    } else if (!strcmp(argv[argi], "-a")) {
+      if (++argi == argc) {
+        show_help = true;
+        fail = true;
+        break;
+      }
+      atlas_path = argv[argi];
+    } else if (!strcmp(argv[argi], "-m")) {
+      if (++argi == argc) {
+        show_help = true;
+        fail = true;
+        break;
+      }
+      ring_path = argv[argi];
+    } else if (!strcmp(argv[argi], "-c")) {
+      if (++argi == argc) {
+        show_help = true;
+        fail = true;
+        break;
+      }
+      chars = argv[argi];
+    } else if (!strcmp(argv[argi], "-g")) {
+      if (++argi == argc) {
+        show_help = true;
+        fail = true;
+        break;
+      }
+      gravity = overlay_gravity(argv[argi]);
+      if (gravity < 0) {
+        fprintf(stderr, "%s: unknown gravity: %s\n", argv[0], argv[argi]);
+        exit(EXIT_FAILURE);
+      }
+    } else if (!strcmp(argv[argi], "-h")) {
+      show_help = true;
+    } else if (argv[argi][0] == '-' || argv[argi][0] == '+') {
+      fprintf(stderr, "%s: unknown switch: %s\n", argv[0], argv[argi]);
+      exit(EXIT_FAILURE);
+    } else {
+      fprintf(stderr, "%s: unknown argument: %s\n", argv[0], argv[argi]);
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  if (show_help) {
+    fprintf(stderr,
+            "Usage: %s [-u|+u] [-m ring]\n"
+            "\t[-a atlas.pgm [-c chars] [-g gravity]]\n"
+            "\t< frames > out.mkv\n", argv[0]);
+    exit(fail ? EXIT_FAILURE : EXIT_SUCCESS);
+  }
+
+  struct atlas *atlas = NULL;
+  if (atlas_path != NULL) {
+    atlas = atlas_load(atlas_path, chars);
+    if (atlas == NULL) {
+      fprintf(stderr, "%s: %s: loading %s\n",
+              argv[0], strerror(errno), atlas_path);
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  struct ring *ring = NULL;
+  uint64_t hint = 0;
+  if (ring_path != NULL) {
+    ring = ring_open(ring_path);
+    if (ring == NULL) {
+      fprintf(stderr, "%s: %s: opening %s\n",
+              argv[0], strerror(errno), ring_path);
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  /* The frame waiting to be written, and the one being read */
+  struct frame fr[2] = { { .data = NULL } };
+  struct frame *pending = NULL, *next = &fr[0];
+  unsigned long long ts = 0;
+
+  char *line = NULL;
+  size_t linecap = 0;
+  while (getline(&line, &linecap, stdin) >= 0) {
+    char *file;
+    unsigned long long dur = strtoull(line, &file, 10);
+    while (*file == ' ') file++;
+    file[strcspn(file, "\n")] = '\0';
+    char *label = strchr(file, '\t');
+    if (label != NULL) *label++ = '\0';
+    if (*file == '\0') continue;
+
+    if (ring != NULL && file[0] == '@' ?
+        !load_ring(next, ring, &hint, strtoll(file + 1, NULL, 10)) :
+        !load(next, file)) {
+      /* Let the previous frame cover this one's time. */
+      if (pending != NULL)
+        pending->dur += dur;
+      continue;
+    }
+    if (unlinking && file[0] != '@')
+      unlink(file);
+    next->dur = dur;
+
+    if (atlas != NULL && label != NULL) {
+      unsigned char *stamped;
+      unsigned long slen;
+      if (overlay_jpeg(atlas, gravity, label, next->data, next->len,
+                       &stamped, &slen) == 0) {
+        free(next->data);
+        next->data = stamped;
+        next->len = next->cap = slen;
+      } else {
+        fprintf(stderr, "%s: unable to label %s\n", argv[0], file);
+      }
+    }
+
+    if (pending == NULL) {
+      unsigned width, height;
+      if (!jpeg_dims(next->data, next->len, &width, &height)) {
+        fprintf(stderr, "%s: no dimensions in %s\n", argv[0], file);
+        continue;
+      }
+      write_header(stdout, width, height);
+    } else {
+      write_frame(stdout, pending, ts);
+      ts += pending->dur;
+      fflush(stdout);
+    }
+    pending = next;
+    next = next == &fr[0] ? &fr[1] : &fr[0];
+  }
+  if (pending != NULL)
+    write_frame(stdout, pending, ts);
+  free(line);
+  free(fr[0].data);
+  free(fr[1].data);
+  atlas_destroy(atlas);
+  if (ring != NULL)
+    ring_close(ring);
+
+  if (fflush(stdout) == EOF || ferror(stdout)) {
+    fprintf(stderr, "%s: %s: writing\n", argv[0], strerror(errno));
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
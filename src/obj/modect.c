@@ -38,121 +38,170 @@
 
 #include <stdlib.h>
 #include <stdio.h>
-#include <assert.h>
 #include <ctype.h>
-#include <math.h>
-#include <float.h>
 #include <limits.h>
 #include <string.h>
 #include <stdbool.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <math.h>
+#include <pthread.h>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/stat.h>
+
+#include "kernels.h"
+#include "pool.h"
+#include "detector.h"
+#include "stats.h"
+#include "queue.h"
+#include "capture.h"
+#include "jpegdet.h"
+
+static uint64_t now_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * UINT64_C(1000000000) + ts.tv_nsec;
+}
 
-#define ROOT2 (1.41421356237309504880)
+/* Where to write timings, or NULL if they are not being collected;
+   "-" means standard error */
+static const char *statspath;
 
-struct vect {
-  double x, y;
-};
+/* How often to write timings, in nanoseconds, and when next */
+static uint64_t stats_period = UINT64_C(60000000000), stats_due;
 
-/* Make a parsable report to the user.  The first word is the score,
-   or '-' if there is no score because the frame was not used for
-   motion detection (indicated by 'fact<0').  The last word (to the
-   end of the line) is the name of the source file associated with
-   this score, surrounded by a couple of graphic characters.  Other
-   words are additional diagnostic values. */
-static void report(double mean, double sd, const char *line, double fact)
-{
-  static double rm = 0.0;
-  const double alt = fdim((sd + 1e-7) / (mean + 1e-7), 1.0);
-  rm = 0.8 * rm + 0.2 * alt;
+/* Set when the user asks for timings immediately */
+static volatile sig_atomic_t stats_wanted;
 
-  if (fact < 0.0)
-    printf("- - - - X%sX\n", line);
-  else {
-#if 0
-    printf("%.0f %g %g %g X%sX\n",
-           (mean / 2.0 + sd / 8.0) * fact, mean, sd,
-           rm, line);
-#else
-    printf("%.0f %g %g %g X%sX\n",
-           rm * fact, mean, sd,
-           rm, line);
-#endif
-  }
-  fflush(stderr);
+static void on_usr1(int sig)
+{
+  (void) sig;
+  stats_wanted = 1;
 }
 
-static double cos2vect(const struct vect *a, const struct vect *b)
-{
-  const double maga = a->x * a->x + a->y * a->y;
-  const double magb = b->x * b->x + b->y * b->y;
-  const double denom = sqrt(maga * magb);
-  if (denom < 1e-6) return 0.0;
+/* How often to write checkpoints, in nanoseconds, and when next */
+static const uint64_t checkpoint_period = UINT64_C(60000000000);
+static uint64_t checkpoint_due;
+
+/* Set when asked to stop, so that checkpoints can be written */
+static volatile sig_atomic_t stopping;
 
-  const double numer = a->x * b->x + a->y * b->y;
-  return (numer / denom + 1.0) / 2.0 * denom;
+static void on_term(int sig)
+{
+  (void) sig;
+  stopping = 1;
 }
 
-#if 0
-static int digiclamp(double val)
+/* Decide whether it's time to write checkpoints. */
+static bool checkpoint_time(void)
 {
-  if (val < 0.0) return 0;
-  if (val > 9.0) return 9;
-  return val;
+  const uint64_t now = now_ns();
+  if (now < checkpoint_due) return false;
+  checkpoint_due = now + checkpoint_period;
+  return true;
 }
-#endif
 
-struct stats {
-  unsigned sum;
-  unsigned sum_sq;
-};
+/* Write a detector's checkpoint, if it has one, and complain if it
+   fails. */
+static void checkpoint(const char *prog, const char *tag,
+                       const struct detector *det)
+{
+  if (detector_checkpoint(det) < 0)
+    fprintf(stderr, "%s: %s%s%s: writing checkpoint\n", prog,
+            tag ? tag : "", tag ? ": " : "", strerror(errno));
+}
 
-static void add_image(int scale, unsigned width, unsigned height,
-                      struct stats sum[height][width],
-                      unsigned char (*img)[width])
+/* Restore a new detector from its checkpoint, if it has a suitable
+   one, and say how its history is to be populated. */
+static void resume(const char *prog, const char *tag, struct detector *det)
 {
-  for (unsigned x = 0; x < width; x++)
-    for (unsigned y = 0; y < height; y++) {
-      unsigned val = img[y][x];
-      sum[y][x].sum += scale * (int) val;
-      sum[y][x].sum_sq += scale * (int) (val * val);
-    }
+  const int rc = detector_resume(det);
+  if (rc < 0)
+    fprintf(stderr, "%s: %s%s%s: reading checkpoint\n", prog,
+            tag ? tag : "", tag ? ": " : "", strerror(errno));
+  fprintf(stderr, "%s%s%s\n", tag ? tag : "", tag ? ": " : "",
+          rc > 0 ? "history resumed" : "populating history");
 }
 
-#if 0
-static int signum(int v)
+/* Decide whether it's time to write timings. */
+static bool stats_time(void)
 {
-  return (v > 0) - (v < 0);
+  if (statspath == NULL) return false;
+  const uint64_t now = now_ns();
+  if (!stats_wanted && now < stats_due) return false;
+  stats_wanted = 0;
+  stats_due = now + stats_period;
+  return true;
 }
 
-static double detedge(signed short pix1, signed short pix2)
+/* Open somewhere to write timings: standard error, or a temporary
+   file to be renamed over 'statspath' by 'end_stats'. */
+static FILE *begin_stats(const char *prog, char *tmp, size_t tmplen)
 {
-  if (signum(pix1) == signum(pix2)) return 0.0;
-  return (double) pix1 * -pix2;
+  if (!strcmp(statspath, "-"))
+    return stderr;
+  snprintf(tmp, tmplen, "%s.tmp", statspath);
+  FILE *out = fopen(tmp, "w");
+  if (out == NULL)
+    fprintf(stderr, "%s: %s: writing %s\n", prog, strerror(errno), tmp);
+  return out;
 }
-#endif
 
-static int fsignum(double v)
+static void end_stats(const char *prog, FILE *out, const char *tmp)
 {
-  return (v > 0.0) - (v < 0.0);
+  if (out == stderr) {
+    fflush(stderr);
+    return;
+  }
+  if (fclose(out) != 0 || rename(tmp, statspath) != 0)
+    fprintf(stderr, "%s: %s: writing %s\n", prog, strerror(errno), statspath);
 }
 
-static double fdetedge(double pix1, double pix2)
+static void write_stats(const char *prog, const struct detstats *stats,
+                        const struct shedder *shed)
 {
-  if (fsignum(pix1) == fsignum(pix2)) return 0.0;
-  return pix1 * -pix2;
+  char tmp[PATH_MAX + 8];
+  FILE *out = begin_stats(prog, tmp, sizeof tmp);
+  if (out == NULL) return;
+  fprintf(out, "%lu frames\n", stats->frames);
+  detstats_print(out, NULL, stats);
+  shed_print(out, NULL, shed);
+  end_stats(prog, out, tmp);
 }
 
-static int read_filenames(FILE *namelist,
-                          size_t linebuflen,
-                          char linebuf[],
-                          const char **srcnameptr,
-                          const char **imgnameptr)
+/* Decide whether to skip scoring a frame because the detector is
+   falling behind, and say when the rate changes. */
+static bool shed(struct shedder *sh, const char *tag, const char *srcname)
 {
-  if (fgets(linebuf, linebuflen, namelist) == NULL) return 0;
+  const unsigned was = sh->stride;
+  const bool rc = shed_frame(sh, srcname);
+  if (sh->stride != was && was != 0)
+    fprintf(stderr, "%s%sscoring 1 in %u frames"
+            " (%lu late, %lu thinned)\n",
+            tag ? tag : "", tag ? ": " : "", sh->stride,
+            sh->late, sh->thinned);
+  return rc;
+}
 
+/* Split a line naming a source file and its condensed frame into
+   those two names, and remove its trailing newline.  The line
+   begins with the length of the source name, so that it may contain
+   spaces. */
+static void split_filenames(char *linebuf,
+                            const char **srcnameptr,
+                            const char **imgnameptr)
+{
   char *srcname;
   unsigned long srclen = strtoul(linebuf, &srcname, 10);
   while (*srcname && isspace(*srcname))
     srcname++;
+  if (srclen > strlen(srcname))
+    srclen = strlen(srcname);
 
   /* Find the start of the name of the condensed file. */
   char *line = srcname + srclen;
@@ -164,156 +213,1078 @@ static int read_filenames(FILE *namelist,
 
   /* Remove the condensed file's trailing newline. */
   size_t linelen = strlen(line);
-  if (line[linelen - 1] == '\n')
+  if (linelen > 0 && line[linelen - 1] == '\n')
     line[linelen - 1] = '\0';
 
   *srcnameptr = srcname;
   *imgnameptr = line;
+}
+
+/* Frames are read and loaded this far ahead of being processed. */
+#define READAHEAD 8
+
+/* A frame read ahead of its processing */
+struct pending {
+  /* the line naming the frame, and the names within it */
+  char linebuf[PATH_MAX + 1];
+  const char *srcname, *line;
+
+  /* the result of loading the frame, and the time it took */
+  int lrc;
+  uint64_t load_ns;
+
+  /* the state of shedding after deciding on this frame */
+  struct shedder shed;
+
+  unsigned char grid[];
+};
+
+/* The thread reading the names of frames, and loading them, so that
+   the time spent waiting for files is not added to that spent
+   processing them */
+struct reader {
+  FILE *namelist;
+  struct framesrc *fs;
+  unsigned width, height;
+  bool timing;
+  struct shedder shed;
+  struct queue *queue;
+};
+
+static void *read_frames(void *vp)
+{
+  struct reader *rd = vp;
+
+  /* Only be cancelled while waiting for a name, when nothing is
+     half done. */
+  int cs;
+  pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &cs);
+
+  struct pending *p;
+  while ((p = queue_claim(rd->queue)) != NULL) {
+    pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, &cs);
+    const bool got =
+      fgets(p->linebuf, sizeof p->linebuf, rd->namelist) != NULL;
+    pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &cs);
+    if (!got) break;
+    split_filenames(p->linebuf, &p->srcname, &p->line);
+
+    /* Decide on shedding before loading, so that a shed frame costs
+       nothing. */
+    if (*p->line && shed(&rd->shed, NULL, p->srcname))
+      p->line = "";
+    p->shed = rd->shed;
+
+    p->lrc = 0;
+    p->load_ns = 0;
+    if (*p->line) {
+      const uint64_t t0 = rd->timing ? now_ns() : 0;
+      p->lrc = framesrc_load(rd->fs, p->line, rd->width, rd->height,
+                             p->grid);
+      if (rd->timing)
+        p->load_ns = now_ns() - t0;
+    }
+    queue_push(rd->queue);
+  }
+  queue_close(rd->queue);
+  return NULL;
+}
+
+/* Interpret 'args[*argi]' as a switch setting a parameter of a
+   stream, taking its argument too if it has one.  Return 1 if it was
+   recognized; 0 if not; -1 if its argument is missing. */
+static int stream_option(struct detparams *par, const char **ringpath,
+                         unsigned *budget,
+                         int argc, const char *const *args, int *argi)
+{
+  const char *arg = args[*argi];
+  if (!strcmp(arg, "+m")) {
+    *ringpath = NULL;
+    return 1;
+  }
+  if (!strcmp(arg, "-E") || !strcmp(arg, "+E")) {
+    par->ewma = arg[0] == '-';
+    return 1;
+  }
+  if (!strcmp(arg, "+M")) {
+    par->mask = NULL;
+    return 1;
+  }
+  if (!strcmp(arg, "+c")) {
+    par->checkpoint = NULL;
+    return 1;
+  }
+  if (!strcmp(arg, "+g")) {
+    par->coarse_width = par->coarse_height = 0;
+    return 1;
+  }
+  if (strcmp(arg, "-m") && strcmp(arg, "-p") && strcmp(arg, "-v") &&
+      strcmp(arg, "-n") && strcmp(arg, "-H") && strcmp(arg, "-s") &&
+      strcmp(arg, "-L") && strcmp(arg, "-M") && strcmp(arg, "-c") &&
+      strcmp(arg, "-C") && strcmp(arg, "-g") && strcmp(arg, "-G"))
+    return 0;
+  if (++*argi == argc)
+    return -1;
+  const char *val = args[*argi];
+  if (!strcmp(arg, "-m"))
+    *ringpath = val;
+  else if (!strcmp(arg, "-p"))
+    par->factpow = atoi(val);
+  else if (!strcmp(arg, "-v"))
+    par->varpow0 = atof(val);
+  else if (!strcmp(arg, "-n"))
+    par->mdeg = atoi(val);
+  else if (!strcmp(arg, "-H"))
+    par->hdeg = atoi(val);
+  else if (!strcmp(arg, "-L"))
+    *budget = atoi(val);
+  else if (!strcmp(arg, "-M"))
+    par->mask = val;
+  else if (!strcmp(arg, "-c"))
+    par->checkpoint = val;
+  else if (!strcmp(arg, "-C"))
+    par->resume = atoi(val);
+  else if (!strcmp(arg, "-g"))
+    sscanf(val, "%ux%u", &par->coarse_width, &par->coarse_height);
+  else if (!strcmp(arg, "-G"))
+    par->gate = atof(val);
+  else
+    sscanf(val, "%ux%u", &par->width, &par->height);
   return 1;
 }
 
-/* Read in a frame from 'fin', and store its raw bytes in 'src'.
-   Close 'fin'.  Return 0 on success; non-zero on failure. */
-static int read_pgm(const unsigned amount,
-                    unsigned char src[amount],
-                    FILE *fin)
-{
-  /* Skip over the PGM header (P5\n16 12\n255\n). */
-  int nl = 3;
-  int c;
-  while (nl > 0 && (c = getc(fin)) != EOF)
-    if (c == '\n') nl--;
-
-  /* Read the raw bytes. */
-  size_t rrc = fread(src, amount, 1, fin);
-  fclose(fin);
-  return rrc == 0;
-}
-
-/* Compute the difference per pixel between two sets of images,
-   'sum_after' (the most recent 'nf_after' frames) and 'sum_before'
-   (the prior 'nf_before' frames).  The difference is diminished by
-   high stddev in the prior frames, but amplified by high stddev in
-   the most recent frames.  'vp_after' is the power used to convert
-   variance to stddev for the most recent frames, and 'vp_before'
-   likewise for prior frames.  These should be 0.5 for the normal
-   meaning of stddev as standard deviation. */
-static void compute_diffs(const unsigned width,
-                          const unsigned height,
-                          const unsigned nf_after,
-                          const unsigned nf_before,
-                          const double vp_after,
-                          const double vp_before,
-                          struct stats sum_after[height][width],
-                          struct stats sum_before[height][width],
-                          double diff[height][width])
-{
-  for (unsigned x = 0; x < width; x++) {
-    for (unsigned y = 0; y < height; y++) {
-        /* Compute means. */
-        double mu1 = sum_after[y][x].sum / (double) nf_after;
-        double mu0 = sum_before[y][x].sum / (double) nf_before;
-
-        /* Compute standard deviations. */
-        double var1 = sum_after[y][x].sum_sq / (double) nf_after - mu1 * mu1;
-        double sig1 = pow(var1, vp_after);
-        double var0 = sum_before[y][x].sum_sq / (double) nf_before - mu0 * mu0;
-        double sig0 = pow(var0, vp_before);
-
-        /* We care about the difference between the means, but we also
-           want to give more significance to the difference if the
-           'after' mean varies a lot, and less significance if the
-           'before' mean varies a lot. */
-        diff[y][x] = (mu1 - mu0) / 255.0;
-        diff[y][x] *= (sig1 / 255.0 + 1.0) / (sig0 / 255.0 + 1.0);
-      }
+/* One of several streams of frames processed by a single process */
+struct stream {
+  /* the first word of each of the stream's records */
+  char *tag;
+
+  struct framesrc fs;
+  char *ringpath;
+  struct detector *det;
+
+  /* where the stream's reports go, or -1 for standard output, where
+     they are tagged */
+  int fd;
+
+  /* reports that the destination had no room for yet, and whether
+     scoring is shed until they have been delivered */
+  char *backlog;
+  size_t blen, bcap;
+  bool behind;
+
+  /* reports not yet delivered */
+  FILE *out;
+  char *obuf;
+  size_t olen;
+
+  /* records awaiting processing */
+  char **recs;
+  size_t nrecs, reccap;
+
+  struct detstats stats;
+  struct shedder shed;
+};
+
+/* The streams of a multi-stream process, and those with records
+   waiting */
+struct streams {
+  const char *prog;
+  struct detparams par;
+  const char *ringpath;
+  unsigned budget;
+  struct pool *pool, *serial;
+
+  struct stream **all;
+  size_t count, cap;
+
+  struct stream **batch;
+  size_t nbatch;
+};
+
+static void stream_destroy(struct stream *s)
+{
+  if (s == NULL) return;
+  detector_destroy(s->det);
+  framesrc_release(&s->fs);
+  if (s->out != NULL) fclose(s->out);
+  free(s->obuf);
+  free(s->backlog);
+  if (s->fd >= 0) close(s->fd);
+  free(s->recs);
+  free(s->ringpath);
+  free(s->tag);
+  free(s);
+}
+
+/* Write as much of a stream's backlog of reports as its destination
+   has room for, and resume scoring once it has all gone. */
+static void flush_backlog(struct streams *ss, struct stream *s)
+{
+  size_t done = 0;
+  while (done < s->blen) {
+    ssize_t rc = write(s->fd, s->backlog + done, s->blen - done);
+    if (rc < 0 && errno == EINTR) continue;
+    if (rc < 0 && errno == EAGAIN) break;
+    if (rc < 0) {
+      fprintf(stderr, "%s: %s: %s: writing reports\n",
+              ss->prog, s->tag, strerror(errno));
+      done = s->blen;
+      break;
     }
+    done += rc;
+  }
+  memmove(s->backlog, s->backlog + done, s->blen - done);
+  s->blen -= done;
+  if (s->blen == 0 && s->behind) {
+    s->behind = false;
+    fprintf(stderr, "%s: %s: reports delivered; scoring resumed\n",
+            ss->prog, s->tag);
+  }
 }
 
-static void sum_adjs(unsigned width, unsigned height,
-                     struct vect motion[height][width],
-                     double diff[height][width],
-                     const void *zero)
+static struct stream *find_stream(struct streams *ss, const char *tag)
 {
-  /* Reset the sums. */
-  memcpy(motion, zero, sizeof motion[0][0] * width * height);
+  for (size_t i = 0; i < ss->count; i++)
+    if (!strcmp(ss->all[i]->tag, tag))
+      return ss->all[i];
+  return NULL;
+}
 
-  /* Compute average vectors for each inner cell. */
-  for (unsigned y = 1; y < height - 1; y++) {
-    const unsigned up = y - 1;
-    const unsigned down = y + 1;
-    for (unsigned x = 1; x < width - 1; x++) {
-      const unsigned left = x - 1;
-      struct vect *const vp = &motion[y][x];
+static void remove_stream(struct streams *ss, const char *tag)
+{
+  for (size_t i = 0; i < ss->count; i++)
+    if (!strcmp(ss->all[i]->tag, tag)) {
+      checkpoint(ss->prog, tag, ss->all[i]->det);
+      flush_backlog(ss, ss->all[i]);
+      if (ss->all[i]->blen > 0)
+        fprintf(stderr, "%s: %s: discarding %zu bytes of reports\n",
+                ss->prog, tag, ss->all[i]->blen);
+      stream_destroy(ss->all[i]);
+      ss->all[i] = ss->all[--ss->count];
+      return;
+    }
+}
 
-      {
-        double mag = fdetedge(diff[y][x], diff[y][left]) / 8.0;
-        vp->x += -1.0 * mag;
-        motion[y][left].x += +1.0 * mag;
-      }
+/* Process a stream's waiting records in order. */
+static void process_stream(void *ctx, unsigned i)
+{
+  struct streams *ss = ctx;
+  struct stream *s = ss->batch[i];
+  for (size_t r = 0; r < s->nrecs; r++) {
+    const char *srcname, *name;
+    split_filenames(s->recs[r], &srcname, &name);
+    if (*name && (s->behind || shed(&s->shed, s->tag, srcname)))
+      name = "";
+    const uint64_t t0 = statspath && *name ? now_ns() : 0;
+    if (detector_feed(s->det, srcname, name, &s->fs, s->out,
+                      s->fd < 0 ? s->tag : NULL))
+      fprintf(stderr, "%s: history complete\n", s->tag);
+    if (t0 != 0)
+      detstats_frame(&s->stats, s->det, now_ns() - t0, srcname);
+  }
+  s->nrecs = 0;
+}
 
-      {
-        double mag = fdetedge(diff[y][x], diff[up][x]) / 8.0;
-        vp->y += -1.0 * mag;
-        motion[up][x].y += +1.0 * mag;
-      }
+/* Reports are kept back for a stream's own destination up to this
+   many bytes before its scoring is shed, so that it catches up on
+   cheap '-' lines rather than losing any. */
+#define BACKLOG_MAX ((size_t) 1 << 20)
 
-      {
-        double mag = fdetedge(diff[y][x], diff[up][left]) / 8.0;
-        vp->x += -ROOT2 * mag;
-        vp->y += -ROOT2 * mag;
-        motion[up][left].x += +ROOT2 * mag;
-        motion[up][left].y += +ROOT2 * mag;
+/* Deliver a stream's reports.  Standard output may block, but a
+   stream's own destination may not, so reports that don't fit are
+   kept back, to be written when it has room. */
+static void deliver(struct streams *ss, struct stream *s)
+{
+  fflush(s->out);
+  const char *pos = s->obuf, *end = s->obuf + s->olen;
+  if (s->fd < 0) {
+    while (pos < end) {
+      ssize_t rc = write(STDOUT_FILENO, pos, end - pos);
+      if (rc < 0) {
+        if (errno == EINTR) continue;
+        fprintf(stderr, "%s: %s: writing reports\n",
+                ss->prog, strerror(errno));
+        exit(EXIT_FAILURE);
       }
-
-      {
-        double mag = fdetedge(diff[y][x], diff[down][left]) / 8.0;
-        vp->x += -ROOT2 * mag;
-        vp->y += +ROOT2 * mag;
-        motion[down][left].x += +ROOT2 * mag;
-        motion[down][left].y += -ROOT2 * mag;
+      pos += rc;
+    }
+  } else if (pos < end) {
+    if (s->blen + (end - pos) > s->bcap) {
+      size_t ncap = s->bcap ? s->bcap : 4096;
+      while (ncap < s->blen + (end - pos))
+        ncap *= 2;
+      char *nb = realloc(s->backlog, ncap);
+      if (nb == NULL) {
+        fprintf(stderr, "%s: %s: %s: keeping reports\n",
+                ss->prog, s->tag, strerror(errno));
+        exit(EXIT_FAILURE);
       }
+      s->backlog = nb;
+      s->bcap = ncap;
+    }
+    memcpy(s->backlog + s->blen, pos, end - pos);
+    s->blen += end - pos;
+    flush_backlog(ss, s);
+    if (s->blen > BACKLOG_MAX && !s->behind) {
+      s->behind = true;
+      fprintf(stderr, "%s: %s: reports backing up; scoring shed\n",
+              ss->prog, s->tag);
     }
   }
+  fseeko(s->out, 0, SEEK_SET);
 }
 
+static void write_streams_stats(struct streams *ss)
+{
+  char tmp[PATH_MAX + 8];
+  FILE *out = begin_stats(ss->prog, tmp, sizeof tmp);
+  if (out == NULL) return;
+  for (size_t i = 0; i < ss->count; i++) {
+    fprintf(out, "%s %lu frames\n",
+            ss->all[i]->tag, ss->all[i]->stats.frames);
+    detstats_print(out, ss->all[i]->tag, &ss->all[i]->stats);
+    shed_print(out, ss->all[i]->tag, &ss->all[i]->shed);
+  }
+  end_stats(ss->prog, out, tmp);
+}
 
-/* Read in 'hdeg' frames into 'src', using filenames from 'namelist'.
-   Return 0 on success; -1 if the stream terminates. */
-static int fill_up(const unsigned width,
-                   const unsigned height,
-                   const double fact,
-                   const unsigned tdeg,
-                   unsigned char src[][width][height],
-                   size_t linebuflen,
-                   char linebuf[linebuflen],
-                   FILE *namelist)
+/* Process all waiting records, sharing the streams between
+   threads. */
+static void run_batch(struct streams *ss)
 {
-  const char *srcname;
-  const char *line;
-  unsigned rplidx = 0;
-  while (rplidx < tdeg) {
-    if (!read_filenames(namelist, linebuflen, linebuf, &srcname, &line))
-      return -1;
-    if (*line == '\0') {
-      /* No condensed file is actually being provided, but we must
-         still report the original file. */
-      report(0.0, 0.0, srcname, -1.0);
-      continue;
+  if (ss->nbatch == 0) return;
+  pool_run(ss->pool, ss->nbatch, &process_stream, ss);
+  for (size_t i = 0; i < ss->nbatch; i++)
+    deliver(ss, ss->batch[i]);
+  ss->nbatch = 0;
+
+  if (stats_time())
+    write_streams_stats(ss);
+  if (checkpoint_time())
+    for (size_t i = 0; i < ss->count; i++)
+      checkpoint(ss->prog, ss->all[i]->tag, ss->all[i]->det);
+}
+
+/* Split 's' in place into at most 'max' whitespace-separated words
+   at 'args', returning how many were found.  A backslash makes the
+   next character part of the word, so that paths may contain spaces
+   or backslashes. */
+static int split_words(char *s, const char **args, int max)
+{
+  int argc = 0;
+  while (argc < max) {
+    while (*s && isspace(*s))
+      s++;
+    if (*s == '\0') break;
+    char *to = s;
+    args[argc++] = to;
+    while (*s && !isspace(*s)) {
+      if (*s == '\\' && s[1] != '\0')
+        s++;
+      *to++ = *s++;
     }
+    if (*s) s++;
+    *to = '\0';
+  }
+  return argc;
+}
 
-    /* Open the image file, and remove it. */
-    FILE *fin = fopen(line, "rb");
-    if (fin == NULL || read_pgm(width * height, &src[rplidx][0][0], fin) != 0) {
-      report(0.0, 0.0, srcname, fact);
+/* Create or replace the stream 'tag', with parameters overriding the
+   defaults given in the words of 'opts'. */
+static void declare_stream(struct streams *ss, const char *tag, char *opts)
+{
+  const char *args[64];
+  int argc = split_words(opts, args, 64);
+
+  struct detparams par = ss->par;
+  const char *ringpath = ss->ringpath;
+  unsigned budget = ss->budget;
+  const char *outpath = NULL;
+  for (int argi = 0; argi < argc; argi++) {
+    int rc = stream_option(&par, &ringpath, &budget, argc, args, &argi);
+    if (rc > 0) continue;
+    if (rc == 0 && !strcmp(args[argi], "-o") && argi + 1 < argc) {
+      outpath = args[++argi];
       continue;
     }
+    fprintf(stderr, "%s: %s: bad declaration at %s\n",
+            ss->prog, tag, args[argi]);
+    return;
+  }
+
+  remove_stream(ss, tag);
+
+  struct stream *s = calloc(1, sizeof *s);
+  if (s == NULL) goto failed;
+  s->fd = -1;
+  s->shed.budget = budget;
+  if ((s->tag = strdup(tag)) == NULL) goto failed;
+  if (ringpath != NULL && (s->ringpath = strdup(ringpath)) == NULL)
+    goto failed;
+  s->fs.ringpath = s->ringpath;
+  framesrc_attach(&s->fs);
+  if ((s->det = detector_create(&par, ss->serial)) == NULL) goto failed;
+  if (statspath && detector_set_timing(s->det, true) < 0) goto failed;
+  if ((s->out = open_memstream(&s->obuf, &s->olen)) == NULL) goto failed;
+  if (outpath != NULL) {
+    /* Opening a FIFO for reading as well as writing never blocks,
+       even if the consumer hasn't opened it yet. */
+    s->fd = open(outpath, O_RDWR | O_CREAT | O_APPEND |
+                 O_NONBLOCK | O_CLOEXEC, 0666);
+    if (s->fd < 0) goto failed;
+  }
+
+  if (ss->count == ss->cap) {
+    const size_t ncap = ss->cap ? ss->cap * 2 : 16;
+    struct stream **nall = realloc(ss->all, ncap * sizeof *nall);
+    struct stream **nbatch =
+      nall ? realloc(ss->batch, ncap * sizeof *nbatch) : NULL;
+    if (nbatch == NULL) {
+      if (nall != NULL) ss->all = nall;
+      goto failed;
+    }
+    ss->all = nall;
+    ss->batch = nbatch;
+    ss->cap = ncap;
+  }
+  ss->all[ss->count++] = s;
+  resume(ss->prog, tag, s->det);
+  return;
+
+ failed:
+  fprintf(stderr, "%s: %s: %s: declaring stream\n",
+          ss->prog, tag, strerror(errno));
+  stream_destroy(s);
+}
+
+/* Handle one record of a multi-stream input.  Its first word is the
+   tag of a stream.  The rest of the record is '+' and the stream's
+   switches to declare it (with spaces and backslashes within them
+   escaped by backslashes), '-' to discard it, or a line naming a
+   frame as for a single stream. */
+static void handle_record(struct streams *ss, char *rec)
+{
+  char *tag = rec;
+  while (*tag && isspace(*tag))
+    tag++;
+  char *rest = tag;
+  while (*rest && !isspace(*rest))
+    rest++;
+  if (*rest) *rest++ = '\0';
+  while (*rest && isspace(*rest))
+    rest++;
+  if (*tag == '\0') return;
+
+  if (*rest == '+' || *rest == '-') {
+    /* Let frames already waiting use the old state. */
+    run_batch(ss);
+    if (*rest == '+')
+      declare_stream(ss, tag, rest + 1);
+    else
+      remove_stream(ss, tag);
+    return;
+  }
+
+  struct stream *s = find_stream(ss, tag);
+  if (s == NULL) {
+    fprintf(stderr, "%s: %s: undeclared stream\n", ss->prog, tag);
+    return;
+  }
+  if (s->nrecs == s->reccap) {
+    const size_t ncap = s->reccap ? s->reccap * 2 : 8;
+    char **nrecs = realloc(s->recs, ncap * sizeof *nrecs);
+    if (nrecs == NULL) {
+      fprintf(stderr, "%s: %s: %s: queuing record\n",
+              ss->prog, tag, strerror(errno));
+      return;
+    }
+    s->recs = nrecs;
+    s->reccap = ncap;
+  }
+  if (s->nrecs == 0)
+    ss->batch[ss->nbatch++] = s;
+  s->recs[s->nrecs++] = rest;
+}
+
+/* Count the streams with reports kept back. */
+static size_t awaiting_room(const struct streams *ss)
+{
+  size_t n = 0;
+  for (size_t i = 0; i < ss->count; i++)
+    if (ss->all[i]->blen > 0)
+      n++;
+  return n;
+}
+
+/* Deliver reports kept back as their destinations make room, until
+   all have gone, or there are records to read from 'fd' (if not
+   negative), or we're stopping. */
+static void wait_for_room(struct streams *ss, int fd)
+{
+  size_t waiting;
+  while (!stopping && (waiting = awaiting_room(ss)) > 0) {
+    struct pollfd pfd[waiting + 1];
+    pfd[0] = (struct pollfd) { .fd = fd, .events = POLLIN };
+    for (size_t i = 0, n = 1; i < ss->count; i++)
+      if (ss->all[i]->blen > 0)
+        pfd[n++] = (struct pollfd) {
+          .fd = ss->all[i]->fd, .events = POLLOUT
+        };
+    if (poll(pfd, waiting + 1, -1) < 0) {
+      if (errno == EINTR) continue;
+      fprintf(stderr, "%s: %s: waiting\n", ss->prog, strerror(errno));
+      exit(EXIT_FAILURE);
+    }
+    for (size_t i = 0; i < ss->count; i++)
+      if (ss->all[i]->blen > 0)
+        flush_backlog(ss, ss->all[i]);
+    if (pfd[0].revents != 0) return;
+  }
+}
+
+/* Read records of many streams from 'fd' until it ends.  Whatever
+   arrives in one read is processed as a batch, with each stream
+   taking its records in order, and the streams shared between the
+   threads of 'ss->pool'. */
+static void run_streams(struct streams *ss, int fd)
+{
+  const size_t bufsz = 2 * PATH_MAX + 64;
+  char *buf = malloc(bufsz + 1);
+  if (buf == NULL) {
+    fprintf(stderr, "%s: %s: allocating\n", ss->prog, strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+  size_t have = 0;
+  while (!stopping) {
+    wait_for_room(ss, fd);
+    if (stopping) break;
+
+    ssize_t got = read(fd, buf + have, bufsz - have);
+    if (got < 0) {
+      if (errno == EINTR) continue;
+      fprintf(stderr, "%s: %s: reading records\n",
+              ss->prog, strerror(errno));
+      exit(EXIT_FAILURE);
+    }
+    if (got == 0) break;
+    have += got;
+
+    /* Queue each complete line. */
+    char *pos = buf, *end = buf + have, *nl;
+    while ((nl = memchr(pos, '\n', end - pos)) != NULL) {
+      *nl = '\0';
+      handle_record(ss, pos);
+      pos = nl + 1;
+    }
+    run_batch(ss);
+
+    /* Keep the incomplete line for next time, unless it's too
+       long. */
+    have = end - pos;
+    if (have == bufsz) {
+      fprintf(stderr, "%s: discarding long record\n", ss->prog);
+      have = 0;
+    }
+    memmove(buf, pos, have);
+  }
+
+  /* Process an unterminated last record. */
+  if (have > 0 && !stopping) {
+    buf[have] = '\0';
+    handle_record(ss, buf);
+    run_batch(ss);
+  }
+
+  /* Deliver the reports still kept back before the streams go. */
+  wait_for_room(ss, -1);
+  free(buf);
+}
+
+/* Offline, a recording is split into parts, each scored by its own
+   detector on a thread of its own, started far enough ahead of the
+   part to have filled its history by the start of it.  The scores
+   are then smoothed and reported in order by a single detector, so
+   that the output is as if the frames had been fed to one. */
+
+/* Each part is at least this many times as long as its lead-in, and
+   at least this many frames. */
+#define PART_LEADS 8
+#define PART_MIN 256
+
+/* a detector scoring part of a recording */
+struct part {
+  struct pool *pool;
+  struct detector *det;
+  bool complete, failed;
+
+  /* the first frame of the part that couldn't be decoded once the
+     history was complete, or SIZE_MAX */
+  size_t spoilt;
+
+  unsigned char *grid, *buf;
+  size_t cap;
+
+  /* where the statistics of frames before the part are recorded */
+  double *scratch;
+};
+
+struct reanalysis {
+  const char *prog;
+  struct detparams par;
+  struct capture *rec;
+
+  /* the number of frames of the recording, and how many each part
+     must be preceded by */
+  size_t count, lead;
+
+  /* the first frame of the parts being scored, and the length of
+     each */
+  size_t start, len;
+
+  /* the statistics recorded for each frame of the parts, of 'rawsize'
+     values each */
+  size_t rawsize;
+  double *raw;
+
+  /* the frame at which the history was complete, if among those
+     being scored, or SIZE_MAX */
+  size_t complete;
+
+  struct part *parts;
+};
+
+/* Load frame 'i' of a recording, and condense it into 'grid',
+   returning as 'framesrc_load' does. */
+static int load_recorded(const struct reanalysis *ra, size_t i,
+                         struct part *pt)
+{
+  struct capture_frame fr;
+  if (capture_frame_at(ra->rec, i, &fr, &pt->buf, &pt->cap) < 0)
+    return -1;
+  return decode_jpeg(ra->par.width, ra->par.height,
+                     pt->grid, fr.data, fr.len) != 0;
+}
+
+/* Score frames from '*from' to 'end - 1', recording the statistics
+   of those from 'begin'.  Return true if the history could not be
+   filled from the same frames before 'begin' as a single detector
+   would have used, with '*from' moved back to try again. */
+static bool score_frames(struct reanalysis *ra, struct part *pt,
+                         size_t *from, size_t begin, size_t end)
+{
+  for (size_t i = *from; i < end; i++) {
+    const int lrc = load_recorded(ra, i, pt);
+    if (lrc != 0 && !pt->complete && i < begin && *from > 0) {
+      *from = i > ra->lead ? i - ra->lead : 0;
+      return true;
+    }
+    if (lrc > 0 && pt->complete && i >= begin && pt->spoilt == SIZE_MAX)
+      pt->spoilt = i;
+    double *raw =
+      i < begin ? pt->scratch : ra->raw + (i - ra->start) * ra->rawsize;
+    if (detector_score(pt->det, pt->grid, lrc, raw) > 0) {
+      pt->complete = true;
+      if (i >= begin) ra->complete = i;
+    }
+  }
+  return false;
+}
+
+/* Score part 'n' of those being scored. */
+static void score_part(void *ctx, unsigned n)
+{
+  struct reanalysis *ra = ctx;
+  struct part *pt = &ra->parts[n];
+  const size_t begin = ra->start + (size_t) n * ra->len;
+  if (begin >= ra->count) return;
+  const size_t end =
+    ra->count - begin > ra->len ? begin + ra->len : ra->count;
+
+  size_t from = begin > ra->lead ? begin - ra->lead : 0;
+  do {
+    detector_destroy(pt->det);
+    pt->complete = false;
+    pt->spoilt = SIZE_MAX;
+    if ((pt->det = detector_create(&ra->par, pt->pool)) == NULL) {
+      fprintf(stderr, "%s: %s: scoring frames %zu to %zu\n",
+              ra->prog, strerror(errno), begin, end - 1);
+      pt->failed = true;
+      return;
+    }
+  } while (score_frames(ra, pt, &from, begin, end));
+}
+
+/* Score the frames of the recording at 'path', sharing the parts
+   between the threads of 'pool', and report them through 'det' in
+   order. */
+static int reanalyse(const char *prog, const char *path,
+                     const struct detparams *par, struct detector *det,
+                     struct pool *pool, unsigned threads)
+{
+  struct reanalysis ra = {
+    .prog = prog,
+    .par = *par,
+    .rec = capture_replay(path, 0, 0),
+    .lead = par->hdeg + par->mdeg + 1,
+    .rawsize = detector_raw_size(det),
+  };
+  ra.par.checkpoint = NULL;
+  if (ra.rec == NULL) {
+    fprintf(stderr, "%s: %s: %s: opening\n", prog, path, strerror(errno));
+    return -1;
+  }
+  const long count = capture_index(ra.rec);
+  if (count < 0) {
+    fprintf(stderr, "%s: %s: %s: indexing\n", prog, path, strerror(errno));
+    capture_close(ra.rec);
+    return -1;
+  }
+  ra.count = count;
+
+  /* An exponentially weighted history never forgets, so it can't be
+     split. */
+  if (par->ewma) {
+    ra.len = ra.count;
+    threads = 1;
+  } else {
+    ra.len = ra.lead * PART_LEADS;
+    if (ra.len < PART_MIN) ra.len = PART_MIN;
+  }
+  const size_t batch = ra.len * threads;
+  int rc = -1;
+  ra.raw = malloc((batch ? batch : 1) * ra.rawsize * sizeof *ra.raw);
+  ra.parts = calloc(threads, sizeof *ra.parts);
+  if (ra.raw == NULL || ra.parts == NULL)
+    goto nomem;
+  for (unsigned n = 0; n < threads; n++) {
+    struct part *pt = &ra.parts[n];
+    pt->pool = pool_create(1);
+    pt->grid = malloc((size_t) par->width * par->height);
+    pt->scratch = malloc(ra.rawsize * sizeof *pt->scratch);
+    if (pt->pool == NULL || pt->grid == NULL || pt->scratch == NULL)
+      goto nomem;
+  }
+
+  /* Once a frame can't be decoded, the history's sums are never
+     again what they would have been without it, so the rest of the
+     recording must be scored by the detector that saw it. */
+  struct part *carry = NULL;
+  char srcname[PATH_MAX];
+  rc = 0;
+  for (ra.start = 0; ra.start < ra.count && !stopping; ra.start += batch) {
+    const size_t end =
+      ra.count - ra.start > batch ? ra.start + batch : ra.count;
+    ra.complete = SIZE_MAX;
+    size_t from = ra.start;
+    if (carry == NULL) {
+      pool_run(pool, threads, &score_part, &ra);
+      for (unsigned n = 0; n < threads; n++)
+        if (ra.parts[n].failed) rc = -1;
+      if (rc < 0) break;
+      for (unsigned n = 0; n < threads && carry == NULL; n++)
+        if (ra.parts[n].spoilt != SIZE_MAX) {
+          carry = &ra.parts[n];
+          from = ra.start + (n + 1) * ra.len;
+        }
+    }
+    if (carry != NULL && from < end)
+      score_frames(&ra, carry, &from, from, end);
+
+    for (size_t i = ra.start; i < end; i++) {
+      const char *leaf = capture_frame_name(ra.rec, i);
+      if (leaf != NULL)
+        snprintf(srcname, sizeof srcname, "%s/%s", path, leaf);
+      else
+        snprintf(srcname, sizeof srcname, "%s#%zu", path, i);
+      detector_report(det, ra.raw + (i - ra.start) * ra.rawsize,
+                      srcname, stdout, NULL);
+      if (i == ra.complete)
+        fprintf(stderr, "history complete\n");
+    }
+  }
+  goto done;
+
+ nomem:
+  fprintf(stderr, "%s: %s: allocating\n", prog, strerror(errno));
+ done:
+  for (unsigned n = 0; ra.parts != NULL && n < threads; n++) {
+    struct part *pt = &ra.parts[n];
+    detector_destroy(pt->det);
+    if (pt->pool != NULL)
+      pool_destroy(pt->pool);
+    free(pt->grid);
+    free(pt->buf);
+    free(pt->scratch);
+  }
+  free(ra.parts);
+  free(ra.raw);
+  capture_close(ra.rec);
+  return rc;
+}
+
+/* Create a detector, or explain why it can't be and exit. */
+static struct detector *create_detector(const char *prog,
+                                        const struct detparams *par,
+                                        struct pool *pool)
+{
+  struct detector *det = detector_create(par, pool);
+  if (det == NULL && par->mask != NULL) {
+    fprintf(stderr, "%s: %s: %s: loading mask\n",
+            prog, par->mask, strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+  if (det == NULL && errno == EINVAL) {
+    fprintf(stderr, "%s: -g %ux%u needs tiles of at least 3x3,"
+            " and neither -E nor -M\n",
+            prog, par->coarse_width, par->coarse_height);
+    exit(EXIT_FAILURE);
+  }
+  return det;
+}
+
+/* A parameter sweep scores each frame, condensed just once, by
+   several configurations at once, each with its own detector.  Each
+   configuration is first described by a line '# <n> <switches>'.
+   For each frame, a row of the configurations' scores ('-' if not
+   scored) is written, ending with the frame's name as in a report.
+   Then 'start <n> <frame>' or 'stop <n> <frame>' is written for each
+   configuration whose recording 'events' would start or stop at
+   that frame, counting from 0. */
+
+/* one configuration of a sweep */
+struct config {
+  struct detparams par;
+
+  /* a copy of the mask's name, if overridden */
+  char *mask;
+
+  struct pool *pool;
+  struct detector *det;
+  double *raw;
+  double score;
+
+  /* whether recording, and how long activity has lasted, or how
+     much longer to continue recording without it */
+  bool recording;
+  long long rem;
+
+  /* how long to continue recording without activity */
+  unsigned linger;
+};
+
+struct sweep {
+  struct config *confs;
+  unsigned count, cap;
 
-    report(0.0, 0.0, srcname, fact);
-    rplidx++;
+  /* the frame being scored */
+  const unsigned char *grid;
+  int lrc;
+
+  /* Recording starts when the score has exceeded 'high' for more
+     than 'hesitate' frames, and stops when it has not exceeded 'low'
+     for more than 'linger' frames. */
+  long long low, high;
+  unsigned hesitate, linger;
+};
+
+/* Is this a switch whose value may be a list to sweep over? */
+static bool swept_option(const char *arg)
+{
+  return !strcmp(arg, "-n") || !strcmp(arg, "-H") ||
+    !strcmp(arg, "-v") || !strcmp(arg, "-p");
+}
+
+/* Add a configuration for each combination of the values of swept
+   switches from 'args[from]' onwards. */
+static int expand_configs(const char *prog, struct sweep *sw,
+                          const struct detparams *base,
+                          int argc, const char **args, int from)
+{
+  for (int argi = from; argi + 1 < argc; argi++) {
+    if (!swept_option(args[argi]) || strchr(args[argi + 1], ',') == NULL)
+      continue;
+    const char *list = args[argi + 1];
+    char vals[strlen(list) + 1];
+    strcpy(vals, list);
+    int rc = 0;
+    for (char *save, *v = strtok_r(vals, ",", &save);
+         v != NULL && rc == 0; v = strtok_r(NULL, ",", &save)) {
+      args[argi + 1] = v;
+      rc = expand_configs(prog, sw, base, argc, args, argi + 2);
+    }
+    args[argi + 1] = list;
+    return rc;
   }
 
+  /* Only the parameters of detection can differ. */
+  struct detparams par = *base;
+  const char *ringpath = NULL;
+  unsigned budget = 0;
+  for (int argi = 0; argi < argc; argi++) {
+    const int rc = stream_option(&par, &ringpath, &budget, argc, args, &argi);
+    if (rc == 0) {
+      fprintf(stderr, "%s: unknown switch in sweep: %s\n", prog, args[argi]);
+      return -1;
+    }
+    if (rc < 0) {
+      fprintf(stderr, "%s: incomplete sweep: %s\n", prog, args[argc - 1]);
+      return -1;
+    }
+  }
+  if (ringpath != NULL || budget != 0 ||
+      par.width != base->width || par.height != base->height) {
+    fprintf(stderr, "%s: -s, -m and -L can't be swept\n", prog);
+    return -1;
+  }
+  par.checkpoint = NULL;
+
+  char *mask = NULL;
+  if (par.mask != base->mask && (par.mask = mask = strdup(par.mask)) == NULL)
+    goto nomem;
+  if (sw->count == sw->cap) {
+    const unsigned ncap = sw->cap ? sw->cap * 2 : 8;
+    struct config *nc = realloc(sw->confs, ncap * sizeof *nc);
+    if (nc == NULL) goto nomem;
+    sw->confs = nc;
+    sw->cap = ncap;
+  }
+  sw->confs[sw->count++] = (struct config) { .par = par, .mask = mask };
   return 0;
+
+ nomem:
+  fprintf(stderr, "%s: %s: allocating\n", prog, strerror(errno));
+  free(mask);
+  return -1;
+}
+
+/* Add the configurations given by the switches of 'opts', which
+   override those of 'base'.  The values of -n, -H, -v and -p may be
+   comma-separated lists, to add every combination. */
+static int add_configs(const char *prog, struct sweep *sw,
+                       const struct detparams *base, const char *opts)
+{
+  char words[strlen(opts) + 1];
+  strcpy(words, opts);
+  const char *args[64];
+  int argc = 0;
+  for (char *save, *w = strtok_r(words, " \t\n", &save);
+       w != NULL && argc < 64; w = strtok_r(NULL, " \t\n", &save))
+    args[argc++] = w;
+  return expand_configs(prog, sw, base, argc, args, 0);
+}
+
+/* Create the detectors of a sweep, and describe its
+   configurations. */
+static void start_sweep(const char *prog, struct sweep *sw)
+{
+  for (unsigned i = 0; i < sw->count; i++) {
+    struct config *c = &sw->confs[i];
+    if ((c->pool = pool_create(1)) == NULL ||
+        (c->det = create_detector(prog, &c->par, c->pool)) == NULL ||
+        (c->raw = malloc(detector_raw_size(c->det) *
+                         sizeof *c->raw)) == NULL) {
+      fprintf(stderr, "%s: %s: allocating\n", prog, strerror(errno));
+      exit(EXIT_FAILURE);
+    }
+
+    /* As in 'events', activity must be absent for at least as long
+       as it takes to leave the 'after' frames. */
+    c->linger = sw->linger;
+    if (c->par.mdeg + sw->hesitate > c->linger)
+      c->linger = c->par.mdeg + sw->hesitate;
+
+    printf("# %u -n %u -H %u -v %g -p %d", i,
+           c->par.mdeg, c->par.hdeg, c->par.varpow0, c->par.factpow);
+    if (c->par.ewma)
+      fputs(" -E", stdout);
+    if (c->par.mask != NULL)
+      printf(" -M %s", c->par.mask);
+    if (c->par.coarse_width > 0)
+      printf(" -g %ux%u -G %g", c->par.coarse_width, c->par.coarse_height,
+             c->par.gate);
+    putchar('\n');
+  }
+}
+
+static void score_config(void *ctx, unsigned i)
+{
+  struct sweep *sw = ctx;
+  struct config *c = &sw->confs[i];
+  detector_score(c->det, sw->grid, sw->lrc, c->raw);
+  c->score = detector_report(c->det, c->raw, NULL, NULL, NULL);
+}
+
+/* Decide whether a configuration would start or stop recording at
+   frame 'seq', as 'events' would. */
+static void simulate_recording(struct sweep *sw, unsigned i,
+                               unsigned long seq)
+{
+  struct config *c = &sw->confs[i];
+  const long long score = llround(c->score);
+  if (c->recording) {
+    if (score > sw->low) {
+      c->rem = c->linger;
+    } else if (c->rem > 0) {
+      c->rem--;
+    } else {
+      c->recording = false;
+      printf("stop %u %lu\n", i, seq);
+    }
+  } else if (score > sw->high) {
+    if (c->rem >= sw->hesitate) {
+      c->recording = true;
+      c->rem = c->linger;
+      printf("start %u %lu\n", i, seq);
+    } else {
+      c->rem++;
+    }
+  } else if (c->rem > 0) {
+    c->rem--;
+  }
+}
+
+/* Score frame 'seq' by every configuration, sharing them between the
+   threads of 'pool', and write their scores.  If 'grid' is NULL,
+   the frame isn't to be scored, but each configuration's smoothed
+   score still decays, as it would for a single detector, while, as
+   in 'events', no recording starts or stops. */
+static void sweep_frame(struct sweep *sw, struct pool *pool,
+                        unsigned long seq, const char *srcname,
+                        const unsigned char *grid, int lrc)
+{
+  if (grid != NULL) {
+    sw->grid = grid;
+    sw->lrc = lrc;
+    pool_run(pool, sw->count, &score_config, sw);
+  } else {
+    for (unsigned i = 0; i < sw->count; i++)
+      detector_feed(sw->confs[i].det, srcname, "", NULL, NULL, NULL);
+  }
+  for (unsigned i = 0; i < sw->count; i++)
+    if (grid != NULL)
+      printf("%.0f ", sw->confs[i].score);
+    else
+      fputs("- ", stdout);
+  printf("X%sX\n", srcname);
+  if (grid != NULL)
+    for (unsigned i = 0; i < sw->count; i++)
+      simulate_recording(sw, i, seq);
+}
+
+/* Stop recording at the last frame, 'seq', and release the sweep's
+   resources. */
+static void end_sweep(struct sweep *sw, unsigned long seq)
+{
+  for (unsigned i = 0; i < sw->count; i++) {
+    struct config *c = &sw->confs[i];
+    if (c->recording)
+      printf("stop %u %lu\n", i, seq);
+    free(c->raw);
+    free(c->mask);
+    detector_destroy(c->det);
+    pool_destroy(c->pool);
+  }
+  free(sw->confs);
 }
 
 int main(int argc, const char *const *argv)
@@ -322,22 +1293,46 @@ int main(int argc, const char *const *argv)
      stream. */
   const char *watch = NULL;
 
-  /* Each image is expected to be an 8bpp PGM, of 16x12 pixels by
-     default. */
-  unsigned width = 16, height = 12;
+  /* Frames named '@<seq>' are read from this ring. */
+  const char *ringpath = NULL;
+
+  /* Force a particular implementation of the arithmetic. */
+  const char *kernels = NULL;
+
+  struct detparams par;
+  detparams_init(&par);
 
-  /* By default, 100 images in a sequence will be averaged to produce
-     the 'before' image, and 5 for 'after'. */
-  unsigned mdeg = 5;
-  unsigned hdeg = 100;
+  /* By default, process each frame on one thread, or share a
+     recording between all processors. */
+  unsigned threads = 0;
 
-  int factpow = 9;
+  /* Rescore this recording, rather than reading names of frames. */
+  const char *recording = NULL;
 
-  double varpow0 = 0.5, varpow1 = 0.5;
+  /* Score each frame by several configurations, each given by
+     switches overriding the others, and simulate recording by
+     each. */
+  const char *sweeps[16];
+  unsigned nsweeps = 0;
+  struct sweep sweep = {
+    .low = 400,
+    .high = 400,
+    .hesitate = 4,
+    .linger = 10,
+  };
+
+  /* Read records of several streams, rather than a single stream of
+     frames. */
+  bool multi = false;
+
+  /* Shed frames that arrive more than this many milliseconds
+     late. */
+  unsigned budget = 0;
 
   /* Parse command-line arguments. */
   bool show_help = false, fail = false;
   for (int argi = 1; argi < argc; argi++) {
+    int rc;
     if (!strcmp(argv[argi], "-f")) {
       if (++argi == argc) {
         show_help = true;
@@ -347,41 +1342,101 @@ int main(int argc, const char *const *argv)
       watch = argv[argi];
     } else if (!strcmp(argv[argi], "+f")) {
       watch = NULL;
-    } else if (!strcmp(argv[argi], "-p")) {
+    } else if (!strcmp(argv[argi], "-k")) {
       if (++argi == argc) {
         show_help = true;
         fail = true;
         break;
       }
-      factpow = atoi(argv[argi]);
-    } else if (!strcmp(argv[argi], "-v")) {
+      kernels = argv[argi];
+    } else if (!strcmp(argv[argi], "-j")) {
       if (++argi == argc) {
         show_help = true;
         fail = true;
         break;
       }
-      varpow0 = atof(argv[argi]);
-    } else if (!strcmp(argv[argi], "-n")) {
+      threads = atoi(argv[argi]);
+      if (threads < 1) threads = 1;
+    } else if (!strcmp(argv[argi], "-t")) {
       if (++argi == argc) {
         show_help = true;
         fail = true;
         break;
       }
-      mdeg = atoi(argv[argi]);
-    } else if (!strcmp(argv[argi], "-H")) {
+      statspath = argv[argi];
+    } else if (!strcmp(argv[argi], "+t")) {
+      statspath = NULL;
+    } else if (!strcmp(argv[argi], "-I")) {
       if (++argi == argc) {
         show_help = true;
         fail = true;
         break;
       }
-      hdeg = atoi(argv[argi]);
-    } else if (!strcmp(argv[argi], "-s")) {
+      stats_period = atof(argv[argi]) * 1e9;
+    } else if (!strcmp(argv[argi], "-R")) {
       if (++argi == argc) {
         show_help = true;
         fail = true;
         break;
       }
-      sscanf(argv[argi], "%ux%u", &width, &height);
+      recording = argv[argi];
+    } else if (!strcmp(argv[argi], "+R")) {
+      recording = NULL;
+    } else if (!strcmp(argv[argi], "-X")) {
+      if (++argi == argc) {
+        show_help = true;
+        fail = true;
+        break;
+      }
+      if (nsweeps == sizeof sweeps / sizeof sweeps[0]) {
+        fprintf(stderr, "%s: too many sweeps: %s\n", argv[0], argv[argi]);
+        exit(EXIT_FAILURE);
+      }
+      sweeps[nsweeps++] = argv[argi];
+    } else if (!strcmp(argv[argi], "+X")) {
+      nsweeps = 0;
+    } else if (!strcmp(argv[argi], "-T")) {
+      if (++argi == argc) {
+        show_help = true;
+        fail = true;
+        break;
+      }
+      /* Either a single threshold, or a pair (low-high) in either
+         order */
+      char *end;
+      sweep.low = sweep.high = strtoll(argv[argi], &end, 10);
+      if (*end == '-')
+        sweep.high = strtoll(end + 1, NULL, 10);
+      if (sweep.high < sweep.low) {
+        const long long tmp = sweep.low;
+        sweep.low = sweep.high;
+        sweep.high = tmp;
+      }
+    } else if (!strcmp(argv[argi], "-z")) {
+      if (++argi == argc) {
+        show_help = true;
+        fail = true;
+        break;
+      }
+      sweep.hesitate = atoi(argv[argi]);
+    } else if (!strcmp(argv[argi], "-l")) {
+      if (++argi == argc) {
+        show_help = true;
+        fail = true;
+        break;
+      }
+      sweep.linger = atoi(argv[argi]);
+    } else if (!strcmp(argv[argi], "-S")) {
+      multi = true;
+    } else if (!strcmp(argv[argi], "+S")) {
+      multi = false;
+    } else if ((rc = stream_option(&par, &ringpath, &budget,
+                                   argc, argv, &argi))) {
+      if (rc < 0) {
+        show_help = true;
+        fail = true;
+        break;
+      }
     } else if (argv[argi][0] == '-' || argv[argi][0] == '+') {
       fprintf(stderr, "%s: unknown switch: %s\n", argv[0], argv[argi]);
       exit(EXIT_FAILURE);
@@ -394,218 +1449,245 @@ int main(int argc, const char *const *argv)
   if (show_help) {
     fprintf(stderr,
             "Usage: %s [-f file|+f]\n"
+            "\t[-m ring|+m]\n"
             "\t[-s WxH]\n"
             "\t[-n frames after]\n"
             "\t[-H frames before]\n"
+            "\t[-E|+E]\n"
+            "\t[-M mask.pgm|+M]\n"
+            "\t[-c checkpoint|+c]\n"
+            "\t[-C max age]\n"
+            "\t[-g WxH|+g]\n"
+            "\t[-G gate]\n"
             "\t[-v varpow]\n"
-            "\t[-p power]\n", argv[0]);
+            "\t[-p power]\n"
+            "\t[-L lag ms]\n"
+            "\t[-k scalar|sse2|avx2]\n"
+            "\t[-j threads]\n"
+            "\t[-t stats|+t]\n"
+            "\t[-I seconds]\n"
+            "\t[-S|+S]\n"
+            "\t[-R dir|recording|+R]\n"
+            "\t[-X switches|+X]\n"
+            "\t[-T threshold[-threshold]]\n"
+            "\t[-z hesitate]\n"
+            "\t[-l linger]\n", argv[0]);
     exit(fail ? EXIT_FAILURE : EXIT_SUCCESS);
   }
 
-  const double fact = pow(10, factpow - 5);
-
-  /* Create a zeroed structure that we can simply byte-copy to reset a
-     similar structure. */
-  struct vect zero_vect[height][width];
-  for (unsigned i = 0; i < 2; i++) {
-    for (unsigned y = 0; y < height; y++) {
-      for (unsigned x = 0; x < width; x++) {
-        zero_vect[y][x].x = 0.0;
-        zero_vect[y][x].y = 0.0;
-      }
-    }
+  if (recording != NULL && (multi || watch != NULL || ringpath != NULL)) {
+    fprintf(stderr, "%s: -R excludes -S, -f and -m\n", argv[0]);
+    exit(EXIT_FAILURE);
+  }
+  if (nsweeps > 0 && (multi || recording != NULL)) {
+    fprintf(stderr, "%s: -X excludes -S and -R\n", argv[0]);
+    exit(EXIT_FAILURE);
+  }
+  if (threads == 0) {
+    const long cpus =
+      recording || nsweeps ? sysconf(_SC_NPROCESSORS_ONLN) : 1;
+    threads = cpus > 0 ? cpus : 1;
   }
 
-  /* How many frames do we keep altogether?  It's the number of before
-     and after frames. */
-  const unsigned tdeg = mdeg + hdeg;
-
-  /* Prepare to store the most recent mdeg images, and the previous
-     hdeg images. */
-  unsigned char src[tdeg][height][width];
-  memset(src, 0, sizeof src);
-
-  /* Store the sums for the 'before' and 'after' images.  We store
-     both the sum and the sum of squares, so we can easily calculate
-     the mean and standard deviation.  We must put y before x so that
-     we can fread an image with a single call, as the data comes in
-     row-by-row. */
-  typedef struct stats sum_type[height][width];
-  sum_type sum_before, sum_after;
-  for (unsigned x = 0; x < width; x++)
-    for (unsigned y = 0; y < height; y++)
-      sum_before[y][x] = sum_after[y][x] = (struct stats) { 0 };
-
-  FILE *namelist = watch == NULL ? stdin : fopen(watch, "r");
-  if (namelist == NULL) {
-    fprintf(stderr, "%s: could not read %s\n", argv[0], watch);
+  if (kernels_init(kernels) < 0) {
+    fprintf(stderr, "%s: kernels unavailable: %s\n", argv[0], kernels);
     exit(EXIT_FAILURE);
   }
 
+  /* Collect timings only if asked to, and write them periodically
+     and when signalled. */
+  if (statspath != NULL) {
+    struct sigaction sa = { .sa_handler = &on_usr1, .sa_flags = SA_RESTART };
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGUSR1, &sa, NULL);
+    stats_due = now_ns() + stats_period;
+  }
 
-  /* Read in the first tdeg images to fill our buffer. */
-  char linebuf[PATH_MAX + 1];
-  fprintf(stderr, "populating history\n");
-  if (fill_up(width, height, fact, tdeg, src,
-              sizeof linebuf, linebuf, namelist) == 0) {
-    fprintf(stderr, "history complete\n");
-
-    /* Make the frames contribute to their respective sums. */
-    for (unsigned rplidx = 0; rplidx < hdeg; rplidx++)
-      add_image(+1, width, height, sum_before, src[rplidx]);
-    for (unsigned rplidx = hdeg; rplidx < tdeg; rplidx++)
-      add_image(+1, width, height, sum_after, src[rplidx]);
-
-    /* Compute the difference per pixel between the most recent frames
-       and the prior frames. */
-    double diff[height][width];
-    compute_diffs(width, height, mdeg, hdeg, varpow1, varpow0,
-                  sum_after, sum_before, diff);
-
-    /* Record vector computations, old and new.  Initialize the new
-       one [0] based on the initial 'diff'. */
-    struct vect motion[2][height][width];
-    unsigned next_mrplidx = 1;
-    sum_adjs(width, height, motion[1 - next_mrplidx], diff, zero_vect);
-
-    /* Read in additional frames. */
-    const char *srcname;
-    const char *line;
-    unsigned sources = 0;
-    while (read_filenames(namelist, sizeof linebuf, linebuf, &srcname, &line)) {
-      if (*line == '\0') {
-        /* No condensed file is actually being provided, but we must
-           still report the original file. */
-        report(0.0, 0.0, srcname, -1.0);
-        continue;
-      }
+  /* Stop at the next frame when asked to, so that checkpoints can be
+     written.  Only this thread is to be interrupted, so the others
+     are created with the signals blocked. */
+  const bool catch_stop = multi || par.checkpoint != NULL;
+  sigset_t stopsigs;
+  sigemptyset(&stopsigs);
+  sigaddset(&stopsigs, SIGTERM);
+  sigaddset(&stopsigs, SIGINT);
+  if (catch_stop) {
+    struct sigaction sa = { .sa_handler = &on_term };
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGTERM, &sa, NULL);
+    sigaction(SIGINT, &sa, NULL);
+    pthread_sigmask(SIG_BLOCK, &stopsigs, NULL);
+    checkpoint_due = now_ns() + checkpoint_period;
+  }
 
-      /* Open the image file, and remove it. */
-      FILE *fin = fopen(line, "rb");
-      if (fin == NULL) {
-        report(0.0, 0.0, srcname, fact);
-        continue;
-      }
+  /* Prepare to share the work between threads. */
+  struct pool *pool = pool_create(threads);
+  if (pool == NULL) {
+    fprintf(stderr, "%s: %s: creating %u threads\n",
+            argv[0], strerror(errno), threads);
+    exit(EXIT_FAILURE);
+  }
 
-      /* Which motion vector array are we replacing? */
-      const unsigned mrplidx = next_mrplidx;
-      const unsigned maltidx = next_mrplidx = 1 - mrplidx;
-
-      /* Move images between the 'before' and 'after' sums.  'rplidx'
-         holds the oldest frame, so that should be overwritten. */
-      const unsigned rplidx = sources;
-
-      /* Which image is to be subtracted from the 'after' sum and
-         added to 'before'?  It's hdeg frames ahead, wrapped
-         around. */
-      const unsigned transidx = (rplidx + hdeg) % tdeg;
-
-#if 0
-      fprintf(stderr, "src %d; rpl %u; trans %u\n", sources, rplidx, transidx);
-#endif
-
-      /* Read in the PGM at rplidx.  If we fail, we don't count it. */
-      unsigned char tmp[height][width];
-      if (read_pgm(width * height, &tmp[0][0], fin) != 0) {
-        memset(&src[rplidx][0][0], 0, width * height);
-        report(0.0, 0.0, srcname, fact);
-        continue;
+  if (multi) {
+    /* The threads work on different streams, so each stream's
+       frames are processed on one. */
+    struct streams ss = {
+      .prog = argv[0],
+      .par = par,
+      .ringpath = ringpath,
+      .budget = budget,
+      .pool = pool,
+      .serial = pool_create(1),
+    };
+    if (ss.serial == NULL) {
+      fprintf(stderr, "%s: %s: creating pool\n", argv[0], strerror(errno));
+      exit(EXIT_FAILURE);
+    }
+    pthread_sigmask(SIG_UNBLOCK, &stopsigs, NULL);
+
+    /* Open a named pipe for writing as well, so that it doesn't end
+       when the last of several producers closes it. */
+    int fd = STDIN_FILENO;
+    if (watch != NULL) {
+      struct stat st;
+      fd = open(watch, stat(watch, &st) == 0 && S_ISFIFO(st.st_mode) ?
+                O_RDWR : O_RDONLY);
+      if (fd < 0) {
+        fprintf(stderr, "%s: could not read %s\n", argv[0], watch);
+        exit(EXIT_FAILURE);
       }
+    }
+    run_streams(&ss, fd);
+    if (statspath != NULL)
+      write_streams_stats(&ss);
+    if (fd != STDIN_FILENO)
+      close(fd);
+    while (ss.count > 0)
+      remove_stream(&ss, ss.all[0]->tag);
+    free(ss.all);
+    free(ss.batch);
+    pool_destroy(ss.serial);
+    pool_destroy(pool);
+    return 0;
+  }
 
-      /* We got a complete image, so ensure we move to the next frame
-         in our buffer. */
-      if (++sources == tdeg)
-        sources = 0;
-
-      /* Subtract the old image from the 'before' sum. */
-      add_image(-1, width, height, sum_before, src[rplidx]);
-
-      /* Move the middle image from 'after' to 'before'. */
-      add_image(-1, width, height, sum_after, src[transidx]);
-      add_image(+1, width, height, sum_before, src[transidx]);
-
-      /* Copy the new image into place. */
-      memcpy(src[rplidx], tmp, sizeof tmp);
-
-      /* Add the new image to the after sum. */
-      add_image(+1, width, height, sum_after, src[rplidx]);
+  /* A sweep replaces the single detector with one per
+     configuration. */
+  struct detector *det = NULL;
+  for (unsigned i = 0; i < nsweeps; i++)
+    if (add_configs(argv[0], &sweep, &par, sweeps[i]) < 0)
+      exit(EXIT_FAILURE);
+  if (sweep.count > 0) {
+    start_sweep(argv[0], &sweep);
+  } else if ((det = create_detector(argv[0], &par, pool)) == NULL ||
+             (statspath && detector_set_timing(det, true) < 0)) {
+    fprintf(stderr, "%s: %s: allocating\n", argv[0], strerror(errno));
+    exit(EXIT_FAILURE);
+  }
 
+  if (recording != NULL) {
+    /* Nothing is read as it arrives, so there's no history to
+       keep. */
+    pthread_sigmask(SIG_UNBLOCK, &stopsigs, NULL);
+    const int rc = reanalyse(argv[0], recording, &par, det, pool, threads);
+    detector_destroy(det);
+    pool_destroy(pool);
+    return rc < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
+  }
 
-      /* Start by computing the differences in the means of each pixel,
-         and the ratio of standard deviations. */
-      double diff[height][width];
-      compute_diffs(width, height, mdeg, hdeg, varpow1, varpow0,
-                    sum_after, sum_before, diff);
+  FILE *namelist = watch == NULL ? stdin : fopen(watch, "r");
+  if (namelist == NULL) {
+    fprintf(stderr, "%s: could not read %s\n", argv[0], watch);
+    exit(EXIT_FAILURE);
+  }
 
-#if 0
-      for (unsigned y = 0; y < height; y++) {
-        for (unsigned i = 0; i < mdeg + 1; i++) {
-          for (unsigned x = 0; x < width; x++) {
-            fprintf(stderr, "%d",
-                    (int) (src[(rplidx + i + hdeg - 1) %
-                               tdeg][y][x] * 10.0 / 255));
-          }
-          putc(' ', stderr);
-        }
-        for (unsigned x = 0; x < width; x++) {
-          fprintf(stderr, "%d",
-                  (int) (sum_before[y][x].sum * 10.0 / (hdeg * 255  + 1)));
-        }
-        putc(' ', stderr);
-        for (unsigned x = 0; x < width; x++) {
-          fprintf(stderr, "%d",
-                  (int) (sum_after[y][x].sum * 10.0 / (mdeg * 255 + 1)));
-        }
-        putc(' ', stderr);
-        for (unsigned x = 0; x < width; x++) {
-          int sn = copysign(1.0, diff[y][x]);
-          fprintf(stderr, "%s", sn < 0 ? "-" : sn > 0 ? "+" : "0");
-        }
-        putc('\n', stderr);
-      }
-#endif
+  pthread_sigmask(SIG_UNBLOCK, &stopsigs, NULL);
+  struct framesrc fs = { .ringpath = ringpath };
+  while (framesrc_attach(&fs) < 0) {
+    if (stopping) exit(EXIT_SUCCESS);
+    if (errno != ENOENT && errno != EINVAL) {
+      fprintf(stderr, "%s: %s: opening %s\n",
+              argv[0], strerror(errno), ringpath);
+      exit(EXIT_FAILURE);
+    }
+    /* Wait for the producer to start. */
+    sleep(1);
+  }
 
+  /* Read in frames on another thread, which must not be
+     interrupted. */
+  struct reader rd = {
+    .namelist = namelist,
+    .fs = &fs,
+    .width = par.width,
+    .height = par.height,
+    .timing = statspath != NULL,
+    .shed = { .budget = budget },
+    .queue = queue_create(READAHEAD, sizeof(struct pending) +
+                          (size_t) par.width * par.height),
+  };
+  if (rd.queue == NULL) {
+    fprintf(stderr, "%s: %s: allocating\n", argv[0], strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+  pthread_t reader;
+  pthread_sigmask(SIG_BLOCK, &stopsigs, NULL);
+  int rc = pthread_create(&reader, NULL, &read_frames, &rd);
+  if (rc != 0) {
+    fprintf(stderr, "%s: %s: creating reader\n", argv[0], strerror(rc));
+    exit(EXIT_FAILURE);
+  }
+  pthread_sigmask(SIG_UNBLOCK, &stopsigs, NULL);
+
+  /* Process the frames in order, populating the history first,
+     unless it can be resumed. */
+  struct detstats stats = { .frames = 0 };
+  struct shedder shedder = rd.shed;
+  unsigned long seq = 0;
+  if (det != NULL)
+    resume(argv[0], NULL, det);
+  struct pending *p;
+  while (!stopping && (p = queue_front(rd.queue)) != NULL) {
+    shedder = p->shed;
+    const uint64_t t0 = statspath && det && *p->line ? now_ns() : 0;
+    if (det == NULL)
+      sweep_frame(&sweep, pool, seq++, p->srcname,
+                  *p->line ? p->grid : NULL, p->lrc);
+    else if (*p->line ?
+             detector_feed_loaded(det, p->srcname, p->grid, p->lrc,
+                                  p->load_ns, stdout, NULL) :
+             detector_feed(det, p->srcname, p->line, NULL, stdout, NULL))
+      fprintf(stderr, "history complete\n");
+    if (t0 != 0)
+      detstats_frame(&stats, det, now_ns() - t0, p->srcname);
+    queue_pop(rd.queue);
+
+    if (stats_time())
+      write_stats(argv[0], &stats, &shedder);
+    if (det != NULL && checkpoint_time())
+      checkpoint(argv[0], NULL, det);
+  }
 
-      /* Compare each pixel difference with each of its neighbours. */
-      sum_adjs(width, height, motion[mrplidx], diff, zero_vect);
+  /* If stopping, the reader might be waiting for a name that never
+     comes. */
+  queue_cancel(rd.queue);
+  if (stopping)
+    pthread_cancel(reader);
+  pthread_join(reader, NULL);
 
-#if 0
-      for (unsigned y = 0; y < height; y++) {
-        for (unsigned x = 0; x < width; x++) {
-          struct vect *const vp = &motion[mrplidx][y][x];
-          fprintf(stderr, "(%6.3f %6.3f) ", vp->x * 1e2, vp->y * 1e2);
-        }
-        fprintf(stderr, "\n");
-      }
-#endif
-
-      /* Compare previous (maltidx) and current (mrplidx) vectors for
-         inner cells. */
-      double sum = 0.0, sum2 = 0.0;
-      for (unsigned y = 1; y < height - 1; y++) {
-        const unsigned up = y - 1;
-        const unsigned down = y + 1;
-        for (unsigned x = 1; x < width; x++) {
-          const unsigned left = x - 1;
-          struct vect *const vp = &motion[mrplidx][y][x];
-          double s = 0.0;
-          s += cos2vect(vp, &motion[maltidx][up][x]);
-          s += cos2vect(vp, &motion[maltidx][up][left]);
-          s += cos2vect(vp, &motion[maltidx][y][left]);
-          s += cos2vect(vp, &motion[maltidx][down][left]);
-          sum += s;
-          sum2 += s * s;
-        }
-      }
-      const double mean = sum / ((width - 1) * (height - 1));
-      const double var = sum2 / ((width - 1) * (height - 1)) - mean * mean;
-      const double sd = sqrt(var);
-      report(mean, sd, srcname, fact);
-    }
-  }
+  if (statspath != NULL)
+    write_stats(argv[0], &stats, &shedder);
+  if (det != NULL)
+    checkpoint(argv[0], NULL, det);
+  else
+    end_sweep(&sweep, seq > 0 ? seq - 1 : 0);
 
   if (namelist != stdin)
     fclose(namelist);
+  queue_destroy(rd.queue);
+  framesrc_release(&fs);
+  detector_destroy(det);
+  pool_destroy(pool);
 
   return 0;
 }
@@ -0,0 +1,330 @@
+// -*- c-basic-offset: 2; indent-tabs-mode: nil -*-
+
+/*
+ * Copyright 2018-19, Lancaster University
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ * 
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the
+ *    distribution.
+ * 
+ *  * Neither the name of the copyright holder nor the names of
+ *    its contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ *
+ * Author: Steven Simpson <https://github.com/simpsonst>
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <math.h>
+#include <setjmp.h>
+
+#include <jpeglib.h>
+
+#include "overlay.h"
+
+/* This replaces the per-frame invocation of
+
+     convert in.jpg -fill black -background white \
+       -font FONT -pointsize SIZE -gravity GRAVITY \
+       label:TEXT -composite out.jpg
+
+   The font is rasterized once, by the caller, into an atlas.  The
+   JPEG is not decoded to pixels: its DCT coefficients are read, the
+   blocks lying under the label are inverse-transformed, painted,
+   transformed and quantized again, and the coefficients are written
+   back out.  Everything else only goes through entropy decoding and
+   encoding. */
+
+struct atlas {
+  unsigned cw, ch, n;
+  char *chars;
+  unsigned char *pix;
+  unsigned stride;
+};
+
+static int read_pnm_int(FILE *in)
+{
+  int c;
+  for ( ; ; ) {
+    c = getc(in);
+    if (c == '#')
+      while ((c = getc(in)) != EOF && c != '\n')
+        ;
+    if (c == EOF) return -1;
+    if (c >= '0' && c <= '9') break;
+  }
+  int v = 0;
+  do {
+    v = v * 10 + (c - '0');
+    c = getc(in);
+  } while (c >= '0' && c <= '9');
+  return v;
+}
+
+struct atlas *atlas_load(const char *path, const char *chars)
+{
+  FILE *in = fopen(path, "rb");
+  if (in == NULL) return NULL;
+  struct atlas *a = NULL;
+  int w, h, maxval;
+  if (getc(in) != 'P' || getc(in) != '5' ||
+      (w = read_pnm_int(in)) <= 0 ||
+      (h = read_pnm_int(in)) <= 0 ||
+      (maxval = read_pnm_int(in)) <= 0 || maxval > 255) {
+    errno = EINVAL;
+    goto failed;
+  }
+  const size_t n = strlen(chars);
+  if (n == 0 || (size_t) w < n) {
+    errno = EINVAL;
+    goto failed;
+  }
+  a = malloc(sizeof *a);
+  if (a == NULL) goto failed;
+  a->pix = malloc((size_t) w * h);
+  a->chars = strdup(chars);
+  if (a->pix == NULL || a->chars == NULL) goto failed;
+  if (fread(a->pix, 1, (size_t) w * h, in) != (size_t) w * h) {
+    errno = EINVAL;
+    goto failed;
+  }
+  fclose(in);
+  a->n = n;
+  a->cw = w / n;
+  a->ch = h;
+  a->stride = w;
+  return a;
+
+ failed:
+  if (a != NULL) {
+    free(a->pix);
+    free(a->chars);
+    free(a);
+  }
+  fclose(in);
+  return NULL;
+}
+
+void atlas_destroy(struct atlas *a)
+{
+  if (a == NULL) return;
+  free(a->pix);
+  free(a->chars);
+  free(a);
+}
+
+/* Gravity is encoded as 3*row+column, with 0 as the top/left. */
+int overlay_gravity(const char *name)
+{
+  static const char *const names[] = {
+    "NorthWest", "North", "NorthEast",
+    "West", "Center", "East",
+    "SouthWest", "South", "SouthEast",
+  };
+  for (int i = 0; i < 9; i++)
+    if (!strcasecmp(name, names[i]))
+      return i;
+  return -1;
+}
+
+/* Get the panel's value at (x, y) relative to its top-left
+   corner. */
+static unsigned char panel_at(const struct atlas *a, const char *text,
+                              unsigned x, unsigned y)
+{
+  const char *p = strchr(a->chars, text[x / a->cw]);
+  if (p == NULL || *p == '\0') return 255;
+  return a->pix[(size_t) y * a->stride + (p - a->chars) * a->cw +
+                x % a->cw];
+}
+
+/* dct[x][u] = C(u)/2 * cos((2x+1)u*pi/16), so that the 2-D transform
+   in each direction is a product of two of these */
+static double dct[8][8];
+
+static void init_dct(void)
+{
+  if (dct[0][0] != 0.0) return;
+  for (int x = 0; x < 8; x++)
+    for (int u = 0; u < 8; u++)
+      dct[x][u] = (u == 0 ? M_SQRT1_2 : 1.0) / 2.0 *
+        cos((2 * x + 1) * u * M_PI / 16.0);
+}
+
+/* Paint the part of a component's block lying under the panel.  The
+   block's top-left sample is at (bx, by) in component coordinates;
+   the panel occupies [x0,x1)x[y0,y1) in image coordinates, and the
+   component is subsampled by (hs/maxh, vs/maxv). */
+static void paint_block(JCOEF *blk, const JQUANT_TBL *qt, bool luma,
+                        const struct atlas *a, const char *text,
+                        unsigned bx, unsigned by,
+                        unsigned x0, unsigned y0,
+                        unsigned x1, unsigned y1,
+                        unsigned hs, unsigned maxh,
+                        unsigned vs, unsigned maxv)
+{
+  double pix[8][8], tmp[8][8];
+
+  /* Inverse transform, in two passes */
+  for (int v = 0; v < 8; v++)
+    for (int x = 0; x < 8; x++) {
+      double s = 0.0;
+      for (int u = 0; u < 8; u++)
+        s += dct[x][u] * blk[v * 8 + u] * qt->quantval[v * 8 + u];
+      tmp[v][x] = s;
+    }
+  for (int y = 0; y < 8; y++)
+    for (int x = 0; x < 8; x++) {
+      double s = 0.0;
+      for (int v = 0; v < 8; v++)
+        s += dct[y][v] * tmp[v][x];
+      pix[y][x] = s;
+    }
+
+  /* Paint the samples whose image coordinates are in the panel,
+     with level-shifted values.  Chroma is made neutral. */
+  for (int y = 0; y < 8; y++) {
+    const unsigned iy = (by + y) * maxv / vs;
+    if (iy < y0 || iy >= y1) continue;
+    for (int x = 0; x < 8; x++) {
+      const unsigned ix = (bx + x) * maxh / hs;
+      if (ix < x0 || ix >= x1) continue;
+      pix[y][x] = luma ?
+        panel_at(a, text, ix - x0, iy - y0) - 128.0 : 0.0;
+    }
+  }
+
+  /* Forward transform, and quantize */
+  for (int y = 0; y < 8; y++)
+    for (int u = 0; u < 8; u++) {
+      double s = 0.0;
+      for (int x = 0; x < 8; x++)
+        s += dct[x][u] * pix[y][x];
+      tmp[y][u] = s;
+    }
+  for (int v = 0; v < 8; v++)
+    for (int u = 0; u < 8; u++) {
+      double s = 0.0;
+      for (int y = 0; y < 8; y++)
+        s += dct[y][v] * tmp[y][u];
+      blk[v * 8 + u] = lround(s / qt->quantval[v * 8 + u]);
+    }
+}
+
+struct errmgr {
+  struct jpeg_error_mgr pub;
+  jmp_buf jmp;
+};
+
+static void on_error(j_common_ptr cinfo)
+{
+  struct errmgr *err = (struct errmgr *) cinfo->err;
+  longjmp(err->jmp, 1);
+}
+
+static void on_message(j_common_ptr cinfo)
+{
+  (void) cinfo;
+}
+
+int overlay_jpeg(const struct atlas *a, int gravity, const char *text,
+                 const unsigned char *in, size_t len,
+                 unsigned char **out, unsigned long *outlen)
+{
+  init_dct();
+
+  struct jpeg_decompress_struct din;
+  struct jpeg_compress_struct cout;
+  struct errmgr err;
+  din.err = cout.err = jpeg_std_error(&err.pub);
+  err.pub.error_exit = &on_error;
+  err.pub.output_message = &on_message;
+  *out = NULL;
+  *outlen = 0;
+  if (setjmp(err.jmp)) {
+    jpeg_destroy_compress(&cout);
+    jpeg_destroy_decompress(&din);
+    free(*out);
+    *out = NULL;
+    return -1;
+  }
+  jpeg_create_decompress(&din);
+  jpeg_create_compress(&cout);
+  jpeg_mem_src(&din, in, len);
+  jpeg_read_header(&din, TRUE);
+  jvirt_barray_ptr *coefs = jpeg_read_coefficients(&din);
+
+  /* Place the panel, clipped to the image. */
+  const unsigned pw = a->cw * strlen(text), ph = a->ch;
+  const unsigned col = gravity % 3, row = gravity / 3;
+  const unsigned x0 = pw >= din.image_width ? 0 :
+    (din.image_width - pw) * col / 2;
+  const unsigned y0 = ph >= din.image_height ? 0 :
+    (din.image_height - ph) * row / 2;
+  const unsigned x1 = x0 + pw > din.image_width ? din.image_width : x0 + pw;
+  const unsigned y1 = y0 + ph > din.image_height ? din.image_height : y0 + ph;
+
+  if (pw > 0 && (din.jpeg_color_space == JCS_YCbCr ||
+                 din.jpeg_color_space == JCS_GRAYSCALE)) {
+    const unsigned maxh = din.max_h_samp_factor;
+    const unsigned maxv = din.max_v_samp_factor;
+    for (int ci = 0; ci < din.num_components; ci++) {
+      jpeg_component_info *comp = &din.comp_info[ci];
+      const unsigned hs = comp->h_samp_factor, vs = comp->v_samp_factor;
+
+      /* Find the blocks of this component under the panel. */
+      const unsigned bx0 = x0 * hs / maxh / DCTSIZE;
+      const unsigned by0 = y0 * vs / maxv / DCTSIZE;
+      unsigned bx1 = ((x1 * hs + maxh - 1) / maxh + DCTSIZE - 1) / DCTSIZE;
+      unsigned by1 = ((y1 * vs + maxv - 1) / maxv + DCTSIZE - 1) / DCTSIZE;
+      if (bx1 > comp->width_in_blocks) bx1 = comp->width_in_blocks;
+      if (by1 > comp->height_in_blocks) by1 = comp->height_in_blocks;
+
+      for (unsigned by = by0; by < by1; by++) {
+        JBLOCKARRAY rows =
+          (*din.mem->access_virt_barray)((j_common_ptr) &din, coefs[ci],
+                                         by, 1, TRUE);
+        for (unsigned bx = bx0; bx < bx1; bx++)
+          paint_block(rows[0][bx], comp->quant_table, ci == 0,
+                      a, text, bx * DCTSIZE, by * DCTSIZE,
+                      x0, y0, x1, y1, hs, maxh, vs, maxv);
+      }
+    }
+  }
+
+  jpeg_mem_dest(&cout, out, outlen);
+  jpeg_copy_critical_parameters(&din, &cout);
+  jpeg_write_coefficients(&cout, coefs);
+  jpeg_finish_compress(&cout);
+  jpeg_finish_decompress(&din);
+  jpeg_destroy_compress(&cout);
+  jpeg_destroy_decompress(&din);
+  return 0;
+}
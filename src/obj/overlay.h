@@ -0,0 +1,68 @@
+// -*- c-basic-offset: 2; indent-tabs-mode: nil -*-
+
+/*
+ * Copyright 2018-19, Lancaster University
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ * 
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the
+ *    distribution.
+ * 
+ *  * Neither the name of the copyright holder nor the names of
+ *    its contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ *
+ * Author: Steven Simpson <https://github.com/simpsonst>
+ */
+
+#ifndef OVERLAY_H
+#define OVERLAY_H
+
+#include <stddef.h>
+
+/* A monospace glyph atlas: a PGM of the characters 'chars' rendered
+   in a row, black on white, with equal advances */
+struct atlas;
+
+/* Load an atlas from the PGM at 'path', holding the characters
+   'chars'.  Return NULL on failure, with errno set. */
+struct atlas *atlas_load(const char *path, const char *chars);
+
+void atlas_destroy(struct atlas *);
+
+/* Parse an ImageMagick gravity name (e.g., "NorthWest", "Center").
+   Return -1 if not recognized. */
+int overlay_gravity(const char *name);
+
+/* Stamp 'text', black on a white panel, onto the JPEG of 'len' bytes
+   at 'in', placed according to 'gravity'.  Characters missing from
+   the atlas are left blank.  Only the DCT blocks under the panel are
+   transformed; the rest of the image is carried over losslessly.  On
+   success, set '*out' to a malloc()ed buffer of '*outlen' bytes, and
+   return 0; return -1 on failure. */
+int overlay_jpeg(const struct atlas *, int gravity, const char *text,
+                 const unsigned char *in, size_t len,
+                 unsigned char **out, unsigned long *outlen);
+
+#endif
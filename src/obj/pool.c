@@ -0,0 +1,169 @@
+// -*- c-basic-offset: 2; indent-tabs-mode: nil -*-
+
+/*
+ * Copyright 2018-19, Lancaster University
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ * 
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the
+ *    distribution.
+ * 
+ *  * Neither the name of the copyright holder nor the names of
+ *    its contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ *
+ * Author: Steven Simpson <https://github.com/simpsonst>
+ */
+
+#include <stdlib.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+
+#include <pthread.h>
+
+#include "pool.h"
+
+struct pool {
+  pthread_mutex_t lock;
+  pthread_cond_t start, done;
+
+  /* the threads other than the caller's */
+  unsigned nthreads;
+  pthread_t *threads;
+
+  /* incremented for each batch of work */
+  unsigned long gen;
+
+  /* the current batch */
+  void (*fn)(void *ctx, unsigned i);
+  void *ctx;
+  unsigned count;
+  atomic_uint next;
+
+  /* the number of threads yet to finish the current batch */
+  unsigned busy;
+
+  bool quit;
+};
+
+static void work(struct pool *p)
+{
+  unsigned i;
+  while ((i = atomic_fetch_add(&p->next, 1)) < p->count)
+    (*p->fn)(p->ctx, i);
+}
+
+static void *run_thread(void *vp)
+{
+  struct pool *p = vp;
+  unsigned long seen = 0;
+  pthread_mutex_lock(&p->lock);
+  for ( ; ; ) {
+    while (p->gen == seen && !p->quit)
+      pthread_cond_wait(&p->start, &p->lock);
+    if (p->quit) break;
+    seen = p->gen;
+    pthread_mutex_unlock(&p->lock);
+
+    work(p);
+
+    pthread_mutex_lock(&p->lock);
+    if (--p->busy == 0)
+      pthread_cond_signal(&p->done);
+  }
+  pthread_mutex_unlock(&p->lock);
+  return NULL;
+}
+
+struct pool *pool_create(unsigned nthreads)
+{
+  struct pool *p = malloc(sizeof *p);
+  if (p == NULL) return NULL;
+  p->nthreads = nthreads > 1 ? nthreads - 1 : 0;
+  p->threads = malloc(p->nthreads * sizeof *p->threads);
+  if (p->nthreads > 0 && p->threads == NULL) {
+    free(p);
+    return NULL;
+  }
+  pthread_mutex_init(&p->lock, NULL);
+  pthread_cond_init(&p->start, NULL);
+  pthread_cond_init(&p->done, NULL);
+  p->gen = 0;
+  p->busy = 0;
+  p->quit = false;
+  for (unsigned i = 0; i < p->nthreads; i++) {
+    int rc = pthread_create(&p->threads[i], NULL, &run_thread, p);
+    if (rc != 0) {
+      p->nthreads = i;
+      pool_destroy(p);
+      errno = rc;
+      return NULL;
+    }
+  }
+  return p;
+}
+
+void pool_destroy(struct pool *p)
+{
+  if (p == NULL) return;
+  pthread_mutex_lock(&p->lock);
+  p->quit = true;
+  pthread_cond_broadcast(&p->start);
+  pthread_mutex_unlock(&p->lock);
+  for (unsigned i = 0; i < p->nthreads; i++)
+    pthread_join(p->threads[i], NULL);
+  pthread_cond_destroy(&p->done);
+  pthread_cond_destroy(&p->start);
+  pthread_mutex_destroy(&p->lock);
+  free(p->threads);
+  free(p);
+}
+
+void pool_run(struct pool *p, unsigned count,
+              void (*fn)(void *ctx, unsigned i), void *ctx)
+{
+  if (p->nthreads == 0 || count < 2) {
+    for (unsigned i = 0; i < count; i++)
+      (*fn)(ctx, i);
+    return;
+  }
+
+  pthread_mutex_lock(&p->lock);
+  p->fn = fn;
+  p->ctx = ctx;
+  p->count = count;
+  atomic_store(&p->next, 0);
+  p->busy = p->nthreads;
+  p->gen++;
+  pthread_cond_broadcast(&p->start);
+  pthread_mutex_unlock(&p->lock);
+
+  work(p);
+
+  pthread_mutex_lock(&p->lock);
+  while (p->busy > 0)
+    pthread_cond_wait(&p->done, &p->lock);
+  pthread_mutex_unlock(&p->lock);
+}
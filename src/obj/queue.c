@@ -0,0 +1,192 @@
+// -*- c-basic-offset: 2; indent-tabs-mode: nil -*-
+
+/*
+ * Copyright 2018-19, Lancaster University
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ * 
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the
+ *    distribution.
+ * 
+ *  * Neither the name of the copyright holder nor the names of
+ *    its contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ *
+ * Author: Steven Simpson <https://github.com/simpsonst>
+ */
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdalign.h>
+#include <stdatomic.h>
+#include <limits.h>
+#include <errno.h>
+
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#include "queue.h"
+
+#define CACHE_LINE 64
+
+struct queue {
+  unsigned char *data;
+  size_t size;
+  unsigned slots;
+
+  /* the numbers of slots pushed and popped, each written by only one
+     side, and kept apart so that they don't share a line */
+  alignas(CACHE_LINE) _Atomic uint32_t head;
+  alignas(CACHE_LINE) _Atomic uint32_t tail;
+
+  /* bumped after each change that a waiting side might be waiting
+     for, and waited on */
+  alignas(CACHE_LINE) _Atomic uint32_t wake;
+  _Atomic uint32_t waiters;
+
+  atomic_bool closed, cancelled;
+};
+
+struct queue *queue_create(unsigned slots, size_t size)
+{
+  if (slots < 1 || slots > INT32_MAX) {
+    errno = EINVAL;
+    return NULL;
+  }
+  struct queue *q = aligned_alloc(CACHE_LINE, sizeof *q);
+  if (q == NULL) return NULL;
+  q->size = (size + CACHE_LINE - 1) / CACHE_LINE * CACHE_LINE;
+  q->slots = slots;
+  q->data = aligned_alloc(CACHE_LINE, q->size * slots);
+  if (q->data == NULL) {
+    free(q);
+    return NULL;
+  }
+  atomic_init(&q->head, 0);
+  atomic_init(&q->tail, 0);
+  atomic_init(&q->wake, 0);
+  atomic_init(&q->waiters, 0);
+  atomic_init(&q->closed, false);
+  atomic_init(&q->cancelled, false);
+  return q;
+}
+
+void queue_destroy(struct queue *q)
+{
+  if (q == NULL) return;
+  free(q->data);
+  free(q);
+}
+
+/* Tell the other side that something has changed, if it's
+   waiting. */
+static void notify(struct queue *q)
+{
+  atomic_fetch_add(&q->wake, 1);
+  if (atomic_load(&q->waiters) > 0)
+    syscall(SYS_futex, &q->wake, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+}
+
+/* Wait until the producer may push, or should stop.  Return false
+   if it should stop. */
+static bool await_space(struct queue *q, uint32_t head)
+{
+  if (head - atomic_load_explicit(&q->tail, memory_order_acquire) <
+      q->slots)
+    return true;
+  atomic_fetch_add(&q->waiters, 1);
+  bool ok;
+  for ( ; ; ) {
+    const uint32_t w = atomic_load(&q->wake);
+    if ((ok = head - atomic_load(&q->tail) < q->slots) ||
+        atomic_load(&q->cancelled))
+      break;
+    syscall(SYS_futex, &q->wake, FUTEX_WAIT_PRIVATE, w, NULL, NULL, 0);
+  }
+  atomic_fetch_sub(&q->waiters, 1);
+  return ok && !atomic_load(&q->cancelled);
+}
+
+void *queue_claim(struct queue *q)
+{
+  if (atomic_load_explicit(&q->cancelled, memory_order_relaxed))
+    return NULL;
+  const uint32_t head = atomic_load_explicit(&q->head, memory_order_relaxed);
+  if (!await_space(q, head)) return NULL;
+  return q->data + head % q->slots * q->size;
+}
+
+void queue_push(struct queue *q)
+{
+  atomic_fetch_add(&q->head, 1);
+  notify(q);
+}
+
+void queue_close(struct queue *q)
+{
+  atomic_store(&q->closed, true);
+  notify(q);
+}
+
+void *queue_front(struct queue *q)
+{
+  const uint32_t tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+  if (atomic_load_explicit(&q->head, memory_order_acquire) != tail)
+    return q->data + tail % q->slots * q->size;
+
+  atomic_fetch_add(&q->waiters, 1);
+  bool got = false;
+  for ( ; ; ) {
+    const uint32_t w = atomic_load(&q->wake);
+    if ((got = atomic_load(&q->head) != tail) || atomic_load(&q->closed))
+      break;
+    if (syscall(SYS_futex, &q->wake, FUTEX_WAIT_PRIVATE,
+                w, NULL, NULL, 0) < 0 && errno == EINTR)
+      break;
+  }
+  atomic_fetch_sub(&q->waiters, 1);
+  if (!got) {
+    /* The producer might have pushed a last slot before closing. */
+    if (atomic_load(&q->head) != tail)
+      return q->data + tail % q->slots * q->size;
+    if (atomic_load(&q->closed))
+      errno = 0;
+    return NULL;
+  }
+  return q->data + tail % q->slots * q->size;
+}
+
+void queue_pop(struct queue *q)
+{
+  atomic_fetch_add(&q->tail, 1);
+  notify(q);
+}
+
+void queue_cancel(struct queue *q)
+{
+  atomic_store(&q->cancelled, true);
+  notify(q);
+}
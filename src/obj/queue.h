@@ -0,0 +1,78 @@
+// -*- c-basic-offset: 2; indent-tabs-mode: nil -*-
+
+/*
+ * Copyright 2018-19, Lancaster University
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ * 
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the
+ *    distribution.
+ * 
+ *  * Neither the name of the copyright holder nor the names of
+ *    its contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ *
+ * Author: Steven Simpson <https://github.com/simpsonst>
+ */
+
+#ifndef QUEUE_H
+#define QUEUE_H
+
+#include <stddef.h>
+
+/* A bounded queue of fixed-size slots, allocated up front, passing
+   work from one producing thread to one consuming thread.  Neither
+   side takes a lock; a side only sleeps when the queue is full or
+   empty. */
+struct queue;
+
+/* Create a queue of 'slots' slots, each of 'size' bytes, aligned to
+   a cache line.  Return NULL on error, with errno set. */
+struct queue *queue_create(unsigned slots, size_t size);
+
+void queue_destroy(struct queue *);
+
+/* As the producer, get the next empty slot, waiting while the queue
+   is full.  Return NULL if the consumer has cancelled. */
+void *queue_claim(struct queue *);
+
+/* As the producer, pass on the slot got from 'queue_claim'. */
+void queue_push(struct queue *);
+
+/* As the producer, say that no more slots will be pushed. */
+void queue_close(struct queue *);
+
+/* As the consumer, get the oldest full slot, waiting while the queue
+   is empty.  Return NULL if the queue is empty and closed, or with
+   errno set to EINTR if a signal interrupted the wait. */
+void *queue_front(struct queue *);
+
+/* As the consumer, release the slot got from 'queue_front'. */
+void queue_pop(struct queue *);
+
+/* As the consumer, say that no more slots will be taken, so that
+   the producer should stop. */
+void queue_cancel(struct queue *);
+
+#endif
@@ -0,0 +1,427 @@
+// -*- c-basic-offset: 2; indent-tabs-mode: nil -*-
+
+/*
+ * Copyright 2018-19, Lancaster University
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ * 
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the
+ *    distribution.
+ * 
+ *  * Neither the name of the copyright holder nor the names of
+ *    its contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ *
+ * Author: Steven Simpson <https://github.com/simpsonst>
+ */
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <limits.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "ring.h"
+
+#define RING_MAGIC UINT64_C(0x53746543616d5231)
+
+/* Each slot describes one frame.  The data of all frames is held
+   in a separate circular area.  Positions in that area are logical,
+   i.e., they keep increasing, and are reduced modulo the area's
+   size only to access it.  A frame's data is never split across the
+   end of the area. */
+struct slot {
+  /* the sequence number of the frame, or BUSY while it is being
+     written */
+  _Atomic uint64_t seq;
+
+  uint64_t start, len;
+  int64_t sec;
+  int32_t nsec;
+  uint32_t flags;
+};
+
+#define BUSY UINT64_MAX
+
+struct header {
+  uint64_t magic;
+  uint64_t slots, datasize;
+
+  /* the sequence number of the next frame to be written */
+  _Atomic uint64_t head;
+
+  /* the logical position of the next frame's data */
+  uint64_t written;
+
+  /* the logical position before which data may already have been
+     overwritten */
+  _Atomic uint64_t reclaimed;
+
+  /* incremented with each frame, for readers to wait on */
+  _Atomic uint32_t wake;
+
+  /* the number of readers waiting */
+  _Atomic uint32_t waiters;
+
+  /* set when the producer has replaced this ring with another */
+  _Atomic uint32_t stale;
+
+  struct slot slot[];
+};
+
+struct ring {
+  char *path;
+  struct header *hdr;
+  unsigned char *data;
+  size_t mapsize;
+};
+
+static size_t layout(uint64_t slots, uint64_t datasize, size_t *dataoff)
+{
+  size_t off = sizeof(struct header) + slots * sizeof(struct slot);
+  off = (off + 63) / 64 * 64;
+  *dataoff = off;
+  return off + datasize;
+}
+
+static int map(struct ring *r, int fd, size_t size, size_t dataoff)
+{
+  void *p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (p == MAP_FAILED) return -1;
+  r->hdr = p;
+  r->data = (unsigned char *) p + dataoff;
+  r->mapsize = size;
+  return 0;
+}
+
+/* Map an existing ring, checking that it is complete. */
+static int attach(struct ring *r)
+{
+  int fd = open(r->path, O_RDWR);
+  if (fd < 0) return -1;
+
+  struct stat st;
+  struct header hdr;
+  if (fstat(fd, &st) < 0 || pread(fd, &hdr, sizeof hdr, 0) != sizeof hdr) {
+    close(fd);
+    return -1;
+  }
+  size_t dataoff;
+  if (hdr.magic != RING_MAGIC || hdr.slots == 0 || hdr.datasize == 0 ||
+      layout(hdr.slots, hdr.datasize, &dataoff) != (size_t) st.st_size) {
+    close(fd);
+    errno = EINVAL;
+    return -1;
+  }
+  int rc = map(r, fd, st.st_size, dataoff);
+  close(fd);
+  return rc;
+}
+
+static void detach(struct ring *r)
+{
+  if (r->hdr == NULL) return;
+  munmap(r->hdr, r->mapsize);
+  r->hdr = NULL;
+}
+
+static struct ring *alloc_ring(const char *path)
+{
+  struct ring *r = malloc(sizeof *r);
+  if (r == NULL) return NULL;
+  r->path = strdup(path);
+  r->hdr = NULL;
+  if (r->path == NULL) {
+    free(r);
+    return NULL;
+  }
+  return r;
+}
+
+static void free_ring(struct ring *r)
+{
+  int e = errno;
+  detach(r);
+  free(r->path);
+  free(r);
+  errno = e;
+}
+
+struct ring *ring_create(const char *path, size_t slots, size_t datasize)
+{
+  struct ring *r = alloc_ring(path);
+  if (r == NULL) return NULL;
+
+  /* Continue with an existing ring if it has the right shape, so
+     that readers need not notice that the producer restarted.
+     Otherwise, keep hold of it, so its readers can be told to move
+     on. */
+  struct ring old = { .path = r->path, .hdr = NULL };
+  if (attach(&old) == 0 &&
+      old.hdr->slots == slots && old.hdr->datasize == datasize &&
+      !atomic_load(&old.hdr->stale)) {
+    *r = old;
+    return r;
+  }
+
+  /* Build a new ring in a temporary file, and move it into
+     place. */
+  size_t dataoff;
+  const size_t size = layout(slots, datasize, &dataoff);
+  size_t tmplen = strlen(path) + 8;
+  char tmpname[tmplen];
+  snprintf(tmpname, tmplen, "%s.XXXXXX", path);
+  int fd = mkstemp(tmpname);
+  if (fd < 0) {
+    detach(&old);
+    free_ring(r);
+    return NULL;
+  }
+  if (ftruncate(fd, size) < 0 || map(r, fd, size, dataoff) < 0) {
+    close(fd);
+    unlink(tmpname);
+    detach(&old);
+    free_ring(r);
+    return NULL;
+  }
+  close(fd);
+
+  struct header *hdr = r->hdr;
+  hdr->magic = RING_MAGIC;
+  hdr->slots = slots;
+  hdr->datasize = datasize;
+  for (size_t i = 0; i < slots; i++)
+    atomic_init(&hdr->slot[i].seq, BUSY);
+
+  if (rename(tmpname, path) < 0) {
+    unlink(tmpname);
+    detach(&old);
+    free_ring(r);
+    return NULL;
+  }
+
+  /* Tell readers of any previous ring to move to this one. */
+  if (old.hdr != NULL) {
+    atomic_store(&old.hdr->stale, 1);
+    atomic_fetch_add(&old.hdr->wake, 1);
+    syscall(SYS_futex, &old.hdr->wake, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+    detach(&old);
+  }
+  return r;
+}
+
+struct ring *ring_open(const char *path)
+{
+  struct ring *r = alloc_ring(path);
+  if (r == NULL) return NULL;
+  if (attach(r) < 0) {
+    free_ring(r);
+    return NULL;
+  }
+  return r;
+}
+
+void ring_close(struct ring *r)
+{
+  if (r == NULL) return;
+  free_ring(r);
+}
+
+size_t ring_maxframe(const struct ring *r)
+{
+  return r->hdr->datasize / 2;
+}
+
+uint64_t ring_head(const struct ring *r)
+{
+  return atomic_load_explicit(&r->hdr->head, memory_order_acquire);
+}
+
+int ring_put(struct ring *r, const void *data, size_t len,
+             const struct timespec *stamp, uint32_t flags)
+{
+  struct header *const hdr = r->hdr;
+  if (len > ring_maxframe(r)) return RING_TOOBIG;
+
+  /* Find contiguous space for the data, and declare the data it
+     will overwrite as reclaimed before touching it. */
+  uint64_t pos = hdr->written;
+  const uint64_t off = pos % hdr->datasize;
+  if (off + len > hdr->datasize)
+    pos += hdr->datasize - off;
+  const uint64_t end = pos + len;
+  if (end > hdr->datasize)
+    atomic_store_explicit(&hdr->reclaimed, end - hdr->datasize,
+                          memory_order_relaxed);
+
+  const uint64_t seq = atomic_load_explicit(&hdr->head, memory_order_relaxed);
+  struct slot *const sl = &hdr->slot[seq % hdr->slots];
+  atomic_store_explicit(&sl->seq, BUSY, memory_order_relaxed);
+  atomic_thread_fence(memory_order_release);
+
+  sl->start = pos;
+  sl->len = len;
+  sl->sec = stamp->tv_sec;
+  sl->nsec = stamp->tv_nsec;
+  sl->flags = flags;
+  memcpy(r->data + pos % hdr->datasize, data, len);
+  hdr->written = end;
+
+  atomic_store_explicit(&sl->seq, seq, memory_order_release);
+  atomic_store_explicit(&hdr->head, seq + 1, memory_order_release);
+
+  /* Only make a system call if someone is waiting. */
+  atomic_fetch_add(&hdr->wake, 1);
+  if (atomic_load(&hdr->waiters) > 0)
+    syscall(SYS_futex, &hdr->wake, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+  return 0;
+}
+
+/* Copy out the description of a frame, optionally with its data,
+   checking afterwards that the producer did not overwrite any of it
+   while we were reading. */
+static int get(struct ring *r, uint64_t seq,
+               void *buf, size_t max, struct ring_frame *out)
+{
+  struct header *const hdr = r->hdr;
+  const uint64_t head = atomic_load_explicit(&hdr->head, memory_order_acquire);
+  if (seq >= head) return RING_AGAIN;
+  if (head - seq > hdr->slots) return RING_GONE;
+
+  struct slot *const sl = &hdr->slot[seq % hdr->slots];
+  if (atomic_load_explicit(&sl->seq, memory_order_acquire) != seq)
+    return RING_GONE;
+  const uint64_t start = sl->start, len = sl->len;
+  out->seq = seq;
+  out->stamp.tv_sec = sl->sec;
+  out->stamp.tv_nsec = sl->nsec;
+  out->flags = sl->flags;
+  out->len = len;
+  atomic_thread_fence(memory_order_acquire);
+  if (atomic_load_explicit(&sl->seq, memory_order_relaxed) != seq ||
+      atomic_load_explicit(&hdr->reclaimed, memory_order_relaxed) > start)
+    return RING_GONE;
+
+  if (buf == NULL) return RING_OK;
+  if (len > max) return RING_TOOBIG;
+  memcpy(buf, r->data + start % hdr->datasize, len);
+  atomic_thread_fence(memory_order_acquire);
+  if (atomic_load_explicit(&sl->seq, memory_order_relaxed) != seq ||
+      atomic_load_explicit(&hdr->reclaimed, memory_order_relaxed) > start)
+    return RING_GONE;
+  return RING_OK;
+}
+
+int ring_peek(struct ring *r, uint64_t seq, struct ring_frame *out)
+{
+  return get(r, seq, NULL, 0, out);
+}
+
+int ring_fetch(struct ring *r, uint64_t seq,
+               void *buf, size_t max, struct ring_frame *out)
+{
+  return get(r, seq, buf, max, out);
+}
+
+/* Wait until the ring's head passes 'seq', or the ring is replaced.
+   Return false on timeout. */
+static bool await(struct ring *r, uint64_t seq, int timeout_ms)
+{
+  struct header *const hdr = r->hdr;
+  struct timespec ts, *tsp = NULL;
+  if (timeout_ms >= 0) {
+    ts.tv_sec = timeout_ms / 1000;
+    ts.tv_nsec = timeout_ms % 1000 * 1000000L;
+    tsp = &ts;
+  }
+
+  atomic_fetch_add(&hdr->waiters, 1);
+  bool got = true;
+  for ( ; ; ) {
+    const uint32_t w = atomic_load(&hdr->wake);
+    if (atomic_load(&hdr->head) > seq || atomic_load(&hdr->stale))
+      break;
+    if (syscall(SYS_futex, &hdr->wake, FUTEX_WAIT, w, tsp, NULL, 0) < 0 &&
+        errno == ETIMEDOUT) {
+      got = atomic_load(&hdr->head) > seq;
+      break;
+    }
+  }
+  atomic_fetch_sub(&hdr->waiters, 1);
+  return got;
+}
+
+int ring_next(struct ring *r, struct ring_cursor *cur,
+              void *buf, size_t max, struct ring_frame *out,
+              int timeout_ms)
+{
+  for ( ; ; ) {
+    if (atomic_load(&r->hdr->stale)) {
+      /* The producer has started a new ring. */
+      struct ring alt = { .path = r->path, .hdr = NULL };
+      if (attach(&alt) < 0 || atomic_load(&alt.hdr->stale)) {
+        /* Its replacement isn't ready yet. */
+        detach(&alt);
+        const struct timespec pause = { .tv_nsec = 100000000 };
+        nanosleep(&pause, NULL);
+        return RING_AGAIN;
+      }
+      detach(r);
+      *r = alt;
+      cur->next = ring_head(r);
+    }
+
+    const uint64_t head = ring_head(r);
+    if (cur->next >= head) {
+      if (!await(r, cur->next, timeout_ms)) return RING_AGAIN;
+      continue;
+    }
+
+    /* Skip straight past anything that can't still be present. */
+    if (head - cur->next > r->hdr->slots) {
+      cur->missed += head - cur->next - r->hdr->slots;
+      cur->next = head - r->hdr->slots;
+    }
+
+    int rc = get(r, cur->next, buf, max, out);
+    cur->next++;
+    if (rc == RING_GONE) {
+      cur->missed++;
+      continue;
+    }
+    return rc;
+  }
+}
@@ -0,0 +1,119 @@
+// -*- c-basic-offset: 2; indent-tabs-mode: nil -*-
+
+/*
+ * Copyright 2018-19, Lancaster University
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ * 
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the
+ *    distribution.
+ * 
+ *  * Neither the name of the copyright holder nor the names of
+ *    its contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ *
+ * Author: Steven Simpson <https://github.com/simpsonst>
+ */
+
+#ifndef RING_H
+#define RING_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+/* A ring of encoded frames in a shared, memory-mapped file.  One
+   producer appends frames; any number of readers follow it, each
+   with its own cursor.  A reader that falls too far behind finds
+   that the frames it wanted have been overwritten, and is told how
+   many it missed. */
+
+struct ring;
+
+/* A frame's description */
+struct ring_frame {
+  uint64_t seq;
+  struct timespec stamp;
+  uint32_t flags;
+  size_t len;
+};
+
+/* A reader's position in the ring */
+struct ring_cursor {
+  /* the next frame to read */
+  uint64_t next;
+
+  /* the number of frames overwritten before they could be read */
+  uint64_t missed;
+};
+
+/* Results of reading */
+#define RING_OK 0
+#define RING_AGAIN (-1)
+#define RING_GONE (-2)
+#define RING_TOOBIG (-3)
+
+/* Open the ring at 'path' as its producer, creating or replacing it
+   unless an existing ring has the same geometry.  Return NULL on
+   error, with errno set. */
+struct ring *ring_create(const char *path, size_t slots, size_t datasize);
+
+/* Open an existing ring as a reader.  Return NULL on error, with
+   errno set. */
+struct ring *ring_open(const char *path);
+
+void ring_close(struct ring *);
+
+/* Get the largest frame that the ring will accept. */
+size_t ring_maxframe(const struct ring *);
+
+/* Get the sequence number that the next frame will have. */
+uint64_t ring_head(const struct ring *);
+
+/* Append a frame, and wake any waiting readers.  Return 0 on
+   success, or RING_TOOBIG. */
+int ring_put(struct ring *, const void *data, size_t len,
+             const struct timespec *stamp, uint32_t flags);
+
+/* Get the description of frame 'seq', without its data.  Return
+   RING_OK, RING_AGAIN if it has not been written yet, or RING_GONE
+   if it has been overwritten. */
+int ring_peek(struct ring *, uint64_t seq, struct ring_frame *);
+
+/* Copy frame 'seq' into 'buf', and describe it.  Return as
+   'ring_peek', or RING_TOOBIG if it does not fit in 'max' bytes. */
+int ring_fetch(struct ring *, uint64_t seq,
+               void *buf, size_t max, struct ring_frame *);
+
+/* Copy the next available frame into 'buf', and advance the cursor.
+   Wait up to 'timeout_ms' (or indefinitely if negative) for one to
+   arrive.  Frames overwritten before they could be read are
+   skipped, and counted in the cursor.  If the producer has replaced
+   the ring, it is reopened, and the cursor moved to its head.
+   Return RING_OK, RING_AGAIN on timeout, or RING_TOOBIG. */
+int ring_next(struct ring *, struct ring_cursor *,
+              void *buf, size_t max, struct ring_frame *,
+              int timeout_ms);
+
+#endif
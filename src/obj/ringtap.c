@@ -0,0 +1,218 @@
+// -*- c-basic-offset: 2; indent-tabs-mode: nil -*-
+
+/*
+ * Copyright 2018-19, Lancaster University
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ * 
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the
+ *    distribution.
+ * 
+ *  * Neither the name of the copyright holder nor the names of
+ *    its contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ *
+ * Author: Steven Simpson <https://github.com/simpsonst>
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <inttypes.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "ring.h"
+
+/* Without frame arguments, follow a ring, printing the sequence
+   number and timestamp (in milliseconds) of each frame as it
+   arrives.  With arguments, each is the timestamp of a frame to be
+   written to <dir>/at-<timestamp>.jpg, if it is still in the
+   ring. */
+
+static long long stamp_ms(const struct timespec *ts)
+{
+  return ts->tv_sec * 1000LL + ts->tv_nsec / 1000000;
+}
+
+static int compare_ll(const void *av, const void *bv)
+{
+  const long long *a = av, *b = bv;
+  return (*a > *b) - (*a < *b);
+}
+
+static int follow(const char *prog, const char *path)
+{
+  struct ring *ring;
+  while ((ring = ring_open(path)) == NULL) {
+    if (errno != ENOENT && errno != EINVAL) {
+      fprintf(stderr, "%s: %s: opening %s\n", prog, strerror(errno), path);
+      return EXIT_FAILURE;
+    }
+    /* Wait for the producer to start. */
+    sleep(1);
+  }
+
+  struct ring_cursor cur = { .next = ring_head(ring) };
+  uint64_t missed = 0;
+  for ( ; ; ) {
+    struct ring_frame fr;
+    int rc = ring_next(ring, &cur, NULL, 0, &fr, -1);
+    if (rc == RING_AGAIN) continue;
+    if (cur.missed != missed) {
+      fprintf(stderr, "Missed %" PRIu64 " frames\n", cur.missed - missed);
+      missed = cur.missed;
+    }
+    if (printf("%" PRIu64 " %lld\n", fr.seq, stamp_ms(&fr.stamp)) < 0 ||
+        fflush(stdout) == EOF)
+      break;
+  }
+  ring_close(ring);
+  return EXIT_SUCCESS;
+}
+
+static int extract(const char *prog, const char *path, const char *dir,
+                   size_t count, long long want[count])
+{
+  struct ring *ring = ring_open(path);
+  if (ring == NULL) {
+    fprintf(stderr, "%s: %s: opening %s\n", prog, strerror(errno), path);
+    return EXIT_FAILURE;
+  }
+  const size_t max = ring_maxframe(ring);
+  unsigned char *buf = malloc(max);
+  bool *found = calloc(count, sizeof *found);
+  if (buf == NULL || found == NULL) {
+    fprintf(stderr, "%s: %s: allocating\n", prog, strerror(errno));
+    return EXIT_FAILURE;
+  }
+  qsort(want, count, sizeof want[0], &compare_ll);
+
+  /* Scan backwards from the newest frame, until the ring runs
+     out. */
+  int status = EXIT_SUCCESS;
+  for (uint64_t seq = ring_head(ring); seq-- > 0; ) {
+    struct ring_frame fr;
+    if (ring_peek(ring, seq, &fr) != RING_OK) break;
+    long long t = stamp_ms(&fr.stamp);
+    long long *hit = bsearch(&t, want, count, sizeof want[0], &compare_ll);
+    if (hit == NULL || found[hit - want]) continue;
+    if (ring_fetch(ring, seq, buf, max, &fr) != RING_OK) break;
+
+    char name[PATH_MAX];
+    snprintf(name, sizeof name, "%s/at-%lld.jpg", dir, t);
+    int fd = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0) {
+      fprintf(stderr, "%s: %s: creating %s\n", prog, strerror(errno), name);
+      status = EXIT_FAILURE;
+      continue;
+    }
+    const unsigned char *p = buf;
+    size_t rem = fr.len;
+    while (rem > 0) {
+      ssize_t done = write(fd, p, rem);
+      if (done < 0) break;
+      p += done;
+      rem -= done;
+    }
+    struct timespec times[2] = { fr.stamp, fr.stamp };
+    futimens(fd, times);
+    if (close(fd) < 0 || rem > 0) {
+      fprintf(stderr, "%s: %s: writing %s\n", prog, strerror(errno), name);
+      unlink(name);
+      status = EXIT_FAILURE;
+      continue;
+    }
+    found[hit - want] = true;
+  }
+
+  for (size_t i = 0; i < count; i++)
+    if (!found[i])
+      fprintf(stderr, "%s: frame %lld no longer available\n", prog, want[i]);
+
+  free(found);
+  free(buf);
+  ring_close(ring);
+  return status;
+}
+
+int main(int argc, const char *const *argv)
+{
+  const char *path = NULL;
+  const char *dir = ".";
+  size_t count = 0;
+  long long want[argc];
+
+  /* Parse command-line arguments. */
+  bool show_help = false, fail = false;
+  for (int argi = 1; argi < argc; argi++) {
+    if (!strcmp(argv[argi], "-m")) {
+      if (++argi == argc) {
+        show_help = true;
+        fail = true;
+        break;
+      }
+      path = argv[argi];
+    } else if (!strcmp(argv[argi], "-o")) {
+      if (++argi == argc) {
+        show_help = true;
+        fail = true;
+        break;
+      }
+      dir = argv[argi];
+    } else if (argv[argi][0] == '-' || argv[argi][0] == '+') {
+      fprintf(stderr, "%s: unknown switch: %s\n", argv[0], argv[argi]);
+      exit(EXIT_FAILURE);
+    } else {
+      char *end;
+      want[count] = strtoll(argv[argi], &end, 10);
+      if (*end != '\0') {
+        fprintf(stderr, "%s: bad timestamp: %s\n", argv[0], argv[argi]);
+        exit(EXIT_FAILURE);
+      }
+      count++;
+    }
+  }
+  if (path == NULL) {
+    show_help = true;
+    fail = true;
+  }
+
+  if (show_help) {
+    fprintf(stderr,
+            "Usage: %s -m ring\n"
+            "\t[-o dir timestamp...]\n", argv[0]);
+    exit(fail ? EXIT_FAILURE : EXIT_SUCCESS);
+  }
+
+  if (count > 0)
+    return extract(argv[0], path, dir, count, want);
+  return follow(argv[0], path);
+}
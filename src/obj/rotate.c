@@ -0,0 +1,222 @@
+// -*- c-basic-offset: 2; indent-tabs-mode: nil -*-
+
+/*
+ * Copyright 2018-19, Lancaster University
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ * 
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the
+ *    distribution.
+ * 
+ *  * Neither the name of the copyright holder nor the names of
+ *    its contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ *
+ * Author: Steven Simpson <https://github.com/simpsonst>
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <setjmp.h>
+
+#include <jpeglib.h>
+
+#include "rotate.h"
+
+/* This replaces the per-frame invocation of 'jpegtran -rotate'.  The
+   DCT blocks are moved, and their coefficients transposed and
+   negated, without decoding.  A rotation by 90 degrees is a
+   transposition followed by a horizontal mirror, which negates the
+   odd columns of each block; 270 is a transposition followed by a
+   vertical mirror, negating the odd rows; 180 mirrors both ways. */
+
+struct errmgr {
+  struct jpeg_error_mgr pub;
+  jmp_buf jmp;
+};
+
+static void on_error(j_common_ptr cinfo)
+{
+  struct errmgr *err = (struct errmgr *) cinfo->err;
+  longjmp(err->jmp, 1);
+}
+
+static void on_message(j_common_ptr cinfo)
+{
+  (void) cinfo;
+}
+
+static unsigned round_up(unsigned n, unsigned m)
+{
+  return (n + m - 1) / m * m;
+}
+
+static void turn_block(int degrees, JCOEFPTR dst, const JCOEF *src)
+{
+  for (int v = 0; v < DCTSIZE; v++)
+    for (int u = 0; u < DCTSIZE; u++)
+      switch (degrees) {
+      case 90:
+        dst[v * DCTSIZE + u] = (u & 1) ?
+          -src[u * DCTSIZE + v] : src[u * DCTSIZE + v];
+        break;
+      case 180:
+        dst[v * DCTSIZE + u] = ((u ^ v) & 1) ?
+          -src[v * DCTSIZE + u] : src[v * DCTSIZE + u];
+        break;
+      case 270:
+        dst[v * DCTSIZE + u] = (v & 1) ?
+          -src[u * DCTSIZE + v] : src[u * DCTSIZE + v];
+        break;
+      }
+}
+
+int rotate_jpeg(int degrees, const unsigned char *in, size_t len,
+                unsigned char **out, unsigned long *outlen)
+{
+  if (degrees != 90 && degrees != 180 && degrees != 270) return -1;
+
+  struct jpeg_decompress_struct din;
+  struct jpeg_compress_struct cout;
+  struct errmgr err;
+  din.err = cout.err = jpeg_std_error(&err.pub);
+  err.pub.error_exit = &on_error;
+  err.pub.output_message = &on_message;
+  *out = NULL;
+  *outlen = 0;
+  if (setjmp(err.jmp)) {
+    jpeg_destroy_compress(&cout);
+    jpeg_destroy_decompress(&din);
+    free(*out);
+    *out = NULL;
+    return -1;
+  }
+  jpeg_create_decompress(&din);
+  jpeg_create_compress(&cout);
+  jpeg_mem_src(&din, in, len);
+  jpeg_read_header(&din, TRUE);
+  jvirt_barray_ptr *src = jpeg_read_coefficients(&din);
+  jpeg_copy_critical_parameters(&din, &cout);
+
+  /* Trim the source edges that will move to the top or left. */
+  const unsigned mcuw = din.max_h_samp_factor * DCTSIZE;
+  const unsigned mcuh = din.max_v_samp_factor * DCTSIZE;
+  unsigned sw = din.image_width, sh = din.image_height;
+  if (degrees != 270) sh -= sh % mcuh;
+  if (degrees != 90) sw -= sw % mcuw;
+  if (sw == 0 || sh == 0) longjmp(err.jmp, 1);
+
+  const int quarter = degrees != 180;
+  cout.image_width = quarter ? sh : sw;
+  cout.image_height = quarter ? sw : sh;
+  const unsigned maxh =
+    quarter ? din.max_v_samp_factor : din.max_h_samp_factor;
+  const unsigned maxv =
+    quarter ? din.max_h_samp_factor : din.max_v_samp_factor;
+  if (quarter) {
+    for (int c = 0; c < cout.num_components; c++) {
+      jpeg_component_info *ci = &cout.comp_info[c];
+      int t = ci->h_samp_factor;
+      ci->h_samp_factor = ci->v_samp_factor;
+      ci->v_samp_factor = t;
+    }
+    for (int q = 0; q < NUM_QUANT_TBLS; q++) {
+      JQUANT_TBL *qt = cout.quant_tbl_ptrs[q];
+      if (qt == NULL) continue;
+      for (int v = 0; v < DCTSIZE; v++)
+        for (int u = v + 1; u < DCTSIZE; u++) {
+          UINT16 t = qt->quantval[v * DCTSIZE + u];
+          qt->quantval[v * DCTSIZE + u] = qt->quantval[u * DCTSIZE + v];
+          qt->quantval[u * DCTSIZE + v] = t;
+        }
+    }
+  }
+
+  /* Allocate the destination blocks, padded to whole MCUs. */
+  jvirt_barray_ptr *dst = (*cout.mem->alloc_small)
+    ((j_common_ptr) &cout, JPOOL_IMAGE,
+     sizeof(jvirt_barray_ptr) * cout.num_components);
+  unsigned dwb[MAX_COMPONENTS], dhb[MAX_COMPONENTS];
+  for (int c = 0; c < cout.num_components; c++) {
+    const jpeg_component_info *ci = &cout.comp_info[c];
+    const unsigned w = ((unsigned long) cout.image_width * ci->h_samp_factor
+                        + maxh - 1) / maxh;
+    const unsigned h = ((unsigned long) cout.image_height * ci->v_samp_factor
+                        + maxv - 1) / maxv;
+    dwb[c] = round_up((w + DCTSIZE - 1) / DCTSIZE, ci->h_samp_factor);
+    dhb[c] = round_up((h + DCTSIZE - 1) / DCTSIZE, ci->v_samp_factor);
+    dst[c] = (*cout.mem->request_virt_barray)
+      ((j_common_ptr) &cout, JPOOL_IMAGE, TRUE, dwb[c], dhb[c],
+       ci->v_samp_factor);
+  }
+  (*cout.mem->realize_virt_arrays)((j_common_ptr) &cout);
+
+  /* Move each block from where the source had it. */
+  for (int c = 0; c < cout.num_components; c++) {
+    const jpeg_component_info *si = &din.comp_info[c];
+    const unsigned stw = (unsigned long) sw * si->h_samp_factor
+      / din.max_h_samp_factor / DCTSIZE;
+    const unsigned sth = (unsigned long) sh * si->v_samp_factor
+      / din.max_v_samp_factor / DCTSIZE;
+    for (unsigned by = 0; by < dhb[c]; by++) {
+      JBLOCKARRAY drow = (*cout.mem->access_virt_barray)
+        ((j_common_ptr) &cout, dst[c], by, 1, TRUE);
+      for (unsigned bx = 0; bx < dwb[c]; bx++) {
+        long sx, sy;
+        switch (degrees) {
+        case 90:
+          sx = by;
+          sy = (long) sth - 1 - bx;
+          break;
+        case 180:
+          sx = (long) stw - 1 - bx;
+          sy = (long) sth - 1 - by;
+          break;
+        default:
+          sx = (long) stw - 1 - by;
+          sy = bx;
+          break;
+        }
+        if (sx < 0 || sy < 0 ||
+            sx >= (long) si->width_in_blocks ||
+            sy >= (long) si->height_in_blocks) {
+          memset(drow[0][bx], 0, sizeof(JBLOCK));
+          continue;
+        }
+        JBLOCKARRAY srow = (*din.mem->access_virt_barray)
+          ((j_common_ptr) &din, src[c], sy, 1, FALSE);
+        turn_block(degrees, drow[0][bx], srow[0][sx]);
+      }
+    }
+  }
+
+  jpeg_mem_dest(&cout, out, outlen);
+  jpeg_write_coefficients(&cout, dst);
+  jpeg_finish_compress(&cout);
+  jpeg_finish_decompress(&din);
+  jpeg_destroy_compress(&cout);
+  jpeg_destroy_decompress(&din);
+  return 0;
+}
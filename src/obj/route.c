@@ -0,0 +1,422 @@
+// -*- c-basic-offset: 2; indent-tabs-mode: nil -*-
+
+/*
+ * Copyright 2018-19, Lancaster University
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ * 
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the
+ *    distribution.
+ * 
+ *  * Neither the name of the copyright holder nor the names of
+ *    its contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ *
+ * Author: Steven Simpson <https://github.com/simpsonst>
+ */
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <string.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <inttypes.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "ring.h"
+#include "rotate.h"
+
+/* Route captured frames to their consumers, replacing a shell loop
+   that forked several processes per frame.  Each frame is moved
+   from the capture directory (rotated on the way, if required) to
+   <detdir>/at-<ms>.jpg, where it is kept in case it is recorded, and
+   hard-linked into the live directory.  A line is then printed for
+   the motion detector, giving the length of the frame's name, the
+   name, and, if the frame is due to be sampled, the source to score
+   it from.  With -m, frames are instead followed in a ring, and
+   scored from there by sequence number; they are given the names
+   they will have if recorded, but are not written out. */
+
+/* Sampling for motion detection at 'num' frames per 'denom'
+   milliseconds */
+struct sampler {
+  long long num, denom;
+  long long next;
+};
+
+/* Decide whether a frame at 't' should be submitted for motion
+   detection. */
+static bool due(struct sampler *s, long long t)
+{
+  if (s->num == 0) return false;
+  long long st = t * s->num;
+  if (st < s->next) return false;
+
+  /* How many frames should we have had? */
+  long long offset = 1 + (st - s->next) / s->denom;
+  if (offset > 1 && s->next != 0)
+    fprintf(stderr, "Missed %lld frames\n", offset - 1);
+  s->next += s->denom * offset;
+  return true;
+}
+
+static bool report(const char *mid, const char *src)
+{
+  if (src != NULL)
+    printf("%zu %s %s\n", strlen(mid), mid, src);
+  else
+    printf("%zu %s\n", strlen(mid), mid);
+  return fflush(stdout) != EOF;
+}
+
+static int write_all(int fd, const void *data, size_t len)
+{
+  const unsigned char *p = data;
+  while (len > 0) {
+    ssize_t done = write(fd, p, len);
+    if (done < 0) {
+      if (errno == EINTR) continue;
+      return -1;
+    }
+    p += done;
+    len -= done;
+  }
+  return 0;
+}
+
+/* Read a whole file into a growing buffer. */
+static int slurp(const char *name, unsigned char **buf, size_t *cap,
+                 size_t *len)
+{
+  int fd = open(name, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) return -1;
+  *len = 0;
+  for ( ; ; ) {
+    if (*len == *cap) {
+      size_t ncap = *cap ? *cap * 2 : 65536;
+      void *nb = realloc(*buf, ncap);
+      if (nb == NULL) break;
+      *buf = nb;
+      *cap = ncap;
+    }
+    ssize_t got = read(fd, *buf + *len, *cap - *len);
+    if (got < 0 && errno == EINTR) continue;
+    if (got < 0) break;
+    if (got == 0) {
+      close(fd);
+      return 0;
+    }
+    *len += got;
+  }
+  int e = errno;
+  close(fd);
+  errno = e;
+  return -1;
+}
+
+/* Write 'len' bytes to 'name' by way of a hidden file, with the
+   given time. */
+static int put_file(const char *dir, const char *leaf,
+                    const void *data, size_t len,
+                    const struct timespec *ts)
+{
+  char name[PATH_MAX], tmpname[PATH_MAX];
+  snprintf(name, sizeof name, "%s/%s", dir, leaf);
+  snprintf(tmpname, sizeof tmpname, "%s/.tmp-%s", dir, leaf);
+  int fd = open(tmpname, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+  if (fd < 0) return -1;
+  if (write_all(fd, data, len) < 0) {
+    int e = errno;
+    close(fd);
+    unlink(tmpname);
+    errno = e;
+    return -1;
+  }
+  struct timespec times[2] = { *ts, *ts };
+  futimens(fd, times);
+  if (close(fd) < 0 || rename(tmpname, name) < 0) {
+    int e = errno;
+    unlink(tmpname);
+    errno = e;
+    return -1;
+  }
+  return 0;
+}
+
+struct router {
+  const char *prog;
+  const char *detdir, *livedir;
+  int rotation;
+  struct sampler samp;
+  unsigned char *buf, *rot;
+  size_t cap;
+};
+
+/* Move a captured frame into place, and report it. */
+static bool route_file(struct router *r, const char *capdir,
+                       const char *leaf)
+{
+  /* Ignore hidden files. */
+  if (leaf[0] == '.') return true;
+
+  char path[PATH_MAX];
+  snprintf(path, sizeof path, "%s/%s", capdir, leaf);
+  struct stat st;
+  if (stat(path, &st) < 0) return true;
+  const long long t = st.st_mtim.tv_sec * 1000LL +
+    st.st_mtim.tv_nsec / 1000000;
+
+  char midleaf[64], mid[PATH_MAX];
+  snprintf(midleaf, sizeof midleaf, "at-%lld.jpg", t);
+  snprintf(mid, sizeof mid, "%s/%s", r->detdir, midleaf);
+
+  /* Re-orient the image if necessary, and move it to the working
+     directory, with a name reflecting the timestamp.  A frame that
+     won't rotate is dropped. */
+  if (r->rotation != 0) {
+    size_t len;
+    unsigned long rotlen;
+    if (slurp(path, &r->buf, &r->cap, &len) < 0) {
+      fprintf(stderr, "%s: %s: reading %s\n",
+              r->prog, strerror(errno), path);
+      unlink(path);
+      return true;
+    }
+    unlink(path);
+    free(r->rot);
+    if (rotate_jpeg(r->rotation, r->buf, len, &r->rot, &rotlen) < 0) {
+      r->rot = NULL;
+      fprintf(stderr, "%s: bad frame %s\n", r->prog, leaf);
+      return true;
+    }
+    if (put_file(r->detdir, midleaf, r->rot, rotlen, &st.st_mtim) < 0) {
+      fprintf(stderr, "%s: %s: writing %s\n",
+              r->prog, strerror(errno), mid);
+      return true;
+    }
+  } else if (rename(path, mid) < 0) {
+    size_t len;
+    if (errno != EXDEV ||
+        slurp(path, &r->buf, &r->cap, &len) < 0 ||
+        put_file(r->detdir, midleaf, r->buf, len, &st.st_mtim) < 0) {
+      fprintf(stderr, "%s: %s: moving %s\n",
+              r->prog, strerror(errno), path);
+      unlink(path);
+      return true;
+    }
+    unlink(path);
+  }
+
+  /* The live image is the same as the recorded, so link it into the
+     live directory. */
+  if (r->livedir != NULL) {
+    char live[PATH_MAX];
+    snprintf(live, sizeof live, "%s/%s", r->livedir, midleaf);
+    unlink(live);
+    if (link(mid, live) < 0)
+      fprintf(stderr, "%s: %s: linking %s\n",
+              r->prog, strerror(errno), live);
+  }
+
+  return report(mid, due(&r->samp, t) ? mid : NULL);
+}
+
+static int watch_dir(struct router *r, const char *capdir)
+{
+  int fd = inotify_init1(IN_CLOEXEC);
+  if (fd < 0 ||
+      inotify_add_watch(fd, capdir, IN_MOVED_TO | IN_CLOSE_WRITE) < 0) {
+    fprintf(stderr, "%s: %s: watching %s\n",
+            r->prog, strerror(errno), capdir);
+    return EXIT_FAILURE;
+  }
+
+  char buf[sizeof(struct inotify_event) + NAME_MAX + 1]
+    __attribute__((aligned(__alignof__(struct inotify_event))));
+  for ( ; ; ) {
+    ssize_t got = read(fd, buf, sizeof buf);
+    if (got < 0 && errno == EINTR) continue;
+    if (got <= 0) {
+      fprintf(stderr, "%s: %s: reading events\n", r->prog, strerror(errno));
+      close(fd);
+      return EXIT_FAILURE;
+    }
+    for (char *p = buf; p < buf + got; ) {
+      const struct inotify_event *ev = (const struct inotify_event *) p;
+      p += sizeof *ev + ev->len;
+      if (ev->mask & IN_Q_OVERFLOW)
+        fprintf(stderr, "%s: lost frame events\n", r->prog);
+      if (ev->len == 0 || (ev->mask & IN_ISDIR)) continue;
+      if (!route_file(r, capdir, ev->name)) {
+        close(fd);
+        return EXIT_SUCCESS;
+      }
+    }
+  }
+}
+
+static int follow_ring(struct router *r, const char *path)
+{
+  struct ring *ring;
+  while ((ring = ring_open(path)) == NULL) {
+    if (errno != ENOENT && errno != EINVAL) {
+      fprintf(stderr, "%s: %s: opening %s\n",
+              r->prog, strerror(errno), path);
+      return EXIT_FAILURE;
+    }
+    /* Wait for the producer to start. */
+    sleep(1);
+  }
+
+  struct ring_cursor cur = { .next = ring_head(ring) };
+  uint64_t missed = 0;
+  for ( ; ; ) {
+    struct ring_frame fr;
+    int rc = ring_next(ring, &cur, NULL, 0, &fr, -1);
+    if (rc == RING_AGAIN) continue;
+    if (cur.missed != missed) {
+      fprintf(stderr, "Missed %" PRIu64 " frames\n", cur.missed - missed);
+      missed = cur.missed;
+    }
+    const long long t = fr.stamp.tv_sec * 1000LL +
+      fr.stamp.tv_nsec / 1000000;
+    char mid[PATH_MAX], src[32];
+    snprintf(mid, sizeof mid, "%s/at-%lld.jpg", r->detdir, t);
+    snprintf(src, sizeof src, "@%" PRIu64, fr.seq);
+    if (!report(mid, due(&r->samp, t) ? src : NULL))
+      break;
+  }
+  ring_close(ring);
+  return EXIT_SUCCESS;
+}
+
+int main(int argc, const char *const *argv)
+{
+  struct router r = {
+    .prog = argv[0],
+    .detdir = ".",
+  };
+  const char *capdir = NULL, *ringpath = NULL;
+
+  /* Parse command-line arguments. */
+  bool show_help = false, fail = false;
+  for (int argi = 1; argi < argc; argi++) {
+    if (!strcmp(argv[argi], "-i")) {
+      if (++argi == argc) {
+        show_help = true;
+        fail = true;
+        break;
+      }
+      capdir = argv[argi];
+      ringpath = NULL;
+    } else if (!strcmp(argv[argi], "-m")) {
+      if (++argi == argc) {
+        show_help = true;
+        fail = true;
+        break;
+      }
+      ringpath = argv[argi];
+      capdir = NULL;
+    } else if (!strcmp(argv[argi], "-o")) {
+      if (++argi == argc) {
+        show_help = true;
+        fail = true;
+        break;
+      }
+      r.detdir = argv[argi];
+    } else if (!strcmp(argv[argi], "-w")) {
+      if (++argi == argc) {
+        show_help = true;
+        fail = true;
+        break;
+      }
+      r.livedir = argv[argi];
+    } else if (!strcmp(argv[argi], "-R")) {
+      if (++argi == argc) {
+        show_help = true;
+        fail = true;
+        break;
+      }
+      r.rotation = (atoi(argv[argi]) % 360 + 360) % 360;
+      if (r.rotation % 90 != 0) {
+        fprintf(stderr, "%s: bad rotation: %s\n", argv[0], argv[argi]);
+        exit(EXIT_FAILURE);
+      }
+    } else if (!strcmp(argv[argi], "-r")) {
+      if (++argi == argc) {
+        show_help = true;
+        fail = true;
+        break;
+      }
+      char *end;
+      r.samp.num = strtoll(argv[argi], &end, 10);
+      r.samp.denom = *end == '/' ? strtoll(end + 1, &end, 10) : 1;
+      if (*end != '\0' || r.samp.num < 0 || r.samp.denom <= 0) {
+        fprintf(stderr, "%s: bad rate: %s\n", argv[0], argv[argi]);
+        exit(EXIT_FAILURE);
+      }
+      r.samp.denom *= 1000;
+    } else if (!strcmp(argv[argi], "-h")) {
+      show_help = true;
+    } else if (argv[argi][0] == '-' || argv[argi][0] == '+') {
+      fprintf(stderr, "%s: unknown switch: %s\n", argv[0], argv[argi]);
+      exit(EXIT_FAILURE);
+    } else {
+      fprintf(stderr, "%s: unknown argument: %s\n", argv[0], argv[argi]);
+      exit(EXIT_FAILURE);
+    }
+  }
+  if (capdir == NULL && ringpath == NULL) {
+    show_help = true;
+    fail = true;
+  }
+
+  if (show_help) {
+    fprintf(stderr,
+            "Usage: %s -i capdir|-m ring\n"
+            "\t[-o detdir]\n"
+            "\t[-w livedir]\n"
+            "\t[-R degrees]\n"
+            "\t[-r rate]\n", argv[0]);
+    exit(fail ? EXIT_FAILURE : EXIT_SUCCESS);
+  }
+
+  if (ringpath != NULL) {
+    if (r.rotation != 0)
+      fprintf(stderr, "%s: rotation ignored with ring\n", argv[0]);
+    return follow_ring(&r, ringpath);
+  }
+  int rc = watch_dir(&r, capdir);
+  free(r.buf);
+  free(r.rot);
+  return rc;
+}
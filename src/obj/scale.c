@@ -0,0 +1,212 @@
+// -*- c-basic-offset: 2; indent-tabs-mode: nil -*-
+
+/*
+ * Copyright 2018-19, Lancaster University
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ * 
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the
+ *    distribution.
+ * 
+ *  * Neither the name of the copyright holder nor the names of
+ *    its contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ *
+ * Author: Steven Simpson <https://github.com/simpsonst>
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <setjmp.h>
+
+#include <jpeglib.h>
+
+#include "scale.h"
+
+/* This replaces the per-frame invocation of
+
+     convert in.jpg -scale WxH out.jpg
+
+   libjpeg is asked to decode at the largest power-of-two reduction
+   (up to 8) that still leaves at least the target size, which saves
+   most of the inverse DCT work.  The rest of the reduction is a box
+   average.  Decoding and encoding stay in YCbCr, so there is no
+   colour conversion in either direction. */
+
+#define QUALITY 85
+
+int scale_parse(const char *s, unsigned *w, unsigned *h)
+{
+  char *end;
+  *w = *h = 0;
+  if (*s != 'x') {
+    *w = strtoul(s, &end, 10);
+    if (end == s) return -1;
+    s = end;
+  }
+  if (*s == 'x') {
+    s++;
+    *h = strtoul(s, &end, 10);
+    if (end == s) return -1;
+    s = end;
+  }
+  if (*s != '\0' || (*w == 0 && *h == 0)) return -1;
+  return 0;
+}
+
+struct errmgr {
+  struct jpeg_error_mgr pub;
+  jmp_buf jmp;
+};
+
+static void on_error(j_common_ptr cinfo)
+{
+  struct errmgr *err = (struct errmgr *) cinfo->err;
+  longjmp(err->jmp, 1);
+}
+
+static void on_message(j_common_ptr cinfo)
+{
+  (void) cinfo;
+}
+
+int scale_jpeg(const unsigned char *in, size_t len,
+               unsigned w, unsigned h,
+               unsigned char **out, unsigned long *outlen)
+{
+  struct jpeg_decompress_struct din;
+  struct jpeg_compress_struct cout;
+  struct errmgr err;
+  unsigned char *volatile row = NULL;
+  unsigned long *volatile acc = NULL;
+  unsigned char *volatile orow = NULL;
+  din.err = cout.err = jpeg_std_error(&err.pub);
+  err.pub.error_exit = &on_error;
+  err.pub.output_message = &on_message;
+  *out = NULL;
+  *outlen = 0;
+  if (setjmp(err.jmp)) {
+    jpeg_destroy_compress(&cout);
+    jpeg_destroy_decompress(&din);
+    free(row);
+    free(acc);
+    free(orow);
+    free(*out);
+    *out = NULL;
+    return -1;
+  }
+  jpeg_create_decompress(&din);
+  jpeg_create_compress(&cout);
+  jpeg_mem_src(&din, in, len);
+  jpeg_read_header(&din, TRUE);
+
+  /* Fit the target within the box, keeping the aspect ratio, and
+     never enlarging. */
+  const unsigned iw = din.image_width, ih = din.image_height;
+  unsigned tw = w, th = h;
+  if (tw == 0 || (th != 0 && (unsigned long long) th * iw <
+                   (unsigned long long) tw * ih))
+    tw = ((unsigned long long) th * iw + ih / 2) / ih;
+  else
+    th = ((unsigned long long) tw * ih + iw / 2) / iw;
+  if (tw >= iw || th >= ih) {
+    jpeg_destroy_compress(&cout);
+    jpeg_destroy_decompress(&din);
+    return 1;
+  }
+  if (tw == 0) tw = 1;
+  if (th == 0) th = 1;
+
+  /* Let libjpeg do as much of the reduction as it can. */
+  unsigned denom = 8;
+  while (denom > 1 && (iw / denom < tw || ih / denom < th))
+    denom /= 2;
+  din.scale_num = 1;
+  din.scale_denom = denom;
+  if (din.jpeg_color_space == JCS_YCbCr)
+    din.out_color_space = JCS_YCbCr;
+  jpeg_start_decompress(&din);
+  const unsigned dw = din.output_width, dh = din.output_height;
+  const unsigned nc = din.output_components;
+
+  cout.image_width = tw;
+  cout.image_height = th;
+  cout.input_components = nc;
+  cout.in_color_space = din.out_color_space;
+  jpeg_set_defaults(&cout);
+  jpeg_set_quality(&cout, QUALITY, TRUE);
+  jpeg_mem_dest(&cout, out, outlen);
+  jpeg_start_compress(&cout, TRUE);
+
+  /* Box-average decoded rows into each output row.  Output row 'oy'
+     covers decoded rows [oy*dh/th, (oy+1)*dh/th), and likewise for
+     columns. */
+  row = malloc((size_t) dw * nc);
+  acc = calloc((size_t) tw * nc, sizeof *acc);
+  orow = malloc((size_t) tw * nc);
+  if (row == NULL || acc == NULL || orow == NULL)
+    longjmp(err.jmp, 1);
+  unsigned y = 0;
+  for (unsigned oy = 0; oy < th; oy++) {
+    const unsigned y1 = (unsigned long long) (oy + 1) * dh / th;
+    unsigned rows = 0;
+    memset(acc, 0, (size_t) tw * nc * sizeof *acc);
+    for ( ; y < y1 || rows == 0; y++, rows++) {
+      JSAMPROW rp = row;
+      jpeg_read_scanlines(&din, &rp, 1);
+      unsigned x = 0;
+      for (unsigned ox = 0; ox < tw; ox++) {
+        const unsigned x1 = (unsigned long long) (ox + 1) * dw / tw;
+        do {
+          for (unsigned c = 0; c < nc; c++)
+            acc[ox * nc + c] += row[x * nc + c];
+          x++;
+        } while (x < x1);
+      }
+    }
+    for (unsigned ox = 0; ox < tw; ox++) {
+      const unsigned x0 = (unsigned long long) ox * dw / tw;
+      const unsigned x1 = (unsigned long long) (ox + 1) * dw / tw;
+      const unsigned long n = (unsigned long) rows * (x1 > x0 ? x1 - x0 : 1);
+      for (unsigned c = 0; c < nc; c++)
+        orow[ox * nc + c] = (acc[ox * nc + c] + n / 2) / n;
+    }
+    JSAMPROW op = orow;
+    jpeg_write_scanlines(&cout, &op, 1);
+  }
+  while (din.output_scanline < dh) {
+    JSAMPROW rp = row;
+    jpeg_read_scanlines(&din, &rp, 1);
+  }
+
+  jpeg_finish_compress(&cout);
+  jpeg_finish_decompress(&din);
+  jpeg_destroy_compress(&cout);
+  jpeg_destroy_decompress(&din);
+  free(row);
+  free(acc);
+  free(orow);
+  return 0;
+}
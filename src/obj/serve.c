@@ -1,34 +1,32 @@
 // -*- c-basic-offset: 2; indent-tabs-mode: nil -*-
 
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <errno.h>
 #include <string.h>
 #include <limits.h>
-#include <assert.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <signal.h>
+#include <pthread.h>
 
 #include <sys/types.h>
 #include <sys/time.h>
 #include <sys/stat.h>
 #include <sys/inotify.h>
-#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <netinet/in.h>
+#include <netdb.h>
 #include <unistd.h>
 #include <fcntl.h>
 
-typedef ssize_t sender_func(int tofd, int fromfd, size_t rem);
-
-static sender_func use_splice, use_sendfile;
-  
-static ssize_t use_splice(int tofd, int fromfd, size_t rem)
-{
-  return splice(fromfd, NULL, tofd, NULL, rem, 0);
-}
-
-static ssize_t use_sendfile(int tofd, int fromfd, size_t rem)
-{
-  return sendfile(tofd, fromfd, NULL, rem);
-}
+#include "ring.h"
+#include "scale.h"
+#include "uring.h"
 
 static bool check_image_name(const char *s)
 {
@@ -46,16 +44,805 @@ static bool check_image_name(const char *s)
   return true;
 }
 
+static void send_header(const char *boundary)
+{
+  /* Send an NPH CGI header. */
+  printf("%s 200 Okay\r\n", getenv("SERVER_PROTOCOL"));
+  //printf("Content-Type: text/plain\r\n\r\n");
+  printf("Content-Type: multipart/x-mixed-replace; boundary=%s\r\n", boundary);
+  printf("\r\n--%s", boundary);
+  fflush(stdout);
+}
+
+/* Write the header of a part holding a frame of 'sz' bytes into
+   'buf', and return its length. */
+static int format_part_header(char *buf, size_t max,
+                              size_t sz, const struct timespec *ts)
+{
+  return snprintf(buf, max,
+                  "\r\nContent-Type: image/jpeg\r\n"
+                  "Content-Length: %zu\r\n"
+                  "X-Timestamp: %ld.%09ld\r\n\r\n",
+                  sz, (long) ts->tv_sec, ts->tv_nsec);
+}
+
+/* Send a part's header, its frame and the boundary after it as one
+   write, after the response header.  Return 0 on success; -1 on
+   error, with errno set. */
+static int send_part(struct uring *ur, const unsigned char *img, size_t sz,
+                     const struct timespec *ts, const char *boundary)
+{
+  char head[200];
+  struct iovec iov[] = {
+    { .iov_base = head },
+    { .iov_base = (void *) img, .iov_len = sz },
+    { .iov_base = "\r\n--", .iov_len = 4 },
+    { .iov_base = (void *) boundary, .iov_len = strlen(boundary) },
+  };
+  iov[0].iov_len = format_part_header(head, sizeof head, sz, ts);
+  return uring_writev(ur, STDOUT_FILENO, iov, sizeof iov / sizeof iov[0]);
+}
+
+/* What a viewer has asked for */
+struct wanted {
+  /* the size to fit the image within, or 0x0 for the original */
+  unsigned w, h;
+
+  /* the minimum time between frames, in nanoseconds */
+  long long interval;
+};
+
+static long long stamp_ns(const struct timespec *ts)
+{
+  return ts->tv_sec * 1000000000LL + ts->tv_nsec;
+}
+
+/* Get a viewer's choices from a query string, such as
+   'size=320x240&rate=5'.  'size=full' asks for the original.  The
+   size defaults to LIVEDIMS. */
+static void parse_query(struct wanted *wt, const char *q)
+{
+  const char *dims = getenv("LIVEDIMS");
+  if (dims == NULL || scale_parse(dims, &wt->w, &wt->h) < 0)
+    wt->w = wt->h = 0;
+  wt->interval = 0;
+
+  while (q != NULL && *q != '\0' && *q != ' ') {
+    const size_t len = strcspn(q, "& ");
+    char item[64];
+    snprintf(item, sizeof item, "%.*s", (int) len, q);
+    if (!strncmp(item, "size=", 5)) {
+      if (!strcmp(item + 5, "full") ||
+          scale_parse(item + 5, &wt->w, &wt->h) < 0)
+        wt->w = wt->h = 0;
+    } else if (!strncmp(item, "rate=", 5)) {
+      const double rate = strtod(item + 5, NULL);
+      wt->interval = rate > 0.0 ? 1e9 / rate : 0;
+    }
+    q += len;
+    if (*q == '&') q++;
+  }
+}
+
+/* Scale a frame as a viewer wants.  Return true if 'buf' and 'len'
+   have been replaced with a malloc()ed buffer. */
+static bool scale_for(const struct wanted *wt,
+                      const unsigned char **buf, size_t *len)
+{
+  if (wt->w == 0 && wt->h == 0) return false;
+  unsigned char *out;
+  unsigned long outlen;
+  if (scale_jpeg(*buf, *len, wt->w, wt->h, &out, &outlen) != 0)
+    return false;
+  *buf = out;
+  *len = outlen;
+  return true;
+}
+
+/* Serve frames from a shared ring instead of watching a directory.
+   Only the newest frame is sent each time, so a slow viewer skips
+   frames rather than falling behind. */
+static int serve_ring(const char *prog, const char *path,
+                      const char *boundary, const struct wanted *wt,
+                      struct uring *ur)
+{
+  struct ring *ring = ring_open(path);
+  if (ring == NULL) {
+    fprintf(stderr, "%s: %s: opening %s\n", prog, strerror(errno), path);
+    return EXIT_FAILURE;
+  }
+  const size_t max = ring_maxframe(ring);
+  unsigned char *buf = malloc(max);
+  if (buf == NULL) {
+    fprintf(stderr, "%s: %s: allocating\n", prog, strerror(errno));
+    return EXIT_FAILURE;
+  }
+
+  send_header(boundary);
+
+  struct ring_cursor cur = { .next = ring_head(ring) };
+  long long last_ns = 0;
+  for ( ; ; ) {
+    const uint64_t head = ring_head(ring);
+    if (head > cur.next + 1)
+      cur.next = head - 1;
+
+    struct ring_frame fr;
+    if (ring_next(ring, &cur, buf, max, &fr, -1) != RING_OK)
+      continue;
+    if (wt->interval > 0 && stamp_ns(&fr.stamp) - last_ns < wt->interval)
+      continue;
+    last_ns = stamp_ns(&fr.stamp);
+
+    const unsigned char *img = buf;
+    size_t len = fr.len;
+    const bool scaled = scale_for(wt, &img, &len);
+    const int rc = send_part(ur, img, len, &fr.stamp, boundary);
+    if (scaled)
+      free((void *) img);
+    if (rc < 0)
+      break;
+  }
+
+  free(buf);
+  ring_close(ring);
+  return EXIT_FAILURE;
+}
+
+/* In standalone mode, one process serves every viewer.  The source
+   (the work directory or the ring) is watched once, and each frame
+   is formatted as a multipart part once, and shared by all clients.
+   Writes are non-blocking.  A client that is still sending one frame
+   when others arrive skips to the latest when it has finished, so a
+   slow client neither stalls the others nor accumulates frames. */
+
+/* A formatted part (or the response header), shared by clients */
+struct part {
+  unsigned refs;
+
+  /* the number of the frame, and when it was captured */
+  unsigned long long serial;
+  struct timespec stamp;
+
+  /* the whole part, and where the image is in it */
+  size_t len, body, blen;
+  char data[];
+};
+
+static struct part *part_ref(struct part *p)
+{
+  p->refs++;
+  return p;
+}
+
+static void part_unref(struct part *p)
+{
+  if (p != NULL && --p->refs == 0)
+    free(p);
+}
+
+/* Make a part holding a frame of 'sz' bytes, to be copied to the
+   address returned through 'body'. */
+static struct part *part_create(const char *boundary, size_t sz,
+                                const struct timespec *ts, char **body)
+{
+  char head[200];
+  int hlen = format_part_header(head, sizeof head, sz, ts);
+  const size_t blen = strlen(boundary) + 4;
+  struct part *p = malloc(sizeof *p + hlen + sz + blen + 1);
+  if (p == NULL) return NULL;
+  p->refs = 1;
+  p->serial = 0;
+  p->stamp = *ts;
+  p->body = hlen;
+  p->blen = sz;
+  memcpy(p->data, head, hlen);
+  *body = p->data + hlen;
+  snprintf(p->data + hlen + sz, blen + 1, "\r\n--%s", boundary);
+  p->len = hlen + sz + blen;
+  return p;
+}
+
+/* A size in which the latest frame is wanted, produced only when a
+   viewer is ready for it, and then shared by all viewers that want
+   that size */
+struct variant {
+  struct variant *next;
+  unsigned users;
+  unsigned w, h;
+
+  /* the frame in this size, and the serial of the frame it was made
+     from */
+  struct part *part;
+  unsigned long long src;
+};
+
+/* What each descriptor in the epoll set is for */
+enum handle_kind { LISTENER, NOTIFIER, FEED, CLIENT };
+
+struct handle {
+  enum handle_kind kind;
+  int fd;
+};
+
+/* A viewer's connection */
+struct client {
+  struct handle h;
+  struct client *next, **prev;
+  uint32_t events;
+  bool dead;
+
+  /* the request, until its end is seen */
+  char req[4096];
+  size_t reqlen;
+  bool ready;
+
+  /* the size wanted (or null for the original), and the minimum
+     time between frames */
+  struct variant *var;
+  long long interval;
+
+  /* the part being sent, how much of it has gone, and the serial and
+     time of the last frame sent completely */
+  struct part *cur;
+  size_t off;
+  unsigned long long last;
+  long long last_ns;
+};
+
+struct server {
+  int ep;
+
+  /* connected clients, and those dropped but perhaps still mentioned
+     in the current batch of events */
+  struct client *clients, *graves;
+
+  struct variant *variants;
+  const char *boundary;
+
+  struct part *preamble, *latest;
+  unsigned long long serial;
+
+  /* how frames are read from files, and space to read them into */
+  struct uring *uring;
+  unsigned char *buf;
+  size_t cap;
+};
+
+static struct variant *get_variant(struct server *srv,
+                                   unsigned w, unsigned h)
+{
+  if (w == 0 && h == 0) return NULL;
+  struct variant *v;
+  for (v = srv->variants; v != NULL; v = v->next)
+    if (v->w == w && v->h == h)
+      break;
+  if (v == NULL) {
+    v = calloc(1, sizeof *v);
+    if (v == NULL) return NULL;
+    v->w = w;
+    v->h = h;
+    v->next = srv->variants;
+    srv->variants = v;
+  }
+  v->users++;
+  return v;
+}
+
+static void put_variant(struct server *srv, struct variant *v)
+{
+  if (v == NULL || --v->users > 0) return;
+  for (struct variant **vp = &srv->variants; *vp != NULL;
+       vp = &(*vp)->next)
+    if (*vp == v) {
+      *vp = v->next;
+      break;
+    }
+  part_unref(v->part);
+  free(v);
+}
+
+/* Get the latest frame in a variant's size, scaling it if no-one
+   else has yet. */
+static struct part *variant_part(struct server *srv, struct variant *v,
+                                 struct part *raw)
+{
+  if (v->part == NULL || v->src != raw->serial) {
+    part_unref(v->part);
+    v->part = NULL;
+    v->src = raw->serial;
+
+    unsigned char *out;
+    unsigned long outlen;
+    char *body;
+    if (scale_jpeg((unsigned char *) raw->data + raw->body, raw->blen,
+                   v->w, v->h, &out, &outlen) == 0) {
+      v->part = part_create(srv->boundary, outlen, &raw->stamp, &body);
+      if (v->part != NULL) {
+        v->part->serial = raw->serial;
+        memcpy(body, out, outlen);
+      }
+      free(out);
+    }
+    if (v->part == NULL)
+      v->part = part_ref(raw);
+  }
+  return part_ref(v->part);
+}
+
+/* Get the next part to send to a client, if there is one it wants
+   yet. */
+static struct part *next_part(struct server *srv, struct client *c)
+{
+  struct part *raw = srv->latest;
+  if (raw == NULL || raw->serial <= c->last) return NULL;
+  if (c->interval > 0 && stamp_ns(&raw->stamp) - c->last_ns < c->interval)
+    return NULL;
+  if (c->var == NULL) return part_ref(raw);
+  return variant_part(srv, c->var, raw);
+}
+
+static void drop_client(struct server *srv, struct client *c)
+{
+  close(c->h.fd);
+  part_unref(c->cur);
+  c->cur = NULL;
+  put_variant(srv, c->var);
+  c->var = NULL;
+  if ((*c->prev = c->next) != NULL)
+    c->next->prev = c->prev;
+  c->dead = true;
+  c->next = srv->graves;
+  srv->graves = c;
+}
+
+static void want_events(struct server *srv, struct client *c, uint32_t ev)
+{
+  if (c->events == ev) return;
+  struct epoll_event ee = { .events = ev, .data.ptr = &c->h };
+  epoll_ctl(srv->ep, EPOLL_CTL_MOD, c->h.fd, &ee);
+  c->events = ev;
+}
+
+/* Send as much as possible to a client, moving on to the latest
+   part each time one is complete.  Return false if the client has
+   gone. */
+static bool flush_client(struct server *srv, struct client *c)
+{
+  while (c->cur != NULL) {
+    ssize_t done = send(c->h.fd, c->cur->data + c->off,
+                        c->cur->len - c->off, MSG_NOSIGNAL | MSG_DONTWAIT);
+    if (done < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        want_events(srv, c, EPOLLIN | EPOLLOUT);
+        return true;
+      }
+      if (errno == EINTR) continue;
+      return false;
+    }
+    c->off += done;
+    if (c->off < c->cur->len) continue;
+
+    if (c->cur->serial > 0) {
+      c->last = c->cur->serial;
+      c->last_ns = stamp_ns(&c->cur->stamp);
+    }
+    part_unref(c->cur);
+    c->off = 0;
+    c->cur = next_part(srv, c);
+  }
+  want_events(srv, c, EPOLLIN);
+  return true;
+}
+
+/* Make a part the latest, and start sending it to idle clients. */
+static void publish(struct server *srv, struct part *p)
+{
+  p->serial = ++srv->serial;
+  part_unref(srv->latest);
+  srv->latest = p;
+  for (struct client *c = srv->clients, *nxt; c != NULL; c = nxt) {
+    nxt = c->next;
+    if (!c->ready || c->cur != NULL) continue;
+    c->cur = next_part(srv, c);
+    if (c->cur != NULL && !flush_client(srv, c))
+      drop_client(srv, c);
+  }
+}
+
+/* Read from a client, looking for the end of its request.  Anything
+   after that is ignored.  Return false if the client has gone. */
+static bool read_client(struct server *srv, struct client *c)
+{
+  for ( ; ; ) {
+    char junk[512];
+    char *buf = c->ready ? junk : c->req + c->reqlen;
+    size_t max = c->ready ? sizeof junk : sizeof c->req - 1 - c->reqlen;
+    if (max == 0) return false;
+    ssize_t got = recv(c->h.fd, buf, max, MSG_DONTWAIT);
+    if (got < 0)
+      return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+    if (got == 0) return false;
+    if (c->ready) continue;
+    c->reqlen += got;
+    c->req[c->reqlen] = '\0';
+    if (strstr(c->req, "\r\n\r\n") == NULL &&
+        strstr(c->req, "\n\n") == NULL)
+      continue;
+
+    /* Find out what size and rate the client wants from the request
+       line's query string. */
+    struct wanted wt;
+    const char *sp = strchr(c->req, ' ');
+    const char *q = sp == NULL ? NULL : strpbrk(sp + 1, "? \r\n");
+    parse_query(&wt, q != NULL && *q == '?' ? q + 1 : NULL);
+    c->var = get_variant(srv, wt.w, wt.h);
+    c->interval = wt.interval;
+
+    /* Send the response header, then the latest frame. */
+    c->ready = true;
+    c->cur = part_ref(srv->preamble);
+    if (!flush_client(srv, c))
+      return false;
+  }
+}
+
+/* Load the latest frame from the work directory. */
+static struct part *load_file(struct server *srv, const char *prog,
+                              const char *path)
+{
+  struct timespec mtime;
+  const ssize_t got = uring_load(srv->uring, path,
+                                 &srv->buf, &srv->cap, &mtime);
+  if (got < 0) {
+    /* It has probably been deleted already. */
+    if (errno != ENOENT)
+      fprintf(stderr, "%s: %s: loading %s\n", prog, strerror(errno), path);
+    return NULL;
+  }
+  char *body;
+  struct part *p = part_create(srv->boundary, got, &mtime, &body);
+  if (p == NULL) {
+    fprintf(stderr, "%s: %s: loading %s\n", prog, strerror(errno), path);
+    return NULL;
+  }
+  memcpy(body, srv->buf, got);
+  return p;
+}
+
+/* The ring can only be waited on by blocking, so a thread follows it,
+   and hands over the newest frame through an event descriptor. */
+struct ring_feed {
+  struct ring *ring;
+  const char *boundary;
+  int efd;
+  pthread_mutex_t lock;
+  struct part *pending;
+};
+
+static void *follow_ring(void *ctxt)
+{
+  struct ring_feed *feed = ctxt;
+  const size_t max = ring_maxframe(feed->ring);
+  unsigned char *buf = malloc(max);
+  if (buf == NULL) return NULL;
+
+  struct ring_cursor cur = { .next = ring_head(feed->ring) };
+  for ( ; ; ) {
+    const uint64_t head = ring_head(feed->ring);
+    if (head > cur.next + 1)
+      cur.next = head - 1;
+
+    struct ring_frame fr;
+    if (ring_next(feed->ring, &cur, buf, max, &fr, -1) != RING_OK)
+      continue;
+    char *body;
+    struct part *p = part_create(feed->boundary, fr.len, &fr.stamp, &body);
+    if (p == NULL) continue;
+    memcpy(body, buf, fr.len);
+
+    /* Replace any frame not yet collected. */
+    pthread_mutex_lock(&feed->lock);
+    struct part *old = feed->pending;
+    feed->pending = p;
+    pthread_mutex_unlock(&feed->lock);
+    free(old);
+    const uint64_t one = 1;
+    if (write(feed->efd, &one, sizeof one) < 0)
+      break;
+  }
+  free(buf);
+  return NULL;
+}
+
+static int open_listeners(const char *prog, int ep, const char *addr)
+{
+  /* Split [host:]port, allowing [v6addr]:port. */
+  char host[256] = "";
+  const char *port = addr;
+  const char *colon = strrchr(addr, ':');
+  if (colon != NULL) {
+    const char *h = addr, *hend = colon;
+    if (*h == '[' && hend > h && hend[-1] == ']') {
+      h++;
+      hend--;
+    }
+    snprintf(host, sizeof host, "%.*s", (int) (hend - h), h);
+    port = colon + 1;
+  }
+
+  struct addrinfo hints = {
+    .ai_family = AF_UNSPEC,
+    .ai_socktype = SOCK_STREAM,
+    .ai_flags = AI_PASSIVE,
+  }, *res;
+  int rc = getaddrinfo(*host ? host : NULL, port, &hints, &res);
+  if (rc != 0) {
+    fprintf(stderr, "%s: %s: resolving %s\n", prog, gai_strerror(rc), addr);
+    return -1;
+  }
+  int count = 0;
+  for (struct addrinfo *ai = res; ai != NULL; ai = ai->ai_next) {
+    int fd = socket(ai->ai_family,
+                    ai->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                    ai->ai_protocol);
+    if (fd < 0) continue;
+    const int on = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof on);
+    if (ai->ai_family == AF_INET6)
+      setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &on, sizeof on);
+    if (bind(fd, ai->ai_addr, ai->ai_addrlen) < 0 || listen(fd, 16) < 0) {
+      fprintf(stderr, "%s: %s: listening on %s\n",
+              prog, strerror(errno), addr);
+      close(fd);
+      continue;
+    }
+    struct handle *h = malloc(sizeof *h);
+    if (h == NULL) {
+      close(fd);
+      continue;
+    }
+    h->kind = LISTENER;
+    h->fd = fd;
+    struct epoll_event ee = { .events = EPOLLIN, .data.ptr = h };
+    epoll_ctl(ep, EPOLL_CTL_ADD, fd, &ee);
+    count++;
+  }
+  freeaddrinfo(res);
+  return count;
+}
+
+static void accept_clients(struct server *srv, int lfd)
+{
+  for ( ; ; ) {
+    int fd = accept4(lfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd < 0) return;
+    struct client *c = calloc(1, sizeof *c);
+    if (c == NULL) {
+      close(fd);
+      continue;
+    }
+    c->h.kind = CLIENT;
+    c->h.fd = fd;
+    c->events = EPOLLIN;
+    struct epoll_event ee = { .events = c->events, .data.ptr = &c->h };
+    if (epoll_ctl(srv->ep, EPOLL_CTL_ADD, fd, &ee) < 0) {
+      close(fd);
+      free(c);
+      continue;
+    }
+    if ((c->next = srv->clients) != NULL)
+      c->next->prev = &c->next;
+    c->prev = &srv->clients;
+    srv->clients = c;
+  }
+}
+
+static int serve_standalone(const char *prog, const char *addr,
+                            const char *ringpath, const char *workdir,
+                            const char *boundary)
+{
+  signal(SIGPIPE, SIG_IGN);
+
+  struct server srv = {
+    .clients = NULL,
+    .graves = NULL,
+    .variants = NULL,
+    .boundary = boundary,
+    .uring = uring_create(),
+    .buf = NULL,
+    .cap = 0,
+  };
+  srv.ep = epoll_create1(EPOLL_CLOEXEC);
+  if (srv.ep < 0) {
+    fprintf(stderr, "%s: %s: creating epoll\n", prog, strerror(errno));
+    return EXIT_FAILURE;
+  }
+  if (open_listeners(prog, srv.ep, addr) <= 0)
+    return EXIT_FAILURE;
+
+  /* The response header is sent to every client first. */
+  const char *const fmt =
+    "HTTP/1.0 200 Okay\r\n"
+    "Content-Type: multipart/x-mixed-replace; boundary=%s\r\n"
+    "Cache-Control: no-cache\r\n"
+    "\r\n--%s";
+  const size_t plen = snprintf(NULL, 0, fmt, boundary, boundary);
+  srv.preamble = malloc(sizeof *srv.preamble + plen + 1);
+  if (srv.preamble == NULL) {
+    fprintf(stderr, "%s: %s: allocating\n", prog, strerror(errno));
+    return EXIT_FAILURE;
+  }
+  srv.preamble->refs = 1;
+  srv.preamble->serial = 0;
+  srv.preamble->len = plen;
+  srv.preamble->body = srv.preamble->blen = 0;
+  snprintf(srv.preamble->data, plen + 1, fmt, boundary, boundary);
+
+  /* Watch the source of frames. */
+  struct handle src;
+  char path[PATH_MAX];
+  size_t sfxpos = 0;
+  struct ring_feed feed = { .boundary = boundary, .pending = NULL };
+  if (ringpath != NULL) {
+    feed.ring = ring_open(ringpath);
+    if (feed.ring == NULL) {
+      fprintf(stderr, "%s: %s: opening %s\n",
+              prog, strerror(errno), ringpath);
+      return EXIT_FAILURE;
+    }
+    feed.efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    pthread_mutex_init(&feed.lock, NULL);
+    pthread_t thr;
+    if (feed.efd < 0 ||
+        (errno = pthread_create(&thr, NULL, &follow_ring, &feed)) != 0) {
+      fprintf(stderr, "%s: %s: following %s\n",
+              prog, strerror(errno), ringpath);
+      return EXIT_FAILURE;
+    }
+    src.kind = FEED;
+    src.fd = feed.efd;
+  } else {
+    snprintf(path, sizeof path, "%s/", workdir);
+    sfxpos = strlen(path);
+    src.kind = NOTIFIER;
+    src.fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (src.fd < 0 ||
+        inotify_add_watch(src.fd, workdir, IN_CREATE | IN_MOVED_TO) < 0) {
+      fprintf(stderr, "%s: %s: watching %s\n",
+              prog, strerror(errno), workdir);
+      return EXIT_FAILURE;
+    }
+  }
+  struct epoll_event ee = { .events = EPOLLIN, .data.ptr = &src };
+  epoll_ctl(srv.ep, EPOLL_CTL_ADD, src.fd, &ee);
+
+  for ( ; ; ) {
+    struct epoll_event evs[32];
+    int n = epoll_wait(srv.ep, evs, sizeof evs / sizeof evs[0], -1);
+    if (n < 0) {
+      if (errno == EINTR) continue;
+      fprintf(stderr, "%s: %s: waiting\n", prog, strerror(errno));
+      return EXIT_FAILURE;
+    }
+    for (int i = 0; i < n; i++) {
+      struct handle *h = evs[i].data.ptr;
+      switch (h->kind) {
+      case LISTENER:
+        accept_clients(&srv, h->fd);
+        break;
+
+      case FEED: {
+        uint64_t count;
+        if (read(h->fd, &count, sizeof count) < 0) break;
+        pthread_mutex_lock(&feed.lock);
+        struct part *p = feed.pending;
+        feed.pending = NULL;
+        pthread_mutex_unlock(&feed.lock);
+        if (p != NULL)
+          publish(&srv, p);
+        break;
+      }
+
+      case NOTIFIER: {
+        /* Only the last image in each batch of events is loaded. */
+        union {
+          struct inotify_event dummy;
+          unsigned char bytes[sizeof(struct inotify_event) + NAME_MAX + 1];
+        } buf;
+        const char *chosen = NULL;
+        ssize_t got;
+        while ((got = read(h->fd, &buf, sizeof buf)) > 0) {
+          for (struct inotify_event *ptr = &buf.dummy;
+               (unsigned char *) ptr - buf.bytes < got;
+               ptr = (struct inotify_event *)
+                 &(ptr->len + sizeof *ptr)[(char *) ptr]) {
+            if (ptr->len == 0) continue;
+            if (!check_image_name(ptr->name)) continue;
+            snprintf(path + sfxpos, sizeof path - sfxpos, "%s", ptr->name);
+            chosen = path;
+          }
+        }
+        if (chosen == NULL) break;
+        struct part *p = load_file(&srv, prog, chosen);
+        if (p != NULL)
+          publish(&srv, p);
+        break;
+      }
+
+      case CLIENT: {
+        struct client *c = (struct client *) h;
+        if (c->dead) break;
+        bool ok = true;
+        if (evs[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+          ok = read_client(&srv, c);
+        if (ok && (evs[i].events & EPOLLOUT))
+          ok = flush_client(&srv, c);
+        if (!ok)
+          drop_client(&srv, c);
+        break;
+      }
+      }
+    }
+
+    while (srv.graves != NULL) {
+      struct client *c = srv.graves;
+      srv.graves = c->next;
+      free(c);
+    }
+  }
+}
+
 int main(int argc, const char *const *argv)
 {
   const char *boundary = "kasduyc69c34ivkcuqbnqx4rkaghsjhcbasjcj";
+  const char *listen_addr = NULL;
+
+  bool show_help = false, fail = false;
+  for (int argi = 1; argi < argc; argi++) {
+    if (!strcmp(argv[argi], "-l")) {
+      if (++argi == argc) {
+        show_help = true;
+        fail = true;
+        break;
+      }
+      listen_addr = argv[argi];
+    } else if (!strcmp(argv[argi], "-h")) {
+      show_help = true;
+    } else if (argv[argi][0] == '-' || argv[argi][0] == '+') {
+      fprintf(stderr, "%s: unknown switch: %s\n", argv[0], argv[argi]);
+      exit(EXIT_FAILURE);
+    } else {
+      fprintf(stderr, "%s: unknown argument: %s\n", argv[0], argv[argi]);
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  if (show_help) {
+    fprintf(stderr, "Usage: %s [-l [host:]port]\n", argv[0]);
+    exit(fail ? EXIT_FAILURE : EXIT_SUCCESS);
+  }
 
+  const char *ringpath = getenv("RING");
+  if (ringpath != NULL && *ringpath == '\0')
+    ringpath = NULL;
   const char *workdir = getenv("WORKDIR");
-  if (workdir == NULL) {
+  if (ringpath == NULL && workdir == NULL) {
     fprintf(stderr, "%s: WORKDIR not set\n", argv[0]);
     exit(EXIT_FAILURE);
   }
 
+  /* Without -l, we're a CGI program serving one viewer, who can ask
+     for a size and rate in the query string. */
+  if (listen_addr != NULL)
+    return serve_standalone(argv[0], listen_addr,
+                            ringpath, workdir, boundary);
+  struct wanted wt;
+  parse_query(&wt, getenv("QUERY_STRING"));
+  struct uring *ur = uring_create();
+  if (ringpath != NULL)
+    return serve_ring(argv[0], ringpath, boundary, &wt, ur);
+
   /* Prepare a buffer to hold complete pathnames of detected
      changes. */
   char path[NAME_MAX];
@@ -78,13 +865,11 @@ int main(int argc, const char *const *argv)
     exit(EXIT_FAILURE);
   }
 
-  /* Send an NPH CGI header. */
-  printf("%s 200 Okay\r\n", getenv("SERVER_PROTOCOL"));
-  //printf("Content-Type: text/plain\r\n\r\n");
-  printf("Content-Type: multipart/x-mixed-replace; boundary=%s\r\n", boundary);
-  printf("\r\n--%s", boundary);
-  fflush(stdout);
+  send_header(boundary);
 
+  unsigned char *frame = NULL;
+  size_t framecap = 0;
+  long long last_ns = 0;
   for ( ; ; ) {
     /* Read in events. */
     union {
@@ -116,60 +901,33 @@ int main(int argc, const char *const *argv)
     strncpy(path + sfxpos, chosen->name, sizeof path - sfxpos);
     //fprintf(stderr, "displaying %s...\n", chosen->name);
 
-    /* Get the file's size. */
-    struct stat mystat;
-    if (stat(path, &mystat) < 0) {
-      fprintf(stderr, "%s: %s: stat(%s)\n", argv[0], strerror(errno), path);
-      exit(EXIT_FAILURE);
-    }
-    const size_t sz = mystat.st_size;
-
-    /* Send this part's header. */
-    printf("\r\n");
-    printf("Content-Type: image/jpeg\r\n");
-    printf("Content-Length: %zu\r\n", sz);
-    printf("X-Timestamp: %ld.%09ld\r\n",
-           mystat.st_mtim.tv_sec, mystat.st_mtim.tv_nsec);
-    printf("\r\n");
-    fflush(stdout);
-
-    /* Send the file. */
-    int fd = open(path, O_RDONLY);
-    if (fd < 0) {
-      fprintf(stderr, "%s: %s: open(%s)\n", argv[0], strerror(errno), path);
+    /* Get the file and its time, in one go. */
+    struct timespec mtime;
+    const ssize_t sz = uring_load(ur, path, &frame, &framecap, &mtime);
+    if (sz < 0) {
+      fprintf(stderr, "%s: %s: loading %s\n",
+              argv[0], strerror(errno), path);
       exit(EXIT_FAILURE);
     }
 
-    struct scheme {
-      const char *name;
-      sender_func *func;
-    } schemes[] = {
-      { .name = "splice", .func = &use_splice },
-      { .name = "sendfile", .func = &use_sendfile },
-    };
-    unsigned sn = 0;
-    for (size_t rem = sz; rem > 0; ) {
-      ssize_t done = 0;
-      while (sn < sizeof(schemes) / sizeof(schemes[0])) {
-        done = (*schemes[sn].func)(fileno(stdout), fd, rem);
-        if (done >= 0)
-          break;
-        if (errno != EINVAL) {
-          fprintf(stderr, "%s: %s: %s(%s)\n",
-                  argv[0], strerror(errno), schemes[sn].name, path);
-          exit(EXIT_FAILURE);
-        }
-        sn++;
-        continue;
-      }
-      assert(done >= 0);
-      rem -= done;
-    }
-    close(fd);
+    /* Skip frames if the viewer wants a lower rate, and scale the
+       rest if they want a smaller size. */
+    if (wt.interval > 0 && stamp_ns(&mtime) - last_ns < wt.interval)
+      continue;
+    last_ns = stamp_ns(&mtime);
+    const unsigned char *img = frame;
+    size_t len = sz;
+    const bool scaled = scale_for(&wt, &img, &len);
 
-    /* Send the boundary. */
-    printf("\r\n--%s", boundary);
-    fflush(stdout);
+    /* Send the part's header, the file and the boundary. */
+    const int rc = send_part(ur, img, len, &mtime, boundary);
+    if (scaled)
+      free((void *) img);
+    if (rc < 0) {
+      fprintf(stderr, "%s: %s: sending %s\n",
+              argv[0], strerror(errno), path);
+      exit(EXIT_FAILURE);
+    }
   }
 
   /* Terminate the multipart message.  We probably won't get here
@@ -0,0 +1,178 @@
+// -*- c-basic-offset: 2; indent-tabs-mode: nil -*-
+
+/*
+ * Copyright 2018-19, Lancaster University
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ * 
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the
+ *    distribution.
+ * 
+ *  * Neither the name of the copyright holder nor the names of
+ *    its contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ *
+ * Author: Steven Simpson <https://github.com/simpsonst>
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "stats.h"
+
+void histo_add(struct histo *h, uint64_t ns)
+{
+  h->count++;
+  h->sum += ns;
+  if (ns > h->max) h->max = ns;
+  h->bucket[ns ? 63 - __builtin_clzll(ns) : 0]++;
+}
+
+/* Get an upper bound on the 'q'th quantile. */
+static uint64_t histo_quantile(const struct histo *h, double q)
+{
+  const uint64_t want = h->count * q;
+  uint64_t seen = 0;
+  for (unsigned b = 0; b < 64; b++) {
+    seen += h->bucket[b];
+    if (seen > want) {
+      const uint64_t lim = b == 63 ? UINT64_MAX : (UINT64_C(2) << b) - 1;
+      return lim < h->max ? lim : h->max;
+    }
+  }
+  return h->max;
+}
+
+static void histo_print(FILE *out, const char *tag, const char *name,
+                        const struct histo *h)
+{
+  if (tag != NULL)
+    fprintf(out, "%s ", tag);
+  fprintf(out, "%-6s %8llu %10.1f %10.1f %10.1f %10.1f %10.1f\n", name,
+          (unsigned long long) h->count,
+          h->count ? h->sum / 1e3 / h->count : 0.0,
+          histo_quantile(h, 0.5) / 1e3, histo_quantile(h, 0.9) / 1e3,
+          histo_quantile(h, 0.99) / 1e3, h->max / 1e3);
+}
+
+/* Get the time in milliseconds from a name of the form
+   .../at-<ms>..., or 0 if it has no timestamp. */
+static uint64_t name_stamp(const char *srcname)
+{
+  const char *leaf = strrchr(srcname, '/');
+  leaf = leaf == NULL ? srcname : leaf + 1;
+  if (strncmp(leaf, "at-", 3) != 0) return 0;
+  return strtoull(leaf + 3, NULL, 10);
+}
+
+void detstats_frame(struct detstats *s, const struct detector *d,
+                    uint64_t frame_ns, const char *srcname)
+{
+  s->frames++;
+  histo_add(&s->frame, frame_ns);
+
+  uint64_t ns[DETSTAGE_COUNT];
+  detector_times(d, ns);
+  for (unsigned i = 0; i < DETSTAGE_COUNT; i++) {
+    /* Stages that were skipped for this frame are not counted. */
+    if (ns[i] > s->last[i])
+      histo_add(&s->stage[i], ns[i] - s->last[i]);
+    s->last[i] = ns[i];
+  }
+
+  const uint64_t ms = name_stamp(srcname);
+  if (ms > 0) {
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    const int64_t lag = (int64_t) now.tv_sec * 1000000000 + now.tv_nsec -
+      (int64_t) ms * 1000000;
+    histo_add(&s->lag, lag > 0 ? lag : 0);
+  }
+}
+
+void detstats_print(FILE *out, const char *tag, const struct detstats *s)
+{
+  if (tag != NULL)
+    fprintf(out, "%s ", tag);
+  fprintf(out, "%-6s %8s %10s %10s %10s %10s %10s\n", "(us)",
+          "count", "mean", "p50", "p90", "p99", "max");
+  for (unsigned i = 0; i < DETSTAGE_COUNT; i++)
+    histo_print(out, tag, detstage_names[i], &s->stage[i]);
+  histo_print(out, tag, "frame", &s->frame);
+  histo_print(out, tag, "lag", &s->lag);
+}
+
+/* The most that the rate is lowered by, how many frames to smooth
+   the lag over before adjusting it, and for how many adjustments it
+   must stay low before the rate is raised */
+#define MAXSTRIDE 16
+#define SETTLE 8
+#define CALM 4
+
+bool shed_frame(struct shedder *s, const char *srcname)
+{
+  if (s->budget == 0) return false;
+  const uint64_t ms = name_stamp(srcname);
+  if (ms == 0) return false;
+  if (s->stride < 1) s->stride = 1;
+
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  const double lag = now.tv_sec * 1000.0 + now.tv_nsec / 1e6 - (double) ms;
+  s->avg += (lag - s->avg) / SETTLE;
+  if (++s->since >= SETTLE) {
+    /* Lower the rate only while the backlog is still growing, so as
+       not to overshoot while it drains.  Raise it only after the lag
+       has stayed low for a while. */
+    s->since = 0;
+    s->calm = s->avg < s->budget / 4.0 ? s->calm + 1 : 0;
+    if (s->avg > s->budget / 2.0 && s->avg > s->last &&
+        s->stride < MAXSTRIDE) {
+      s->stride++;
+    } else if (s->calm >= CALM && s->stride > 1) {
+      s->stride--;
+      s->calm = 0;
+    }
+    s->last = s->avg;
+  }
+
+  if (lag > s->budget) {
+    s->late++;
+    return true;
+  }
+  if (s->count++ % s->stride != 0) {
+    s->thinned++;
+    return true;
+  }
+  return false;
+}
+
+void shed_print(FILE *out, const char *tag, const struct shedder *s)
+{
+  if (tag != NULL)
+    fprintf(out, "%s ", tag);
+  fprintf(out, "shed %lu late, %lu thinned; scoring 1 in %u\n",
+          s->late, s->thinned, s->stride < 1 ? 1 : s->stride);
+}
@@ -0,0 +1,112 @@
+// -*- c-basic-offset: 2; indent-tabs-mode: nil -*-
+
+/*
+ * Copyright 2018-19, Lancaster University
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ * 
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the
+ *    distribution.
+ * 
+ *  * Neither the name of the copyright holder nor the names of
+ *    its contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ *
+ * Author: Steven Simpson <https://github.com/simpsonst>
+ */
+
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "detector.h"
+
+/* A histogram of durations in nanoseconds, with a bucket for each
+   power of two */
+struct histo {
+  uint64_t count, sum, max;
+  uint64_t bucket[64];
+};
+
+void histo_add(struct histo *, uint64_t ns);
+
+/* Timings of the frames of one stream */
+struct detstats {
+  unsigned long frames;
+
+  /* per-frame time spent on each stage */
+  struct histo stage[DETSTAGE_COUNT];
+
+  /* per-frame time spent in the detector altogether */
+  struct histo frame;
+
+  /* the time from each frame's timestamp to its score */
+  struct histo lag;
+
+  /* the detector's stage totals after the previous frame */
+  uint64_t last[DETSTAGE_COUNT];
+};
+
+/* Record the timings of a frame just fed to 'd', which took
+   'frame_ns' altogether.  If 'srcname' is a timestamped name
+   (at-<ms>...), record the lag from that time to now. */
+void detstats_frame(struct detstats *, const struct detector *d,
+                    uint64_t frame_ns, const char *srcname);
+
+/* Print percentiles of each histogram in microseconds, prefixing
+   each line with 'tag' if not NULL. */
+void detstats_print(FILE *out, const char *tag, const struct detstats *);
+
+/* Shedding of frames that the detector can't keep up with */
+struct shedder {
+  /* the greatest lag tolerated, in milliseconds, or 0 to score every
+     frame */
+  unsigned budget;
+
+  /* Only one in 'stride' frames is scored. */
+  unsigned stride, count, since, calm;
+
+  /* the smoothed lag of recent frames, and when the rate was last
+     considered, in milliseconds */
+  double avg, last;
+
+  /* frames shed for being later than the budget, and to lower the
+     rate */
+  unsigned long late, thinned;
+};
+
+/* Decide whether to skip scoring the frame 'srcname' (named
+   .../at-<ms>...) because of how far behind it is.  A frame later
+   than the budget is always shed, which bounds the backlog.
+   Otherwise, the rate is lowered while the smoothed lag exceeds
+   half the budget, and raised again once it falls below a
+   quarter. */
+bool shed_frame(struct shedder *, const char *srcname);
+
+void shed_print(FILE *out, const char *tag, const struct shedder *);
+
+#endif
@@ -0,0 +1,383 @@
+// -*- c-basic-offset: 2; indent-tabs-mode: nil -*-
+
+/*
+ * Copyright 2018-19, Lancaster University
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ * 
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the
+ *    distribution.
+ * 
+ *  * Neither the name of the copyright holder nor the names of
+ *    its contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ *
+ * Author: Steven Simpson <https://github.com/simpsonst>
+ */
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "uring.h"
+
+/* enough entries for the largest submission */
+#define ENTRIES 8
+
+/* the slot of the registered file table that files are opened into,
+   so that the same submission can read and close them */
+#define SLOT 0
+
+/* the initial size of a buffer for a whole file */
+#define INITIAL_CAP 65536
+
+struct uring {
+  int fd;
+
+  /* the shared rings, and the submission entries */
+  void *rings;
+  size_t ringslen;
+  struct io_uring_sqe *sqes;
+  size_t sqeslen;
+
+  unsigned *sq_tail, *sq_array, sq_mask;
+  unsigned *cq_head, *cq_tail, cq_mask;
+  struct io_uring_cqe *cqes;
+
+  /* the number of entries prepared but not yet submitted */
+  unsigned queued;
+};
+
+static int sys_setup(unsigned entries, struct io_uring_params *p)
+{
+  return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_enter(int fd, unsigned submit, unsigned wait)
+{
+  return syscall(__NR_io_uring_enter, fd, submit, wait,
+                 IORING_ENTER_GETEVENTS, NULL, 0);
+}
+
+static int sys_register(int fd, unsigned op, void *arg, unsigned n)
+{
+  return syscall(__NR_io_uring_register, fd, op, arg, n);
+}
+
+/* Prepare the next entry, whose result will be reported under
+   'tag'. */
+static struct io_uring_sqe *prepare(struct uring *ur, uint8_t op,
+                                    unsigned tag)
+{
+  const unsigned idx = (*ur->sq_tail + ur->queued++) & ur->sq_mask;
+  struct io_uring_sqe *sqe = &ur->sqes[idx];
+  memset(sqe, 0, sizeof *sqe);
+  sqe->opcode = op;
+  sqe->user_data = tag;
+  ur->sq_array[idx] = idx;
+  return sqe;
+}
+
+/* Submit the prepared entries, and wait for all of them to complete,
+   putting the result of each in 'res[tag]'.  Return 0 on success; -1
+   on error, with errno set. */
+static int submit(struct uring *ur, int res[])
+{
+  const unsigned n = ur->queued;
+  ur->queued = 0;
+  __atomic_store_n(ur->sq_tail, *ur->sq_tail + n, __ATOMIC_RELEASE);
+
+  unsigned unsent = n, done = 0;
+  while (done < n) {
+    const int rc = sys_enter(ur->fd, unsent, n - done);
+    if (rc < 0 && errno != EINTR) return -1;
+    if (rc > 0) unsent -= rc;
+
+    unsigned head = *ur->cq_head;
+    const unsigned tail = __atomic_load_n(ur->cq_tail, __ATOMIC_ACQUIRE);
+    for ( ; head != tail; head++, done++) {
+      const struct io_uring_cqe *cqe = &ur->cqes[head & ur->cq_mask];
+      res[cqe->user_data] = cqe->res;
+    }
+    __atomic_store_n(ur->cq_head, head, __ATOMIC_RELEASE);
+  }
+  return 0;
+}
+
+/* Check that the kernel can open a file into a registered slot.
+   Older ones would return an ordinary descriptor instead.  (Such a
+   slot is never inherited, so O_CLOEXEC is not allowed.) */
+static bool opens_direct(struct uring *ur)
+{
+  struct io_uring_sqe *sqe = prepare(ur, IORING_OP_OPENAT, 0);
+  sqe->fd = AT_FDCWD;
+  sqe->addr = (uintptr_t) "/";
+  sqe->open_flags = O_RDONLY | O_DIRECTORY;
+  sqe->file_index = SLOT + 1;
+  int res[1];
+  if (submit(ur, res) < 0) return false;
+  if (res[0] > 0) close(res[0]);
+  if (res[0] != 0) return false;
+
+  sqe = prepare(ur, IORING_OP_CLOSE, 0);
+  sqe->file_index = SLOT + 1;
+  return submit(ur, res) == 0 && res[0] == 0;
+}
+
+static bool supports(const struct uring *ur, const uint8_t *ops, size_t n)
+{
+  const size_t len = sizeof(struct io_uring_probe) +
+    IORING_OP_LAST * sizeof(struct io_uring_probe_op);
+  struct io_uring_probe *probe = calloc(1, len);
+  if (probe == NULL) return false;
+  bool ok = sys_register(ur->fd, IORING_REGISTER_PROBE,
+                         probe, IORING_OP_LAST) == 0;
+  for (size_t i = 0; ok && i < n; i++)
+    ok = ops[i] <= probe->last_op &&
+      (probe->ops[ops[i]].flags & IO_URING_OP_SUPPORTED);
+  free(probe);
+  return ok;
+}
+
+struct uring *uring_create(void)
+{
+  struct uring *ur = calloc(1, sizeof *ur);
+  if (ur == NULL) return NULL;
+  ur->rings = ur->sqes = MAP_FAILED;
+
+  struct io_uring_params p;
+  memset(&p, 0, sizeof p);
+  if ((ur->fd = sys_setup(ENTRIES, &p)) < 0) {
+    free(ur);
+    return NULL;
+  }
+  if (!(p.features & IORING_FEAT_SINGLE_MMAP)) {
+    errno = ENOSYS;
+    goto failed;
+  }
+
+  ur->ringslen = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  const size_t cqlen =
+    p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  if (ur->ringslen < cqlen) ur->ringslen = cqlen;
+  ur->rings = mmap(NULL, ur->ringslen, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, ur->fd, IORING_OFF_SQ_RING);
+  if (ur->rings == MAP_FAILED) goto failed;
+  ur->sqeslen = p.sq_entries * sizeof(struct io_uring_sqe);
+  ur->sqes = mmap(NULL, ur->sqeslen, PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_POPULATE, ur->fd, IORING_OFF_SQES);
+  if (ur->sqes == MAP_FAILED) goto failed;
+
+  unsigned char *const base = ur->rings;
+  ur->sq_tail = (unsigned *) (base + p.sq_off.tail);
+  ur->sq_array = (unsigned *) (base + p.sq_off.array);
+  ur->sq_mask = *(unsigned *) (base + p.sq_off.ring_mask);
+  ur->cq_head = (unsigned *) (base + p.cq_off.head);
+  ur->cq_tail = (unsigned *) (base + p.cq_off.tail);
+  ur->cq_mask = *(unsigned *) (base + p.cq_off.ring_mask);
+  ur->cqes = (struct io_uring_cqe *) (base + p.cq_off.cqes);
+
+  static const uint8_t needed[] = {
+    IORING_OP_OPENAT, IORING_OP_STATX, IORING_OP_READ,
+    IORING_OP_CLOSE, IORING_OP_WRITEV,
+  };
+  int fds[1] = { -1 };
+  if (!supports(ur, needed, sizeof needed / sizeof needed[0]) ||
+      sys_register(ur->fd, IORING_REGISTER_FILES, fds, 1) < 0 ||
+      !opens_direct(ur)) {
+    errno = ENOSYS;
+    goto failed;
+  }
+  return ur;
+
+ failed:
+  uring_destroy(ur);
+  return NULL;
+}
+
+void uring_destroy(struct uring *ur)
+{
+  if (ur == NULL) return;
+  const int e = errno;
+  if (ur->sqes != MAP_FAILED) munmap(ur->sqes, ur->sqeslen);
+  if (ur->rings != MAP_FAILED) munmap(ur->rings, ur->ringslen);
+  close(ur->fd);
+  free(ur);
+  errno = e;
+}
+
+static int grow(unsigned char **buf, size_t *cap, size_t need)
+{
+  if (need <= *cap) return 0;
+  if (need < INITIAL_CAP) need = INITIAL_CAP;
+  unsigned char *nb = realloc(*buf, need);
+  if (nb == NULL) return -1;
+  *buf = nb;
+  *cap = need;
+  return 0;
+}
+
+static ssize_t load_plain(const char *path,
+                          unsigned char **buf, size_t *cap,
+                          struct timespec *mtime)
+{
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) return -1;
+  struct stat st;
+  if (fstat(fd, &st) < 0 || grow(buf, cap, st.st_size) < 0) {
+    const int e = errno;
+    close(fd);
+    errno = e;
+    return -1;
+  }
+  size_t got = 0;
+  while (got < (size_t) st.st_size) {
+    ssize_t rc = read(fd, *buf + got, st.st_size - got);
+    if (rc < 0 && errno == EINTR) continue;
+    if (rc < 0) {
+      const int e = errno;
+      close(fd);
+      errno = e;
+      return -1;
+    }
+    if (rc == 0) break;
+    got += rc;
+  }
+  close(fd);
+  if (mtime != NULL)
+    *mtime = st.st_mtim;
+  return got;
+}
+
+ssize_t uring_load(struct uring *ur, const char *path,
+                   unsigned char **buf, size_t *cap,
+                   struct timespec *mtime)
+{
+  if (ur == NULL) return load_plain(path, buf, cap, mtime);
+  if (grow(buf, cap, INITIAL_CAP) < 0) return -1;
+
+  for ( ; ; ) {
+    /* Get the file's size independently, in case it doesn't fit. */
+    struct statx stx;
+    struct io_uring_sqe *sqe = prepare(ur, IORING_OP_STATX, 0);
+    sqe->fd = AT_FDCWD;
+    sqe->addr = (uintptr_t) path;
+    sqe->len = STATX_SIZE | STATX_MTIME;
+    sqe->off = (uintptr_t) &stx;
+
+    /* Open the file, read it, and close it.  It is closed even if the
+       read fails or is short. */
+    sqe = prepare(ur, IORING_OP_OPENAT, 1);
+    sqe->fd = AT_FDCWD;
+    sqe->addr = (uintptr_t) path;
+    sqe->open_flags = O_RDONLY;
+    sqe->file_index = SLOT + 1;
+    sqe->flags = IOSQE_IO_LINK;
+
+    sqe = prepare(ur, IORING_OP_READ, 2);
+    sqe->fd = SLOT;
+    sqe->addr = (uintptr_t) *buf;
+    sqe->len = *cap > INT32_MAX ? INT32_MAX : *cap;
+    sqe->flags = IOSQE_FIXED_FILE | IOSQE_IO_HARDLINK;
+
+    sqe = prepare(ur, IORING_OP_CLOSE, 3);
+    sqe->file_index = SLOT + 1;
+
+    int res[4];
+    if (submit(ur, res) < 0) return -1;
+    for (unsigned i = 1; i < 3; i++)
+      if (res[i] < 0) {
+        errno = -res[i];
+        return -1;
+      }
+    if (res[0] < 0) {
+      errno = -res[0];
+      return -1;
+    }
+
+    /* Try again if the file was too big. */
+    const size_t len = res[2];
+    if (len == *cap && stx.stx_size > len) {
+      if (grow(buf, cap, stx.stx_size) < 0) return -1;
+      continue;
+    }
+    if (mtime != NULL) {
+      mtime->tv_sec = stx.stx_mtime.tv_sec;
+      mtime->tv_nsec = stx.stx_mtime.tv_nsec;
+    }
+    return len;
+  }
+}
+
+int uring_writev(struct uring *ur, int fd,
+                 const struct iovec *iov, unsigned count)
+{
+  struct iovec left[count];
+  memcpy(left, iov, sizeof left);
+  struct iovec *v = left;
+  while (count > 0) {
+    ssize_t done;
+    if (ur != NULL) {
+      struct io_uring_sqe *sqe = prepare(ur, IORING_OP_WRITEV, 0);
+      sqe->fd = fd;
+      sqe->addr = (uintptr_t) v;
+      sqe->len = count;
+      sqe->off = (uint64_t) -1;
+      int res[1];
+      if (submit(ur, res) < 0) return -1;
+      if ((done = res[0]) < 0) errno = -res[0];
+    } else {
+      done = writev(fd, v, count);
+    }
+    if (done < 0) {
+      if (errno == EINTR) continue;
+      return -1;
+    }
+
+    /* Skip what was written, in case it was cut short. */
+    while (count > 0 && (size_t) done >= v->iov_len) {
+      done -= v->iov_len;
+      v++;
+      count--;
+    }
+    if (count > 0) {
+      v->iov_base = (char *) v->iov_base + done;
+      v->iov_len -= done;
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,77 @@
+// -*- c-basic-offset: 2; indent-tabs-mode: nil -*-
+
+/*
+ * Copyright 2018-19, Lancaster University
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are
+ * met:
+ * 
+ *  * Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 
+ *  * Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the
+ *    distribution.
+ * 
+ *  * Neither the name of the copyright holder nor the names of
+ *    its contributors may be used to endorse or promote products derived
+ *    from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+ * A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+ * OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+ * SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+ * LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+ * OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ *
+ *
+ * Author: Steven Simpson <https://github.com/simpsonst>
+ */
+
+#ifndef URING_H
+#define URING_H
+
+#include <stddef.h>
+#include <time.h>
+
+#include <sys/types.h>
+#include <sys/uio.h>
+
+/* Whole-file reads and gathered writes, each made with a single
+   io_uring submission where the kernel allows it, and with the
+   plain calls otherwise.  A ring must only be used by one thread at
+   a time. */
+struct uring;
+
+/* Create a ring.  Return NULL if io_uring is unavailable or lacks
+   the operations needed, with errno set, in which case NULL may be
+   passed to the other functions to use plain calls instead. */
+struct uring *uring_create(void);
+
+void uring_destroy(struct uring *);
+
+/* Read the whole of the file 'path' into '*buf', which holds '*cap'
+   bytes, and is enlarged with 'realloc' if the file is bigger.  Get
+   its modification time in '*mtime' if that is not NULL.  The file
+   is opened, read and closed, and its status got, in one
+   submission.  Return the file's length, or -1 on error, with errno
+   set. */
+ssize_t uring_load(struct uring *, const char *path,
+                   unsigned char **buf, size_t *cap,
+                   struct timespec *mtime);
+
+/* Write all of the 'count' buffers of 'iov' to 'fd', as one
+   operation if it is not cut short.  Return 0 on success; -1 on
+   error, with errno set. */
+int uring_writev(struct uring *, int fd,
+                 const struct iovec *iov, unsigned count);
+
+#endif
@@ -38,7 +38,9 @@
 
 ####### Capture
 
-## /... => Video4Linux device to capture from; otherwise, URL of
+## /... => Video4Linux device to capture from; replay:path =>
+## directory of JPEGs or file of concatenated JPEGs to replay in a
+## loop at RATE, for testing without a camera; otherwise, URL of
 ## multipart/x-mixed-replace of image/jpeg to fetch from
 DEVICE=/dev/video0
 
@@ -55,6 +57,24 @@ CAPDIMS=640x480
 ## configuration.
 CAPDIR=/var/run/stecam/capture
 
+## Set to a file on a tmpfs (e.g., /dev/shm/stecam-front) to pass
+## frames from the camera through a shared-memory ring, instead of
+## through files in CAPDIR and WORKDIR.  Frames are then written to
+## disk only when they are recorded.  ROTATION is not applied to
+## frames in the ring, and it can't be used with OVERLAY or POSTXLATE,
+## which would be skipped by detection; use DETMASK to leave regions
+## out instead.
+#RING
+
+## Capacity of the ring, in frames and in MiB - As recordings are
+## encoded while they are made, it need only hold the pre-roll
+## (LEADER+GATHER+HESITATE sampled frames, or LINGER if more) at the
+## capture rate, plus a few seconds; by default, RINGFRAMES is worked
+## out from these.  RINGMB must be enough for that many frames, or
+## the older ones will be missing.
+#RINGFRAMES=1000
+RINGMB=32
+
 
 
 ####### Correction
@@ -68,9 +88,18 @@ WORKDIR=/var/run/stecam/work
 
 
 ## Set this if you need to scale down the live video (because of
-## limited upstream bandwidth, for example).
+## limited upstream bandwidth, for example).  This is only the
+## default; viewers can ask for another size and a maximum rate with
+## a query string, e.g., ?size=640x480&rate=5 (or size=full).  Frames
+## are scaled by the live server only while someone is watching, and
+## once for all viewers of the same size.
 #LIVEDIMS=320x240
 
+## Set to [host:]port to serve live video to all viewers from one
+## process, started by stecamd, instead of running the CGI program
+## once per viewer.  Slow viewers skip frames.
+#LIVELISTEN=8080
+
 
 ## Rotate the captured image by 90, 180 or 270 degrees before any
 ## other processing.
@@ -88,6 +117,24 @@ WORKDIR=/var/run/stecam/work
 ## smaller movements.  Unset to turn off detection.
 DETDIMS=16x12
 
+## Set to a coarse grid (e.g., 16x12) dividing $DETDIMS into tiles of
+## at least 3x3 cells, to detect coarse-to-fine - Every frame is
+## scored cheaply on the coarse grid, and only tiles within one of a
+## cell whose difference reaches DETGATE (a fraction of full scale)
+## are processed at $DETDIMS.  Quiet scenes then cost little more than
+## the coarse grid alone.  It can't be combined with MERGEEWMA or
+## DETMASK.
+#DETCOARSE=16x12
+DETGATE=0.02
+
+## A binary PGM of $DETDIMS selecting the cells to detect motion in -
+## Black cells (e.g., over a road, trees or sky) are ignored, and cost
+## nothing.  Other cells of the same grey level form a zone, whose
+## score is also reported, as <name>=<score>; a comment '# zone <level>
+## <name>' in the header names a zone.  Only the overall score
+## triggers recording.
+#DETMASK=/etc/stecam/mask.pgm
+
 ## The motion score that triggers recording; either a single integer,
 ## or a pair (100-200), the larger of which triggers the start of
 ## recording when exceeded, and the smaller triggers the end when it
@@ -103,6 +150,13 @@ MERGE=50
 ## comparison with the previous $MERGE frames
 GATHER=1
 
+## Set to model the $MERGE frames as a running (exponentially
+## weighted) mean and variance per cell, instead of keeping them all -
+## Memory then no longer grows with MERGE, so it can be thousands of
+## frames, but older frames fade out gradually instead of dropping
+## out.
+#MERGEEWMA=yes
+
 ## Number of above-upper-threshold detection frames to wait before
 ## starting recording - A counter increases by one while the threshold
 ## is exceeded, and decreases by one otherwise.  If the counter
@@ -117,6 +171,19 @@ POWER=9
 ## Additional frames before motion to record
 LEADER=5
 
+## File in which modect keeps its detection history, so that it can
+## resume detecting straight after a restart, instead of first
+## repopulating the history - It is written every minute and when
+## modect stops, and is only resumed from if no older than DETRESUME
+## seconds, and written with the same detection parameters.  A
+## relative name is kept in DETDIR, or in the unit's state directory
+## as a SystemD unit, so that each configuration has its own.  With a
+## shared DETECTOR, it is kept only if the configuration sets a DETDIR
+## of its own.  An absolute name must not be shared with another
+## configuration.  Unset to always start afresh.
+DETCHECKPOINT=history
+DETRESUME=300
+
 ## Ephemeral storage for condensed frames for detection and modified
 ## frames for recording - The same file-naming scheme is used for all
 ## camera configurations, i.e., you'll need a different one for each
@@ -135,6 +202,27 @@ MOVDIR=/var/spool/stecam
 ## frames to record.
 LINGER=10
 
+## Set to the named pipe of a shared detector (see -S in modect) to
+## score frames there, instead of in a process of this configuration's
+## own.  stecamd sets this for the configurations it starts, so that
+## they all share one process.  Unset it in a configuration to give
+## that one its own.
+#DETECTOR
+
+## Set to a file to have modect time each stage of detection, and the
+## lag from capture to score, and write percentiles there every minute,
+## and on SIGUSR1.  Not available with a shared DETECTOR.
+#DETSTATS
+
+## If motion detection falls behind by more than this many
+## milliseconds, frames are passed to the recorder unscored - Frames
+## later than this are always shed, and the rate at which frames are
+## scored is lowered while detection is half this far behind, and
+## raised again once it catches up.  The numbers shed are reported
+## with DETSTATS, and whenever the rate changes.  Unset or 0 to score
+## every frame, however late.
+DETLAG=2000
+
 ## The exponent to convert the variance of the old frames' cells into
 ## their standard deviation - By using a value greater than 0.5, the
 ## 'SD' comes out higher, and reduces the significance of cells where
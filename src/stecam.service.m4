@@ -6,6 +6,7 @@ After=network.target
 Type=simple
 ExecStart=}]SBINDIR[{/stecam-capture -f "/etc/stecam.d/%i.conf" -q -x
 RuntimeDirectory=stecam-%i
+StateDirectory=stecam-%i
 
 [Install]
 WantedBy=multi-user.target}]